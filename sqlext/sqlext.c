@@ -59,6 +59,9 @@ sqlext_daap_no_zero_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
     sqlite3_result_int64(pv, old_value);
 }
 
+/* Library queries sort by keys made with sort_key_create() in db.c, which must
+ * give the same order as this collation
+ */
 static int
 sqlext_daap_unicode_xcollation(void *notused, int llen, const void *left, int rlen, const void *right)
 {
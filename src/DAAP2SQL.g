@@ -47,9 +47,9 @@ options {
 	#include "daap_query_hash.h"
 }
 
-query	returns [ pANTLR3_STRING result ]
+query[int files]	returns [ pANTLR3_STRING result ]
 @init { $result = NULL; }
-	:	e = expr
+	:	e = expr[$files]
 		{
 			if (!$e.valid)
 			{
@@ -65,9 +65,9 @@ query	returns [ pANTLR3_STRING result ]
 		}
 	;
 
-expr	returns [ pANTLR3_STRING result, int valid ]
+expr[int files]	returns [ pANTLR3_STRING result, int valid ]
 @init { $result = NULL; $valid = 1; }
-	:	^(OPAND a = expr b = expr)
+	:	^(OPAND a = expr[$files] b = expr[$files])
 		{
 			if ($a.valid && $b.valid)
 			{
@@ -93,7 +93,7 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 				$valid = 0;
 			}
 		}
-	|	^(OPOR a = expr b = expr)
+	|	^(OPOR a = expr[$files] b = expr[$files])
 		{
 			if ($a.valid && $b.valid)
 			{
@@ -125,6 +125,7 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 			pANTLR3_UINT8 field;
 			pANTLR3_UINT8 val;
 			pANTLR3_UINT8 escaped;
+			char *like;
 			ANTLR3_UINT8 op;
 			int neg_op;
 			const struct dmap_query_field_map *dqfm;
@@ -304,6 +305,16 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 					val[strlen((char *)val) - 1] = '\%';
 				}
 			}
+
+			/* In queries on files, substring matches may be looked up in the full-text index */
+			if ((op == '\%') && $files)
+			{
+				like = db_mprintf_like(dqfm->db_col, "\%s", (char *)val);
+				$result->append8($result, like);
+				free(like);
+
+				goto STR_result_valid_0;
+			}
 			
 			$result->append8($result, dqfm->db_col);
 
@@ -158,6 +158,8 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 			const struct rsp_query_field_map *rqfp;
 			pANTLR3_STRING field;
 			char *escaped;
+			char *col;
+			char *like;
 			ANTLR3_UINT32 optok;
 
 			escaped = NULL;
@@ -205,18 +207,27 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 			}
 
 			$result = field->factory->newRaw(field->factory);
-			$result->append8($result, "f.");
-			$result->appendS($result, field);
-			$result->append8($result, op);
-			$result->append8($result, "'");
-			if ((optok == INCLUDES) || (optok == STARTSW))
-				$result->append8($result, "\%");
-
-			$result->append8($result, escaped);
-
-			if ((optok == INCLUDES) || (optok == ENDSW))
-				$result->append8($result, "\%");
-			$result->append8($result, "'");
+			if (optok == EQUAL)
+			{
+				$result->append8($result, "f.");
+				$result->appendS($result, field);
+				$result->append8($result, op);
+				$result->append8($result, "'");
+				$result->append8($result, escaped);
+				$result->append8($result, "'");
+			}
+			else
+			{
+				/* Substring matches may be looked up in the full-text index */
+				col = db_mprintf("f.\%s", (char *)field->chars);
+				like = db_mprintf_like(col, "\%s\%s\%s",
+				                       ((optok == INCLUDES) || (optok == STARTSW)) ? "\%" : "",
+				                       escaped,
+				                       ((optok == INCLUDES) || (optok == ENDSW)) ? "\%" : "");
+				$result->append8($result, like);
+				free(like);
+				free(col);
+			}
 
 			strcrit_valid_0:
 				;
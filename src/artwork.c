@@ -1361,6 +1361,7 @@ source_group_dir_get(struct artwork_ctx *ctx)
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_GROUP_DIRS;
+  qp.skip_count = 1;
   qp.persistentid = ctx->persistentid;
 
   ret = db_query_start(&qp);
@@ -1701,6 +1702,7 @@ source_item_ownpl_get(struct artwork_ctx *ctx)
 
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_FIND_PL;
+  qp.skip_count = 1;
   qp.filter = filter;
 
   ret = db_query_start(&qp);
@@ -1912,6 +1914,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   memset(&ctx, 0, sizeof(struct artwork_ctx));
 
   ctx.qp.type = Q_ITEMS;
+  ctx.qp.skip_count = 1;
   ctx.qp.filter = filter;
   ctx.evbuf = evbuf;
   ctx.req_params.max_w = max_w;
@@ -1939,6 +1942,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
     }
 
   ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.skip_count = 1;
   ctx.qp.persistentid = ctx.persistentid;
 
   ret = process_group(&ctx);
@@ -1977,6 +1981,7 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
     }
 
   ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.skip_count = 1;
   ctx.qp.persistentid = ctx.persistentid;
   ctx.evbuf = evbuf;
   ctx.req_params.max_w = max_w;
@@ -24,6 +24,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -35,6 +36,7 @@
 #endif
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <sqlite3.h>
 
 #include "conffile.h"
@@ -49,6 +51,14 @@
 
 #define CACHE_VERSION 3
 
+// Max number of queries we keep rebuilding replies for, the memory used by the
+// replies is bounded by cache_daap_size
+#define CACHE_DAAP_QUERIES_MAX 100
+#define CACHE_DAAP_BUCKETS 256
+#define CACHE_DAAP_FREQ_SIZE 1024
+// Number of threads rebuilding DAAP replies after a library change
+#define CACHE_DAAP_WORKERS 3
+
 
 struct cache_arg
 {
@@ -579,7 +589,336 @@ cache_close(void)
   DPRINTF(E_DBG, L_CACHE, "Cache closed\n");
 }
 
-/* Adds the reply (stored in evbuf) to the cache */
+/* ------------------------- DAAP reply memory cache ----------------------- */
+
+/* The gzipped replies are served from memory, so that a cache hit needs neither
+ * a round trip to the cache thread nor a copy: the reply evbuffer just gets a
+ * reference to the entry. The entries are shared between the httpd thread
+ * (lookups) and the cache thread (updates), so access is serialized by a lock,
+ * which is held only for the hash lookup and the list update. An entry is freed
+ * when it has been removed from the cache and the last reply referencing it has
+ * been sent, see cache_daap_entry_unref().
+ *
+ * Memory use is bounded by cache_daap_size. When a new reply doesn't fit, the
+ * least recently used replies are evicted, but only if they have not been
+ * requested more often than the new one (frequency admission). The request
+ * frequencies are approximated with a small table of counters that is halved
+ * now and then, so that old popularity fades.
+ *
+ * Each entry is tagged with the library generation it was built from, and the
+ * generation is bumped whenever we are notified of a library change. Replies
+ * from older generations are never served, even before the update has rebuilt
+ * them.
+ */
+struct cache_daap_entry
+{
+  char *query;
+  uint32_t hash;
+  unsigned int generation;
+
+  uint8_t *data;
+  size_t len;
+
+  // One reference is held by the cache itself while the entry is in it
+  int refcount;
+
+  struct cache_daap_entry *prev;
+  struct cache_daap_entry *next;
+  struct cache_daap_entry *hnext;
+};
+
+struct cache_daap_mem
+{
+  struct cache_daap_entry *buckets[CACHE_DAAP_BUCKETS];
+
+  // LRU list, head is most recently used
+  struct cache_daap_entry *head;
+  struct cache_daap_entry *tail;
+
+  size_t size;
+  size_t max_size;
+
+  unsigned int generation;
+
+  uint8_t freq[CACHE_DAAP_FREQ_SIZE];
+  unsigned int freq_count;
+};
+
+static struct cache_daap_mem g_daap;
+static pthread_mutex_t g_daap_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+cache_daap_hash(const char *query)
+{
+  return djb_hash(query, strlen(query));
+}
+
+static void
+cache_daap_freq_inc(uint32_t hash)
+{
+  int i;
+
+  if (g_daap.freq[hash % CACHE_DAAP_FREQ_SIZE] < UINT8_MAX)
+    g_daap.freq[hash % CACHE_DAAP_FREQ_SIZE]++;
+
+  g_daap.freq_count++;
+  if (g_daap.freq_count < 10 * CACHE_DAAP_FREQ_SIZE)
+    return;
+
+  for (i = 0; i < CACHE_DAAP_FREQ_SIZE; i++)
+    g_daap.freq[i] /= 2;
+
+  g_daap.freq_count = 0;
+}
+
+static inline uint8_t
+cache_daap_freq_get(uint32_t hash)
+{
+  return g_daap.freq[hash % CACHE_DAAP_FREQ_SIZE];
+}
+
+// Must be called with the lock held
+static void
+cache_daap_entry_unref(struct cache_daap_entry *entry)
+{
+  entry->refcount--;
+  if (entry->refcount > 0)
+    return;
+
+  free(entry->query);
+  free(entry->data);
+  free(entry);
+}
+
+// Called by libevent when a reply that referenced the entry has been sent
+static void
+cache_daap_entry_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+  cache_daap_entry_unref(extra);
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+}
+
+// Must be called with the lock held
+static struct cache_daap_entry *
+cache_daap_entry_find(const char *query, uint32_t hash)
+{
+  struct cache_daap_entry *entry;
+
+  for (entry = g_daap.buckets[hash % CACHE_DAAP_BUCKETS]; entry; entry = entry->hnext)
+    {
+      if ((entry->hash == hash) && (strcmp(entry->query, query) == 0))
+	return entry;
+    }
+
+  return NULL;
+}
+
+// Must be called with the lock held
+static void
+cache_daap_entry_lru_unlink(struct cache_daap_entry *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    g_daap.head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    g_daap.tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+// Must be called with the lock held
+static void
+cache_daap_entry_lru_push(struct cache_daap_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = g_daap.head;
+
+  if (g_daap.head)
+    g_daap.head->prev = entry;
+  else
+    g_daap.tail = entry;
+
+  g_daap.head = entry;
+}
+
+// Must be called with the lock held
+static void
+cache_daap_entry_remove(struct cache_daap_entry *entry)
+{
+  struct cache_daap_entry **p;
+
+  for (p = &g_daap.buckets[entry->hash % CACHE_DAAP_BUCKETS]; *p; p = &(*p)->hnext)
+    {
+      if (*p == entry)
+	{
+	  *p = entry->hnext;
+	  break;
+	}
+    }
+
+  cache_daap_entry_lru_unlink(entry);
+
+  g_daap.size -= entry->len;
+
+  cache_daap_entry_unref(entry);
+}
+
+// Removes all entries, or only those not from the current generation
+static void
+cache_daap_mem_clear(bool stale_only)
+{
+  struct cache_daap_entry *entry;
+  struct cache_daap_entry *prev;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+
+  for (entry = g_daap.tail; entry; entry = prev)
+    {
+      prev = entry->prev;
+
+      if (!stale_only || (entry->generation != g_daap.generation))
+	cache_daap_entry_remove(entry);
+    }
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+}
+
+/* Takes ownership of data, which must be a gzipped reply built from the given
+ * library generation. Returns -1 if the reply was not admitted.
+ */
+static int
+cache_daap_mem_add(const char *query, uint8_t *data, size_t len, unsigned int generation)
+{
+  struct cache_daap_entry *entry;
+  struct cache_daap_entry *victim;
+  uint32_t hash;
+
+  hash = cache_daap_hash(query);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+
+  if ((generation != g_daap.generation) || (len > g_daap.max_size))
+    goto reject;
+
+  entry = cache_daap_entry_find(query, hash);
+  if (entry)
+    cache_daap_entry_remove(entry);
+
+  // Make room, unless that means evicting replies that are in more demand
+  for (victim = g_daap.tail; victim && (g_daap.size + len > g_daap.max_size); victim = g_daap.tail)
+    {
+      if ((victim->generation == g_daap.generation) && (cache_daap_freq_get(victim->hash) > cache_daap_freq_get(hash)))
+	goto reject;
+
+      DPRINTF(E_DBG, L_CACHE, "Evicting cached reply for '%s'\n", victim->query);
+
+      cache_daap_entry_remove(victim);
+    }
+
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_daap_entry)));
+  CHECK_NULL(L_CACHE, entry->query = strdup(query));
+
+  entry->hash = hash;
+  entry->generation = generation;
+  entry->data = data;
+  entry->len = len;
+  entry->refcount = 1;
+
+  entry->hnext = g_daap.buckets[hash % CACHE_DAAP_BUCKETS];
+  g_daap.buckets[hash % CACHE_DAAP_BUCKETS] = entry;
+
+  cache_daap_entry_lru_push(entry);
+
+  g_daap.size += len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+
+  return 0;
+
+ reject:
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+
+  DPRINTF(E_DBG, L_CACHE, "Reply for '%s' (%zu bytes) not admitted to cache\n", query, len);
+
+  free(data);
+  return -1;
+}
+
+static unsigned int
+cache_daap_generation_get(void)
+{
+  unsigned int generation;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+  generation = g_daap.generation;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+
+  return generation;
+}
+
+static void
+cache_daap_generation_bump(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+  g_daap.generation++;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+}
+
+/* Loads the replies persisted in the cache db, so the cache is warm after a
+ * restart. They are tagged with the current generation, and will be replaced as
+ * soon as the library reports a change.
+ */
+static void
+cache_daap_mem_load(void)
+{
+#define Q_TMPL "SELECT query, reply FROM replies;"
+  sqlite3_stmt *stmt;
+  unsigned int generation;
+  uint8_t *data;
+  int datalen;
+  int count;
+  int ret;
+
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for loading cached replies: %s\n", sqlite3_errmsg(g_db_hdl));
+      return;
+    }
+
+  generation = cache_daap_generation_get();
+  count = 0;
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      datalen = sqlite3_column_bytes(stmt, 1);
+      if (datalen <= 0)
+	continue;
+
+      CHECK_NULL(L_CACHE, data = malloc(datalen));
+      memcpy(data, sqlite3_column_blob(stmt, 1), datalen);
+
+      ret = cache_daap_mem_add((const char *)sqlite3_column_text(stmt, 0), data, datalen, generation);
+      if (ret == 0)
+	count++;
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+
+  sqlite3_finalize(stmt);
+
+  DPRINTF(E_DBG, L_CACHE, "Loaded %d cached DAAP replies\n", count);
+#undef Q_TMPL
+}
+
+/* Persists the reply (stored in evbuf) in the cache db */
 static int
 cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
 {
@@ -628,11 +967,12 @@ static enum command_state
 cache_daap_query_add(void *arg, int *retval)
 {
 #define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ");"
-#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
+#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT %d);"
   struct cache_arg *cmdarg;
   struct timeval delay = { 60, 0 };
   char *query;
   char *errmsg;
+  char *delta;
   int ret;
 
   cmdarg = arg;
@@ -650,6 +990,11 @@ cache_daap_query_add(void *arg, int *retval)
        (strncmp(cmdarg->query, "/databases/1/browse/", strlen("/databases/1/browse/")) != 0) )
     goto error_add;
 
+  // Delta song lists depend on the client's revision, no use rebuilding them
+  delta = strstr(cmdarg->query, "delta=");
+  if (delta && atoi(delta + strlen("delta=")) > 0)
+    goto error_add;
+
   remove_tag(cmdarg->query, "session-id");
   remove_tag(cmdarg->query, "revision-number");
 
@@ -676,8 +1021,17 @@ cache_daap_query_add(void *arg, int *retval)
   free(cmdarg->ua);
   free(cmdarg->query);
 
-  // Limits the size of the cache to only contain replies for 20 most recent queries
-  ret = sqlite3_exec(g_db_hdl, Q_CLEANUP, NULL, NULL, &errmsg);
+  // Limits the cache to only contain replies for the most recent queries
+  query = sqlite3_mprintf(Q_CLEANUP, CACHE_DAAP_QUERIES_MAX);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error cleaning up query list before update: %s\n", errmsg);
@@ -706,113 +1060,163 @@ cache_daap_query_add(void *arg, int *retval)
 #undef Q_TMPL
 }
 
-// Gets a reply from the cache.
-// cmdarg->evbuf will be filled with the reply (gzipped)
-static enum command_state
-cache_daap_query_get(void *arg, int *retval)
+/* Removes the query from the cache */
+static int
+cache_daap_query_delete(const int id)
 {
-#define Q_TMPL "SELECT reply FROM replies WHERE query = ?;"
-  struct cache_arg *cmdarg;
-  sqlite3_stmt *stmt;
+#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
   char *query;
-  int datalen;
+  char *errmsg;
   int ret;
 
-  cmdarg = arg;
-  query = cmdarg->query;
-  remove_tag(query, "session-id");
-  remove_tag(query, "revision-number");
+  query = sqlite3_mprintf(Q_TMPL, id);
 
-  // Look in the DB
-  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      free(query);
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
     }
 
-  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+  return 0;
+#undef Q_TMPL
+}
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_ROW)  
-    {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      goto error_get;
-    }
+/* The replies are rebuilt by a few worker threads, each with its own connection
+ * to the library db. Only the cache thread uses the cache db, so the workers
+ * leave the results for it in the job list.
+ */
+struct cache_daap_job
+{
+  int id;
+  char *query;
+  char *ua;
+  int is_remote;
 
-  datalen = sqlite3_column_bytes(stmt, 0);
+  // Result, NULL if the reply could not be built or the rebuild was cancelled
+  struct evbuffer *gzbuf;
+  bool done;
 
-  if (!cmdarg->evbuf)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error: DAAP reply evbuffer is NULL\n");
-      goto error_get;
-    }
+  struct cache_daap_job *next;
+};
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), datalen);
-  if (ret < 0)
+struct cache_daap_rebuild
+{
+  struct cache_daap_job *jobs;
+  struct cache_daap_job *next_job;
+  unsigned int generation;
+
+  pthread_mutex_t lck;
+};
+
+static void
+cache_daap_job_free(struct cache_daap_job *job)
+{
+  if (job->gzbuf)
+    evbuffer_free(job->gzbuf);
+
+  free(job->query);
+  free(job->ua);
+  free(job);
+}
+
+/* Thread: cache worker (or cache) */
+static void
+cache_daap_jobs_run(struct cache_daap_rebuild *rebuild)
+{
+  struct cache_daap_job *job;
+  struct evbuffer *evbuf;
+  struct evbuffer *gzbuf;
+  uint8_t *data;
+  size_t datalen;
+
+  for (;;)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
-      goto error_get;
-    }
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&rebuild->lck));
+      job = rebuild->next_job;
+      if (job)
+	rebuild->next_job = job->next;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&rebuild->lck));
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(g_db_hdl));
+      if (!job)
+	break;
 
-  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", query);
+      // The library changed again, so another rebuild is coming anyway
+      if (!g_initialized || (cache_daap_generation_get() != rebuild->generation))
+	{
+	  DPRINTF(E_DBG, L_CACHE, "DAAP cache update cancelled, library changed\n");
+	  break;
+	}
 
-  free(query);
+      evbuf = daap_reply_build(job->query, job->ua, job->is_remote);
+      if (!evbuf)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", job->query);
+	  job->done = true;
+	  continue;
+	}
 
-  *retval = 0;
-  return COMMAND_END;
+      gzbuf = httpd_gzip_deflate(evbuf);
+      evbuffer_free(evbuf);
+      if (!gzbuf)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", job->query);
+	  job->done = true;
+	  continue;
+	}
 
- error_get:
-  sqlite3_finalize(stmt);
-  free(query);
-  *retval = -1;
-  return COMMAND_END;
-#undef Q_TMPL
+      // Make it available right away, the cache thread persists it later
+      datalen = evbuffer_get_length(gzbuf);
+      CHECK_NULL(L_CACHE, data = malloc(datalen));
+      evbuffer_copyout(gzbuf, data, datalen);
+
+      cache_daap_mem_add(job->query, data, datalen, rebuild->generation);
+
+      job->gzbuf = gzbuf;
+      job->done = true;
+    }
 }
 
-/* Removes the query from the cache */
-static int
-cache_daap_query_delete(const int id)
+/* Thread: cache worker */
+static void *
+cache_daap_worker(void *arg)
 {
-#define Q_TMPL "DELETE FROM queries WHERE id = %d;"
-  char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-
-  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  ret = db_perthread_init();
+  if (ret < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error deleting query from cache: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      return -1;
+      DPRINTF(E_LOG, L_CACHE, "Error: DB init failed (cache worker)\n");
+      pthread_exit(NULL);
     }
 
-  return 0;
-#undef Q_TMPL
+  cache_daap_jobs_run(arg);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
 }
 
 /* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
+ * to the queries set for caching. The most recently and slowest queries are
+ * rebuilt first.
  */
 static void
 cache_daap_update_cb(int fd, short what, void *arg)
 {
+#define Q_TMPL "SELECT id, user_agent, is_remote, query FROM queries ORDER BY timestamp DESC, msec DESC;"
+  struct cache_daap_rebuild rebuild;
+  struct cache_daap_job *job;
+  struct cache_daap_job **tail;
+  pthread_t tid[CACHE_DAAP_WORKERS];
   sqlite3_stmt *stmt;
-  struct evbuffer *evbuf;
-  struct evbuffer *gzbuf;
   char *errmsg;
-  char *query;
+  int nthreads;
+  int njobs;
+  int i;
   int ret;
 
   if (g_suspended)
@@ -823,6 +1227,13 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
   DPRINTF(E_LOG, L_CACHE, "Beginning DAAP cache update\n");
 
+  memset(&rebuild, 0, sizeof(struct cache_daap_rebuild));
+
+  // Replies built from now on belong to this generation, and those from
+  // previous generations can go
+  rebuild.generation = cache_daap_generation_get();
+  cache_daap_mem_clear(true);
+
   ret = sqlite3_exec(g_db_hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
@@ -831,52 +1242,80 @@ cache_daap_update_cb(int fd, short what, void *arg)
       return;
     }
 
-  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
       return;
     }
 
+  njobs = 0;
+  tail = &rebuild.jobs;
   while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
+      CHECK_NULL(L_CACHE, job = calloc(1, sizeof(struct cache_daap_job)));
 
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
-      if (!evbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
+      job->id = sqlite3_column_int(stmt, 0);
+      job->ua = safe_strdup((char *)sqlite3_column_text(stmt, 1));
+      job->is_remote = sqlite3_column_int(stmt, 2);
+      job->query = safe_strdup((char *)sqlite3_column_text(stmt, 3));
 
-	  continue;
-	}
+      *tail = job;
+      tail = &job->next;
+      njobs++;
+    }
 
-      gzbuf = httpd_gzip_deflate(evbuf);
-      if (!gzbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
-	  evbuffer_free(evbuf);
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
 
-	  continue;
-	}
+  sqlite3_finalize(stmt);
 
-      evbuffer_free(evbuf);
+  rebuild.next_job = rebuild.jobs;
+  CHECK_ERR(L_CACHE, mutex_init(&rebuild.lck));
 
-      cache_daap_reply_add(query, gzbuf);
+  for (nthreads = 0; (nthreads < CACHE_DAAP_WORKERS) && (nthreads < njobs); nthreads++)
+    {
+      ret = pthread_create(&tid[nthreads], NULL, cache_daap_worker, &rebuild);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not spawn cache worker: %s\n", strerror(ret));
+	  break;
+	}
 
-      free(query);
-      evbuffer_free(gzbuf);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(tid[nthreads], "cache worker");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(tid[nthreads], "cache worker");
+#endif
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+  // If no workers could be started, we rebuild here like before
+  if (nthreads == 0)
+    cache_daap_jobs_run(&rebuild);
 
-  sqlite3_finalize(stmt);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tid[i], NULL);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_destroy(&rebuild.lck));
+
+  // Persist the results, and forget queries that can't be built
+  while ((job = rebuild.jobs))
+    {
+      rebuild.jobs = job->next;
+
+      if (job->gzbuf)
+	cache_daap_reply_add(job->query, job->gzbuf);
+      else if (job->done)
+	cache_daap_query_delete(job->id);
+
+      cache_daap_job_free(job);
+    }
 
-  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated\n");
+  if (cache_daap_generation_get() != rebuild.generation)
+    DPRINTF(E_LOG, L_CACHE, "DAAP cache update interrupted by library change\n");
+  else
+    DPRINTF(E_LOG, L_CACHE, "DAAP cache updated (%d queries, %d workers)\n", njobs, nthreads);
+#undef Q_TMPL
 }
 
 /* Sets off an update by activating the event. The delay is because we are low
@@ -895,6 +1334,9 @@ cache_daap_update(void *arg, int *retval)
 static void
 cache_daap_listener_cb(short event_mask)
 {
+  // Stops replies built before the change from being served
+  cache_daap_generation_bump();
+
   commands_exec_async(cmdbase, cache_daap_update, NULL);
 }
 
@@ -1304,6 +1746,8 @@ cache(void *arg)
       pthread_exit(NULL);
     }
 
+  cache_daap_mem_load();
+
   g_initialized = 1;
 
   event_base_dispatch(evbase_cache);
@@ -1343,18 +1787,64 @@ cache_daap_resume(void)
   g_suspended = 0;
 }
 
+/* Thread: httpd (no thread hop, the reply references the cached data) */
 int
 cache_daap_get(struct evbuffer *evbuf, const char *query)
 {
-  struct cache_arg cmdarg;
+  struct cache_daap_entry *entry;
+  char *key;
+  uint32_t hash;
+  int ret;
 
   if (!g_initialized)
     return -1;
 
-  cmdarg.query = strdup(query);
-  cmdarg.evbuf = evbuf;
+  CHECK_NULL(L_CACHE, key = strdup(query));
+  remove_tag(key, "session-id");
+  remove_tag(key, "revision-number");
+
+  hash = cache_daap_hash(key);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
 
-  return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  cache_daap_freq_inc(hash);
+
+  entry = cache_daap_entry_find(key, hash);
+  if (entry && (entry->generation == g_daap.generation))
+    {
+      cache_daap_entry_lru_unlink(entry);
+      cache_daap_entry_lru_push(entry);
+      entry->refcount++;
+    }
+  else
+    entry = NULL;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+
+  if (!entry)
+    {
+      free(key);
+      return -1;
+    }
+
+  ret = evbuffer_add_reference(evbuf, entry->data, entry->len, cache_daap_entry_cleanup_cb, entry);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for DAAP reply evbuffer\n");
+
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_lck));
+      cache_daap_entry_unref(entry);
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_lck));
+
+      free(key);
+      return -1;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Cache hit: %s\n", key);
+
+  free(key);
+
+  return 0;
 }
 
 void
@@ -1607,6 +2097,8 @@ cache_init(void)
       return 0;
     }
 
+  g_daap.max_size = (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_size") * 1024 * 1024;
+
   evbase_cache = event_base_new();
   if (!evbase_cache)
     {
@@ -1681,6 +2173,9 @@ cache_deinit(void)
       return;
     }
 
+  // Entries still referenced by a reply in flight are freed when it is sent
+  cache_daap_mem_clear(false);
+
   // Free event base
   event_free(cache_daap_updateev);
   event_base_free(evbase_cache);
@@ -55,6 +55,7 @@ static cfg_opt_t sec_general[] =
     CFG_BOOL("ipv6", cfg_true, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_size", 32, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -103,6 +104,7 @@ static cfg_opt_t sec_library[] =
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
+    CFG_INT("metadata_threads", 1, CFGF_NONE),
     CFG_BOOL("m3u_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
@@ -204,6 +206,12 @@ static cfg_opt_t sec_sqlite[] =
     CFG_INT("pragma_synchronous", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_library", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_cache", -1, CFGF_NONE),
+    CFG_INT("statement_cache_size", 32, CFGF_NONE),
+    CFG_INT("write_batch_size", 50, CFGF_NONE),
+    CFG_INT("write_commit_interval", 200, CFGF_NONE),
+    CFG_INT("read_pool_size", 2, CFGF_NONE),
+    CFG_BOOL("profiling", cfg_false, CFGF_NONE),
+    CFG_INT("profiling_explain_threshold", 100, CFGF_NONE),
     CFG_BOOL("vacuum", cfg_true, CFGF_NONE),
     CFG_END()
   };
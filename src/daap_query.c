@@ -35,7 +35,7 @@
 
 
 char *
-daap_query_parse_sql(const char *daap_query)
+daap_query_parse_sql(const char *daap_query, bool files)
 {
   /* Input DAAP query, fed to the lexer */
   pANTLR3_INPUT_STREAM query;
@@ -120,7 +120,7 @@ daap_query_parse_sql(const char *daap_query)
       goto sql_fail;
     }
 
-  sql = sqlconv->query(sqlconv);
+  sql = sqlconv->query(sqlconv, files);
 
   /* Check for tree parser errors */
   if (sqlconv->pTreeParser->rec->state->errorCount > 0)
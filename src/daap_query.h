@@ -6,7 +6,10 @@
 #include "misc.h"
 
 
+/* Set files if the query is applied to the files table (items, groups and
+ * browse queries), which allows looking up string matches in the full-text
+ * index */
 char *
-daap_query_parse_sql(const char *daap_query);
+daap_query_parse_sql(const char *daap_query, bool files);
 
 #endif /* !__DAAP_QUERY_H__ */
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -33,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unicase.h>
 #include <unictype.h>
 #include <uninorm.h>
 #include <unistr.h>
@@ -62,6 +64,24 @@
 // Flags that we will only update column value if we have non-zero value (to avoid zeroing e.g. rating)
 #define DB_FLAG_NO_ZERO  (1 << 1)
 
+// Number of result counts each thread remembers, see db_get_query_count()
+#define DB_COUNT_CACHE_SIZE 16
+
+// Max number of columns in a sort clause that supports keyset pagination
+#define DB_SORT_KEYS_MAX 4
+
+// Max number of changed files that a smart playlist refresh rechecks, if more
+// files have changed the smart playlists are refreshed from scratch
+#define DB_SMARTPL_CHANGES_MAX 4096
+// Number of changed files remembered by the files journal
+#define DB_FILES_JOURNAL_SIZE 16384
+
+// Seconds before the results of a smart playlist relative to 'now' expire
+#define DB_SMARTPL_EXPIRE 60
+
+// Number of ids per UPDATE when db_file_ping_end() pings the unchanged files
+#define DB_FILE_PING_IDS 500
+
 // The two last columns of playlist_info are calculated fields, so all playlist retrieval functions must use this query
 #define Q_PL_SELECT "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')" \
                     " FROM playlists f LEFT JOIN playlistitems pi ON (f.id = pi.playlistid)"
@@ -95,6 +115,10 @@ enum fixup_type {
   DB_FIXUP_ALBUM_SORT,
   DB_FIXUP_ALBUM_ARTIST_SORT,
   DB_FIXUP_COMPOSER_SORT,
+  DB_FIXUP_TITLE_SORT_KEY,
+  DB_FIXUP_ALBUM_SORT_KEY,
+  DB_FIXUP_ALBUM_ARTIST_SORT_KEY,
+  DB_FIXUP_COMPOSER_SORT_KEY,
   DB_FIXUP_TIME_MODIFIED,
   DB_FIXUP_SONGARTISTID,
   DB_FIXUP_SONGALBUMID,
@@ -119,6 +143,240 @@ struct db_statements
   sqlite3_stmt *queue_items_update;
 };
 
+struct db_stmt_cache_entry
+{
+  char *query;
+  sqlite3_stmt *stmt;
+  uint64_t last_used;
+  bool in_use;
+};
+
+struct db_stmt_cache
+{
+  struct db_stmt_cache_entry *entries;
+  int size;
+  uint64_t clock;
+};
+
+struct db_count_cache_entry
+{
+  char *query;
+  int id;
+  int64_t persistentid;
+  uint64_t revision;
+  int results;
+  uint64_t last_used;
+};
+
+struct db_count_cache
+{
+  struct db_count_cache_entry entries[DB_COUNT_CACHE_SIZE];
+  uint64_t clock;
+};
+
+// Files queued by db_file_add/db_file_update while a batch is active
+struct db_file_batch
+{
+  bool active;
+
+  struct media_file_info *adds;
+  int nadds;
+  struct media_file_info *updates;
+  int nupdates;
+  int size;
+
+  // Writes since the transaction was started, and when to commit it
+  int uncommitted;
+  int commit_interval;
+
+  // Multi-row insert, NULL if sqlite does not support it
+  sqlite3_stmt *insert;
+  int insert_rows;
+};
+
+struct db_file_stamp
+{
+  uint64_t hash;
+  uint32_t id;
+  uint32_t db_timestamp;
+};
+
+// Preloaded timestamps of the files, so that a bulk scan can tell if a file is
+// unchanged without a query, see db_file_ping_begin()
+struct db_file_stamps
+{
+  bool active;
+
+  // Open addressing, path hash -> id and db_timestamp. The id is 0 if the file
+  // must be pinged with a query (disabled, or the hash is not unique).
+  struct db_file_stamp *slots;
+  uint32_t nslots;
+
+  // Unchanged files, their db_timestamp is set by db_file_ping_end()
+  uint32_t *pinged;
+  int npinged;
+  int pinged_size;
+
+  // When the timestamps were loaded, which will be the new db_timestamp
+  time_t loaded;
+};
+
+struct db_dir_node
+{
+  struct directory_info di;
+
+  // Indices into nodes, -1 if none
+  int first_child;
+  int next_sibling;
+};
+
+// In-memory copy of the directories table
+struct db_dir_copy
+{
+  struct db_dir_node *nodes;
+  int nnodes;
+  int size;
+
+  // Directory id -> index into nodes, -1 if not present
+  int *byid;
+  uint32_t nbyid;
+
+  // Open addressing, hash of virtual_path and of path -> index into nodes
+  int *vpath_slots;
+  int *path_slots;
+  uint32_t nslots;
+};
+
+// The directory copy used by the lookups, see dir_index_lock()
+struct db_dir_index
+{
+  // Current copy, NULL if it must be rebuilt
+  struct db_dir_copy *copy;
+
+  // Incremented when the copy is invalidated, so that a copy that was being
+  // built at the time is not used
+  uint64_t generation;
+
+  pthread_mutex_t lck;
+};
+
+struct db_queue_mirror_slot
+{
+  uint32_t item_id;
+  int idx;
+};
+
+// In-memory copy of the queue, never modified once built
+struct db_queue_copy
+{
+  // Ordered by pos
+  struct db_queue_item *items;
+  int nitems;
+
+  // Indices into items, ordered by shuffle_pos
+  int *shuffle;
+
+  // Open addressing, item id -> index into items
+  struct db_queue_mirror_slot *slots;
+  int nslots;
+
+  // Queue changes the copy was made from
+  uint64_t version;
+};
+
+// The queue copy used by the read functions, see queue_mirror_fetch()
+struct db_queue_mirror
+{
+  // Current copy, NULL until the first read. Only replaced under the lock
+  struct db_queue_copy *copy;
+
+  // Incremented by queue_transaction_end() after each committed change, the
+  // copy is current if its version is the same
+  uint64_t changes;
+
+  // A thread is reading the queue for a new copy
+  bool building;
+
+  pthread_mutex_t lck;
+};
+
+// Files changed by a thread's writes that are not yet committed, see db_xupdate()
+struct db_files_changes
+{
+  int64_t *ids;
+  int nids;
+  bool overflow;
+  bool dirty;
+};
+
+struct db_smartpl_state
+{
+  int id;
+  char *query;
+
+  // Files revision that the smartpl_items rows of the playlist match
+  uint64_t revision;
+
+  // Refresh that committed the rows, see smartpl_valid()
+  uint64_t generation;
+
+  // Set if the query is relative to the current time
+  time_t expires;
+};
+
+// Materialized smart playlist results, see db_smartpl_refresh()
+struct db_smartpl
+{
+  struct db_smartpl_state *states;
+  int nstates;
+
+  // Incremented when changes to the files table are committed
+  uint64_t revision;
+
+  // Files changed after the revision 'refreshed', unless there were too many
+  int64_t *changed;
+  int nchanged;
+  bool overflow;
+  uint64_t refreshed;
+
+  // Incremented by each refresh that committed changes to smartpl_items
+  uint64_t generation;
+
+  pthread_mutex_t lck;
+};
+
+// Ring of the files changed by recent commits, see db_files_journal_get()
+struct db_files_journal
+{
+  int64_t *ids;
+  uint64_t *seqs;
+  int head;
+  int nids;
+
+  // Incremented with each commit of changes to the files table
+  uint64_t seq;
+
+  // Changes made after this seq are all in the ring
+  uint64_t valid_from;
+
+  pthread_mutex_t lck;
+};
+
+// Read-only connection that a thread can check out, see db_snapshot_begin()
+struct db_read_conn
+{
+  sqlite3 *hdl;
+  struct db_stmt_cache stmt_cache;
+  bool in_use;
+};
+
+struct db_read_pool
+{
+  struct db_read_conn *conns;
+  int size;
+  pthread_mutex_t lck;
+};
+
 struct col_type_map {
   char *name;
   ssize_t offset;
@@ -146,10 +404,12 @@ struct fixup_ctx
 
 struct query_clause {
   char *where;
+  char *keyset;
   char *group;
   char *having;
   char *order;
   char *index;
+  char *rownum;
 };
 
 struct browse_clause {
@@ -158,6 +418,12 @@ struct browse_clause {
   char *group;
 };
 
+struct sort_keyset {
+  const char *keys[DB_SORT_KEYS_MAX]; // Column names, see mfi_cols_map
+  const char *collate;
+  bool descending;
+};
+
 /* This list must be kept in sync with
  * - the order of the columns in the files table
  * - the type and name of the fields in struct media_file_info
@@ -227,6 +493,10 @@ static const struct col_type_map mfi_cols_map[] =
     { "album_artist_sort",  mfi_offsetof(album_artist_sort),  DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORT },
     { "composer_sort",      mfi_offsetof(composer_sort),      DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORT },
     { "channels",           mfi_offsetof(channels),           DB_TYPE_INT },
+    { "title_sort_key",     mfi_offsetof(title_sort_key),     DB_TYPE_STRING, DB_FIXUP_TITLE_SORT_KEY },
+    { "album_sort_key",     mfi_offsetof(album_sort_key),     DB_TYPE_STRING, DB_FIXUP_ALBUM_SORT_KEY },
+    { "album_artist_sort_key", mfi_offsetof(album_artist_sort_key), DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORT_KEY },
+    { "composer_sort_key",  mfi_offsetof(composer_sort_key),  DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORT_KEY },
   };
 
 /* This list must be kept in sync with
@@ -365,6 +635,10 @@ static const ssize_t dbmfi_cols_map[] =
     dbmfi_offsetof(album_artist_sort),
     dbmfi_offsetof(composer_sort),
     dbmfi_offsetof(channels),
+    dbmfi_offsetof(title_sort_key),
+    dbmfi_offsetof(album_sort_key),
+    dbmfi_offsetof(album_artist_sort_key),
+    dbmfi_offsetof(composer_sort_key),
   };
 
 /* This list must be kept in sync with
@@ -471,19 +745,42 @@ static const struct col_type_map wi_cols_map[] =
 static const char *sort_clause[] =
   {
     "",
-    "f.title_sort",
-    "f.album_sort, f.disc, f.track",
-    "f.album_artist_sort, f.album_sort, f.disc, f.track",
+    "f.title_sort_key",
+    "f.album_sort_key, f.disc, f.track",
+    "f.album_artist_sort_key, f.album_sort_key, f.disc, f.track",
     "f.type, f.parent_id, f.special_id, f.title",
     "f.year",
     "f.genre",
-    "f.composer_sort",
+    "f.composer_sort_key",
     "f.disc",
     "f.track",
     "f.virtual_path COLLATE NOCASE",
     "pos",
     "shuffle_pos",
-    "f.date_released DESC, f.title_sort DESC",
+    "f.date_released DESC, f.title_sort_key DESC",
+  };
+
+/* Keyset pagination, must be kept in sync with enum sort_type and sort_clause.
+ * The keys must be the same columns as the sort clause, rows are then further
+ * ordered by f.id, so that the cursor position is unique. Sort types without
+ * keys don't support keyset pagination.
+ */
+static const struct sort_keyset sort_keysets[] =
+  {
+    { { NULL } },
+    { { "title_sort_key" } },
+    { { "album_sort_key", "disc", "track" } },
+    { { "album_artist_sort_key", "album_sort_key", "disc", "track" } },
+    { { NULL } },
+    { { "year" } },
+    { { "genre" } },
+    { { "composer_sort_key" } },
+    { { "disc" } },
+    { { "track" } },
+    { { "virtual_path" }, "NOCASE" },
+    { { NULL } },
+    { { NULL } },
+    { { "date_released", "title_sort_key" }, NULL, true },
   };
 
 /* Browse clauses, used for SELECT, WHERE, GROUP BY and for default ORDER BY
@@ -493,10 +790,10 @@ static const char *sort_clause[] =
 static const struct browse_clause browse_clause[] =
   {
     { "",                                      "",                 "" },
-    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort, f.album_artist" },
-    { "f.album, f.album_sort",                 "f.album",          "f.album_sort, f.album" },
+    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort_key, f.album_artist" },
+    { "f.album, f.album_sort",                 "f.album",          "f.album_sort_key, f.album" },
     { "f.genre, f.genre",                      "f.genre",          "f.genre" },
-    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort, f.composer" },
+    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort_key, f.composer" },
     { "f.year, f.year",                        "f.year",           "f.year" },
     { "f.disc, f.disc",                        "f.disc",           "f.disc" },
     { "f.track, f.track",                      "f.track",          "f.track" },
@@ -586,9 +883,48 @@ struct rng_ctx shuffle_rng;
 
 static char *db_path;
 static bool db_rating_updates;
+static bool db_fts_enabled;
 
 static __thread sqlite3 *hdl;
 static __thread struct db_statements db_statements;
+static __thread struct db_stmt_cache db_stmt_cache;
+
+static __thread struct db_count_cache db_count_cache;
+
+static __thread struct db_file_batch db_file_batch;
+
+static __thread struct db_file_stamps db_file_stamps;
+
+static struct db_read_pool db_read_pool = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_queue_mirror db_queue_mirror = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_smartpl db_smartpl = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_files_journal db_files_journal = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_dir_index db_dir_index = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+// Set if the thread changed directories in a transaction, see dir_index_invalidate()
+static __thread bool db_dir_index_stale;
+
+static __thread struct db_files_changes db_files_changes;
+
+
+// Set while the thread has a read connection checked out
+static __thread struct db_read_conn *db_read_conn;
+static __thread sqlite3 *db_read_saved_hdl;
+static __thread struct db_stmt_cache db_read_saved_stmt_cache;
+static __thread uint64_t db_read_revision;
+static __thread uint64_t db_read_files_revision;
+static __thread uint64_t db_read_smartpl_generation;
+
+static struct db_stmt_cache_stats db_stmt_cache_stats;
+static pthread_mutex_t db_stmt_cache_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// Incremented after every write to the library db, see db_write_revision_bump()
+static uint64_t db_write_revision;
+static pthread_mutex_t db_write_revision_lck = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* Forward */
@@ -598,6 +934,48 @@ db_group_type_bypersistentid(int64_t persistentid);
 static int
 db_query_run(char *query, int free, short update_events);
 
+static sqlite3_stmt *
+db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, const char *table, int rows);
+
+static void
+file_batch_count(int writes);
+
+static void
+file_batch_flush_path(const char *path);
+
+static inline uint64_t
+sqlstats_now_ns(void);
+
+static void
+sqlstats_wait_add(uint64_t start_ns);
+
+static void
+sqlstats_trace_sync(void);
+
+static void
+smartpl_changes_commit(void);
+
+static void
+files_journal_add(struct db_files_changes *changes);
+
+static void
+group_stats_defer(void);
+
+static void
+group_stats_flush(void);
+
+static bool
+smartpl_valid(struct playlist_info *pli);
+
+static void
+dir_index_invalidate(void);
+
+static bool
+dir_index_lock(void);
+
+static void
+dir_index_unlock(void);
+
 
 char *
 db_escape_string(const char *str)
@@ -665,6 +1043,66 @@ db_snprintf(char *s, int n, const char *fmt, ...)
   return 0;
 }
 
+// Columns of files that are in the full-text index, see db_init_fts()
+static const char *db_fts_columns[] =
+  {
+    "title", "artist", "album", "album_artist", "composer", "genre", "virtual_path",
+  };
+
+// The trigram index can only be used if the pattern has three characters in a row
+static bool
+like_pattern_indexable(const char *pattern)
+{
+  int run;
+
+  for (run = 0; *pattern && run < 3; pattern++)
+    run = (*pattern == '%' || *pattern == '_') ? 0 : run + 1;
+
+  return (run == 3);
+}
+
+/* Makes a "col LIKE 'pattern'" expression with the pattern from fmt, which
+ * must be escaped (use %q). If possible the expression first looks up the
+ * candidate files in the full-text index, so col must be a column of the files
+ * table with the alias f. The trigram index folds case beyond ASCII, so the
+ * candidates are still matched with LIKE to get the same results with and
+ * without the index. Caller must free.
+ */
+char *
+db_mprintf_like(const char *col, const char *fmt, ...)
+{
+  const char *name;
+  char *pattern;
+  char *ret;
+  va_list va;
+  int i;
+
+  va_start(va, fmt);
+  pattern = sqlite3_vmprintf(fmt, va);
+  if (!pattern)
+    {
+      DPRINTF(E_FATAL, L_MISC, "Out of memory for db_mprintf_like\n");
+      abort();
+    }
+  va_end(va);
+
+  name = (strncmp(col, "f.", 2) == 0) ? col + 2 : col;
+
+  for (i = 0; db_fts_enabled && i < ARRAY_SIZE(db_fts_columns); i++)
+    {
+      if (strcmp(name, db_fts_columns[i]) == 0 && like_pattern_indexable(pattern))
+	{
+	  ret = db_mprintf("(f.id IN (SELECT rowid FROM files_fts WHERE files_fts.%s LIKE '%s') AND %s LIKE '%s')", name, pattern, col, pattern);
+	  sqlite3_free(pattern);
+	  return ret;
+	}
+    }
+
+  ret = db_mprintf("%s LIKE '%s'", col, pattern);
+  sqlite3_free(pattern);
+  return ret;
+}
+
 void
 free_pi(struct pairing_info *pi, int content_only)
 {
@@ -711,6 +1149,10 @@ free_mfi(struct media_file_info *mfi, int content_only)
   free(mfi->album_sort);
   free(mfi->composer_sort);
   free(mfi->album_artist_sort);
+  free(mfi->title_sort_key);
+  free(mfi->album_sort_key);
+  free(mfi->album_artist_sort_key);
+  free(mfi->composer_sort_key);
   free(mfi->virtual_path);
 
   if (!content_only)
@@ -985,6 +1427,39 @@ sort_tag_create(char **sort_tag, const char *src_tag)
   *sort_tag = (char *)u8_normalize(UNINORM_NFD, (uint8_t *)&out, u8_strlen(out) + 1, NULL, &len);
 }
 
+/* Makes a key from a sort tag that gives the same order with plain memcmp (the
+ * BINARY collation) as the DAAP collation in sqlext.c gives for the sort tag:
+ * first a '0' or '1' so that tags that don't start with a letter go to the tail,
+ * then the tag case folded and NFD normalized. Since UTF-8 byte order is code
+ * point order, this is what u8_casecmp() compares. Keep in sync with sqlext.c.
+ */
+static void
+sort_key_create(char **sort_key, const char *sort_tag)
+{
+  uint8_t *folded;
+  ucs4_t uc;
+  size_t len;
+  int ret;
+
+  free(*sort_key);
+  *sort_key = NULL;
+
+  if (!sort_tag || sort_tag[0] == '\0')
+    return;
+
+  ret = u8_mbtoucr(&uc, (const uint8_t *)sort_tag, strlen(sort_tag));
+  if (ret < 0)
+    return;
+
+  folded = u8_casefold((const uint8_t *)sort_tag, strlen(sort_tag), NULL, UNINORM_NFD, NULL, &len);
+  if (!folded)
+    return;
+
+  *sort_key = safe_asprintf("%c%.*s", uc_is_alpha(uc) ? '0' : '1', (int)len, (char *)folded);
+
+  free(folded);
+}
+
 static void
 fixup_sanitize(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
 {
@@ -997,6 +1472,10 @@ fixup_sanitize(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
     {
       case DB_FIXUP_NO_SANITIZE:
       case DB_FIXUP_CODECTYPE:
+      case DB_FIXUP_TITLE_SORT_KEY:
+      case DB_FIXUP_ALBUM_SORT_KEY:
+      case DB_FIXUP_ALBUM_ARTIST_SORT_KEY:
+      case DB_FIXUP_COMPOSER_SORT_KEY:
 	break; // Don't touch the above
 
       default:
@@ -1192,6 +1671,27 @@ fixup_sort_tags(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
 	  sort_tag_create(tag, ctx->mfi->composer);
 	break;
 
+      // The keys come after the sort tags in mfi_cols_map, so these are ready
+      case DB_FIXUP_TITLE_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->title_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->album_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_ARTIST_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->album_artist_sort);
+	break;
+
+      case DB_FIXUP_COMPOSER_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->composer_sort);
+	break;
+
       default:
 	break;
     }
@@ -1261,15 +1761,16 @@ fixup_tags_qi(struct db_queue_item *qi)
   fixup_tags(&ctx);
 }
 
+// Binds the columns from data starting at parameter n, returns the next free
+// parameter index or -1 on error
 static int
-bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, size_t map_size, int id)
+bind_generic_at(sqlite3_stmt *stmt, int n, void *data, const struct col_type_map *map, size_t map_size)
 {
   char **strptr;
   char *ptr;
   int i;
-  int n;
 
-  for (i = 0, n = 1; i < map_size; i++)
+  for (i = 0; i < map_size; i++)
     {
       if (map[i].flag & DB_FLAG_NO_BIND)
 	continue;
@@ -1299,6 +1800,18 @@ bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, siz
       n++;
     }
 
+  return n;
+}
+
+static int
+bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, size_t map_size, int id)
+{
+  int n;
+
+  n = bind_generic_at(stmt, 1, data, map, map_size);
+  if (n < 0)
+    return -1;
+
   // This binds the final "WHERE id = ?" if it is an update
   if (id)
     sqlite3_bind_int(stmt, n, id);
@@ -1348,8 +1861,11 @@ static int
 db_wait_unlock(void)
 {
   struct db_unlock u;
+  uint64_t start_ns;
   int ret;
 
+  start_ns = sqlstats_now_ns();
+
   u.proceed = 0;
   CHECK_ERR(L_DB, mutex_init(&u.lck));
   CHECK_ERR(L_DB, pthread_cond_init(&u.cond, NULL));
@@ -1371,6 +1887,8 @@ db_wait_unlock(void)
   CHECK_ERR(L_DB, pthread_cond_destroy(&u.cond));
   CHECK_ERR(L_DB, pthread_mutex_destroy(&u.lck));
 
+  sqlstats_wait_add(start_ns);
+
   return ret;
 }
 
@@ -1379,6 +1897,8 @@ db_blocking_step(sqlite3_stmt *stmt)
 {
   int ret;
 
+  sqlstats_trace_sync();
+
   while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
     {
       ret = db_wait_unlock();
@@ -1412,6 +1932,39 @@ db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const ch
   return ret;
 }
 
+/* The write revision tells if the library may have changed, so that cached
+ * query results can be validated. Readers must get the revision before running
+ * the query they want to cache, and writers must bump it after the change has
+ * been made (or committed, in case of a transaction).
+ */
+static void
+db_write_revision_bump(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_write_revision_lck));
+  db_write_revision++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_write_revision_lck));
+
+  // Changes to the files table are tracked separately for the smart playlists
+  if (db_files_changes.dirty && hdl && sqlite3_get_autocommit(hdl))
+    smartpl_changes_commit();
+
+  // Another thread may have rebuilt the directory index before the commit
+  if (db_dir_index_stale && hdl && sqlite3_get_autocommit(hdl))
+    dir_index_invalidate();
+}
+
+static uint64_t
+db_write_revision_get(void)
+{
+  uint64_t revision;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_write_revision_lck));
+  revision = db_write_revision;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_write_revision_lck));
+
+  return revision;
+}
+
 static int
 db_statement_run(sqlite3_stmt *stmt, short update_events)
 {
@@ -1442,6 +1995,9 @@ db_statement_run(sqlite3_stmt *stmt, short update_events)
   sqlite3_clear_bindings(stmt);
 
   changes = sqlite3_changes(hdl);
+  if (changes > 0)
+    db_write_revision_bump();
+
   if (update_events && changes > 0)
     library_update_trigger(update_events);
 
@@ -1483,30 +2039,342 @@ db_exec(const char *query, char **errmsg)
       return ret;
     }
 
+  // We don't know if the query was a write, so assume it was
+  db_write_revision_bump();
+
   return SQLITE_OK;
 }
 
 
-/* Maintenance and DB hygiene */
+/* Prepared statement cache
+ *
+ * Each thread keeps the statements from db_query_start() in a small LRU cache,
+ * keyed on the SQL text. The query builders use bound parameters for ids,
+ * limits and offsets, so the same kind of query will have the same SQL and
+ * doesn't need to be parsed and planned again. A cached statement is handed
+ * out to one query at a time. If it is already in use (nested queries), a new
+ * statement is prepared and finalized again when released.
+ */
 static void
-db_pragma_optimize(void)
+stmt_cache_stats_add(int hits, int misses)
 {
-  const char *query = "ANALYZE;";
-  char *errmsg;
-  int ret;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_stmt_cache_stats_lck));
+  db_stmt_cache_stats.hits += hits;
+  db_stmt_cache_stats.misses += misses;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_stmt_cache_stats_lck));
+}
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+static int
+stmt_cache_prepare(const char *query, sqlite3_stmt **stmt)
+{
+  struct db_stmt_cache_entry *e;
+  struct db_stmt_cache_entry *victim;
+  int i;
+  int ret;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  for (i = 0; i < db_stmt_cache.size; i++)
     {
-      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
+      e = &db_stmt_cache.entries[i];
+      if (!e->query || e->in_use || (strcmp(e->query, query) != 0))
+	continue;
 
-      sqlite3_free(errmsg);
+      e->in_use = true;
+      e->last_used = ++db_stmt_cache.clock;
+      *stmt = e->stmt;
+
+      stmt_cache_stats_add(1, 0);
+      return SQLITE_OK;
     }
-}
 
-/* Set names of default playlists according to config */
+  ret = db_blocking_prepare_v2(query, -1, stmt, NULL);
+  if (ret != SQLITE_OK)
+    return ret;
+
+  if (db_stmt_cache.size == 0)
+    return SQLITE_OK;
+
+  stmt_cache_stats_add(0, 1);
+
+  // Take a free slot or evict the least recently used statement
+  victim = NULL;
+  for (i = 0; i < db_stmt_cache.size; i++)
+    {
+      e = &db_stmt_cache.entries[i];
+      if (e->in_use)
+	continue;
+
+      if (!e->query)
+	{
+	  victim = e;
+	  break;
+	}
+
+      if (!victim || (e->last_used < victim->last_used))
+	victim = e;
+    }
+
+  // All slots in use, the statement will be finalized by stmt_cache_release()
+  if (!victim)
+    return SQLITE_OK;
+
+  if (victim->query)
+    {
+      DPRINTF(E_SPAM, L_DB, "Evicting statement from cache: '%s'\n", victim->query);
+
+      sqlite3_finalize(victim->stmt);
+      free(victim->query);
+      victim->query = NULL;
+    }
+
+  victim->query = strdup(query);
+  if (!victim->query)
+    return SQLITE_OK;
+
+  victim->stmt = *stmt;
+  victim->in_use = true;
+  victim->last_used = ++db_stmt_cache.clock;
+
+  return SQLITE_OK;
+}
+
+static void
+stmt_cache_release(sqlite3_stmt *stmt)
+{
+  struct db_stmt_cache_entry *e;
+  int i;
+
+  for (i = 0; i < db_stmt_cache.size; i++)
+    {
+      e = &db_stmt_cache.entries[i];
+      if (e->stmt != stmt || !e->in_use)
+	continue;
+
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      e->in_use = false;
+      return;
+    }
+
+  sqlite3_finalize(stmt);
+}
+
+static void
+stmt_cache_init(void)
+{
+  int size;
+
+  size = cfg_getint(cfg_getsec(cfg, "sqlite"), "statement_cache_size");
+  if (size <= 0)
+    {
+      DPRINTF(E_DBG, L_DB, "Prepared statement cache is disabled\n");
+      return;
+    }
+
+  CHECK_NULL(L_DB, db_stmt_cache.entries = calloc(size, sizeof(struct db_stmt_cache_entry)));
+  db_stmt_cache.size = size;
+  db_stmt_cache.clock = 0;
+}
+
+static void
+stmt_cache_deinit(void)
+{
+  struct db_stmt_cache_entry *e;
+  int i;
+
+  for (i = 0; i < db_stmt_cache.size; i++)
+    {
+      e = &db_stmt_cache.entries[i];
+      if (!e->query)
+	continue;
+
+      sqlite3_finalize(e->stmt);
+      free(e->query);
+    }
+
+  free(db_stmt_cache.entries);
+  memset(&db_stmt_cache, 0, sizeof(struct db_stmt_cache));
+}
+
+void
+db_stmt_cache_stats_get(struct db_stmt_cache_stats *stats)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_stmt_cache_stats_lck));
+  *stats = db_stmt_cache_stats;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_stmt_cache_stats_lck));
+}
+
+/* Cursors for keyset pagination are base64 (with the url safe alphabet) of
+ * "sort:id:len:value:len:value...", with a value for each of the sort keys. A
+ * NULL value has len -1 and is empty.
+ */
+struct keyset_cursor
+{
+  char *raw;
+  long id;
+  const char *values[DB_SORT_KEYS_MAX];
+  long lens[DB_SORT_KEYS_MAX]; // -1 if the value is NULL
+};
+
+static char *
+keyset_cursor_decode(const char *cursor)
+{
+  char *tmp;
+  char *raw;
+  char *ptr;
+
+  CHECK_NULL(L_DB, tmp = strdup(cursor));
+  for (ptr = tmp; *ptr; ptr++)
+    {
+      if (*ptr == '-')
+	*ptr = '+';
+      else if (*ptr == '_')
+	*ptr = '/';
+    }
+
+  raw = (char *)b64_decode(NULL, tmp);
+  free(tmp);
+
+  return raw;
+}
+
+// Caller must free kc->raw if this succeeds
+static int
+keyset_cursor_parse(struct keyset_cursor *kc, struct query_params *qp)
+{
+  const struct sort_keyset *ks;
+  char *ptr;
+  char *end;
+  long sort;
+  long len;
+  int i;
+
+  ks = &sort_keysets[qp->sort];
+
+  memset(kc, 0, sizeof(struct keyset_cursor));
+
+  kc->raw = keyset_cursor_decode(qp->after);
+  if (!kc->raw)
+    goto invalid;
+
+  sort = strtol(kc->raw, &end, 10);
+  if (end == kc->raw || *end != ':' || sort != qp->sort)
+    goto invalid;
+
+  ptr = end + 1;
+  kc->id = strtol(ptr, &end, 10);
+  if (end == ptr || (*end != ':' && *end != '\0'))
+    goto invalid;
+
+  for (i = 0; (i < DB_SORT_KEYS_MAX) && ks->keys[i]; i++)
+    {
+      if (*end != ':')
+	goto invalid;
+
+      ptr = end + 1;
+      len = strtol(ptr, &end, 10);
+      if (end == ptr || *end != ':' || len < -1 || len > (long)strlen(end + 1))
+	goto invalid;
+
+      ptr = end + 1;
+      end = (len > 0) ? ptr + len : ptr;
+
+      kc->values[i] = ptr;
+      kc->lens[i] = len;
+    }
+
+  if (*end != '\0')
+    goto invalid;
+
+  return 0;
+
+ invalid:
+  DPRINTF(E_LOG, L_DB, "Invalid or outdated query cursor '%s'\n", qp->after);
+  free(kc->raw);
+  kc->raw = NULL;
+  return -1;
+}
+
+static int
+keyset_bind(sqlite3_stmt *stmt, struct query_params *qp)
+{
+  const struct sort_keyset *ks;
+  struct keyset_cursor kc;
+  char param[16];
+  int i;
+  int ret;
+
+  ks = &sort_keysets[qp->sort];
+
+  ret = keyset_cursor_parse(&kc, qp);
+  if (ret < 0)
+    return SQLITE_MISMATCH;
+
+  ret = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":after_id"), kc.id);
+
+  // NULL values are not bound, keyset_clause_make() tests them with IS NULL
+  for (i = 0; (ret == SQLITE_OK) && (i < DB_SORT_KEYS_MAX) && ks->keys[i]; i++)
+    {
+      if (kc.lens[i] < 0)
+	continue;
+
+      snprintf(param, sizeof(param), ":after_%d", i);
+      ret = sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, param), kc.values[i], kc.lens[i], SQLITE_TRANSIENT);
+    }
+
+  free(kc.raw);
+  return ret;
+}
+
+/* Binds the query parameters that the query builders reference by name */
+static int
+stmt_bind_query_params(sqlite3_stmt *stmt, struct query_params *qp)
+{
+  int offset;
+  int idx;
+  int ret = SQLITE_OK;
+
+  if (qp->idx_type == I_LAST)
+    offset = qp->results - qp->limit;
+  else
+    offset = qp->offset;
+
+  if ((idx = sqlite3_bind_parameter_index(stmt, ":id")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, qp->id);
+  if ((ret == SQLITE_OK) && (idx = sqlite3_bind_parameter_index(stmt, ":persistentid")) > 0)
+    ret = sqlite3_bind_int64(stmt, idx, qp->persistentid);
+  if ((ret == SQLITE_OK) && (idx = sqlite3_bind_parameter_index(stmt, ":limit")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, qp->limit);
+  if ((ret == SQLITE_OK) && (idx = sqlite3_bind_parameter_index(stmt, ":offset")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, offset);
+  if ((ret == SQLITE_OK) && sqlite3_bind_parameter_index(stmt, ":after_id") > 0)
+    ret = keyset_bind(stmt, qp);
+
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error binding query parameters: %s\n", sqlite3_errmsg(hdl));
+
+  return ret;
+}
+
+/* Maintenance and DB hygiene */
+static void
+db_pragma_optimize(void)
+{
+  const char *query = "ANALYZE;";
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+    }
+}
+
+/* Set names of default playlists according to config */
 static void
 db_set_cfg_names(void)
 {
@@ -1615,6 +2483,8 @@ db_purge_cruft(time_t ref)
 
   db_transaction_end();
 
+  dir_index_invalidate();
+
 #undef Q_TMPL
 }
 
@@ -1623,10 +2493,11 @@ db_purge_all(void)
 {
 #define Q_TMPL_PL "DELETE FROM playlists WHERE type <> %d;"
 #define Q_TMPL_DIR "DELETE FROM directories WHERE id >= %d;"
-  char *queries[4] =
+  char *queries[5] =
     {
       "DELETE FROM inotify;",
       "DELETE FROM playlistitems;",
+      "DELETE FROM smartpl_items;",
       "DELETE FROM files;",
       "DELETE FROM groups;",
     };
@@ -1635,6 +2506,10 @@ db_purge_all(void)
   int i;
   int ret;
 
+  // Deleting all rows doesn't call the update hook, so db_xupdate() won't know
+  db_files_changes.overflow = true;
+  db_files_changes.dirty = true;
+
   for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
     {
       DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
@@ -1694,6 +2569,8 @@ db_purge_all(void)
 
   sqlite3_free(query);
 
+  dir_index_invalidate();
+
 #undef Q_TMPL_PL
 #undef Q_TMPL_DIR
 }
@@ -1791,6 +2668,100 @@ db_transaction_rollback(void)
 
       sqlite3_free(errmsg);
     }
+
+  // Directories that were added to the index may have been rolled back
+  dir_index_invalidate();
+}
+
+static bool
+keyset_supported(struct query_params *qp)
+{
+  if (qp->type != Q_ITEMS && qp->type != Q_GROUP_ITEMS)
+    return false;
+
+  if (qp->order || qp->group)
+    return false;
+
+  return (sort_keysets[qp->sort].keys[0] != NULL);
+}
+
+static void
+keyset_expr(char *buf, size_t bufsize, const struct sort_keyset *ks, int i)
+{
+  if (ks->collate)
+    snprintf(buf, bufsize, "f.%s COLLATE %s", ks->keys[i], ks->collate);
+  else
+    snprintf(buf, bufsize, "f.%s", ks->keys[i]);
+}
+
+/* Makes "WHERE f.k0 >= :after_0 AND (f.k0 > :after_0 OR (f.k0 = :after_0 AND
+ * (f.k1 > :after_1 OR (f.k1 = :after_1 AND f.id > :after_id))))". The first
+ * condition is redundant, but lets sqlite use the sort index. Keys can be NULL,
+ * which sqlite sorts before any other value, so a NULL in the cursor gets its
+ * own IS NULL conditions instead of a bound parameter.
+ */
+static char *
+keyset_clause_make(struct query_params *qp, const char *where)
+{
+  const struct sort_keyset *ks;
+  struct keyset_cursor kc;
+  char expr[128];
+  char *first;
+  char *cond;
+  char *tmp;
+  int nkeys;
+  int i;
+
+  ks = &sort_keysets[qp->sort];
+
+  if (keyset_cursor_parse(&kc, qp) < 0)
+    return NULL;
+
+  for (nkeys = 0; nkeys < DB_SORT_KEYS_MAX && ks->keys[nkeys]; nkeys++)
+    ; /* EMPTY */
+
+  cond = sqlite3_mprintf("f.id %s :after_id", ks->descending ? "<" : ">");
+
+  for (i = nkeys - 1; cond && i >= 0; i--)
+    {
+      keyset_expr(expr, sizeof(expr), ks, i);
+
+      if (kc.lens[i] < 0 && ks->descending)
+	tmp = sqlite3_mprintf("(%s IS NULL AND (%s))", expr, cond);
+      else if (kc.lens[i] < 0)
+	tmp = sqlite3_mprintf("(%s IS NOT NULL OR (%s IS NULL AND (%s)))", expr, expr, cond);
+      else if (ks->descending)
+	tmp = sqlite3_mprintf("(%s < :after_%d OR %s IS NULL OR (%s = :after_%d AND (%s)))", expr, i, expr, expr, i, cond);
+      else
+	tmp = sqlite3_mprintf("(%s > :after_%d OR (%s = :after_%d AND (%s)))", expr, i, expr, i, cond);
+
+      sqlite3_free(cond);
+      cond = tmp;
+    }
+
+  keyset_expr(expr, sizeof(expr), ks, 0);
+  if (kc.lens[0] < 0)
+    first = sqlite3_mprintf("");
+  else if (ks->descending)
+    first = sqlite3_mprintf("(%s <= :after_0 OR %s IS NULL) AND ", expr, expr);
+  else
+    first = sqlite3_mprintf("%s >= :after_0 AND ", expr);
+
+  free(kc.raw);
+
+  if (!cond || !first)
+    {
+      sqlite3_free(cond);
+      sqlite3_free(first);
+      return NULL;
+    }
+
+  tmp = sqlite3_mprintf("%s %s%s", (where[0] != '\0') ? "AND" : "WHERE", first, cond);
+
+  sqlite3_free(first);
+  sqlite3_free(cond);
+
+  return tmp;
 }
 
 static void
@@ -1800,17 +2771,54 @@ db_free_query_clause(struct query_clause *qc)
     return;
 
   sqlite3_free(qc->where);
+  sqlite3_free(qc->keyset);
   sqlite3_free(qc->group);
   sqlite3_free(qc->having);
   sqlite3_free(qc->order);
   sqlite3_free(qc->index);
+  sqlite3_free(qc->rownum);
   free(qc);
 }
 
+// Combines qp->filter with the typed filters, returns NULL if there is none
+static char *
+query_filter_make(struct query_params *qp)
+{
+  char *filter;
+  char *tmp;
+
+  filter = qp->filter ? sqlite3_mprintf("%s", qp->filter) : NULL;
+
+  if (qp->filter_media_kind)
+    {
+      if (filter)
+	tmp = sqlite3_mprintf("%s AND (f.media_kind = %d)", filter, qp->filter_media_kind);
+      else
+	tmp = sqlite3_mprintf("(f.media_kind = %d)", qp->filter_media_kind);
+
+      sqlite3_free(filter);
+      filter = tmp;
+    }
+
+  if (qp->filter_songartistid)
+    {
+      if (filter)
+	tmp = sqlite3_mprintf("%s AND (f.songartistid = %" PRIi64 ")", filter, qp->filter_songartistid);
+      else
+	tmp = sqlite3_mprintf("(f.songartistid = %" PRIi64 ")", qp->filter_songartistid);
+
+      sqlite3_free(filter);
+      filter = tmp;
+    }
+
+  return filter;
+}
+
 static struct query_clause *
 db_build_query_clause(struct query_params *qp)
 {
   struct query_clause *qc;
+  char *filter;
 
   qc = calloc(1, sizeof(struct query_clause));
   if (!qc)
@@ -1823,22 +2831,40 @@ db_build_query_clause(struct query_params *qp)
   else
     qc->group = sqlite3_mprintf("");
 
-  if (qp->filter && !qp->with_disabled)
-    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", qp->filter);
+  filter = query_filter_make(qp);
+  if (!filter && (qp->filter || qp->filter_media_kind || qp->filter_songartistid))
+    goto error;
+
+  if (filter && !qp->with_disabled)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", filter);
   else if (!qp->with_disabled)
     qc->where = sqlite3_mprintf("WHERE f.disabled = 0");
-  else if (qp->filter)
-    qc->where = sqlite3_mprintf("WHERE %s", qp->filter);
+  else if (filter)
+    qc->where = sqlite3_mprintf("WHERE %s", filter);
   else
     qc->where = sqlite3_mprintf("");
 
+  sqlite3_free(filter);
+
   if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
     qc->having = sqlite3_mprintf("HAVING %s", qp->having);
   else
     qc->having = sqlite3_mprintf("");
 
+  if (qp->after && !keyset_supported(qp))
+    {
+      DPRINTF(E_LOG, L_DB, "Query type %d with sort %d does not support cursors\n", qp->type, qp->sort);
+      goto error;
+    }
+  else if (qp->after)
+    qc->keyset = keyset_clause_make(qp, qc->where);
+  else
+    qc->keyset = sqlite3_mprintf("");
+
   if (qp->order)
     qc->order = sqlite3_mprintf("ORDER BY %s", qp->order);
+  else if (keyset_supported(qp))
+    qc->order = sqlite3_mprintf("ORDER BY %s, f.id%s", sort_clause[qp->sort], sort_keysets[qp->sort].descending ? " DESC" : "");
   else if (qp->sort)
     qc->order = sqlite3_mprintf("ORDER BY %s", sort_clause[qp->sort]);
   else if (qp->type & Q_F_BROWSE)
@@ -1850,20 +2876,20 @@ db_build_query_clause(struct query_params *qp)
     {
       case I_FIRST:
 	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
+	  qc->index = sqlite3_mprintf("LIMIT :limit");
 	else
 	  qc->index = sqlite3_mprintf("");
 	break;
 
       case I_LAST:
-	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
+	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET :offset");
 	break;
 
       case I_SUB:
 	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
+	  qc->index = sqlite3_mprintf("LIMIT :limit OFFSET :offset");
 	else
-	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->offset);
+	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET :offset");
 	break;
 
       case I_NONE:
@@ -1871,7 +2897,12 @@ db_build_query_clause(struct query_params *qp)
 	break;
     }
 
-  if (!qc->where || !qc->index)
+  if (qp->with_rownum && qc->order)
+    qc->rownum = sqlite3_mprintf(", ROW_NUMBER() OVER (%s) AS rownum", qc->order);
+  else
+    qc->rownum = sqlite3_mprintf("");
+
+  if (!qc->where || !qc->keyset || !qc->order || !qc->index || !qc->rownum)
     goto error;
 
   return qc;
@@ -1882,45 +2913,175 @@ db_build_query_clause(struct query_params *qp)
   return NULL;
 }
 
-static char *
-db_build_query_check(struct query_params *qp, char *count, char *query)
+static struct db_count_cache_entry *
+count_cache_get(const char *query, struct query_params *qp)
 {
-  if (!count || !query)
+  struct db_count_cache_entry *e;
+  int i;
+
+  for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      goto failed;
+      e = &db_count_cache.entries[i];
+      if (e->query && (e->id == qp->id) && (e->persistentid == qp->persistentid) && (strcmp(e->query, query) == 0))
+	return e;
     }
 
-  qp->results = db_get_one_int(count);
-  if (qp->results < 0)
+  return NULL;
+}
+
+static void
+count_cache_set(const char *query, struct query_params *qp, uint64_t revision, int results)
+{
+  struct db_count_cache_entry *e;
+  int i;
+
+  e = count_cache_get(query, qp);
+  if (!e)
     {
-      DPRINTF(E_LOG, L_DB, "No results for count\n");
-      goto failed;
-    }
+      // Take a free slot or evict the least recently used count
+      for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
+	{
+	  if (!db_count_cache.entries[i].query)
+	    {
+	      e = &db_count_cache.entries[i];
+	      break;
+	    }
 
-  sqlite3_free(count);
+	  if (!e || (db_count_cache.entries[i].last_used < e->last_used))
+	    e = &db_count_cache.entries[i];
+	}
 
-  return query;
+      free(e->query);
+      e->query = strdup(query);
+      if (!e->query)
+	return;
 
- failed:
-  sqlite3_free(count);
-  sqlite3_free(query);
-  return NULL;
+      e->id = qp->id;
+      e->persistentid = qp->persistentid;
+    }
+
+  e->revision = revision;
+  e->results = results;
+  e->last_used = ++db_count_cache.clock;
 }
 
-static char *
-db_build_query_items(struct query_params *qp, struct query_clause *qc)
+static void
+count_cache_deinit(void)
 {
-  char *count;
-  char *query;
+  int i;
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s;", qc->where, qc->group, qc->order, qc->index);
+  for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
+    free(db_count_cache.entries[i].query);
 
-  return db_build_query_check(qp, count, query);
+  memset(&db_count_cache, 0, sizeof(struct db_count_cache));
 }
 
-static char *
+/* Returns the number of results of a count query. Since the count requires a
+ * scan of all the matching rows, the result is remembered for the query and
+ * its parameters, and reused as long as the library hasn't been written to.
+ */
+static int
+db_get_query_count(const char *query, struct query_params *qp)
+{
+  struct db_count_cache_entry *e;
+  sqlite3_stmt *stmt;
+  uint64_t revision;
+  int ret;
+
+  // In a snapshot the count must be tagged with the revision the snapshot started from
+  revision = db_read_conn ? db_read_revision : db_write_revision_get();
+
+  e = count_cache_get(query, qp);
+  if (e && (e->revision == revision))
+    {
+      DPRINTF(E_DBG, L_DB, "Using cached count %d for query '%s'\n", e->results, query);
+
+      e->last_used = ++db_count_cache.clock;
+      return e->results;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = stmt_cache_prepare(query, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = stmt_bind_query_params(stmt, qp);
+  if (ret != SQLITE_OK)
+    {
+      stmt_cache_release(stmt);
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No matching row found for query: %s\n", query);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+
+      stmt_cache_release(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  stmt_cache_release(stmt);
+
+  count_cache_set(query, qp, revision, ret);
+
+  return ret;
+}
+
+static char *
+db_build_query_check(struct query_params *qp, char *count, char *query)
+{
+  if (!count || !query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      goto failed;
+    }
+
+  if (qp->skip_count && (qp->idx_type != I_LAST))
+    {
+      sqlite3_free(count);
+      return query;
+    }
+
+  qp->results = db_get_query_count(count, qp);
+  if (qp->results < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "No results for count\n");
+      goto failed;
+    }
+
+  sqlite3_free(count);
+
+  return query;
+
+ failed:
+  sqlite3_free(count);
+  sqlite3_free(query);
+  return NULL;
+}
+
+static char *
+db_build_query_items(struct query_params *qp, struct query_clause *qc)
+{
+  char *count;
+  char *query;
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
+  query = sqlite3_mprintf("SELECT f.*%s FROM files f %s %s %s %s %s;", qc->rownum, qc->where, qc->keyset, qc->group, qc->order, qc->index);
+
+  return db_build_query_check(qp, count, query);
+}
+
+static char *
 db_build_query_pls(struct query_params *qp, struct query_clause *qc)
 {
   char *count;
@@ -1954,8 +3115,9 @@ db_build_query_plitems_plain(struct query_params *qp, struct query_clause *qc)
   char *count;
   char *query;
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d;", qc->where, qp->id);
-  query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->where, qp->id, qc->index);
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = :id;", qc->where);
+  query = sqlite3_mprintf("SELECT f.*%s FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = :id ORDER BY pi.id ASC %s;",
+			  qp->with_rownum ? ", ROW_NUMBER() OVER (ORDER BY pi.id ASC) AS rownum" : "", qc->where, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2007,8 +3169,17 @@ db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
   if (!qc)
     return NULL;
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND %s LIMIT %d;", qc->where, pli->query, pli->query_limit ? pli->query_limit : -1);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s AND %s %s %s;", qc->where, pli->query, qc->order, qc->index);
+  // Use the materialized results if they are up to date, see db_smartpl_refresh()
+  if (smartpl_valid(pli))
+    {
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM smartpl_items s JOIN files f ON f.id = s.fileid %s AND s.playlistid = %d LIMIT %d;", qc->where, pli->id, pli->query_limit ? pli->query_limit : -1);
+      query = sqlite3_mprintf("SELECT f.*%s FROM smartpl_items s JOIN files f ON f.id = s.fileid %s AND s.playlistid = %d %s %s;", qc->rownum, qc->where, pli->id, qc->order, qc->index);
+    }
+  else
+    {
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND %s LIMIT %d;", qc->where, pli->query, pli->query_limit ? pli->query_limit : -1);
+      query = sqlite3_mprintf("SELECT f.*%s FROM files f %s AND %s %s %s;", qc->rownum, qc->where, pli->query, qc->order, qc->index);
+    }
 
   db_free_query_clause(qc);
 
@@ -2055,11 +3226,76 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
+/* The group_stats table can replace the GROUP BY of group queries if they are
+ * only filtered with the typed filters (media_kind and songartistid) and are
+ * sorted by album or artist. Returns true and sets the filter values if the
+ * query qualifies.
+ */
+static bool
+group_stats_usable(struct query_params *qp, int *kind, int64_t *songartistid)
+{
+  *kind = qp->filter_media_kind;
+  *songartistid = qp->filter_songartistid;
+
+  if (qp->filter || qp->with_disabled || qp->having || qp->order || qp->group)
+    return false;
+
+  if (qp->sort != S_NONE && qp->sort != S_ALBUM && qp->sort != S_ARTIST)
+    return false;
+
+  return true;
+}
+
+static char *
+db_build_query_group_stats(struct query_params *qp, struct query_clause *qc, enum group_type type, int kind, int64_t songartistid)
+{
+  const char *names;
+  const char *order;
+  char *where;
+  char *count;
+  char *query;
+
+  if (songartistid)
+    where = sqlite3_mprintf("WHERE f.type = %d AND f.kind = %d AND f.songartistid = %" PRIi64, type, kind, songartistid);
+  else
+    where = sqlite3_mprintf("WHERE f.type = %d AND f.kind = %d", type, kind);
+
+  if (type == G_ALBUMS)
+    names = "f.album, f.album_sort";
+  else
+    names = "f.album_artist, f.album_artist_sort";
+
+  if (qp->sort == S_ALBUM)
+    order = "ORDER BY f.album_sort_key";
+  else if (qp->sort == S_ARTIST)
+    order = "ORDER BY f.album_artist_sort_key, f.album_sort_key";
+  else
+    order = "";
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM group_stats f %s;", where);
+  query = sqlite3_mprintf("SELECT " \
+			  "  g.id, g.persistentid, %s, f.track_count, " \
+			  "  f.album_count, f.album_artist, f.songartistid, " \
+			  "  f.song_length, f.data_kind, f.media_kind, f.year, f.date_released, " \
+			  "  f.time_added, f.time_played, f.seek " \
+			  "FROM group_stats f JOIN groups g ON f.type = g.type AND f.persistentid = g.persistentid %s " \
+			  "%s %s;", names, where, order, qc->index);
+
+  sqlite3_free(where);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 {
+  int64_t songartistid;
   char *count;
   char *query;
+  int kind;
+
+  if (group_stats_usable(qp, &kind, &songartistid))
+    return db_build_query_group_stats(qp, qc, G_ALBUMS, kind, songartistid);
 
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT " \
@@ -2076,8 +3312,13 @@ db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 static char *
 db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
 {
+  int64_t songartistid;
   char *count;
   char *query;
+  int kind;
+
+  if (group_stats_usable(qp, &kind, &songartistid))
+    return db_build_query_group_stats(qp, qc, G_ARTISTS, kind, songartistid);
 
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT " \
@@ -2104,13 +3345,13 @@ db_build_query_group_items(struct query_params *qp, struct query_clause *qc)
   switch (gt)
     {
       case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = :persistentid;", qc->where);
+	query = sqlite3_mprintf("SELECT f.*%s FROM files f %s %s AND f.songalbumid = :persistentid %s %s;", qc->rownum, qc->where, qc->keyset, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = :persistentid;", qc->where);
+	query = sqlite3_mprintf("SELECT f.*%s FROM files f %s %s AND f.songartistid = :persistentid %s %s;", qc->rownum, qc->where, qc->keyset, qc->order, qc->index);
 	break;
 
       default:
@@ -2134,16 +3375,16 @@ db_build_query_group_dirs(struct query_params *qp, struct query_clause *qc)
     {
       case G_ALBUMS:
 	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
-				" FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
+				" FROM files f %s AND f.songalbumid = :persistentid;", qc->where);
 	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
-				" FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+				" FROM files f %s AND f.songalbumid = :persistentid %s %s;", qc->where, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
 	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
-				" FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
+				" FROM files f %s AND f.songartistid = :persistentid;", qc->where);
 	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
-				" FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+				" FROM files f %s AND f.songartistid = :persistentid %s %s;", qc->where, qc->order, qc->index);
 	break;
 
       default:
@@ -2185,20 +3426,16 @@ db_build_query_count_items(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
-int
-db_query_start(struct query_params *qp)
+// Returns the SQL for the query, caller must sqlite3_free() it
+static char *
+db_build_query(struct query_params *qp)
 {
   struct query_clause *qc;
-  sqlite3_stmt *stmt;
   char *query;
-  int ret;
-
-  qp->stmt = NULL;
-  qp->results = -1;
 
   qc = db_build_query_clause(qp);
   if (!qc)
-    return -1;
+    return NULL;
 
   switch (qp->type)
     {
@@ -2248,14 +3485,28 @@ db_query_start(struct query_params *qp)
   db_free_query_clause(qc);
 
   if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not create query, unknown type %d\n", qp->type);
-      return -1;
-    }
+    DPRINTF(E_LOG, L_DB, "Could not create query, unknown type %d\n", qp->type);
+
+  return query;
+}
+
+int
+db_query_start(struct query_params *qp)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  qp->stmt = NULL;
+  qp->results = -1;
+
+  query = db_build_query(qp);
+  if (!query)
+    return -1;
 
   DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = stmt_cache_prepare(query, &stmt);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -2266,6 +3517,13 @@ db_query_start(struct query_params *qp)
 
   sqlite3_free(query);
 
+  ret = stmt_bind_query_params(stmt, qp);
+  if (ret != SQLITE_OK)
+    {
+      stmt_cache_release(stmt);
+      return -1;
+    }
+
   qp->stmt = stmt;
 
   return 0;
@@ -2277,10 +3535,116 @@ db_query_end(struct query_params *qp)
   if (!qp->stmt)
     return;
 
-  sqlite3_finalize(qp->stmt);
+  stmt_cache_release(qp->stmt);
   qp->stmt = NULL;
 }
 
+/* Returns a cursor that can be set as qp->after to continue a query after the
+ * given row, or NULL if the query doesn't support keyset pagination. Caller
+ * must free the returned string.
+ */
+char *
+db_query_cursor_make(struct query_params *qp, struct media_file_info *mfi)
+{
+  const struct sort_keyset *ks;
+  const struct col_type_map *map;
+  char *raw;
+  char *tmp;
+  char *out;
+  char *ptr;
+  char value[32];
+  const char *strval;
+  int i;
+  int j;
+
+  if (!keyset_supported(qp))
+    return NULL;
+
+  ks = &sort_keysets[qp->sort];
+
+  raw = safe_asprintf("%d:%u", qp->sort, mfi->id);
+
+  for (i = 0; i < DB_SORT_KEYS_MAX && ks->keys[i]; i++)
+    {
+      for (j = 0, map = NULL; j < ARRAY_SIZE(mfi_cols_map); j++)
+	{
+	  if (strcmp(mfi_cols_map[j].name, ks->keys[i]) == 0)
+	    map = &mfi_cols_map[j];
+	}
+
+      if (!map)
+	{
+	  DPRINTF(E_LOG, L_DB, "BUG: Unknown sort key '%s'\n", ks->keys[i]);
+	  free(raw);
+	  return NULL;
+	}
+
+      switch (map->type)
+	{
+	  case DB_TYPE_STRING:
+	    strval = *(char **) ((char *)mfi + map->offset);
+	    break;
+
+	  case DB_TYPE_INT64:
+	    snprintf(value, sizeof(value), "%" PRIi64, *(int64_t *) ((char *)mfi + map->offset));
+	    strval = value;
+	    break;
+
+	  default:
+	    snprintf(value, sizeof(value), "%u", *(uint32_t *) ((char *)mfi + map->offset));
+	    strval = value;
+	    break;
+	}
+
+      if (strval)
+	tmp = safe_asprintf("%s:%zu:%s", raw, strlen(strval), strval);
+      else
+	tmp = safe_asprintf("%s:-1:", raw);
+      free(raw);
+      raw = tmp;
+    }
+
+  out = b64_encode((uint8_t *)raw, strlen(raw));
+  free(raw);
+  if (!out)
+    return NULL;
+
+  for (ptr = out; *ptr; ptr++)
+    {
+      if (*ptr == '+')
+	*ptr = '-';
+      else if (*ptr == '/')
+	*ptr = '_';
+    }
+
+  return out;
+}
+
+/* Returns 0 if qp->after is not set or is a cursor the query can continue
+ * from, and -1 if the cursor is malformed, outdated (e.g. made with another
+ * sort) or the query doesn't support cursors.
+ */
+int
+db_query_cursor_check(struct query_params *qp)
+{
+  struct keyset_cursor kc;
+
+  if (!qp->after)
+    return 0;
+
+  if (!keyset_supported(qp))
+    {
+      DPRINTF(E_LOG, L_DB, "Query type %d with sort %d does not support cursors\n", qp->type, qp->sort);
+      return -1;
+    }
+
+  if (keyset_cursor_parse(&kc, qp) < 0)
+    return -1;
+
+  free(kc.raw);
+  return 0;
+}
+
 /*
  * Utility function for running write queries (INSERT, UPDATE, DELETE). If you
  * set free to non-zero, the function will free the query. If you set
@@ -2326,16 +3690,12 @@ db_query_run(char *query, int free, short update_events)
   return ((ret != SQLITE_OK) ? -1 : 0);
 }
 
-int
-db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
+static int
+query_fetch_file_step(struct query_params *qp)
 {
   int ncols;
-  char **strcol;
-  int i;
   int ret;
 
-  memset(dbmfi, 0, sizeof(struct db_media_file_info));
-
   if (!qp->stmt)
     {
       DPRINTF(E_LOG, L_DB, "Query not started!\n");
@@ -2352,7 +3712,6 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
   if (ret == SQLITE_DONE)
     {
       DPRINTF(E_DBG, L_DB, "End of query results\n");
-      dbmfi->id = NULL;
       return 0;
     }
   else if (ret != SQLITE_ROW)
@@ -2370,6 +3729,22 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
       return -1;
     }
 
+  return 1;
+}
+
+int
+db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
+{
+  char **strcol;
+  int i;
+  int ret;
+
+  memset(dbmfi, 0, sizeof(struct db_media_file_info));
+
+  ret = query_fetch_file_step(qp);
+  if (ret <= 0)
+    return ret; // dbmfi->id is NULL at end of results
+
   for (i = 0; i < ARRAY_SIZE(dbmfi_cols_map); i++)
     {
       strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i]);
@@ -2380,6 +3755,31 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
   return 0;
 }
 
+/* Like db_query_fetch_file(), but fills a typed struct directly from the column
+ * values, so that callers don't have to convert integers back from text. The
+ * strings in mfi point into the statement and are only valid until the next
+ * fetch or db_query_end(), so the caller must not free_mfi() it.
+ */
+int
+db_query_fetch_mfi(struct query_params *qp, struct media_file_info *mfi)
+{
+  int i;
+  int ret;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  ret = query_fetch_file_step(qp);
+  if (ret <= 0)
+    return ret; // mfi->id is 0 at end of results
+
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      struct_field_from_statement(mfi, mfi_cols_map[i].offset, mfi_cols_map[i].type, qp->stmt, i, false, false);
+    }
+
+  return 0;
+}
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli)
 {
@@ -2839,21 +4239,224 @@ db_file_ping(int id)
 #undef Q_TMPL
 }
 
-int
-db_file_ping_bypath(const char *path, time_t mtime_max)
+/* Bulk scans ping every file in the library, which used to be an UPDATE per
+ * file even if nothing had changed. Instead, the scan can preload the path and
+ * db_timestamp of all files with db_file_ping_begin(), so that
+ * db_file_ping_bypath() can compare with the file mtime in memory. The
+ * unchanged files are then pinged with a few UPDATEs by db_file_ping_end(),
+ * which must be called before the library purges files that were not pinged.
+ * Only affects the calling thread.
+ */
+static struct db_file_stamp *
+file_stamp_slot(uint64_t hash)
 {
-  sqlite3_bind_int64(db_statements.files_ping, 1, (int64_t)time(NULL));
-  sqlite3_bind_text(db_statements.files_ping, 2, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int64(db_statements.files_ping, 3, (int64_t)mtime_max);
+  struct db_file_stamps *s = &db_file_stamps;
+  uint32_t i;
+
+  for (i = hash & (s->nslots - 1); s->slots[i].hash != 0 && s->slots[i].hash != hash; i = (i + 1) & (s->nslots - 1))
+    ; /* EMPTY */
+
+  return &s->slots[i];
+}
 
-  return db_statement_run(db_statements.files_ping, 0);
+static uint64_t
+file_stamp_hash(const char *path)
+{
+  uint64_t hash;
+
+  hash = murmur_hash64(path, strlen(path), 0);
+
+  // 0 marks an empty slot
+  return hash ? hash : 1;
 }
 
 void
-db_file_ping_bymatch(const char *path, int isdir)
+db_file_ping_begin(void)
 {
-#define Q_TMPL_DIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q/%%';"
-#define Q_TMPL_NODIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q%%';"
+#define Q_COUNT "SELECT COUNT(*) FROM files f WHERE f.data_kind IN (%d, %d);"
+#define Q_TMPL "SELECT f.id, f.path, f.db_timestamp, f.disabled FROM files f WHERE f.data_kind IN (%d, %d);"
+  struct db_file_stamps *s = &db_file_stamps;
+  struct db_file_stamp *slot;
+  sqlite3_stmt *stmt;
+  const char *path;
+  char *query;
+  uint64_t hash;
+  int nfiles;
+  int ret;
+
+  if (s->active)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: Preload of file timestamps already done\n");
+      return;
+    }
+
+  // Loaded before the timestamps are read, so that it never exceeds the time a
+  // file was pinged
+  s->loaded = time(NULL);
+
+  query = sqlite3_mprintf(Q_COUNT, DATA_KIND_FILE, DATA_KIND_PIPE);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return;
+    }
+
+  nfiles = db_get_one_int(query);
+  sqlite3_free(query);
+  if (nfiles < 0)
+    return;
+
+  for (s->nslots = 1024; s->nslots < 2 * (uint32_t)nfiles; s->nslots *= 2)
+    ; /* EMPTY */
+
+  s->slots = calloc(s->nslots, sizeof(struct db_file_stamp));
+  if (!s->slots)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for timestamps of %d files, will ping them one by one\n", nfiles);
+      return;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, DATA_KIND_FILE, DATA_KIND_PIPE);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      goto error;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      goto error;
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      path = (const char *)sqlite3_column_text(stmt, 1);
+      if (!path)
+	continue;
+
+      hash = file_stamp_hash(path);
+      slot = file_stamp_slot(hash);
+      if (slot->hash == hash)
+	{
+	  slot->id = 0;
+	  continue;
+	}
+
+      slot->hash = hash;
+      slot->id = (sqlite3_column_int64(stmt, 3) == 0) ? sqlite3_column_int(stmt, 0) : 0;
+      slot->db_timestamp = sqlite3_column_int64(stmt, 2);
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      goto error;
+    }
+
+  s->npinged = 0;
+  s->active = true;
+
+  DPRINTF(E_DBG, L_DB, "Preloaded timestamps of %d files\n", nfiles);
+  return;
+
+ error:
+  free(s->slots);
+  s->slots = NULL;
+  s->nslots = 0;
+#undef Q_TMPL
+#undef Q_COUNT
+}
+
+void
+db_file_ping_end(void)
+{
+#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 " WHERE id IN (%s);"
+  struct db_file_stamps *s = &db_file_stamps;
+  char ids[DB_FILE_PING_IDS * 11 + 1];
+  size_t len;
+  int i;
+  int j;
+
+  if (!s->active)
+    return;
+
+  if (s->npinged > 0)
+    db_transaction_begin();
+
+  for (i = 0; i < s->npinged; i += DB_FILE_PING_IDS)
+    {
+      for (len = 0, j = i; j < s->npinged && j < i + DB_FILE_PING_IDS; j++)
+	len += sprintf(ids + len, (j == i) ? "%" PRIu32 : ",%" PRIu32, s->pinged[j]);
+
+      db_query_run(sqlite3_mprintf(Q_TMPL, (int64_t)s->loaded, ids), 1, 0);
+    }
+
+  if (s->npinged > 0)
+    db_transaction_end();
+
+  DPRINTF(E_DBG, L_DB, "Pinged %d unchanged files\n", s->npinged);
+
+  free(s->slots);
+  free(s->pinged);
+  memset(s, 0, sizeof(struct db_file_stamps));
+#undef Q_TMPL
+}
+
+int
+db_file_ping_bypath(const char *path, time_t mtime_max)
+{
+  struct db_file_stamps *s = &db_file_stamps;
+  struct db_file_stamp *slot;
+  int ret;
+
+  file_batch_flush_path(path);
+
+  if (s->active)
+    {
+      slot = file_stamp_slot(file_stamp_hash(path));
+
+      // Not in the library (when the scan started), or changed
+      if (slot->hash == 0 || (slot->id != 0 && (time_t)slot->db_timestamp < mtime_max))
+	return 0;
+
+      if (slot->id != 0)
+	{
+	  if (s->npinged == s->pinged_size)
+	    {
+	      s->pinged_size = s->pinged_size ? 2 * s->pinged_size : 1024;
+	      CHECK_NULL(L_DB, s->pinged = realloc(s->pinged, s->pinged_size * sizeof(uint32_t)));
+	    }
+
+	  s->pinged[s->npinged] = slot->id;
+	  s->npinged++;
+	  return 1;
+	}
+    }
+
+  sqlite3_bind_int64(db_statements.files_ping, 1, (int64_t)time(NULL));
+  sqlite3_bind_text(db_statements.files_ping, 2, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(db_statements.files_ping, 3, (int64_t)mtime_max);
+
+  ret = db_statement_run(db_statements.files_ping, 0);
+
+  if (db_file_batch.active)
+    file_batch_count(1);
+
+  return ret;
+}
+
+void
+db_file_ping_bymatch(const char *path, int isdir)
+{
+#define Q_TMPL_DIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL_NODIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q%%';"
   char *query;
 
   if (isdir)
@@ -2974,6 +4577,8 @@ db_file_id_bypath(const char *path)
   char *query;
   int ret;
 
+  file_batch_flush_path(path);
+
   query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
     {
@@ -3182,146 +4787,430 @@ db_file_fetch_byvirtualpath(const char *virtual_path)
 #undef Q_TMPL
 }
 
-int
-db_file_add(struct media_file_info *mfi)
-{
-  int ret;
+/* Batched file writes
+ *
+ * While a batch is active, db_file_add() and db_file_update() make a copy of
+ * the file and queue it instead of writing it. The queues are written when
+ * they are full, new files with a multi-row insert, and the transaction that
+ * db_file_batch_begin() started is committed after every commit_interval
+ * writes. Queued files are not visible to queries until they have been written,
+ * so the path lookups (db_file_ping_bypath, db_file_id_bypath) first write the
+ * batch if it has the path, see file_batch_flush_path().
+ */
 
-  if (mfi->id != 0)
-    {
-      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
-      return -1;
-    }
+static void
+file_batch_mfi_copy(struct media_file_info *dst, struct media_file_info *src)
+{
+  char **strptr;
+  int i;
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
+  memcpy(dst, src, sizeof(struct media_file_info));
 
-  // We don't do this in fixup_tags_mfi() to avoid affecting db_file_update()
-  if (mfi->time_added == 0)
-    mfi->time_added = mfi->db_timestamp;
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (mfi_cols_map[i].type != DB_TYPE_STRING)
+	continue;
 
-  fixup_tags_mfi(mfi);
+      strptr = (char **)((char *)dst + mfi_cols_map[i].offset);
+      *strptr = safe_strdup(*strptr);
+    }
+}
 
-  ret = bind_mfi(db_statements.files_insert, mfi);
-  if (ret < 0)
-    return -1;
+static int
+file_batch_insert_rows(struct media_file_info *mfi, int rows)
+{
+  sqlite3_stmt *stmt;
+  int n;
+  int i;
 
-  ret = db_statement_run(db_statements.files_insert, 0);
-  if (ret < 0)
-    return -1;
+  stmt = (rows > 1) ? db_file_batch.insert : db_statements.files_insert;
 
-  library_update_trigger(LISTENER_DATABASE);
+  for (i = 0, n = 1; i < rows; i++)
+    {
+      n = bind_generic_at(stmt, n, &mfi[i], mfi_cols_map, ARRAY_SIZE(mfi_cols_map));
+      if (n < 0)
+	{
+	  sqlite3_reset(stmt);
+	  sqlite3_clear_bindings(stmt);
+	  return -1;
+	}
+    }
 
-  return 0;
+  return db_statement_run(stmt, 0);
 }
 
-int
-db_file_update(struct media_file_info *mfi)
+static void
+file_batch_flush(void)
 {
+  struct db_file_batch *b = &db_file_batch;
+  int changes;
   int ret;
+  int i;
+  int j;
 
-  if (mfi->id == 0)
+  if (b->nadds == 0 && b->nupdates == 0)
+    return;
+
+  DPRINTF(E_DBG, L_DB, "Writing batch of %d new and %d updated files\n", b->nadds, b->nupdates);
+
+  changes = 0;
+  for (i = 0; b->insert && (b->nadds - i >= b->insert_rows); i += b->insert_rows)
     {
-      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
-      return -1;
+      ret = file_batch_insert_rows(&b->adds[i], b->insert_rows);
+      if (ret >= 0)
+	{
+	  changes += ret;
+	  continue;
+	}
+
+      // The failed statement was rolled back, retry row by row so one bad file doesn't take the others with it
+      for (j = i; j < i + b->insert_rows; j++)
+	{
+	  ret = file_batch_insert_rows(&b->adds[j], 1);
+	  if (ret > 0)
+	    changes += ret;
+	}
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
+  for (; i < b->nadds; i++)
+    {
+      ret = file_batch_insert_rows(&b->adds[i], 1);
+      if (ret > 0)
+	changes += ret;
+    }
 
-  fixup_tags_mfi(mfi);
+  for (i = 0; i < b->nupdates; i++)
+    {
+      ret = bind_mfi(db_statements.files_update, &b->updates[i]);
+      if (ret < 0)
+	continue;
 
-  ret = bind_mfi(db_statements.files_update, mfi);
-  if (ret < 0)
-    return -1;
+      ret = db_statement_run(db_statements.files_update, 0);
+      if (ret > 0)
+	changes += ret;
+    }
 
-  ret = db_statement_run(db_statements.files_update, 0);
-  if (ret < 0)
-    return -1;
+  for (i = 0; i < b->nadds; i++)
+    free_mfi(&b->adds[i], 1);
+  for (i = 0; i < b->nupdates; i++)
+    free_mfi(&b->updates[i], 1);
 
-  library_update_trigger(LISTENER_DATABASE);
+  b->uncommitted += b->nadds + b->nupdates;
+  b->nadds = 0;
+  b->nupdates = 0;
 
-  return 0;
+  if (changes > 0)
+    library_update_trigger(LISTENER_DATABASE);
 }
 
-void
-db_file_seek_update(int id, uint32_t seek)
+// Writes the queued files if one of them has the given path, otherwise a path
+// seen twice during a scan would not be found and the file would be added twice
+static void
+file_batch_flush_path(const char *path)
 {
-#define Q_TMPL "UPDATE files SET seek = %d WHERE id = %d;"
-  char *query;
-  int ret;
+  struct db_file_batch *b = &db_file_batch;
+  int i;
 
-  if (id == 0)
+  if (!b->active || !path)
     return;
 
-  query = sqlite3_mprintf(Q_TMPL, seek, id);
-  if (!query)
+  for (i = 0; i < b->nadds; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
+      if (b->adds[i].path && strcmp(b->adds[i].path, path) == 0)
+	goto flush;
     }
 
-  ret = db_query_run(query, 1, 0);
-  if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
-#undef Q_TMPL
-}
-
-static int
-db_file_rating_update(char *query)
-{
-  int ret;
-
-  ret = db_query_run(query, 1, 0);
-
-  if (ret == 0)
+  for (i = 0; i < b->nupdates; i++)
     {
-      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
-      listener_notify(LISTENER_RATING);
+      if (b->updates[i].path && strcmp(b->updates[i].path, path) == 0)
+	goto flush;
     }
 
-  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+  return;
+
+ flush:
+  file_batch_flush();
 }
 
-int
-db_file_rating_update_byid(uint32_t id, uint32_t rating)
+// Counts writes and commits the transaction when the interval is reached
+static void
+file_batch_count(int writes)
 {
-#define Q_TMPL "UPDATE files SET rating = %d WHERE id = %d;"
-  char *query;
+  struct db_file_batch *b = &db_file_batch;
 
-  query = sqlite3_mprintf(Q_TMPL, rating, id);
+  b->uncommitted += writes;
+  if (b->uncommitted < b->commit_interval)
+    return;
 
-  return db_file_rating_update(query);
-#undef Q_TMPL
-}
+  file_batch_flush();
+  group_stats_flush();
 
-int
-db_file_rating_update_byvirtualpath(const char *virtual_path, uint32_t rating)
-{
-#define Q_TMPL "UPDATE files SET rating = %d WHERE virtual_path = %Q;"
-  char *query;
+  db_transaction_end();
+  db_transaction_begin();
 
-  query = sqlite3_mprintf(Q_TMPL, rating, virtual_path);
+  group_stats_defer();
 
-  return db_file_rating_update(query);
-#undef Q_TMPL
+  b->uncommitted = 0;
 }
 
-void
-db_file_delete_bypath(const char *path)
+static int
+file_batch_queue(struct media_file_info *mfi)
 {
-#define Q_TMPL "DELETE FROM files WHERE path = '%q';"
-  char *query;
+  struct db_file_batch *b = &db_file_batch;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  if (mfi->id == 0)
+    file_batch_mfi_copy(&b->adds[b->nadds++], mfi);
+  else
+    file_batch_mfi_copy(&b->updates[b->nupdates++], mfi);
 
-  db_query_run(query, 1, LISTENER_DATABASE);
-#undef Q_TMPL
+  if (b->nadds < b->size && b->nupdates < b->size)
+    return 0;
+
+  file_batch_flush();
+  file_batch_count(0);
+
+  return 0;
 }
 
 void
-db_file_disable_bypath(const char *path, enum strip_type strip, uint32_t cookie)
+db_file_batch_begin(void)
 {
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
+  struct db_file_batch *b = &db_file_batch;
+  cfg_t *sqlite_cfg;
+  int ncols;
+  int rows;
+  int i;
+
+  if (b->active)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: Batch of file writes already started\n");
+      return;
+    }
+
+  sqlite_cfg = cfg_getsec(cfg, "sqlite");
+
+  b->size = cfg_getint(sqlite_cfg, "write_batch_size");
+  if (b->size < 1)
+    b->size = 1;
+
+  b->commit_interval = cfg_getint(sqlite_cfg, "write_commit_interval");
+  if (b->commit_interval < b->size)
+    b->commit_interval = b->size;
+
+  for (i = 0, ncols = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (!(mfi_cols_map[i].flag & DB_FLAG_NO_BIND))
+	ncols++;
+    }
+
+  // Multi-row VALUES requires sqlite 3.7.11, and the number of parameters in a statement is limited
+  rows = sqlite3_limit(hdl, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / ncols;
+  if (rows > b->size)
+    rows = b->size;
+  if (sqlite3_libversion_number() < 3007011)
+    rows = 1;
+
+  if (b->insert && rows != b->insert_rows)
+    {
+      sqlite3_finalize(b->insert);
+      b->insert = NULL;
+    }
+
+  if (!b->insert && rows > 1)
+    {
+      b->insert = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files", rows);
+      if (!b->insert)
+	DPRINTF(E_LOG, L_DB, "Could not prepare multi-row insert, files will be added one by one\n");
+    }
+
+  b->insert_rows = rows;
+
+  CHECK_NULL(L_DB, b->adds = calloc(b->size, sizeof(struct media_file_info)));
+  CHECK_NULL(L_DB, b->updates = calloc(b->size, sizeof(struct media_file_info)));
+  b->nadds = 0;
+  b->nupdates = 0;
+  b->uncommitted = 0;
+
+  // The directory index can't be rebuilt inside the transaction, so make sure
+  // it is there for the parent directory lookups of the scan
+  if (dir_index_lock())
+    dir_index_unlock();
+
+  db_transaction_begin();
+
+  // Adding the files of a group one by one would recompute its stats each time
+  group_stats_defer();
+
+  b->active = true;
+}
+
+void
+db_file_batch_end(void)
+{
+  struct db_file_batch *b = &db_file_batch;
+
+  if (!b->active)
+    return;
+
+  file_batch_flush();
+  group_stats_flush();
+
+  db_transaction_end();
+
+  free(b->adds);
+  free(b->updates);
+  b->adds = NULL;
+  b->updates = NULL;
+
+  b->active = false;
+}
+
+int
+db_file_add(struct media_file_info *mfi)
+{
+  int ret;
+
+  if (mfi->id != 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
+      return -1;
+    }
+
+  mfi->db_timestamp = (uint64_t)time(NULL);
+
+  // We don't do this in fixup_tags_mfi() to avoid affecting db_file_update()
+  if (mfi->time_added == 0)
+    mfi->time_added = mfi->db_timestamp;
+
+  fixup_tags_mfi(mfi);
+
+  if (db_file_batch.active)
+    return file_batch_queue(mfi);
+
+  ret = bind_mfi(db_statements.files_insert, mfi);
+  if (ret < 0)
+    return -1;
+
+  ret = db_statement_run(db_statements.files_insert, 0);
+  if (ret < 0)
+    return -1;
+
+  library_update_trigger(LISTENER_DATABASE);
+
+  return 0;
+}
+
+int
+db_file_update(struct media_file_info *mfi)
+{
+  int ret;
+
+  if (mfi->id == 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
+      return -1;
+    }
+
+  mfi->db_timestamp = (uint64_t)time(NULL);
+
+  fixup_tags_mfi(mfi);
+
+  if (db_file_batch.active)
+    return file_batch_queue(mfi);
+
+  ret = bind_mfi(db_statements.files_update, mfi);
+  if (ret < 0)
+    return -1;
+
+  ret = db_statement_run(db_statements.files_update, 0);
+  if (ret < 0)
+    return -1;
+
+  library_update_trigger(LISTENER_DATABASE);
+
+  return 0;
+}
+
+void
+db_file_seek_update(int id, uint32_t seek)
+{
+#define Q_TMPL "UPDATE files SET seek = %d WHERE id = %d;"
+  char *query;
+  int ret;
+
+  if (id == 0)
+    return;
+
+  query = sqlite3_mprintf(Q_TMPL, seek, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return;
+    }
+
+  ret = db_query_run(query, 1, 0);
+  if (ret == 0)
+    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+#undef Q_TMPL
+}
+
+static int
+db_file_rating_update(char *query)
+{
+  int ret;
+
+  ret = db_query_run(query, 1, 0);
+
+  if (ret == 0)
+    {
+      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      listener_notify(LISTENER_RATING);
+    }
+
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+}
+
+int
+db_file_rating_update_byid(uint32_t id, uint32_t rating)
+{
+#define Q_TMPL "UPDATE files SET rating = %d WHERE id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, rating, id);
+
+  return db_file_rating_update(query);
+#undef Q_TMPL
+}
+
+int
+db_file_rating_update_byvirtualpath(const char *virtual_path, uint32_t rating)
+{
+#define Q_TMPL "UPDATE files SET rating = %d WHERE virtual_path = %Q;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, rating, virtual_path);
+
+  return db_file_rating_update(query);
+#undef Q_TMPL
+}
+
+void
+db_file_delete_bypath(const char *path)
+{
+#define Q_TMPL "DELETE FROM files WHERE path = '%q';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, path);
+
+  db_query_run(query, 1, LISTENER_DATABASE);
+#undef Q_TMPL
+}
+
+void
+db_file_disable_bypath(const char *path, enum strip_type strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE files SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
   char *query;
   int64_t disabled;
   int path_striplen;
@@ -3867,516 +5756,728 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path)
 
 
 
-/* Groups */
+/* Smart playlists
+ *
+ * The results of the smart playlist queries are materialized in the
+ * smartpl_items table, so that opening a smart playlist doesn't evaluate its
+ * query against the whole files table. The library thread keeps the table up
+ * to date with db_smartpl_refresh(): the files that changed since the last
+ * refresh are rechecked against each query, and queries relative to 'now' are
+ * evaluated from scratch when their results expire. The changed files are
+ * collected by an update hook (db_xupdate()) and handed over when the change is
+ * committed, see db_write_revision_bump().
+ *
+ * Only PL_SMART playlists are materialized, special playlists keep running
+ * their query directly. The rows of a playlist are only used as long as no
+ * change to the files table has been committed after they were made, otherwise
+ * the query is run as usual.
+ */
+enum smartpl_action
+{
+  SMARTPL_KEEP,
+  SMARTPL_CHANGED,
+  SMARTPL_FULL,
+};
 
-// Remove album and artist entries in the groups table that are not longer referenced from the files table
-int
-db_groups_cleanup()
+struct smartpl_refresh
 {
-#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
-#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
-  int ret;
+  struct db_smartpl_state state;
+  enum smartpl_action action;
+  bool failed;
+};
 
-  db_transaction_begin();
+static void
+db_xupdate(void *arg, int op, char const *dbname, char const *table, sqlite3_int64 rowid)
+{
+  struct db_files_changes *changes = &db_files_changes;
 
-  ret = db_query_run(Q_TMPL_ALBUM, 0, LISTENER_DATABASE);
-  if (ret < 0)
-    {
-      db_transaction_rollback();
-      return -1;
-    }
+  if (strcmp(table, "files") != 0)
+    return;
 
-  DPRINTF(E_DBG, L_DB, "Removed album group-entries: %d\n", sqlite3_changes(hdl));
+  changes->dirty = true;
 
-  ret = db_query_run(Q_TMPL_ARTIST, 0, LISTENER_DATABASE);
-  if (ret < 0)
+  if (changes->overflow || (changes->nids > 0 && changes->ids[changes->nids - 1] == rowid))
+    return;
+
+  if (changes->nids == DB_SMARTPL_CHANGES_MAX)
     {
-      db_transaction_rollback();
-      return -1;
+      changes->overflow = true;
+      return;
     }
 
-  DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", sqlite3_changes(hdl));
-  db_transaction_end();
-
-  return 0;
+  if (!changes->ids)
+    CHECK_NULL(L_DB, changes->ids = malloc(DB_SMARTPL_CHANGES_MAX * sizeof(int64_t)));
 
-#undef Q_TMPL_ALBUM
-#undef Q_TMPL_ARTIST
+  changes->ids[changes->nids] = rowid;
+  changes->nids++;
 }
 
-static enum group_type
-db_group_type_bypersistentid(int64_t persistentid)
+// Called when the thread has committed changes to the files table
+static void
+smartpl_changes_commit(void)
 {
-#define Q_TMPL "SELECT g.type FROM groups g WHERE g.persistentid = %" PRIi64 ";"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
+  struct db_files_changes *changes = &db_files_changes;
 
-  query = sqlite3_mprintf(Q_TMPL, persistentid);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
 
-      return 0;
-    }
+  db_smartpl.revision++;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (changes->overflow || db_smartpl.nchanged + changes->nids > DB_SMARTPL_CHANGES_MAX)
+    db_smartpl.overflow = true;
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (!db_smartpl.overflow && changes->nids > 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      if (!db_smartpl.changed)
+	CHECK_NULL(L_DB, db_smartpl.changed = malloc(DB_SMARTPL_CHANGES_MAX * sizeof(int64_t)));
 
-      sqlite3_free(query);
-      return 0;
+      memcpy(db_smartpl.changed + db_smartpl.nchanged, changes->ids, changes->nids * sizeof(int64_t));
+      db_smartpl.nchanged += changes->nids;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_DBG, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return 0;
-    }
+  files_journal_add(changes);
 
-  ret = sqlite3_column_int(stmt, 0);
+  changes->nids = 0;
+  changes->overflow = false;
+  changes->dirty = false;
+}
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+// Must be called with the lock held
+static struct db_smartpl_state *
+smartpl_state_find(int id)
+{
+  int i;
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  for (i = 0; i < db_smartpl.nstates; i++)
+    {
+      if (db_smartpl.states[i].id == id)
+	return &db_smartpl.states[i];
+    }
 
-  return ret;
+  return NULL;
+}
 
-#undef Q_TMPL
+// Must be called with the lock held
+static void
+smartpl_states_clear(void)
+{
+  int i;
+
+  for (i = 0; i < db_smartpl.nstates; i++)
+    free(db_smartpl.states[i].query);
+
+  free(db_smartpl.states);
+
+  db_smartpl.states = NULL;
+  db_smartpl.nstates = 0;
 }
 
-int
-db_group_persistentid_byid(int id, int64_t *persistentid)
+// Gets what a snapshot started now will see, see db_snapshot_begin()
+static void
+smartpl_snapshot_get(uint64_t *revision, uint64_t *generation)
 {
-#define Q_TMPL "SELECT g.persistentid FROM groups g WHERE g.id = %d;"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
+  *revision = db_smartpl.revision;
+  *generation = db_smartpl.generation;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
+}
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+// Returns true if the smartpl_items rows of the playlist can be used instead of
+// running its query
+static bool
+smartpl_valid(struct playlist_info *pli)
+{
+  struct db_smartpl_state *state;
+  uint64_t revision;
+  uint64_t generation;
+  bool valid;
 
-      return -1;
-    }
+  // Only user smart playlists are materialized, special playlists (e.g. the
+  // library or the music/podcast lists) are cheap enough to query directly.
+  // The rows don't include uncommitted changes made by the thread itself
+  if (pli->type != PL_SMART || !pli->query || (!db_read_conn && !sqlite3_get_autocommit(hdl)))
+    return false;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  // A snapshot only has the rows of refreshes that were committed before it
+  // was started
+  if (db_read_conn)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_free(query);
-      return -1;
+      revision = db_read_files_revision;
+      generation = db_read_smartpl_generation;
     }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  else
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_DBG, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+      revision = db_smartpl.revision;
+      generation = db_smartpl.generation;
     }
 
-  *persistentid = sqlite3_column_int64(stmt, 0);
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-  ; /* EMPTY */
-#endif
+  state = smartpl_state_find(pli->id);
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  valid = state && state->revision == revision && state->generation <= generation && strcmp(state->query, pli->query) == 0
+          && (state->expires == 0 || state->expires > time(NULL));
 
-  return 0;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
 
-#undef Q_TMPL
+  return valid;
 }
 
+// Queries that pick random files or look at other tables can't be materialized
+static bool
+smartpl_query_supported(const char *query)
+{
+  return !strcasestr(query, "random(") && !strcasestr(query, "select");
+}
 
-/* Directories */
-int
-db_directory_id_byvirtualpath(const char *virtual_path)
+// Returns a comma separated list of the ids
+static char *
+smartpl_idlist(int64_t *ids, int nids)
 {
-#define Q_TMPL "SELECT d.id FROM directories d WHERE d.virtual_path = '%q';"
-  char *query;
-  int ret;
+  char *list;
+  size_t len;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  CHECK_NULL(L_DB, list = malloc(nids * 21 + 1));
 
-      return 0;
-    }
+  list[0] = '\0';
+  for (len = 0, i = 0; i < nids; i++)
+    len += sprintf(list + len, (i == 0) ? "%" PRIi64 : ",%" PRIi64, ids[i]);
 
-  ret = db_file_id_byquery(query);
+  return list;
+}
 
-  sqlite3_free(query);
+static int
+smartpl_refresh_one(int id, const char *query, const char *changed)
+{
+  char *q;
+  int ret;
 
-  return ret;
+  if (changed)
+    q = sqlite3_mprintf("DELETE FROM smartpl_items WHERE playlistid = %d AND fileid IN (%s);", id, changed);
+  else
+    q = sqlite3_mprintf("DELETE FROM smartpl_items WHERE playlistid = %d AND fileid NOT IN (SELECT f.id FROM files f WHERE (%s));", id, query);
 
-#undef Q_TMPL
+  ret = db_query_run(q, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  if (changed)
+    q = sqlite3_mprintf("INSERT OR IGNORE INTO smartpl_items (playlistid, fileid) SELECT %d, f.id FROM files f WHERE f.id IN (%s) AND (%s);", id, changed, query);
+  else
+    q = sqlite3_mprintf("INSERT OR IGNORE INTO smartpl_items (playlistid, fileid) SELECT %d, f.id FROM files f WHERE (%s);", id, query);
+
+  return db_query_run(q, 1, 0);
 }
 
-int
-db_directory_id_bypath(const char *path)
+/* Brings the materialized smart playlist results up to date with the files
+ * table. Playlists whose rows are current are left alone, otherwise only the
+ * files changed since the last refresh are rechecked, unless too many files
+ * changed, the query changed or the results expired.
+ */
+void
+db_smartpl_refresh(void)
 {
-#define Q_TMPL "SELECT d.id FROM directories d WHERE d.path = '%q';"
+#define Q_TMPL "SELECT id, query FROM playlists WHERE type = %d AND disabled = 0 AND query IS NOT NULL;"
+  struct smartpl_refresh *pls;
+  struct smartpl_refresh *pl;
+  struct db_smartpl_state *state;
+  sqlite3_stmt *stmt;
+  int64_t *changed;
+  int nchanged;
+  bool overflow;
+  uint64_t from;
+  uint64_t to;
+  char *changed_list;
   char *query;
+  int *removed;
+  int nremoved;
+  time_t now;
+  bool first;
+  bool written;
+  int npls;
+  int nfull;
+  int i;
+  int j;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  // Take over the changes made since the last refresh
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
+  from = db_smartpl.refreshed;
+  to = db_smartpl.revision;
+  changed = db_smartpl.changed;
+  nchanged = db_smartpl.nchanged;
+  overflow = db_smartpl.overflow;
+  db_smartpl.refreshed = to;
+  db_smartpl.changed = NULL;
+  db_smartpl.nchanged = 0;
+  db_smartpl.overflow = false;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
+
+  changed_list = NULL;
+  removed = NULL;
+  pls = NULL;
+  npls = 0;
+
+  query = sqlite3_mprintf(Q_TMPL, PL_SMART);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
+      goto out;
     }
 
-  ret = db_file_id_byquery(query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      goto out;
+    }
 
-  return ret;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (!smartpl_query_supported((const char *)sqlite3_column_text(stmt, 1)))
+	continue;
 
-#undef Q_TMPL
-}
+      CHECK_NULL(L_DB, pls = realloc(pls, (npls + 1) * sizeof(struct smartpl_refresh)));
 
-int
-db_directory_enum_start(struct directory_enum *de)
-{
-#define Q_TMPL "SELECT * FROM directories WHERE disabled = 0 AND parent_id = %d ORDER BY virtual_path COLLATE NOCASE;"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+      pl = &pls[npls];
+      memset(pl, 0, sizeof(struct smartpl_refresh));
+      pl->state.id = sqlite3_column_int(stmt, 0);
+      CHECK_NULL(L_DB, pl->state.query = strdup((const char *)sqlite3_column_text(stmt, 1)));
+      npls++;
+    }
 
-  de->stmt = NULL;
+  sqlite3_finalize(stmt);
 
-  query = sqlite3_mprintf(Q_TMPL, de->parent_id);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      goto out;
+    }
 
-  if (!query)
+  // Decide what to do with each playlist
+  now = time(NULL);
+  nfull = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
+  for (i = 0; i < npls; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      pl = &pls[i];
+      state = smartpl_state_find(pl->state.id);
 
-      return -1;
+      if (!state || strcmp(state->query, pl->state.query) != 0 || (state->expires != 0 && state->expires <= now))
+	pl->action = SMARTPL_FULL;
+      else if (state->revision == to)
+	pl->action = SMARTPL_KEEP;
+      else if (state->revision == from && !overflow)
+	pl->action = SMARTPL_CHANGED;
+      else
+	pl->action = SMARTPL_FULL;
+
+      if (pl->action == SMARTPL_KEEP)
+	{
+	  pl->state.revision = state->revision;
+	  pl->state.generation = state->generation;
+	  pl->state.expires = state->expires;
+	  continue;
+	}
+
+      pl->state.revision = to;
+      if (strstr(pl->state.query, "'now'"))
+	pl->state.expires = now + DB_SMARTPL_EXPIRE;
+
+      if (pl->action == SMARTPL_FULL)
+	nfull++;
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+  // Playlists that are no longer materialized, their rows are removed. The
+  // first refresh also removes rows of playlists deleted before a restart.
+  first = (db_smartpl.generation == 0);
+  CHECK_NULL(L_DB, removed = calloc(db_smartpl.nstates + 1, sizeof(int)));
+  nremoved = 0;
+  for (i = 0; i < db_smartpl.nstates; i++)
+    {
+      for (j = 0; j < npls && pls[j].state.id != db_smartpl.states[i].id; j++)
+	; /* EMPTY */
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+      if (j == npls)
+	removed[nremoved++] = db_smartpl.states[i].id;
+    }
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
+
+  if (nchanged > 0)
+    changed_list = smartpl_idlist(changed, nchanged);
+
+  written = false;
+  for (i = 0; i < npls; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      pl = &pls[i];
+      if (pl->action == SMARTPL_KEEP || (pl->action == SMARTPL_CHANGED && !changed_list))
+	continue;
 
-      sqlite3_free(query);
-      return -1;
+      if (!written)
+	db_transaction_begin();
+
+      written = true;
+
+      ret = smartpl_refresh_one(pl->state.id, pl->state.query, (pl->action == SMARTPL_CHANGED) ? changed_list : NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not refresh smart playlist %d, will use its query instead\n", pl->state.id);
+
+	  // Leaving out the state makes the next refresh start from scratch
+	  pl->failed = true;
+	}
     }
 
-  sqlite3_free(query);
+  if (nremoved > 0 || first)
+    {
+      if (!written)
+	db_transaction_begin();
 
-  de->stmt = stmt;
+      written = true;
 
-  return 0;
+      for (i = 0; i < nremoved; i++)
+	db_query_run(sqlite3_mprintf("DELETE FROM smartpl_items WHERE playlistid = %d;", removed[i]), 1, 0);
+
+      if (first)
+	db_query_run(sqlite3_mprintf("DELETE FROM smartpl_items WHERE playlistid NOT IN (SELECT id FROM playlists WHERE type = %d);", PL_SMART), 1, 0);
+    }
+
+  if (written)
+    db_transaction_end();
+
+  // Install the new states, the rows they refer to are now committed
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
+  if (written)
+    db_smartpl.generation++;
+
+  smartpl_states_clear();
+  CHECK_NULL(L_DB, db_smartpl.states = calloc(npls + 1, sizeof(struct db_smartpl_state)));
+
+  for (i = 0; i < npls; i++)
+    {
+      pl = &pls[i];
+      if (pl->failed)
+	continue;
+
+      if (pl->action != SMARTPL_KEEP)
+	pl->state.generation = db_smartpl.generation;
+
+      db_smartpl.states[db_smartpl.nstates] = pl->state;
+      db_smartpl.nstates++;
+      pl->state.query = NULL;
+    }
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
+
+  if (written)
+    DPRINTF(E_DBG, L_DB, "Refreshed smart playlists (%d of %d from scratch, %d changed files)\n", nfull, npls, overflow ? -1 : nchanged);
 
+ out:
+  for (i = 0; i < npls; i++)
+    free(pls[i].state.query);
+
+  free(pls);
+  free(removed);
+  free(changed_list);
+  free(changed);
 #undef Q_TMPL
 }
 
-int
-db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
+
+/* Files journal
+ *
+ * Remembers which files the last DB_FILES_JOURNAL_SIZE changes to the files
+ * table were made to, so that clients can be sent just the files that changed
+ * since they last fetched them. Each commit gets a sequence number, and the
+ * caller asks for the files changed after a seq it got from
+ * db_files_journal_seq(), and gets their ids sorted and without duplicates.
+ * If a commit changed too many files to track (e.g. a rescan pinging all of
+ * them), or the ring wrapped, older seqs can no longer be answered.
+ */
+static void
+files_journal_add(struct db_files_changes *changes)
 {
-  int ret;
+  struct db_files_journal *journal = &db_files_journal;
+  int i;
 
-  memset(di, 0, sizeof(struct directory_info));
+  CHECK_ERR(L_DB, pthread_mutex_lock(&journal->lck));
 
-  if (!de->stmt)
+  journal->seq++;
+
+  if (changes->overflow || changes->nids > DB_FILES_JOURNAL_SIZE)
     {
-      DPRINTF(E_LOG, L_DB, "Directory enum not started!\n");
-      return -1;
+      journal->valid_from = journal->seq;
+      journal->nids = 0;
+      goto out;
     }
 
-  ret = db_blocking_step(de->stmt);
-  if (ret == SQLITE_DONE)
+  if (!journal->ids)
     {
-      DPRINTF(E_DBG, L_DB, "End of directory enum results\n");
-      return 0;
+      CHECK_NULL(L_DB, journal->ids = malloc(DB_FILES_JOURNAL_SIZE * sizeof(int64_t)));
+      CHECK_NULL(L_DB, journal->seqs = malloc(DB_FILES_JOURNAL_SIZE * sizeof(uint64_t)));
     }
-  else if (ret != SQLITE_ROW)
+
+  for (i = 0; i < changes->nids; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
+      // Overwriting the oldest entry means its commit is no longer complete
+      if (journal->nids == DB_FILES_JOURNAL_SIZE && journal->seqs[journal->head] > journal->valid_from)
+	journal->valid_from = journal->seqs[journal->head];
 
-  di->id = sqlite3_column_int(de->stmt, 0);
-  di->virtual_path = (char *)sqlite3_column_text(de->stmt, 1);
-  di->db_timestamp = sqlite3_column_int(de->stmt, 2);
-  di->disabled = sqlite3_column_int64(de->stmt, 3);
-  di->parent_id = sqlite3_column_int(de->stmt, 4);
-  di->path = (char *)sqlite3_column_text(de->stmt, 5);
+      journal->ids[journal->head] = changes->ids[i];
+      journal->seqs[journal->head] = journal->seq;
 
-  return 0;
+      journal->head = (journal->head + 1) % DB_FILES_JOURNAL_SIZE;
+      if (journal->nids < DB_FILES_JOURNAL_SIZE)
+	journal->nids++;
+    }
+
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&journal->lck));
 }
 
-void
-db_directory_enum_end(struct directory_enum *de)
+static int
+files_journal_id_cmp(const void *a, const void *b)
 {
-  if (!de->stmt)
-    return;
+  int64_t ia = *(const int64_t *)a;
+  int64_t ib = *(const int64_t *)b;
 
-  sqlite3_finalize(de->stmt);
-  de->stmt = NULL;
+  return (ia > ib) - (ia < ib);
 }
 
-static int
-db_directory_add(struct directory_info *di, int *id)
+uint64_t
+db_files_journal_seq(void)
 {
-#define QADD_TMPL "INSERT INTO directories (virtual_path, db_timestamp, disabled, parent_id, path)" \
-                  " VALUES (TRIM(%Q), %d, %" PRIi64 ", %d, TRIM(%Q));"
+  uint64_t seq;
 
-  char *query;
-  char *errmsg;
-  int vp_len = strlen(di->virtual_path);
-  int ret;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_files_journal.lck));
+  seq = db_files_journal.seq;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_files_journal.lck));
 
-  if (vp_len && di->virtual_path[vp_len-1] == ' ')
-    {
-      /* Since sqlite removes the trailing space, so these
-       * directories will be found as new in perpetuity.
-       */
-      DPRINTF(E_LOG, L_DB, "Directory name ends with space: '%s'\n", di->virtual_path);
-    }
+  return seq;
+}
 
-  query = sqlite3_mprintf(QADD_TMPL, di->virtual_path, di->db_timestamp, di->disabled, di->parent_id, di->path);
+int
+db_files_journal_get(uint64_t since, int64_t **ids, int *nids)
+{
+  struct db_files_journal *journal = &db_files_journal;
+  int64_t *list;
+  int start;
+  int n;
+  int i;
 
-  if (!query)
+  *ids = NULL;
+  *nids = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&journal->lck));
+
+  if (since < journal->valid_from || since > journal->seq)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&journal->lck));
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  list = NULL;
+  n = 0;
+  if (journal->nids > 0 && since < journal->seq)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      CHECK_NULL(L_DB, list = malloc(journal->nids * sizeof(int64_t)));
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
+      // Oldest first, the seqs are in ascending order
+      start = (journal->head - journal->nids + DB_FILES_JOURNAL_SIZE) % DB_FILES_JOURNAL_SIZE;
+      for (i = 0; i < journal->nids; i++)
+	{
+	  if (journal->seqs[(start + i) % DB_FILES_JOURNAL_SIZE] > since)
+	    list[n++] = journal->ids[(start + i) % DB_FILES_JOURNAL_SIZE];
+	}
     }
 
-  sqlite3_free(query);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&journal->lck));
 
-  *id = (int)sqlite3_last_insert_rowid(hdl);
-  if (*id == 0)
+  // Files that changed more than once are only listed once
+  if (n > 1)
     {
-      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
-      return -1;
+      qsort(list, n, sizeof(int64_t), files_journal_id_cmp);
+
+      for (start = 0, i = 1; i < n; i++)
+	{
+	  if (list[i] != list[start])
+	    list[++start] = list[i];
+	}
+
+      n = start + 1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Added directory '%s' with id %d\n", di->virtual_path, *id);
+  *ids = list;
+  *nids = n;
 
   return 0;
-
-#undef QADD_TMPL
 }
 
-static int
-db_directory_update(struct directory_info *di)
-{
-#define QADD_TMPL "UPDATE directories SET virtual_path = TRIM(%Q), db_timestamp = %d, disabled = %" PRIi64 ", parent_id = %d, path = TRIM(%Q)" \
-                  " WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
 
-  /* Add */
-  query = sqlite3_mprintf(QADD_TMPL, di->virtual_path, di->db_timestamp, di->disabled, di->parent_id, di->path, di->id);
+/* Groups */
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+/* The trg_group_stats triggers recompute all the group_stats rows of a group
+ * when one of its files changes, so adding the files of a large group one by
+ * one is quadratic. While a batch of file writes is active, the triggers
+ * instead add the groups to group_stats_pending, and group_stats_flush()
+ * recomputes each of them once before the batch commits. The marker row that
+ * tells the triggers to do so is removed by the flush, so it is never
+ * committed, and other connections are not affected.
+ */
+static void
+group_stats_defer(void)
+{
+  db_query_run("INSERT OR IGNORE INTO group_stats_pending (type, persistentid) VALUES (0, 0);", 0, 0);
+}
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+static void
+group_stats_flush(void)
+{
+#define Q_PENDING "SELECT persistentid FROM group_stats_pending WHERE type = %d"
+#define Q_DELETE "DELETE FROM group_stats WHERE type = %d AND persistentid IN (" Q_PENDING ");"
+#define Q_ALL "INSERT INTO group_stats (" Q_GROUP_STATS_COLS ") SELECT %d, f.%s, 0," Q_GROUP_STATS_AGGR \
+              " FROM files f WHERE f.disabled = 0 AND f.%s IN (" Q_PENDING ") GROUP BY f.%s;"
+#define Q_KIND "INSERT INTO group_stats (" Q_GROUP_STATS_COLS ") SELECT %d, f.%s, f.media_kind," Q_GROUP_STATS_AGGR \
+               " FROM files f WHERE f.disabled = 0 AND f.%s IN (" Q_PENDING ") GROUP BY f.%s, f.media_kind;"
+  const char *cols[2] = { "songalbumid", "songartistid" };
+  int type;
+  int i;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  for (i = 0; i < 2; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      type = i + 1;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
+      db_query_run(sqlite3_mprintf(Q_DELETE, type, type), 1, 0);
+      db_query_run(sqlite3_mprintf(Q_ALL, type, cols[i], cols[i], type, cols[i]), 1, 0);
+      db_query_run(sqlite3_mprintf(Q_KIND, type, cols[i], cols[i], type, cols[i]), 1, 0);
     }
 
-  sqlite3_free(query);
-
-  DPRINTF(E_DBG, L_DB, "Updated directory '%s' with id %d\n", di->virtual_path, di->id);
-
-  return 0;
-
-#undef QADD_TMPL
+  db_query_run("DELETE FROM group_stats_pending;", 0, 0);
+#undef Q_PENDING
+#undef Q_DELETE
+#undef Q_ALL
+#undef Q_KIND
 }
 
+// Remove album and artist entries in the groups table that are not longer referenced from the files table
 int
-db_directory_addorupdate(char *virtual_path, char *path, int disabled, int parent_id)
+db_groups_cleanup()
 {
-  struct directory_info di;
-  int id;
+#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
+#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
+#define Q_TMPL_STATS "DELETE FROM group_stats WHERE NOT EXISTS (SELECT 1 FROM groups g WHERE g.type = group_stats.type AND g.persistentid = group_stats.persistentid);"
   int ret;
 
-  id = db_directory_id_byvirtualpath(virtual_path);
-
-  di.id = id;
-  di.parent_id = parent_id;
-  di.virtual_path = virtual_path;
-  di.path = path;
-  di.disabled = disabled;
-  di.db_timestamp = (uint64_t)time(NULL);
-
-  if (di.id == 0)
-    ret = db_directory_add(&di, &id);
-  else
-    ret = db_directory_update(&di);
-
-  if (ret < 0 || id <= 0)
-  {
-    DPRINTF(E_LOG, L_DB, "Insert or update of directory failed '%s'\n", virtual_path);
-    return -1;
-  }
-
-  return id;
-}
+  db_transaction_begin();
 
-void
-db_directory_ping_bymatch(char *virtual_path)
-{
-#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR virtual_path LIKE '%q/%%';"
-  char *query;
+  ret = db_query_run(Q_TMPL_ALBUM, 0, LISTENER_DATABASE);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path);
+  DPRINTF(E_DBG, L_DB, "Removed album group-entries: %d\n", sqlite3_changes(hdl));
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL_DIR
-}
+  ret = db_query_run(Q_TMPL_ARTIST, 0, LISTENER_DATABASE);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
 
-void
-db_directory_disable_bymatch(char *path, enum strip_type strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE directories SET virtual_path = substr(virtual_path, %d)," \
-               " disabled = %" PRIi64 " WHERE virtual_path = '/file:%q' OR virtual_path LIKE '/file:%q/%%';"
-  char *query;
-  int64_t disabled;
-  int vpath_striplen;
+  DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", sqlite3_changes(hdl));
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  // Should already be gone through the triggers on files, this is just cleanup
+  ret = db_query_run(Q_TMPL_STATS, 0, 0);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
 
-  vpath_striplen = (strip == STRIP_PATH) ? strlen("/file:") + strlen(path) : 0;
+  db_transaction_end();
 
-  query = sqlite3_mprintf(Q_TMPL, vpath_striplen + 1, disabled, path, path, path);
+  return 0;
 
-  db_query_run(query, 1, LISTENER_DATABASE);
-#undef Q_TMPL
+#undef Q_TMPL_ALBUM
+#undef Q_TMPL_ARTIST
+#undef Q_TMPL_STATS
 }
 
-int
-db_directory_enable_bycookie(uint32_t cookie, char *path)
+static enum group_type
+db_group_type_bypersistentid(int64_t persistentid)
 {
-#define Q_TMPL "UPDATE directories SET virtual_path = ('/file:%q' || virtual_path)," \
-               " disabled = 0 WHERE disabled = %" PRIi64 ";"
+#define Q_TMPL "SELECT g.type FROM groups g WHERE g.persistentid = %" PRIi64 ";"
   char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
-
-  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
-#undef Q_TMPL
-}
-
-int
-db_directory_enable_bypath(char *path)
-{
-#define Q_TMPL "UPDATE directories SET disabled = 0 WHERE virtual_path = %Q AND disabled <> 0;"
-  char *query;
-  int ret;
+  query = sqlite3_mprintf(Q_TMPL, persistentid);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+      return 0;
+    }
 
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
-#undef Q_TMPL
-}
+  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
+      sqlite3_free(query);
+      return 0;
+    }
 
-/* Remotes */
-static int
-db_pairing_delete_byremote(char *remote_id)
-{
-#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
-  char *query;
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_DBG, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-  query = sqlite3_mprintf(Q_TMPL, remote_id);
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return 0;
+    }
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  ret = sqlite3_column_int(stmt, 0);
 
-int
-db_pairing_add(struct pairing_info *pi)
-{
-#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
-  char *query;
-  int ret;
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
 
-  ret = db_pairing_delete_byremote(pi->remote_id);
-  if (ret < 0)
-    return ret;
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
 
-  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
+  return ret;
 
-  return db_query_run(query, 1, 0);
 #undef Q_TMPL
 }
 
 int
-db_pairing_fetch_byguid(struct pairing_info *pi)
+db_group_persistentid_byid(int id, int64_t *persistentid)
 {
-#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
+#define Q_TMPL "SELECT g.persistentid FROM groups g WHERE g.id = %d;"
   char *query;
   sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, pi->guid);
+  query = sqlite3_mprintf(Q_TMPL, id);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
       return -1;
     }
 
@@ -4386,6 +6487,8 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
       return -1;
     }
 
@@ -4393,7 +6496,7 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
   if (ret != SQLITE_ROW)
     {
       if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
+	DPRINTF(E_DBG, L_DB, "No results\n");
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
@@ -4402,12 +6505,11 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
       return -1;
     }
 
-  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
-  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+  *persistentid = sqlite3_column_int64(stmt, 0);
 
 #ifdef DB_PROFILE
   while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
+  ; /* EMPTY */
 #endif
 
   sqlite3_finalize(stmt);
@@ -4418,2128 +6520,4176 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
 #undef Q_TMPL
 }
 
-/* Spotify */
-void
-db_spotify_purge(void)
-{
-#define Q_TMPL "UPDATE directories SET disabled = %" PRIi64 " WHERE virtual_path = '/spotify:' AND disabled <> %" PRIi64 ";"
-  char *queries[4] =
-    {
-      "DELETE FROM files WHERE path LIKE 'spotify:%%';",
-      "DELETE FROM playlistitems WHERE filepath LIKE 'spotify:%%';",
-      "DELETE FROM playlists WHERE path LIKE 'spotify:%%';",
-      "DELETE FROM directories WHERE virtual_path LIKE '/spotify:/%%';",
-    };
-  char *query;
-  int i;
-  int ret;
 
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
-    {
-      ret = db_query_run(queries[i], 0, LISTENER_DATABASE);
+/* Directories */
+/* Directory index
+ *
+ * Folder browsing (MPD lsinfo and the JSON API) and the scanner's lookups of
+ * parent directories are served from an in-memory copy of the directories
+ * table, where the children of each directory are linked and virtual_path and
+ * path are hashed. db_directory_add() and db_directory_update() keep the copy
+ * up to date, other changes of the table invalidate it, so that the next lookup
+ * rebuilds it. The rebuild reads the table without holding the lock and is only
+ * done outside of transactions, see dir_index_lock(). A lookup that doesn't find a directory still checks the table,
+ * since the copy can miss directories that another thread added in a
+ * transaction that was not committed when the copy was made.
+ */
 
-      if (ret == 0)
-	DPRINTF(E_DBG, L_DB, "Processed %d rows\n", sqlite3_changes(hdl));
-    }
+// Same as the TRIM() the directories are written with
+static char *
+dir_index_strdup_trim(const char *str)
+{
+  size_t len;
 
-  // Disable the spotify directory by setting 'disabled' to INOTIFY_FAKE_COOKIE value
-  query = sqlite3_mprintf(Q_TMPL, INOTIFY_FAKE_COOKIE, INOTIFY_FAKE_COOKIE);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return;
-    }
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
+  if (!str)
+    return NULL;
 
-  if (ret == 0)
-    DPRINTF(E_DBG, L_DB, "Disabled spotify directory\n");
+  while (*str == ' ')
+    str++;
 
-#undef Q_TMPL
+  for (len = strlen(str); len > 0 && str[len - 1] == ' '; len--)
+    ; /* EMPTY */
+
+  return strndup(str, len);
 }
 
-/* Spotify */
-void
-db_spotify_pl_delete(int id)
+static bool
+dir_index_streq_trim(const char *trimmed, const char *str)
 {
-  char *queries_tmpl[2] =
-    {
-      "DELETE FROM playlists WHERE id = %d;",
-      "DELETE FROM playlistitems WHERE playlistid = %d;",
-    };
-  char *query;
-  int i;
-  int ret;
+  char *tmp;
+  bool ret;
 
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
-    {
-      query = sqlite3_mprintf(queries_tmpl[i], id);
+  if (!trimmed || !str)
+    return (!trimmed && !str);
 
-      ret = db_query_run(query, 1, LISTENER_DATABASE);
+  tmp = dir_index_strdup_trim(str);
+  ret = tmp && (strcmp(trimmed, tmp) == 0);
+  free(tmp);
 
-      if (ret == 0)
-	DPRINTF(E_DBG, L_DB, "Deleted %d rows\n", sqlite3_changes(hdl));
-    }
+  return ret;
 }
 
-/* Spotify */
-void
-db_spotify_files_delete(void)
+static void
+dir_index_free(struct db_dir_copy *x)
 {
-#define Q_TMPL "DELETE FROM files WHERE path LIKE 'spotify:%%' AND NOT path IN (SELECT filepath FROM playlistitems);"
-  char *query;
-  int ret;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL);
+  if (!x)
+    return;
 
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
+  for (i = 0; i < x->nnodes; i++)
+    {
+      free(x->nodes[i].di.virtual_path);
+      free(x->nodes[i].di.path);
+    }
 
-  if (ret == 0)
-    DPRINTF(E_DBG, L_DB, "Deleted %d rows\n", sqlite3_changes(hdl));
-#undef Q_TMPL
+  free(x->nodes);
+  free(x->byid);
+  free(x->vpath_slots);
+  free(x->path_slots);
+  free(x);
 }
 
-/* Admin */
-int
-db_admin_set(const char *key, const char *value)
+// Must be called with the lock held
+static void
+dir_index_clear(void)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%q');"
-  char *query;
+  dir_index_free(db_dir_index.copy);
+  db_dir_index.copy = NULL;
+  db_dir_index.generation++;
+}
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+static void
+dir_index_invalidate(void)
+{
+  // If the change is not committed yet, another thread could rebuild the index
+  // without it, so it is invalidated again on commit
+  db_dir_index_stale = (hdl && !sqlite3_get_autocommit(hdl));
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
+  dir_index_clear();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
 }
 
-int
-db_admin_setint(const char *key, int value)
+static void
+dir_index_slot_set(struct db_dir_copy *x, int *slots, const char *key, int idx)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%d');"
-  char *query;
+  uint32_t mask = x->nslots - 1;
+  uint32_t i;
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+  if (!key)
+    return;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  for (i = djb_hash(key, strlen(key)) & mask; slots[i] >= 0; i = (i + 1) & mask)
+    ; /* EMPTY */
+
+  slots[i] = idx;
 }
 
-int
-db_admin_setint64(const char *key, int64_t value)
+// Returns an index into nodes or -1
+static int
+dir_index_slot_get(struct db_dir_copy *x, const char *key, bool bypath)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%" PRIi64 "');"
-  char *query;
+  const char *str;
+  int *slots = bypath ? x->path_slots : x->vpath_slots;
+  uint32_t mask = x->nslots - 1;
+  uint32_t i;
 
-  query = sqlite3_mprintf(Q_TMPL, key, value);
+  if (!key || x->nslots == 0)
+    return -1;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  for (i = djb_hash(key, strlen(key)) & mask; slots[i] >= 0; i = (i + 1) & mask)
+    {
+      str = bypath ? x->nodes[slots[i]].di.path : x->nodes[slots[i]].di.virtual_path;
+      if (str && strcmp(str, key) == 0)
+	return slots[i];
+    }
+
+  return -1;
 }
 
-static int
-admin_get(void *value, const char *key, short type)
+static void
+dir_index_rehash(struct db_dir_copy *x, uint32_t nslots)
 {
-#define Q_TMPL "SELECT value FROM admin a WHERE a.key = '%q';"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
+  int i;
 
-  CHECK_NULL(L_DB, query = sqlite3_mprintf(Q_TMPL, key));
+  free(x->vpath_slots);
+  free(x->path_slots);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  CHECK_NULL(L_DB, x->vpath_slots = malloc(nslots * sizeof(int)));
+  CHECK_NULL(L_DB, x->path_slots = malloc(nslots * sizeof(int)));
+  memset(x->vpath_slots, -1, nslots * sizeof(int));
+  memset(x->path_slots, -1, nslots * sizeof(int));
+  x->nslots = nslots;
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  for (i = 0; i < x->nnodes; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      dir_index_slot_set(x, x->vpath_slots, x->nodes[i].di.virtual_path, i);
+      dir_index_slot_set(x, x->path_slots, x->nodes[i].di.path, i);
+    }
+}
 
-      sqlite3_free(query);
-      return -1;
+// The node must then be linked to its parent with dir_index_link()
+static int
+dir_index_add(struct db_dir_copy *x, struct directory_info *di)
+{
+  struct db_dir_node *node;
+  uint32_t nbyid;
+  int idx;
+
+  if (x->nnodes == x->size)
+    {
+      x->size = x->size ? 2 * x->size : 256;
+      CHECK_NULL(L_DB, x->nodes = realloc(x->nodes, x->size * sizeof(struct db_dir_node)));
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  if (di->id >= x->nbyid)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_DBG, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      for (nbyid = x->nbyid ? x->nbyid : 256; nbyid <= di->id; nbyid *= 2)
+	; /* EMPTY */
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+      CHECK_NULL(L_DB, x->byid = realloc(x->byid, nbyid * sizeof(int)));
+      memset(x->byid + x->nbyid, -1, (nbyid - x->nbyid) * sizeof(int));
+      x->nbyid = nbyid;
     }
 
-  struct_field_from_statement(value, 0, type, stmt, 0, true, false);
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  idx = x->nnodes;
+  node = &x->nodes[idx];
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  node->di = *di;
+  node->di.virtual_path = dir_index_strdup_trim(di->virtual_path);
+  node->di.path = dir_index_strdup_trim(di->path);
+  node->first_child = -1;
+  node->next_sibling = -1;
 
-  return 0;
+  x->nnodes++;
+  x->byid[di->id] = idx;
 
-#undef Q_TMPL
-}
+  if (2 * x->nnodes > x->nslots)
+    dir_index_rehash(x, x->nslots ? 2 * x->nslots : 512);
+  else
+    {
+      dir_index_slot_set(x, x->vpath_slots, node->di.virtual_path, idx);
+      dir_index_slot_set(x, x->path_slots, node->di.path, idx);
+    }
 
-int
-db_admin_get(char **value, const char *key)
-{
-  return admin_get(value, key, DB_TYPE_STRING);
+  return idx;
 }
 
-int
-db_admin_getint(int *intval, const char *key)
+static struct db_dir_node *
+dir_index_node_byid(struct db_dir_copy *x, uint32_t id)
 {
-  return admin_get(intval, key, DB_TYPE_INT);
-}
+  if (id >= x->nbyid || x->byid[id] < 0)
+    return NULL;
 
-int
-db_admin_getint64(int64_t *int64val, const char *key)
-{
-  return admin_get(int64val, key, DB_TYPE_INT64);
+  return &x->nodes[x->byid[id]];
 }
 
-int
-db_admin_delete(const char *key)
+// Returns -1 if the parent is not present
+static int
+dir_index_link(struct db_dir_copy *x, int idx)
 {
-#define Q_TMPL "DELETE FROM admin WHERE key='%q';"
-  char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, key);
+  struct db_dir_node *parent;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  if (x->nodes[idx].di.parent_id == 0)
+    return 0;
 
-/* Speakers */
-int
-db_speaker_save(struct output_device *device)
-{
-#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume, name, auth_key) VALUES (%" PRIi64 ", %d, %d, %Q, %Q);"
-  char *query;
+  parent = dir_index_node_byid(x, x->nodes[idx].di.parent_id);
+  if (!parent)
+    return -1;
 
-  query = sqlite3_mprintf(Q_TMPL, device->id, device->selected, device->volume, device->name, device->auth_key);
+  x->nodes[idx].next_sibling = parent->first_child;
+  parent->first_child = idx;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return 0;
 }
 
-int
-db_speaker_get(struct output_device *device, uint64_t id)
+/* Reads the directories table into a new copy and swaps it in, unless the
+ * index was invalidated (or a directory applied) while reading. Must be called
+ * without the lock, since the query may have to wait for another thread's
+ * transaction, and that thread may need the lock before it can commit.
+ */
+static int
+dir_index_rebuild(void)
 {
-#define Q_TMPL "SELECT s.selected, s.volume, s.name, s.auth_key FROM speakers s WHERE s.id = %" PRIi64 ";"
+#define Q_TMPL "SELECT d.id, d.virtual_path, d.db_timestamp, d.disabled, d.parent_id, d.path FROM directories d;"
+  struct directory_info di;
+  struct db_dir_copy *x;
   sqlite3_stmt *stmt;
-  char *query;
+  uint64_t generation;
+  int ndirs;
   int ret;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
+  generation = db_dir_index.generation;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_TMPL);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      ret = -1;
-      goto out;
+      return -1;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  CHECK_NULL(L_DB, x = calloc(1, sizeof(struct db_dir_copy)));
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      sqlite3_finalize(stmt);
-      ret = -1;
-      goto out;
+      di.id = sqlite3_column_int(stmt, 0);
+      di.virtual_path = (char *)sqlite3_column_text(stmt, 1);
+      di.db_timestamp = sqlite3_column_int(stmt, 2);
+      di.disabled = sqlite3_column_int64(stmt, 3);
+      di.parent_id = sqlite3_column_int(stmt, 4);
+      di.path = (char *)sqlite3_column_text(stmt, 5);
+
+      dir_index_add(x, &di);
     }
 
-  device->id = id;
-  device->selected = sqlite3_column_int(stmt, 0);
-  device->volume = sqlite3_column_int(stmt, 1);
+  sqlite3_finalize(stmt);
 
-  free(device->name);
-  device->name = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      dir_index_free(x);
+      return -1;
+    }
 
-  free(device->auth_key);
-  device->auth_key = safe_strdup((char *)sqlite3_column_text(stmt, 3));
+  // Linked in reverse, so that the children are in table order
+  for (i = x->nnodes - 1; i >= 0; i--)
+    dir_index_link(x, i);
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  ndirs = x->nnodes;
 
-  sqlite3_finalize(stmt);
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
+  if (!db_dir_index.copy && db_dir_index.generation == generation)
+    {
+      db_dir_index.copy = x;
+      x = NULL;
+    }
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
 
-  ret = 0;
+  if (x)
+    {
+      DPRINTF(E_DBG, L_DB, "Directory index changed while it was rebuilt, discarding\n");
+      dir_index_free(x);
+      return -1;
+    }
 
- out:
-  sqlite3_free(query);
-  return ret;
+  DPRINTF(E_DBG, L_DB, "Directory index rebuilt with %d directories\n", ndirs);
 
+  return 0;
 #undef Q_TMPL
 }
 
+// Returns true with the lock held if the index can be used. The index is only
+// rebuilt outside of transactions: a read snapshot may be older than the
+// table, and a writer would publish its uncommitted changes to other threads.
+static bool
+dir_index_lock(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
 
-/* Queue */
+  if (db_dir_index.copy)
+    return true;
 
-/*
- * Start a new transaction for modifying the queue. Returns the new queue version for the following changes.
- * After finishing all queue modifications 'queue_transaction_end' needs to be called.
- */
-static int
-queue_transaction_begin()
-{
-  int queue_version = 0;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
 
-  db_transaction_begin();
+  if (db_read_conn || !hdl || !sqlite3_get_autocommit(hdl))
+    return false;
 
-  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
-  queue_version++;
+  if (dir_index_rebuild() < 0)
+    return false;
 
-  return queue_version;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
+
+  if (db_dir_index.copy)
+    return true;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
+  return false;
 }
 
-/*
- * If retval == 0, updates the version of the queue in the admin table, commits the transaction
- * and notifies listener of LISTENER_QUEUE about the changes.
- * If retval < 0, rollsback the transaction.
- *
- * This function must be called after modifying the queue.
- *
- * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
- * @param queue_version The new queue version, for the pending modifications
- */
 static void
-queue_transaction_end(int retval, int queue_version)
+dir_index_unlock(void)
 {
-  int ret;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
+}
 
-  if (retval < 0)
-    goto error;
+// Applies an added or updated directory that has been written to the table
+static void
+dir_index_apply(struct directory_info *di)
+{
+  struct db_dir_copy *x;
+  struct db_dir_node *node;
+  int idx;
 
-  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
-  if (ret < 0)
-    goto error;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
 
-  db_transaction_end();
-  listener_notify(LISTENER_QUEUE);
-  return;
+  x = db_dir_index.copy;
+  if (!x)
+    {
+      // A copy being built may not include the directory
+      db_dir_index.generation++;
+      goto out;
+    }
 
- error:
-  db_transaction_rollback();
+  // The index may have been rebuilt with the directory already in it
+  node = dir_index_node_byid(x, di->id);
+  if (node)
+    {
+      // Changing the keys or the parent would need rehashing and relinking
+      if (node->di.parent_id != di->parent_id || !dir_index_streq_trim(node->di.virtual_path, di->virtual_path)
+	  || !dir_index_streq_trim(node->di.path, di->path))
+	dir_index_clear();
+      else
+	{
+	  node->di.db_timestamp = di->db_timestamp;
+	  node->di.disabled = di->disabled;
+	}
+
+      goto out;
+    }
+
+  idx = dir_index_add(x, di);
+  if (dir_index_link(x, idx) < 0)
+    dir_index_clear();
+
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
 }
 
 static int
-queue_reshuffle(uint32_t item_id, int queue_version);
+dir_index_enum_cmp(const void *a, const void *b)
+{
+  const struct directory_info *da = a;
+  const struct directory_info *db = b;
 
-static int
-queue_item_add(struct db_queue_item *qi)
+  return strcasecmp(da->virtual_path, db->virtual_path);
+}
+
+int
+db_directory_id_byvirtualpath(const char *virtual_path)
 {
+#define Q_TMPL "SELECT d.id FROM directories d WHERE d.virtual_path = '%q';"
+  char *query;
+  int idx;
   int ret;
 
-  fixup_tags_qi(qi);
-
-  ret = bind_qi(db_statements.queue_items_insert, qi);
-  if (ret < 0)
-    return -1;
+  if (dir_index_lock())
+    {
+      idx = dir_index_slot_get(db_dir_index.copy, virtual_path, false);
+      ret = (idx >= 0) ? db_dir_index.copy->nodes[idx].di.id : 0;
+      dir_index_unlock();
 
-  // Do not update events here, only caller knows if more items will be added
-  ret = db_statement_run(db_statements.queue_items_insert, 0);
-  if (ret < 0)
-    return -1;
+      if (ret > 0)
+	return ret;
+    }
 
-  ret = (int)sqlite3_last_insert_rowid(hdl);
-  if (ret == 0)
+  query = sqlite3_mprintf(Q_TMPL, virtual_path);
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return 0;
     }
 
+  ret = db_file_id_byquery(query);
+
+  sqlite3_free(query);
+
   return ret;
+
+#undef Q_TMPL
 }
 
-static int
-queue_item_add_from_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
+int
+db_directory_id_bypath(const char *path)
 {
-  struct db_queue_item qi;
+#define Q_TMPL "SELECT d.id FROM directories d WHERE d.path = '%q';"
+  char *query;
+  int idx;
   int ret;
 
-  // No allocations, just the struct content is copied
-  db_queue_item_from_dbmfi(&qi, dbmfi);
+  if (dir_index_lock())
+    {
+      idx = dir_index_slot_get(db_dir_index.copy, path, true);
+      ret = (idx >= 0) ? db_dir_index.copy->nodes[idx].di.id : 0;
+      dir_index_unlock();
 
-  // No tag fixup, we can't touch the strings in qi, plus must assume dbmfi has proper tags
+      if (ret > 0)
+	return ret;
+    }
 
-  qi.pos = pos;
-  qi.shuffle_pos = shuffle_pos;
-  qi.queue_version = queue_version;
+  query = sqlite3_mprintf(Q_TMPL, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-  ret = bind_qi(db_statements.queue_items_insert, &qi);
-  if (ret < 0)
-    return -1;
+      return 0;
+    }
 
-  // Do not update events here, only caller knows if more items will be added
-  ret = db_statement_run(db_statements.queue_items_insert, 0);
-  if (ret < 0)
-    return -1;
+  ret = db_file_id_byquery(query);
 
-  ret = (int)sqlite3_last_insert_rowid(hdl);
-  if (ret == 0)
-    {
-      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
-      return -1;
-    }
+  sqlite3_free(query);
 
   return ret;
+
+#undef Q_TMPL
 }
 
-static int
-queue_item_update(struct db_queue_item *qi)
+int
+db_directory_enum_start(struct directory_enum *de)
 {
+#define Q_TMPL "SELECT * FROM directories WHERE disabled = 0 AND parent_id = %d ORDER BY virtual_path COLLATE NOCASE;"
+  struct db_dir_node *parent;
+  struct db_dir_node *node;
+  sqlite3_stmt *stmt;
+  char *query;
+  int idx;
   int ret;
 
-  fixup_tags_qi(qi);
-
-  ret = bind_qi(db_statements.queue_items_update, qi);
-  if (ret < 0)
-    return -1;
-
-  // Do not update events here, only caller knows if more items will be updated
-  ret = db_statement_run(db_statements.queue_items_update, 0);
-  if (ret < 0)
-    return -1;
+  de->stmt = NULL;
+  de->dirs = NULL;
+  de->ndirs = 0;
+  de->pos = 0;
 
-  return qi->id;
-}
+  if (dir_index_lock())
+    {
+      parent = dir_index_node_byid(db_dir_index.copy, de->parent_id);
+      if (parent)
+	{
+	  for (idx = parent->first_child; idx >= 0; idx = db_dir_index.copy->nodes[idx].next_sibling)
+	    de->ndirs++;
 
-void
-db_queue_item_from_mfi(struct db_queue_item *qi, struct media_file_info *mfi)
-{
-  int i;
+	  CHECK_NULL(L_DB, de->dirs = calloc(de->ndirs + 1, sizeof(struct directory_info)));
 
-  memset(qi, 0, sizeof(struct db_queue_item));
+	  de->ndirs = 0;
+	  for (idx = parent->first_child; idx >= 0; idx = node->next_sibling)
+	    {
+	      node = &db_dir_index.copy->nodes[idx];
+	      if (node->di.disabled != 0 || !node->di.virtual_path)
+		continue;
+
+	      de->dirs[de->ndirs] = node->di;
+	      de->dirs[de->ndirs].virtual_path = strdup(node->di.virtual_path);
+	      de->dirs[de->ndirs].path = safe_strdup(node->di.path);
+	      de->ndirs++;
+	    }
+	}
 
-  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
-    {
-      if (qi_mfi_map[i].mfi_offset < 0)
-	continue;
+      dir_index_unlock();
 
-      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, mfi, qi_mfi_map[i].mfi_offset, true, false);
+      if (de->dirs)
+	{
+	  qsort(de->dirs, de->ndirs, sizeof(struct directory_info), dir_index_enum_cmp);
+	  return 0;
+	}
     }
 
-  if (!qi->file_id)
-    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
-}
-
-void
-db_queue_item_from_dbmfi(struct db_queue_item *qi, struct db_media_file_info *dbmfi)
-{
-  int i;
-
-  memset(qi, 0, sizeof(struct db_queue_item));
+  query = sqlite3_mprintf(Q_TMPL, de->parent_id);
 
-  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+  if (!query)
     {
-      if (qi_mfi_map[i].dbmfi_offset < 0)
-	continue;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, dbmfi, qi_mfi_map[i].dbmfi_offset, false, true);
+      return -1;
     }
 
-  if (!qi->file_id)
-    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
-}
-
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
 
-int
-db_queue_item_update(struct db_queue_item *qi)
-{
-  int queue_version;
-  int ret;
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-  queue_version = queue_transaction_begin();
+      sqlite3_free(query);
+      return -1;
+    }
 
-  qi->queue_version = queue_version;
+  sqlite3_free(query);
 
-  ret = queue_item_update(qi);
+  de->stmt = stmt;
 
-  // MPD changes playlist version when metadata changes, also makes LISTENER_QUEUE
-  queue_transaction_end(ret, queue_version);
+  return 0;
 
-  return ret;
+#undef Q_TMPL
 }
 
-/*
- * Adds the files matching the given query to the queue after the item with the given item id
- *
- * The files table is queried with the given parameters and all found files are added after the
- * item with the given item id to the "normal" queue. They are appended to end of the shuffled queue
- * (assuming that the shuffled queue will get reshuffled after adding new items).
- *
- * The function returns -1 on failure (e. g. error reading from database) and if the given item id
- * does not exist. It wraps all database access in a transaction and performs a rollback if an error
- * occurs, leaving the queue in a consistent state.
- *
- * @param qp Query parameters for the files table
- * @param item_id Files are added after item with this id
- * @return 0 on success, -1 on failure
- */
 int
-db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
+db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
 {
-  int pos;
   int ret;
 
-  // Position of the first new item
-  pos = db_queue_get_pos(item_id, 0);
-  if (pos < 0)
-    {
-      return -1;
-    }
-  pos++;
-
-  ret = db_queue_add_by_query(qp, 0, 0, pos, NULL, NULL);
-  return ret;
-}
+  memset(di, 0, sizeof(struct directory_info));
 
-int
-db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
-{
-  uint32_t queue_count;
-  int ret;
+  if (de->dirs)
+    {
+      if (de->pos == de->ndirs)
+	{
+	  DPRINTF(E_DBG, L_DB, "End of directory enum results\n");
+	  return 0;
+	}
 
-  memset(queue_add_info, 0, sizeof(struct db_queue_add_info));
-  queue_add_info->queue_version = queue_transaction_begin();
+      *di = de->dirs[de->pos];
+      de->pos++;
+      return 0;
+    }
 
-  ret = db_queue_get_count(&queue_count);
-  if (ret < 0)
+  if (!de->stmt)
     {
-      ret = -1;
-      queue_transaction_end(ret, queue_add_info->queue_version);
-      return ret;
+      DPRINTF(E_LOG, L_DB, "Directory enum not started!\n");
+      return -1;
     }
 
-  queue_add_info->pos = queue_count;
-  queue_add_info->shuffle_pos = queue_count;
-
-  if (pos >= 0 && pos < queue_count)
-    queue_add_info->pos = pos;
+  ret = db_blocking_step(de->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of directory enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-  queue_add_info->start_pos = queue_add_info->pos;
+  di->id = sqlite3_column_int(de->stmt, 0);
+  di->virtual_path = (char *)sqlite3_column_text(de->stmt, 1);
+  di->db_timestamp = sqlite3_column_int(de->stmt, 2);
+  di->disabled = sqlite3_column_int64(de->stmt, 3);
+  di->parent_id = sqlite3_column_int(de->stmt, 4);
+  di->path = (char *)sqlite3_column_text(de->stmt, 5);
 
   return 0;
 }
 
-int
-db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint32_t item_id, int ret)
+void
+db_directory_enum_end(struct directory_enum *de)
 {
-  char *query;
+  int i;
 
-  // Update pos for all items from the given position
-  if (ret == 0)
+  if (de->dirs)
     {
-      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND queue_version < %d;",
-			      queue_add_info->count, queue_add_info->queue_version, queue_add_info->start_pos, queue_add_info->queue_version);
-      ret = db_query_run(query, 1, 0);
-    }
+      for (i = 0; i < de->ndirs; i++)
+	{
+	  free(de->dirs[i].virtual_path);
+	  free(de->dirs[i].path);
+	}
 
-  // Reshuffle after adding new items
-  if (ret == 0 && reshuffle)
-    {
-      ret = queue_reshuffle(item_id, queue_add_info->queue_version);
+      free(de->dirs);
+      de->dirs = NULL;
+      de->ndirs = 0;
     }
 
-  queue_transaction_end(ret, queue_add_info->queue_version);
-  return ret;
+  if (!de->stmt)
+    return;
+
+  sqlite3_finalize(de->stmt);
+  de->stmt = NULL;
 }
 
-int
-db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item *qi)
+static int
+db_directory_add(struct directory_info *di, int *id)
 {
-  int ret;
-
-  qi->pos = queue_add_info->pos;
-  qi->shuffle_pos = queue_add_info->shuffle_pos;
-  qi->queue_version = queue_add_info->queue_version;
-
-  ret = queue_item_add(qi);
-  if (ret < 0)
-    return ret;
-
-  queue_add_info->pos++;
-  queue_add_info->shuffle_pos++;
-  queue_add_info->count++;
-
-  if (queue_add_info->new_item_id == 0)
-    queue_add_info->new_item_id = ret;
-
-  return ret;
-}
+#define QADD_TMPL "INSERT INTO directories (virtual_path, db_timestamp, disabled, parent_id, path)" \
+                  " VALUES (TRIM(%Q), %d, %" PRIi64 ", %d, TRIM(%Q));"
 
-/*
- * Adds the files matching the given query to the queue
- *
- * The files table is queried with the given parameters and all found files are added to the end of the
- * "normal" queue and the shuffled queue.
- *
- * The function returns -1 on failure (e. g. error reading from database). It wraps all database access
- * in a transaction and performs a rollback if an error occurs, leaving the queue in a consistent state.
- *
- * @param qp Query parameters for the files table
- * @param reshuffle If 1 queue will be reshuffled after adding new items
- * @param item_id The base item id, all items after this will be reshuffled
- * @param position The position in the queue for the new queue item, -1 to add at end of queue
- * @param count If not NULL returns the number of items added to the queue
- * @param new_item_id If not NULL return the queue item id of the first new queue item
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
-{
-  struct db_media_file_info dbmfi;
   char *query;
-  int queue_version;
-  uint32_t queue_count;
-  int pos;
+  char *errmsg;
+  int vp_len = strlen(di->virtual_path);
   int ret;
 
-  if (new_item_id)
-    *new_item_id = 0;
-  if (count)
-    *count = 0;
-
-  queue_version = queue_transaction_begin();
-
-  ret = db_queue_get_count(&queue_count);
-  if (ret < 0)
+  if (vp_len && di->virtual_path[vp_len-1] == ' ')
     {
-      ret = -1;
-      goto end_transaction;
+      /* Since sqlite removes the trailing space, so these
+       * directories will be found as new in perpetuity.
+       */
+      DPRINTF(E_LOG, L_DB, "Directory name ends with space: '%s'\n", di->virtual_path);
     }
 
-  ret = db_query_start(qp);
-  if (ret < 0)
-    goto end_transaction;
-
-  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
-
-  if (qp->results == 0)
-    {
-      db_query_end(qp);
-      db_transaction_end();
-      return 0;
-    }
+  query = sqlite3_mprintf(QADD_TMPL, di->virtual_path, di->db_timestamp, di->disabled, di->parent_id, di->path);
 
-  if (position < 0 || position > queue_count)
+  if (!query)
     {
-      pos = queue_count;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
-  else
-    {
-      pos = position;
 
-      // Update pos for all items from the given position (make room for the new items in the queue)
-      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d;", qp->results, queue_version, pos);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	goto end_transaction;
-    }
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      ret = queue_item_add_from_file(&dbmfi, pos, queue_count, queue_version);
-
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_DB, "Failed to add song id %s (%s)\n", dbmfi.id, dbmfi.title);
-	  break;
-	}
-
-      DPRINTF(E_DBG, L_DB, "Added song id %s (%s) to queue with item id %d\n", dbmfi.id, dbmfi.title, ret);
-
-      if (new_item_id && *new_item_id == 0)
-	*new_item_id = ret;
-      if (count)
-	(*count)++;
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
 
-      pos++;
-      queue_count++;
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      return -1;
     }
 
-  db_query_end(qp);
-
-  if (ret < 0)
-    goto end_transaction;
+  sqlite3_free(query);
 
-  // Reshuffle after adding new items
-  if (reshuffle)
+  *id = (int)sqlite3_last_insert_rowid(hdl);
+  if (*id == 0)
     {
-      ret = queue_reshuffle(item_id, queue_version);
+      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
+      return -1;
     }
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
-
-  return ret;
-}
-
-/*
- * Adds the items of the stored playlist with the given id to the end of the queue
- *
- * @param plid Id of the stored playlist
- * @param reshuffle If 1 queue will be reshuffled after adding new items
- * @param item_id The base item id, all items after this will be reshuffled
- * @param position The position in the queue for the new queue item, -1 to add at end of queue
- * @param count If not NULL returns the number of items added to the queue
- * @param new_item_id If not NULL return the queue item id of the first new queue item
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_add_by_playlistid(int plid, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
-{
-  struct query_params qp;
-  int ret;
-
-  memset(&qp, 0, sizeof(struct query_params));
-
-  qp.id = plid;
-  qp.type = Q_PLITEMS;
-
-  ret = db_queue_add_by_query(&qp, reshuffle, item_id, position, count, new_item_id);
-
-  return ret;
-}
-
-/*
- * Adds the file with the given id to the queue
- *
- * @param id Id of the file
- * @param reshuffle If 1 queue will be reshuffled after adding new items
- * @param item_id The base item id, all items after this will be reshuffled
- * @param position The position in the queue for the new queue item, -1 to add at end of queue
- * @param count If not NULL returns the number of items added to the queue
- * @param new_item_id If not NULL return the queue item id of the first new queue item
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_add_by_fileid(int id, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
-{
-  struct query_params qp;
-  char buf[124];
-  int ret;
-
-  memset(&qp, 0, sizeof(struct query_params));
+  DPRINTF(E_DBG, L_DB, "Added directory '%s' with id %d\n", di->virtual_path, *id);
 
-  qp.type = Q_ITEMS;
-  snprintf(buf, sizeof(buf), "f.id = %" PRIu32, id);
-  qp.filter = buf;
+  di->id = *id;
+  dir_index_apply(di);
 
-  ret = db_queue_add_by_query(&qp, reshuffle, item_id, position, count, new_item_id);
+  return 0;
 
-  return ret;
+#undef QADD_TMPL
 }
 
 static int
-queue_enum_start(struct query_params *qp)
+db_directory_update(struct directory_info *di)
 {
-#define Q_TMPL "SELECT * FROM queue f WHERE %s ORDER BY %s;"
-  sqlite3_stmt *stmt;
+#define QADD_TMPL "UPDATE directories SET virtual_path = TRIM(%Q), db_timestamp = %d, disabled = %" PRIi64 ", parent_id = %d, path = TRIM(%Q)" \
+                  " WHERE id = %d;"
   char *query;
-  const char *orderby;
+  char *errmsg;
   int ret;
 
-  qp->stmt = NULL;
-
-  if (qp->sort)
-    orderby = sort_clause[qp->sort];
-  else
-    orderby = sort_clause[S_POS];
-
-  if (qp->filter)
-    query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
-  else
-    query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
+  /* Add */
+  query = sqlite3_mprintf(QADD_TMPL, di->virtual_path, di->db_timestamp, di->disabled, di->parent_id, di->path, di->id);
 
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_exec(query, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
 
+      sqlite3_free(errmsg);
       sqlite3_free(query);
       return -1;
     }
 
   sqlite3_free(query);
 
-  qp->stmt = stmt;
+  DPRINTF(E_DBG, L_DB, "Updated directory '%s' with id %d\n", di->virtual_path, di->id);
+
+  dir_index_apply(di);
 
   return 0;
 
-#undef Q_TMPL
+#undef QADD_TMPL
 }
 
-static inline char *
-strdup_if(char *str, int cond)
+int
+db_directory_addorupdate(char *virtual_path, char *path, int disabled, int parent_id)
 {
-  if (str == NULL)
-    return NULL;
+  struct directory_info di;
+  int id;
+  int ret;
 
-  if (cond)
-    return strdup(str);
+  id = db_directory_id_byvirtualpath(virtual_path);
 
-  return str;
+  di.id = id;
+  di.parent_id = parent_id;
+  di.virtual_path = virtual_path;
+  di.path = path;
+  di.disabled = disabled;
+  di.db_timestamp = (uint64_t)time(NULL);
+
+  if (di.id == 0)
+    ret = db_directory_add(&di, &id);
+  else
+    ret = db_directory_update(&di);
+
+  if (ret < 0 || id <= 0)
+  {
+    DPRINTF(E_LOG, L_DB, "Insert or update of directory failed '%s'\n", virtual_path);
+    return -1;
+  }
+
+  return id;
 }
 
-static int
-queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_strdup)
+void
+db_directory_ping_bymatch(char *virtual_path)
 {
-  int ret;
-  int i;
+#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR virtual_path LIKE '%q/%%';"
+  char *query;
 
-  memset(qi, 0, sizeof(struct db_queue_item));
+  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path);
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Queue enum not started!\n");
-      return -1;
-    }
-
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_DBG, L_DB, "End of queue enum results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
-
-  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
-    {
-      struct_field_from_statement(qi, qi_cols_map[i].offset, qi_cols_map[i].type, qp->stmt, i, must_strdup, false);
-    }
+  db_query_run(query, 1, 0);
 
-  return 0;
+  dir_index_invalidate();
+#undef Q_TMPL_DIR
 }
 
-int
-db_queue_enum_start(struct query_params *qp)
+void
+db_directory_disable_bymatch(char *path, enum strip_type strip, uint32_t cookie)
 {
-  int ret;
+#define Q_TMPL "UPDATE directories SET virtual_path = substr(virtual_path, %d)," \
+               " disabled = %" PRIi64 " WHERE virtual_path = '/file:%q' OR virtual_path LIKE '/file:%q/%%';"
+  char *query;
+  int64_t disabled;
+  int vpath_striplen;
 
-  db_transaction_begin();
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
 
-  ret = queue_enum_start(qp);
+  vpath_striplen = (strip == STRIP_PATH) ? strlen("/file:") + strlen(path) : 0;
 
-  if (ret < 0)
-    db_transaction_rollback();
+  query = sqlite3_mprintf(Q_TMPL, vpath_striplen + 1, disabled, path, path, path);
 
-  return ret;
-}
+  db_query_run(query, 1, LISTENER_DATABASE);
 
-void
-db_queue_enum_end(struct query_params *qp)
-{
-  db_query_end(qp);
-  db_transaction_end();
+  dir_index_invalidate();
+#undef Q_TMPL
 }
 
 int
-db_queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi)
+db_directory_enable_bycookie(uint32_t cookie, char *path)
 {
-  return queue_enum_fetch(qp, qi, 0);
+#define Q_TMPL "UPDATE directories SET virtual_path = ('/file:%q' || virtual_path)," \
+               " disabled = 0 WHERE disabled = %" PRIi64 ";"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
+
+  dir_index_invalidate();
+
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+#undef Q_TMPL
 }
 
 int
-db_queue_get_pos(uint32_t item_id, char shuffle)
+db_directory_enable_bypath(char *path)
 {
-#define Q_TMPL "SELECT pos FROM queue WHERE id = %d;"
-#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE id = %d;"
-
+#define Q_TMPL "UPDATE directories SET disabled = 0 WHERE virtual_path = %Q AND disabled <> 0;"
   char *query;
-  int pos;
-
-  if (shuffle)
-    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, item_id);
-  else
-    query = sqlite3_mprintf(Q_TMPL, item_id);
+  int ret;
 
-  pos = db_get_one_int(query);
+  query = sqlite3_mprintf(Q_TMPL, path);
 
-  sqlite3_free(query);
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
 
-  return pos;
+  dir_index_invalidate();
 
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL
-#undef Q_TMPL_SHUFFLE
 }
 
+
+/* Remotes */
 static int
-queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *qi, int with_metadata)
+db_pairing_delete_byremote(char *remote_id)
 {
-  struct query_params qp;
-  int ret;
+#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
+  char *query;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("id = %d", item_id);
+  query = sqlite3_mprintf(Q_TMPL, remote_id);
 
-  ret = queue_enum_start(&qp);
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_pairing_add(struct pairing_info *pi)
+{
+#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
+  char *query;
+  int ret;
+
+  ret = db_pairing_delete_byremote(pi->remote_id);
   if (ret < 0)
-    {
-      sqlite3_free(qp.filter);
-      return -1;
-    }
+    return ret;
 
-  ret = queue_enum_fetch(&qp, qi, with_metadata);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
-  return ret;
+  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
 }
 
-struct db_queue_item *
-db_queue_fetch_byitemid(uint32_t item_id)
+int
+db_pairing_fetch_byguid(struct pairing_info *pi)
 {
-  struct db_queue_item *qi;
+#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
+  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
+  query = sqlite3_mprintf(Q_TMPL, pi->guid);
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  db_transaction_begin();
-  ret = queue_fetch_byitemid(item_id, qi, 1);
-  db_transaction_end();
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  if (ret < 0)
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by item id\n");
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
     }
-  else if (qi->id == 0)
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
     }
 
-  return qi;
+  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
+  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
 }
 
-struct db_queue_item *
-db_queue_fetch_byfileid(uint32_t file_id)
+/* Spotify */
+void
+db_spotify_purge(void)
 {
-  struct db_queue_item *qi;
-  struct query_params qp;
+#define Q_TMPL "UPDATE directories SET disabled = %" PRIi64 " WHERE virtual_path = '/spotify:' AND disabled <> %" PRIi64 ";"
+  char *queries[4] =
+    {
+      "DELETE FROM files WHERE path LIKE 'spotify:%%';",
+      "DELETE FROM playlistitems WHERE filepath LIKE 'spotify:%%';",
+      "DELETE FROM playlists WHERE path LIKE 'spotify:%%';",
+      "DELETE FROM directories WHERE virtual_path LIKE '/spotify:/%%';",
+    };
+  char *query;
+  int i;
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
-      return NULL;
-    }
+      ret = db_query_run(queries[i], 0, LISTENER_DATABASE);
 
-  db_transaction_begin();
+      if (ret == 0)
+	DPRINTF(E_DBG, L_DB, "Processed %d rows\n", sqlite3_changes(hdl));
+    }
 
-  qp.filter = sqlite3_mprintf("file_id = %d", file_id);
+  dir_index_invalidate();
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  // Disable the spotify directory by setting 'disabled' to INOTIFY_FAKE_COOKIE value
+  query = sqlite3_mprintf(Q_TMPL, INOTIFY_FAKE_COOKIE, INOTIFY_FAKE_COOKIE);
+  if (!query)
     {
-      sqlite3_free(qp.filter);
-      db_transaction_end();
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return;
     }
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
 
-  ret = queue_enum_fetch(&qp, qi, 1);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
-  db_transaction_end();
+  if (ret == 0)
+    DPRINTF(E_DBG, L_DB, "Disabled spotify directory\n");
 
-  if (ret < 0)
-    {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
-    }
+  dir_index_invalidate();
 
-  return qi;
+#undef Q_TMPL
 }
 
-static int
-queue_fetch_bypos(uint32_t pos, char shuffle, struct db_queue_item *qi, int with_metadata)
+/* Spotify */
+void
+db_spotify_pl_delete(int id)
 {
-  struct query_params qp;
+  char *queries_tmpl[2] =
+    {
+      "DELETE FROM playlists WHERE id = %d;",
+      "DELETE FROM playlistitems WHERE playlistid = %d;",
+    };
+  char *query;
+  int i;
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  if (shuffle)
-    qp.filter = sqlite3_mprintf("shuffle_pos = %d", pos);
-  else
-    qp.filter = sqlite3_mprintf("pos = %d", pos);
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
     {
-      sqlite3_free(qp.filter);
-      return -1;
-    }
+      query = sqlite3_mprintf(queries_tmpl[i], id);
 
-  ret = queue_enum_fetch(&qp, qi, with_metadata);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
-  return ret;
+      ret = db_query_run(query, 1, LISTENER_DATABASE);
+
+      if (ret == 0)
+	DPRINTF(E_DBG, L_DB, "Deleted %d rows\n", sqlite3_changes(hdl));
+    }
 }
 
-struct db_queue_item *
-db_queue_fetch_bypos(uint32_t pos, char shuffle)
+/* Spotify */
+void
+db_spotify_files_delete(void)
 {
-  struct db_queue_item *qi;
+#define Q_TMPL "DELETE FROM files WHERE path LIKE 'spotify:%%' AND NOT path IN (SELECT filepath FROM playlistitems);"
+  char *query;
   int ret;
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
-    {
-      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
-      return NULL;
-    }
-
-  db_transaction_begin();
-  ret = queue_fetch_bypos(pos, shuffle, qi, 1);
-  db_transaction_end();
+  query = sqlite3_mprintf(Q_TMPL);
 
-  if (ret < 0)
-    {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
-    }
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
 
-  return qi;
+  if (ret == 0)
+    DPRINTF(E_DBG, L_DB, "Deleted %d rows\n", sqlite3_changes(hdl));
+#undef Q_TMPL
 }
 
-static int
-queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle, struct db_queue_item *qi, int with_metadata)
+/* Admin */
+int
+db_admin_set(const char *key, const char *value)
 {
-  int pos_absolute;
-  int ret;
+#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%q');"
+  char *query;
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  query = sqlite3_mprintf(Q_TMPL, key, value);
 
-  pos_absolute = db_queue_get_pos(item_id, shuffle);
-  if (pos_absolute < 0)
-    {
-      return -1;
-    }
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: item (%d) has absolute pos %d\n", item_id, pos_absolute);
+int
+db_admin_setint(const char *key, int value)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%d');"
+  char *query;
 
-  pos_absolute += pos;
+  query = sqlite3_mprintf(Q_TMPL, key, value);
 
-  ret = queue_fetch_bypos(pos_absolute, shuffle, qi, with_metadata);
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
-  if (ret < 0)
-    DPRINTF(E_LOG, L_DB, "Error fetching item by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
-  else
-    DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+int
+db_admin_setint64(const char *key, int64_t value)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%" PRIi64 "');"
+  char *query;
 
-  return ret;
+  query = sqlite3_mprintf(Q_TMPL, key, value);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
 }
 
-struct db_queue_item *
-db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
+static int
+admin_get(void *value, const char *key, short type)
 {
-  struct db_queue_item *qi;
+#define Q_TMPL "SELECT value FROM admin a WHERE a.key = '%q';"
+  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  CHECK_NULL(L_DB, query = sqlite3_mprintf(Q_TMPL, key));
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
     }
 
-  db_transaction_begin();
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_DBG, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, qi, 1);
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
 
-  db_transaction_end();
+  struct_field_from_statement(value, 0, type, stmt, 0, true, false);
 
-  if (ret < 0)
-    {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos relative to item id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
-    }
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
 
-  return qi;
+  return 0;
+
+#undef Q_TMPL
 }
 
-struct db_queue_item *
-db_queue_fetch_next(uint32_t item_id, char shuffle)
+int
+db_admin_get(char **value, const char *key)
 {
-  return db_queue_fetch_byposrelativetoitem(1, item_id, shuffle);
+  return admin_get(value, key, DB_TYPE_STRING);
 }
 
-struct db_queue_item *
-db_queue_fetch_prev(uint32_t item_id, char shuffle)
+int
+db_admin_getint(int *intval, const char *key)
 {
-  return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
+  return admin_get(intval, key, DB_TYPE_INT);
 }
 
-static int
-queue_fix_pos(enum sort_type sort, int queue_version)
+int
+db_admin_getint64(int64_t *int64val, const char *key)
 {
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
+  return admin_get(int64val, key, DB_TYPE_INT64);
+}
 
-  struct query_params qp;
-  struct db_queue_item queue_item;
+int
+db_admin_delete(const char *key)
+{
+#define Q_TMPL "DELETE FROM admin WHERE key='%q';"
   char *query;
-  int pos;
-  int ret;
-
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.sort = sort;
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    {
-      return -1;
-    }
 
-  pos = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
-    {
-      if (queue_item.pos != pos)
-        {
-	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
-	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+  query = sqlite3_mprintf(Q_TMPL, key);
 
-	  ret = db_query_run(query, 1, 0);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
-	      break;
-	    }
-	}
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
-      pos++;
-    }
+/* Speakers */
+int
+db_speaker_save(struct output_device *device)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume, name, auth_key) VALUES (%" PRIi64 ", %d, %d, %Q, %Q);"
+  char *query;
 
-  db_query_end(&qp);
-  return ret;
+  query = sqlite3_mprintf(Q_TMPL, device->id, device->selected, device->volume, device->name, device->auth_key);
 
+  return db_query_run(query, 1, 0);
 #undef Q_TMPL
 }
 
-/*
- * Remove files that are disabled or non existent in the library and repair ordering of
- * the queue (shuffle and normal)
- */
 int
-db_queue_cleanup()
+db_speaker_get(struct output_device *device, uint64_t id)
 {
-#define Q_TMPL "DELETE FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
-
-  int queue_version;
-  int deleted;
+#define Q_TMPL "SELECT s.selected, s.volume, s.name, s.auth_key FROM speakers s WHERE s.id = %" PRIi64 ";"
+  sqlite3_stmt *stmt;
+  char *query;
   int ret;
 
-  queue_version = queue_transaction_begin();
-
-  ret = db_query_run(Q_TMPL, 0, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  deleted = sqlite3_changes(hdl);
-  if (deleted <= 0)
+  query = sqlite3_mprintf(Q_TMPL, id);
+  if (!query)
     {
-      // Nothing to do
-      db_transaction_end();
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  // Update position of normal queue
-  ret = queue_fix_pos(S_POS, queue_version);
-  if (ret < 0)
-    goto end_transaction;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  // Update position of shuffle queue
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      ret = -1;
+      goto out;
+    }
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_finalize(stmt);
+      ret = -1;
+      goto out;
+    }
+
+  device->id = id;
+  device->selected = sqlite3_column_int(stmt, 0);
+  device->volume = sqlite3_column_int(stmt, 1);
+
+  free(device->name);
+  device->name = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+
+  free(device->auth_key);
+  device->auth_key = safe_strdup((char *)sqlite3_column_text(stmt, 3));
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
 
+  ret = 0;
+
+ out:
+  sqlite3_free(query);
   return ret;
 
 #undef Q_TMPL
 }
 
+
+/* Queue */
+
 /*
- * Removes all items from the queue except the item give by 'keep_item_id' (if 'keep_item_id' > 0).
- *
- * @param keep_item_id item-id (e. g. the now playing item) to be left in the queue
+ * Start a new transaction for modifying the queue. Returns the new queue version for the following changes.
+ * After finishing all queue modifications 'queue_transaction_end' needs to be called.
  */
-int
-db_queue_clear(uint32_t keep_item_id)
+static int
+queue_transaction_begin()
 {
-  int queue_version;
-  char *query;
-  int ret;
-
-  queue_version = queue_transaction_begin();
-
-  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
-  ret = db_query_run(query, 1, 0);
+  int queue_version = 0;
 
-  if (ret == 0 && keep_item_id)
-    {
-      query = sqlite3_mprintf("UPDATE queue SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", queue_version, keep_item_id);
-      ret = db_query_run(query, 1, 0);
-    }
+  db_transaction_begin();
 
-  queue_transaction_end(ret, queue_version);
+  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
+  queue_version++;
 
-  return ret;
+  return queue_version;
 }
 
-static int
-queue_delete_item(struct db_queue_item *qi, int queue_version)
+/*
+ * If retval == 0, updates the version of the queue in the admin table, commits the transaction
+ * and notifies listener of LISTENER_QUEUE about the changes.
+ * If retval < 0, rollsback the transaction.
+ *
+ * This function must be called after modifying the queue.
+ *
+ * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
+ * @param queue_version The new queue version, for the pending modifications
+ */
+static void
+queue_transaction_end(int retval, int queue_version)
 {
-  char *query;
   int ret;
 
-  // Remove item with the given item_id
-  query = sqlite3_mprintf("DELETE FROM queue where id = %d;", qi->id);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    {
-      return -1;
-    }
+  if (retval < 0)
+    goto error;
 
-  // Update pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, qi->pos);
-  ret = db_query_run(query, 1, 0);
+  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
   if (ret < 0)
-    {
-      return -1;
-    }
+    goto error;
 
-  // Update shuffle_pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, qi->shuffle_pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    {
-      return -1;
-    }
+  db_transaction_end();
 
-  return 0;
+  // Invalidates the in-memory copy, must be after the commit
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_mirror.lck));
+  db_queue_mirror.changes++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+
+  listener_notify(LISTENER_QUEUE);
+  return;
+
+ error:
+  db_transaction_rollback();
 }
 
-int
-db_queue_delete_byitemid(uint32_t item_id)
+static int
+queue_reshuffle(uint32_t item_id, int queue_version);
+
+static int
+queue_item_add(struct db_queue_item *qi)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  fixup_tags_qi(qi);
 
-  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
+  ret = bind_qi(db_statements.queue_items_insert, qi);
+  if (ret < 0)
+    return -1;
 
+  // Do not update events here, only caller knows if more items will be added
+  ret = db_statement_run(db_statements.queue_items_insert, 0);
   if (ret < 0)
-    goto end_transaction;
+    return -1;
 
-  if (queue_item.id == 0)
+  ret = (int)sqlite3_last_insert_rowid(hdl);
+  if (ret == 0)
     {
-      db_transaction_end();
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
+      return -1;
     }
 
-  ret = queue_delete_item(&queue_item, queue_version);
-
- end_transaction:
-  queue_transaction_end(ret, queue_version);
-
   return ret;
 }
 
-int
-db_queue_delete_bypos(uint32_t pos, int count)
+static int
+queue_item_update(struct db_queue_item *qi)
 {
-  int queue_version;
-  char *query;
-  int to_pos;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  fixup_tags_qi(qi);
 
-  // Remove item with the given item_id
-  to_pos = pos + count;
-  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d;", pos, to_pos);
-  ret = db_query_run(query, 1, 0);
+  ret = bind_qi(db_statements.queue_items_update, qi);
   if (ret < 0)
-    goto end_transaction;
+    return -1;
 
-  ret = queue_fix_pos(S_POS, queue_version);
+  // Do not update events here, only caller knows if more items will be updated
+  ret = db_statement_run(db_statements.queue_items_update, 0);
   if (ret < 0)
-    goto end_transaction;
-
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
-
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+    return -1;
 
-  return ret;
+  return qi->id;
 }
 
-int
-db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle)
+void
+db_queue_item_from_mfi(struct db_queue_item *qi, struct media_file_info *mfi)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  int ret;
-
-  queue_version = queue_transaction_begin();
+  int i;
 
-  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+  memset(qi, 0, sizeof(struct db_queue_item));
 
-  if (queue_item.id == 0)
+  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
     {
-      // No item found
-      db_transaction_end();
-      return 0;
+      if (qi_mfi_map[i].mfi_offset < 0)
+	continue;
+
+      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, mfi, qi_mfi_map[i].mfi_offset, true, false);
     }
 
-  ret = queue_delete_item(&queue_item, queue_version);
+  if (!qi->file_id)
+    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
+}
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+void
+db_queue_item_from_dbmfi(struct db_queue_item *qi, struct db_media_file_info *dbmfi)
+{
+  int i;
 
-  return ret;
+  memset(qi, 0, sizeof(struct db_queue_item));
+
+  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+    {
+      if (qi_mfi_map[i].dbmfi_offset < 0)
+	continue;
+
+      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, dbmfi, qi_mfi_map[i].dbmfi_offset, false, true);
+    }
+
+  if (!qi->file_id)
+    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
 }
 
 /*
- * Moves the queue item with the given id to the given position (zero-based).
+ * Inserts the files from a files query (Q_ITEMS, Q_PLITEMS or Q_GROUP_ITEMS)
+ * straight into the queue with a single INSERT ... SELECT. The items get the
+ * positions from pos and shuffle_pos onwards in the order of the query, which
+ * is numbered by the query's rownum column.
  *
- * @param item_id Queue item id
- * @param pos_to target position in the queue (zero-based)
- * @þaram shuffle If 1 move item in the shuffle queue
- * @return 0 on success, -1 on failure
+ * @return Number of items added, -1 on failure
  */
-int
-db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
+static int
+queue_add_from_query(struct query_params *qp, int queue_version, int pos, int shuffle_pos)
 {
-  int queue_version;
+  sqlite3_stmt *stmt;
+  char keystr[2048];
+  char valstr[2048];
+  char *select;
   char *query;
-  int pos_from;
+  char *ptr;
+  int idx;
   int ret;
+  int i;
+  int j;
 
-  queue_version = queue_transaction_begin();
-
-  // Find item with the given item_id
-  pos_from = db_queue_get_pos(item_id, shuffle);
-  if (pos_from < 0)
+  if (qp->type != Q_ITEMS && qp->type != Q_PLITEMS && qp->type != Q_GROUP_ITEMS)
     {
-      ret = -1;
-      goto end_transaction;
+      DPRINTF(E_LOG, L_DB, "Bug! Unsupported query type %d for adding to queue\n", qp->type);
+      return -1;
     }
 
-  // Update pos for all items after the item with given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, pos_from);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, pos_from);
+  memset(keystr, 0, sizeof(keystr));
+  memset(valstr, 0, sizeof(valstr));
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      if (qi_cols_map[i].flag & DB_FLAG_NO_BIND)
+	continue;
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+      CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, ", qi_cols_map[i].name));
 
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
+      if (qi_cols_map[i].offset == qi_offsetof(queue_version))
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), ":queue_version, "));
+	  continue;
+	}
+      else if (qi_cols_map[i].offset == qi_offsetof(pos))
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), ":pos + f.rownum - 1, "));
+	  continue;
+	}
+      else if (qi_cols_map[i].offset == qi_offsetof(shuffle_pos))
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), ":shuffle_pos + f.rownum - 1, "));
+	  continue;
+	}
+      else if (qi_mfi_map[i].mfi_offset < 0)
+	{
+	  CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "%s, ", (qi_cols_map[i].type == DB_TYPE_STRING) ? "NULL" : "0"));
+	  continue;
+	}
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+      for (j = 0; j < ARRAY_SIZE(mfi_cols_map); j++)
+	{
+	  if (mfi_cols_map[j].offset == qi_mfi_map[i].mfi_offset)
+	    break;
+	}
 
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
+      if (j == ARRAY_SIZE(mfi_cols_map))
+	{
+	  DPRINTF(E_LOG, L_DB, "Bug! Queue column '%s' not found in files table\n", qi_cols_map[i].name);
+	  return -1;
+	}
 
-  ret = db_query_run(query, 1, 0);
+      CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "f.%s, ", mfi_cols_map[j].name));
+    }
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  // Terminate at the ending ", "
+  *(strrchr(keystr, ',')) = '\0';
+  *(strrchr(valstr, ',')) = '\0';
+
+  // We don't need the count of the query, the insert tells us
+  qp->skip_count = 1;
+  qp->with_rownum = 1;
+
+  select = db_build_query(qp);
+  qp->with_rownum = 0;
+  if (!select)
+    return -1;
+
+  ptr = strrchr(select, ';');
+  if (ptr)
+    *ptr = '\0';
+
+  query = sqlite3_mprintf("INSERT INTO queue (%s) SELECT %s FROM (%s) f ORDER BY f.rownum;", keystr, valstr, select);
+  sqlite3_free(select);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = stmt_cache_prepare(query, &stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  ret = stmt_bind_query_params(stmt, qp);
+  if (ret == SQLITE_OK && (idx = sqlite3_bind_parameter_index(stmt, ":queue_version")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, queue_version);
+  if (ret == SQLITE_OK && (idx = sqlite3_bind_parameter_index(stmt, ":pos")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, pos);
+  if (ret == SQLITE_OK && (idx = sqlite3_bind_parameter_index(stmt, ":shuffle_pos")) > 0)
+    ret = sqlite3_bind_int(stmt, idx, shuffle_pos);
+  if (ret != SQLITE_OK)
+    {
+      stmt_cache_release(stmt);
+      return -1;
+    }
+
+  ret = db_statement_run(stmt, 0);
+  stmt_cache_release(stmt);
 
   return ret;
 }
 
 /*
- * Moves the queue item at the given position to the given position (zero-based).
+ * Same as queue_add_from_query(), but inserts the files one by one, for sqlite
+ * versions that don't have the window functions needed for the rownum column.
  *
- * @param pos_from Position of the queue item to move
- * @param pos_to target position in the queue (zero-based)
- * @return 0 on success, -1 on failure
+ * @return Number of items added, -1 on failure
  */
-int
-db_queue_move_bypos(int pos_from, int pos_to)
+static int
+queue_add_from_query_rows(struct query_params *qp, int queue_version, int pos, int shuffle_pos)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  char *query;
+  struct db_media_file_info dbmfi;
+  struct db_queue_item qi;
+  int added;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  qp->skip_count = 1;
 
-  // Find item to move
-  ret = queue_fetch_bypos(pos_from, 0, &queue_item, 0);
+  ret = db_query_start(qp);
   if (ret < 0)
-    goto end_transaction;
+    return -1;
 
-  if (queue_item.id == 0)
+  added = 0;
+  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
     {
-      db_transaction_end();
-      return 0;
+      // No allocations, just the struct content is copied
+      db_queue_item_from_dbmfi(&qi, &dbmfi);
+
+      // No tag fixup, we can't touch the strings in qi, plus must assume dbmfi has proper tags
+
+      qi.pos = pos + added;
+      qi.shuffle_pos = shuffle_pos + added;
+      qi.queue_version = queue_version;
+
+      ret = bind_qi(db_statements.queue_items_insert, &qi);
+      if (ret < 0)
+	break;
+
+      // Do not update events here, only caller knows if more items will be added
+      ret = db_statement_run(db_statements.queue_items_insert, 0);
+      if (ret < 0)
+	{
+	  DPRINTF(E_DBG, L_DB, "Failed to add song id %s (%s)\n", dbmfi.id, dbmfi.title);
+	  break;
+	}
+
+      added++;
     }
 
-  // Update pos for all items after the item with given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  db_query_end(qp);
 
-  // Update pos for all items from the given pos_to
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-  ret = db_query_run(query, 1, 0);
   if (ret < 0)
-    goto end_transaction;
+    return -1;
 
-  // Update item with the given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, queue_item.id);
-  ret = db_query_run(query, 1, 0);
+  return added;
+}
 
- end_transaction:
+int
+db_queue_item_update(struct db_queue_item *qi)
+{
+  int queue_version;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  qi->queue_version = queue_version;
+
+  ret = queue_item_update(qi);
+
+  // MPD changes playlist version when metadata changes, also makes LISTENER_QUEUE
   queue_transaction_end(ret, queue_version);
 
   return ret;
 }
 
 /*
- * Moves the queue item at the given position to the given target position. The positions
- * are relavtive to the given base item (item id).
+ * Adds the files matching the given query to the queue after the item with the given item id
  *
- * @param from_pos Relative position of the queue item to the base item
- * @param to_offset Target position relative to the base item
- * @param item_id The base item id (normaly the now playing item)
+ * The files table is queried with the given parameters and all found files are added after the
+ * item with the given item id to the "normal" queue. They are appended to end of the shuffled queue
+ * (assuming that the shuffled queue will get reshuffled after adding new items).
+ *
+ * The function returns -1 on failure (e. g. error reading from database) and if the given item id
+ * does not exist. It wraps all database access in a transaction and performs a rollback if an error
+ * occurs, leaving the queue in a consistent state.
+ *
+ * @param qp Query parameters for the files table
+ * @param item_id Files are added after item with this id
  * @return 0 on success, -1 on failure
  */
 int
-db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_t item_id, char shuffle)
+db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  char *query;
-  int pos_move_from;
-  int pos_move_to;
+  int pos;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  // Position of the first new item
+  pos = db_queue_get_pos(item_id, 0);
+  if (pos < 0)
+    {
+      return -1;
+    }
+  pos++;
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: from %d offset %d relative to item (%d)\n", from_pos, to_offset, item_id);
+  ret = db_queue_add_by_query(qp, 0, 0, pos, NULL, NULL);
+  return ret;
+}
 
-  // Find item with the given item_id
-  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+int
+db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
+{
+  uint32_t queue_count;
+  int ret;
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: base item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
+  memset(queue_add_info, 0, sizeof(struct db_queue_add_info));
+  queue_add_info->queue_version = queue_transaction_begin();
 
-  if (queue_item.id == 0)
+  ret = db_queue_get_count(&queue_count);
+  if (ret < 0)
     {
-      db_transaction_end();
-      return 0;
+      ret = -1;
+      queue_transaction_end(ret, queue_add_info->queue_version);
+      return ret;
     }
 
-  // Calculate the position of the item to move
-  if (shuffle)
-    pos_move_from = queue_item.shuffle_pos + from_pos;
-  else
-    pos_move_from = queue_item.pos + from_pos;
+  queue_add_info->pos = queue_count;
+  queue_add_info->shuffle_pos = queue_count;
 
-  // Calculate the position where to move the item to
-  if (shuffle)
-    pos_move_to = queue_item.shuffle_pos + to_offset;
-  else
-    pos_move_to = queue_item.pos + to_offset;
+  if (pos >= 0 && pos < queue_count)
+    queue_add_info->pos = pos;
 
-  if (pos_move_to < pos_move_from)
-    {
-      /*
-       * Moving an item to a previous position seems to send an offset incremented by one
-       */
-      pos_move_to++;
-    }
+  queue_add_info->start_pos = queue_add_info->pos;
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: absolute pos: move from %d to %d\n", pos_move_from, pos_move_to);
+  return 0;
+}
 
-  // Find item to move
-  ret = queue_fetch_bypos(pos_move_from, shuffle, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+int
+db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint32_t item_id, int ret)
+{
+  char *query;
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: move item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
+  // Update pos for all items from the given position
+  if (ret == 0)
+    {
+      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND queue_version < %d;",
+			      queue_add_info->count, queue_add_info->queue_version, queue_add_info->start_pos, queue_add_info->queue_version);
+      ret = db_query_run(query, 1, 0);
+    }
 
-  if (queue_item.id == 0)
+  // Reshuffle after adding new items
+  if (ret == 0 && reshuffle)
     {
-      db_transaction_end();
-      return 0;
+      ret = queue_reshuffle(item_id, queue_add_info->queue_version);
     }
 
-  // Update pos for all items after the item with given position
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item.shuffle_pos);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
+  queue_transaction_end(ret, queue_add_info->queue_version);
+  return ret;
+}
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+int
+db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item *qi)
+{
+  int ret;
 
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_move_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_move_to);
+  qi->pos = queue_add_info->pos;
+  qi->shuffle_pos = queue_add_info->shuffle_pos;
+  qi->queue_version = queue_add_info->queue_version;
 
-  ret = db_query_run(query, 1, 0);
+  ret = queue_item_add(qi);
   if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
+    return ret;
 
-  ret = db_query_run(query, 1, 0);
+  queue_add_info->pos++;
+  queue_add_info->shuffle_pos++;
+  queue_add_info->count++;
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  if (queue_add_info->new_item_id == 0)
+    queue_add_info->new_item_id = ret;
 
   return ret;
 }
 
 /*
- * Reshuffles the shuffle queue
+ * Adds the files matching the given query to the queue
  *
- * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
- * queue is reshuffled after the item with the given id (excluding this item).
+ * The files table is queried with the given parameters and all found files are added to the end of the
+ * "normal" queue and the shuffled queue.
  *
- * @param item_id The base item, after this item the queue is reshuffled
+ * The function returns -1 on failure (e. g. error reading from database). It wraps all database access
+ * in a transaction and performs a rollback if an error occurs, leaving the queue in a consistent state.
+ *
+ * @param qp Query parameters for the files table
+ * @param reshuffle If 1 queue will be reshuffled after adding new items
+ * @param item_id The base item id, all items after this will be reshuffled
+ * @param position The position in the queue for the new queue item, -1 to add at end of queue
+ * @param count If not NULL returns the number of items added to the queue
+ * @param new_item_id If not NULL return the queue item id of the first new queue item
  * @return 0 on success, -1 on failure
  */
-static int
-queue_reshuffle(uint32_t item_id, int queue_version)
+int
+db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
 {
   char *query;
+  int queue_version;
+  uint32_t queue_count;
+  int last_id;
+  int first_id;
+  int added;
   int pos;
-  uint32_t count;
-  struct db_queue_item queue_item;
-  int *shuffle_pos;
-  int len;
-  int i;
+  int ret;
+
+  if (new_item_id)
+    *new_item_id = 0;
+  if (count)
+    *count = 0;
+
+  queue_version = queue_transaction_begin();
+
+  ret = db_queue_get_count(&queue_count);
+  if (ret < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  if (position < 0 || position > queue_count)
+    pos = queue_count;
+  else
+    pos = position;
+
+  // Queue ids are autoincremented, so the new items will have ids above this
+  last_id = db_get_one_int("SELECT COALESCE(MAX(id), 0) FROM queue;");
+  if (last_id < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  // The rownum column of the single insert needs window functions (sqlite 3.25)
+  if (sqlite3_libversion_number() >= 3025000)
+    added = queue_add_from_query(qp, queue_version, pos, queue_count);
+  else
+    added = queue_add_from_query_rows(qp, queue_version, pos, queue_count);
+  if (added < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Player queue query added %d items\n", added);
+
+  if (added == 0)
+    {
+      db_transaction_end();
+      return 0;
+    }
+
+  // Make room for the new items in the queue
+  if (pos < queue_count)
+    {
+      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND id <= %d;", added, queue_version, pos, last_id);
+      ret = db_query_run(query, 1, 0);
+      if (ret < 0)
+	goto end_transaction;
+    }
+
+  query = sqlite3_mprintf("SELECT id FROM queue WHERE pos = %d AND id > %d;", pos, last_id);
+  first_id = db_get_one_int(query);
+  sqlite3_free(query);
+  if (first_id < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  if (new_item_id)
+    *new_item_id = first_id;
+  if (count)
+    *count = added;
+
+  // Reshuffle after adding new items
+  if (reshuffle)
+    {
+      ret = queue_reshuffle(item_id, queue_version);
+    }
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Adds the items of the stored playlist with the given id to the end of the queue
+ *
+ * @param plid Id of the stored playlist
+ * @param reshuffle If 1 queue will be reshuffled after adding new items
+ * @param item_id The base item id, all items after this will be reshuffled
+ * @param position The position in the queue for the new queue item, -1 to add at end of queue
+ * @param count If not NULL returns the number of items added to the queue
+ * @param new_item_id If not NULL return the queue item id of the first new queue item
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_add_by_playlistid(int plid, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
+{
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+
+  qp.id = plid;
+  qp.type = Q_PLITEMS;
+
+  ret = db_queue_add_by_query(&qp, reshuffle, item_id, position, count, new_item_id);
+
+  return ret;
+}
+
+/*
+ * Adds the file with the given id to the queue
+ *
+ * @param id Id of the file
+ * @param reshuffle If 1 queue will be reshuffled after adding new items
+ * @param item_id The base item id, all items after this will be reshuffled
+ * @param position The position in the queue for the new queue item, -1 to add at end of queue
+ * @param count If not NULL returns the number of items added to the queue
+ * @param new_item_id If not NULL return the queue item id of the first new queue item
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_add_by_fileid(int id, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
+{
   struct query_params qp;
+  char buf[124];
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
+  memset(&qp, 0, sizeof(struct query_params));
+
+  qp.type = Q_ITEMS;
+  snprintf(buf, sizeof(buf), "f.id = %" PRIu32, id);
+  qp.filter = buf;
+
+  ret = db_queue_add_by_query(&qp, reshuffle, item_id, position, count, new_item_id);
+
+  return ret;
+}
+
+static int
+queue_enum_start(struct query_params *qp)
+{
+#define Q_TMPL "SELECT * FROM queue f WHERE %s ORDER BY %s;"
+  sqlite3_stmt *stmt;
+  char *query;
+  const char *orderby;
+  int ret;
+
+  qp->stmt = NULL;
+
+  if (qp->sort)
+    orderby = sort_clause[qp->sort];
+  else
+    orderby = sort_clause[S_POS];
+
+  if (qp->filter)
+    query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
+  else
+    query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  qp->stmt = stmt;
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+static inline char *
+strdup_if(char *str, int cond)
+{
+  if (str == NULL)
+    return NULL;
+
+  if (cond)
+    return strdup(str);
+
+  return str;
+}
+
+static int
+queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_strdup)
+{
+  int ret;
+  int i;
+
+  memset(qi, 0, sizeof(struct db_queue_item));
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Queue enum not started!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of queue enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      struct_field_from_statement(qi, qi_cols_map[i].offset, qi_cols_map[i].type, qp->stmt, i, must_strdup, false);
+    }
+
+  return 0;
+}
+
+int
+db_queue_enum_start(struct query_params *qp)
+{
+  int ret;
+
+  db_transaction_begin();
+
+  ret = queue_enum_start(qp);
+
+  if (ret < 0)
+    db_transaction_rollback();
+
+  return ret;
+}
+
+void
+db_queue_enum_end(struct query_params *qp)
+{
+  db_query_end(qp);
+  db_transaction_end();
+}
+
+int
+db_queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi)
+{
+  return queue_enum_fetch(qp, qi, 0);
+}
+
+/* Queue mirror
+ *
+ * The player, DACP and MPD look up queue items (current, next, by position) all
+ * the time, while the queue only changes when a user edits it. So the read
+ * functions below are served from an in-memory copy of the queue, which is
+ * indexed by position, shuffle position and item id. The queue table remains
+ * the authoritative store: all changes are made there (in a queue transaction),
+ * and queue_transaction_end() invalidates the copy after the commit, so that the
+ * next read builds a new one, see queue_mirror_lock(). A thread that is inside a
+ * transaction (e.g. the one changing the queue) or a read snapshot bypasses the
+ * copy and reads the table.
+ */
+enum queue_mirror_key
+{
+  QM_ITEMID,
+  QM_FILEID,
+  QM_POS,
+  QM_POS_RELATIVE,
+};
+
+static void
+queue_mirror_free(struct db_queue_copy *copy)
+{
+  int i;
+
+  if (!copy)
+    return;
+
+  for (i = 0; i < copy->nitems; i++)
+    free_queue_item(&copy->items[i], 1);
+
+  free(copy->items);
+  free(copy->shuffle);
+  free(copy->slots);
+  free(copy);
+}
+
+// The items being sorted by queue_mirror_build(), qsort() has no context argument
+static __thread struct db_queue_item *queue_mirror_sort_items;
+
+static int
+queue_mirror_shuffle_cmp(const void *a, const void *b)
+{
+  const struct db_queue_item *qa = &queue_mirror_sort_items[*(const int *)a];
+  const struct db_queue_item *qb = &queue_mirror_sort_items[*(const int *)b];
+
+  if (qa->shuffle_pos != qb->shuffle_pos)
+    return (qa->shuffle_pos < qb->shuffle_pos) ? -1 : 1;
+
+  return (qa->pos < qb->pos) ? -1 : (qa->pos > qb->pos);
+}
+
+// Reads the queue table into a new copy. Called without the mirror lock, so
+// other threads are not blocked by the query.
+static struct db_queue_copy *
+queue_mirror_build(uint64_t version)
+{
+  struct query_params qp;
+  struct db_queue_copy *copy;
+  struct db_queue_item *items;
+  struct db_queue_item *tmp;
+  uint32_t h;
+  int size;
+  int n;
+  int i;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.sort = S_POS;
+
+  db_transaction_begin();
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      db_transaction_end();
+      return NULL;
+    }
+
+  items = NULL;
+  size = 0;
+  n = 0;
+  while (1)
+    {
+      if (n == size)
+	{
+	  size = size ? 2 * size : 256;
+	  CHECK_NULL(L_DB, tmp = realloc(items, size * sizeof(struct db_queue_item)));
+	  items = tmp;
+	}
+
+      ret = queue_enum_fetch(&qp, &items[n], 1);
+      if (ret < 0 || items[n].id == 0)
+	break;
+
+      n++;
+    }
+
+  db_query_end(&qp);
+  db_transaction_end();
+
+  CHECK_NULL(L_DB, copy = calloc(1, sizeof(struct db_queue_copy)));
+  copy->items = items;
+  copy->nitems = n;
+
+  if (ret < 0)
+    {
+      queue_mirror_free(copy);
+      return NULL;
+    }
+
+  CHECK_NULL(L_DB, copy->shuffle = malloc((n + 1) * sizeof(int)));
+  for (i = 0; i < n; i++)
+    copy->shuffle[i] = i;
+
+  queue_mirror_sort_items = items;
+  qsort(copy->shuffle, n, sizeof(int), queue_mirror_shuffle_cmp);
+  queue_mirror_sort_items = NULL;
+
+  for (copy->nslots = 16; copy->nslots < 2 * n; copy->nslots *= 2)
+    ; /* EMPTY */
+
+  CHECK_NULL(L_DB, copy->slots = calloc(copy->nslots, sizeof(struct db_queue_mirror_slot)));
+  for (i = 0; i < n; i++)
+    {
+      h = items[i].id & (copy->nslots - 1);
+      while (copy->slots[h].item_id)
+	h = (h + 1) & (copy->nslots - 1);
+
+      copy->slots[h].item_id = items[i].id;
+      copy->slots[h].idx = i;
+    }
+
+  copy->version = version;
+
+  DPRINTF(E_DBG, L_DB, "Rebuilt in-memory queue with %d items\n", n);
+
+  return copy;
+}
+
+/*
+ * Takes the mirror lock and makes sure the copy is current. If it isn't, a new
+ * copy is built without holding the lock and then swapped in. Threads that need
+ * the copy while another one is building it read from the table instead of
+ * waiting.
+ *
+ * @return 0 with the lock held, -1 (lock not held) if the caller must read from
+ *         the table
+ */
+static int
+queue_mirror_lock(void)
+{
+  struct db_queue_copy *copy;
+  uint64_t version;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_mirror.lck));
+
+  if (db_queue_mirror.copy && db_queue_mirror.copy->version == db_queue_mirror.changes)
+    return 0;
+
+  if (db_queue_mirror.building)
+    {
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+      return -1;
+    }
+
+  // The table is read after this, so the copy has at least these changes
+  version = db_queue_mirror.changes;
+  db_queue_mirror.building = true;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+
+  copy = queue_mirror_build(version);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_mirror.lck));
+
+  db_queue_mirror.building = false;
+  if (copy)
+    {
+      // Lookups only use the copy while holding the lock, so the old one can go
+      queue_mirror_free(db_queue_mirror.copy);
+      db_queue_mirror.copy = copy;
+    }
+
+  // Also if the queue changed again while the copy was being built
+  if (!copy || copy->version != db_queue_mirror.changes)
+    {
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+queue_mirror_idx_byitemid(struct db_queue_copy *copy, uint32_t item_id)
+{
+  uint32_t h;
+
+  h = item_id & (copy->nslots - 1);
+  while (copy->slots[h].item_id)
+    {
+      if (copy->slots[h].item_id == item_id)
+	return copy->slots[h].idx;
+
+      h = (h + 1) & (copy->nslots - 1);
+    }
+
+  return -1;
+}
+
+static int
+queue_mirror_idx_bypos(struct db_queue_copy *copy, int pos, char shuffle)
+{
+  struct db_queue_item *qi;
+  int low;
+  int high;
+  int mid;
+
+  if (pos < 0)
+    return -1;
+
+  // Positions are normally without gaps, so try the direct index first
+  if (pos < copy->nitems)
+    {
+      qi = &copy->items[shuffle ? copy->shuffle[pos] : pos];
+      if ((shuffle ? qi->shuffle_pos : qi->pos) == pos)
+	return shuffle ? copy->shuffle[pos] : pos;
+    }
+
+  low = 0;
+  high = copy->nitems - 1;
+  while (low <= high)
+    {
+      mid = low + (high - low) / 2;
+      qi = &copy->items[shuffle ? copy->shuffle[mid] : mid];
+
+      if ((shuffle ? qi->shuffle_pos : qi->pos) == pos)
+	return shuffle ? copy->shuffle[mid] : mid;
+      else if ((shuffle ? qi->shuffle_pos : qi->pos) < pos)
+	low = mid + 1;
+      else
+	high = mid - 1;
+    }
+
+  return -1;
+}
+
+static void
+queue_mirror_item_copy(struct db_queue_item *dst, struct db_queue_item *src, int with_metadata)
+{
+  char **strptr;
+  int i;
+
+  memcpy(dst, src, sizeof(struct db_queue_item));
+
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      if (qi_cols_map[i].type != DB_TYPE_STRING)
+	continue;
+
+      strptr = (char **)((char *)dst + qi_cols_map[i].offset);
+      *strptr = with_metadata ? safe_strdup(*strptr) : NULL;
+    }
+}
+
+/*
+ * Looks up a queue item in the in-memory copy. Depending on the key, arg is an
+ * item id, a file id, or a (shuffle) position, which is relative to the item
+ * with item_id for QM_POS_RELATIVE. If with_metadata is 0 only the numeric
+ * fields are copied to qi. Like queue_fetch_xxx(), qi->id is 0 if the item was
+ * not found.
+ *
+ * @return 0 if the lookup was done, -1 if the caller must read from the table
+ */
+static int
+queue_mirror_fetch(enum queue_mirror_key key, int arg, uint32_t item_id, char shuffle, struct db_queue_item *qi, int with_metadata)
+{
+  struct db_queue_copy *copy;
+  struct db_queue_item *base;
+  int idx;
+  int ret;
+  int i;
+
+  if (db_read_conn || !sqlite3_get_autocommit(hdl))
+    return -1;
+
+  memset(qi, 0, sizeof(struct db_queue_item));
+
+  ret = queue_mirror_lock();
+  if (ret < 0)
+    return -1;
+
+  copy = db_queue_mirror.copy;
+
+  idx = -1;
+  switch (key)
+    {
+      case QM_ITEMID:
+	idx = queue_mirror_idx_byitemid(copy, arg);
+	break;
+
+      case QM_FILEID:
+	for (i = 0; i < copy->nitems; i++)
+	  {
+	    if (copy->items[i].file_id == arg)
+	      {
+		idx = i;
+		break;
+	      }
+	  }
+	break;
+
+      case QM_POS:
+	idx = queue_mirror_idx_bypos(copy, arg, shuffle);
+	break;
+
+      case QM_POS_RELATIVE:
+	idx = queue_mirror_idx_byitemid(copy, item_id);
+	if (idx < 0)
+	  break;
+
+	base = &copy->items[idx];
+	idx = queue_mirror_idx_bypos(copy, (shuffle ? base->shuffle_pos : base->pos) + arg, shuffle);
+	break;
+    }
+
+  if (idx >= 0)
+    queue_mirror_item_copy(qi, &copy->items[idx], with_metadata);
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+
+  return 0;
+}
+
+static int
+queue_mirror_count(uint32_t *nitems)
+{
+  int ret;
+
+  if (db_read_conn || !sqlite3_get_autocommit(hdl))
+    return -1;
+
+  ret = queue_mirror_lock();
+  if (ret < 0)
+    return -1;
+
+  *nitems = db_queue_mirror.copy->nitems;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+
+  return 0;
+}
+
+int
+db_queue_get_pos(uint32_t item_id, char shuffle)
+{
+#define Q_TMPL "SELECT pos FROM queue WHERE id = %d;"
+#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE id = %d;"
+
+  struct db_queue_item qi;
+  char *query;
+  int pos;
+  int ret;
+
+  ret = queue_mirror_fetch(QM_ITEMID, item_id, 0, 0, &qi, 0);
+  if (ret == 0)
+    return qi.id ? (int)(shuffle ? qi.shuffle_pos : qi.pos) : -1;
+
+  if (shuffle)
+    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, item_id);
+  else
+    query = sqlite3_mprintf(Q_TMPL, item_id);
+
+  pos = db_get_one_int(query);
+
+  sqlite3_free(query);
+
+  return pos;
+
+#undef Q_TMPL
+#undef Q_TMPL_SHUFFLE
+}
+
+static int
+queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *qi, int with_metadata)
+{
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.filter = sqlite3_mprintf("id = %d", item_id);
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      sqlite3_free(qp.filter);
+      return -1;
+    }
+
+  ret = queue_enum_fetch(&qp, qi, with_metadata);
+  db_query_end(&qp);
+  sqlite3_free(qp.filter);
+  return ret;
+}
+
+struct db_queue_item *
+db_queue_fetch_byitemid(uint32_t item_id)
+{
+  struct db_queue_item *qi;
+  int ret;
+
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  ret = queue_mirror_fetch(QM_ITEMID, item_id, 0, 0, qi, 1);
+  if (ret < 0)
+    {
+      db_transaction_begin();
+      ret = queue_fetch_byitemid(item_id, qi, 1);
+      db_transaction_end();
+    }
+
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by item id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // No item found
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  return qi;
+}
+
+struct db_queue_item *
+db_queue_fetch_byfileid(uint32_t file_id)
+{
+  struct db_queue_item *qi;
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  ret = queue_mirror_fetch(QM_FILEID, file_id, 0, 0, qi, 1);
+  if (ret == 0)
+    goto out;
+
+  db_transaction_begin();
+
+  qp.filter = sqlite3_mprintf("file_id = %d", file_id);
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      sqlite3_free(qp.filter);
+      db_transaction_end();
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
+      return NULL;
+    }
+
+  ret = queue_enum_fetch(&qp, qi, 1);
+  db_query_end(&qp);
+  sqlite3_free(qp.filter);
+  db_transaction_end();
+
+ out:
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // No item found
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  return qi;
+}
+
+static int
+queue_fetch_bypos(uint32_t pos, char shuffle, struct db_queue_item *qi, int with_metadata)
+{
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  if (shuffle)
+    qp.filter = sqlite3_mprintf("shuffle_pos = %d", pos);
+  else
+    qp.filter = sqlite3_mprintf("pos = %d", pos);
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      sqlite3_free(qp.filter);
+      return -1;
+    }
+
+  ret = queue_enum_fetch(&qp, qi, with_metadata);
+  db_query_end(&qp);
+  sqlite3_free(qp.filter);
+  return ret;
+}
+
+struct db_queue_item *
+db_queue_fetch_bypos(uint32_t pos, char shuffle)
+{
+  struct db_queue_item *qi;
+  int ret;
+
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  ret = queue_mirror_fetch(QM_POS, pos, 0, shuffle, qi, 1);
+  if (ret < 0)
+    {
+      db_transaction_begin();
+      ret = queue_fetch_bypos(pos, shuffle, qi, 1);
+      db_transaction_end();
+    }
+
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // No item found
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  return qi;
+}
+
+static int
+queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle, struct db_queue_item *qi, int with_metadata)
+{
+  int pos_absolute;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+
+  pos_absolute = db_queue_get_pos(item_id, shuffle);
+  if (pos_absolute < 0)
+    {
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: item (%d) has absolute pos %d\n", item_id, pos_absolute);
+
+  pos_absolute += pos;
+
+  ret = queue_fetch_bypos(pos_absolute, shuffle, qi, with_metadata);
+
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Error fetching item by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  else
+    DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+
+  return ret;
+}
+
+struct db_queue_item *
+db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
+{
+  struct db_queue_item *qi;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  ret = queue_mirror_fetch(QM_POS_RELATIVE, pos, item_id, shuffle, qi, 1);
+  if (ret < 0)
+    {
+      db_transaction_begin();
+      ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, qi, 1);
+      db_transaction_end();
+    }
+
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos relative to item id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // No item found
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+
+  return qi;
+}
+
+struct db_queue_item *
+db_queue_fetch_next(uint32_t item_id, char shuffle)
+{
+  return db_queue_fetch_byposrelativetoitem(1, item_id, shuffle);
+}
+
+struct db_queue_item *
+db_queue_fetch_prev(uint32_t item_id, char shuffle)
+{
+  return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
+}
+
+/*
+ * Renumbers pos (or shuffle_pos) so there are no gaps, e.g. after items were
+ * deleted. The items before position 'from' must already be in place, only the
+ * ones from there are checked, and only the ones that move are updated.
+ */
+static int
+queue_fix_pos(enum sort_type sort, int from, int queue_version)
+{
+#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
+
+  struct query_params qp;
+  struct db_queue_item queue_item;
+  char *query;
+  int pos;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.sort = sort;
+  qp.filter = sqlite3_mprintf("%s >= %d", (sort == S_SHUFFLE_POS) ? "shuffle_pos" : "pos", from);
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      sqlite3_free(qp.filter);
+      return -1;
+    }
+
+  pos = from;
+  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
+    {
+      if (((sort == S_SHUFFLE_POS) ? queue_item.shuffle_pos : queue_item.pos) != pos)
+        {
+	  if (sort == S_SHUFFLE_POS)
+	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
+	  else
+	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+
+	  ret = db_query_run(query, 1, 0);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
+	      break;
+	    }
+	}
+
+      pos++;
+    }
+
+  db_query_end(&qp);
+  sqlite3_free(qp.filter);
+  return ret;
+
+#undef Q_TMPL
+}
+
+/*
+ * Moves the item with the given id from position 'from' to position 'to' in the
+ * normal or the shuffle queue. Only the items between the two positions change
+ * position, so only those are updated (and get the new queue version).
+ */
+static int
+queue_move_pos(uint32_t item_id, int from, int to, char shuffle, int queue_version)
+{
+#define Q_TMPL "UPDATE queue SET %s = CASE WHEN id = %d THEN %d ELSE %s %s 1 END, queue_version = %d WHERE %s >= %d AND %s <= %d;"
+  const char *col;
+  char *query;
+
+  col = shuffle ? "shuffle_pos" : "pos";
+
+  if (from < to)
+    query = sqlite3_mprintf(Q_TMPL, col, item_id, to, col, "-", queue_version, col, from, col, to);
+  else if (from > to)
+    query = sqlite3_mprintf(Q_TMPL, col, item_id, to, col, "+", queue_version, col, to, col, from);
+  else
+    return 0;
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+/*
+ * Remove files that are disabled or non existent in the library and repair ordering of
+ * the queue (shuffle and normal)
+ */
+int
+db_queue_cleanup()
+{
+#define Q_TMPL "DELETE FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
+
+  int queue_version;
+  int deleted;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  ret = db_query_run(Q_TMPL, 0, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  deleted = sqlite3_changes(hdl);
+  if (deleted <= 0)
+    {
+      // Nothing to do
+      db_transaction_end();
+      return 0;
+    }
+
+  // Update position of normal queue
+  ret = queue_fix_pos(S_POS, 0, queue_version);
+  if (ret < 0)
+    goto end_transaction;
+
+  // Update position of shuffle queue
+  ret = queue_fix_pos(S_SHUFFLE_POS, 0, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+/*
+ * Removes all items from the queue except the item give by 'keep_item_id' (if 'keep_item_id' > 0).
+ *
+ * @param keep_item_id item-id (e. g. the now playing item) to be left in the queue
+ */
+int
+db_queue_clear(uint32_t keep_item_id)
+{
+  int queue_version;
+  char *query;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
+  ret = db_query_run(query, 1, 0);
+
+  if (ret == 0 && keep_item_id)
+    {
+      query = sqlite3_mprintf("UPDATE queue SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", queue_version, keep_item_id);
+      ret = db_query_run(query, 1, 0);
+    }
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+static int
+queue_delete_item(struct db_queue_item *qi, int queue_version)
+{
+  char *query;
+  int ret;
+
+  // Remove item with the given item_id
+  query = sqlite3_mprintf("DELETE FROM queue where id = %d;", qi->id);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    {
+      return -1;
+    }
+
+  // Update pos for all items after the item with given item_id
+  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, qi->pos);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    {
+      return -1;
+    }
+
+  // Update shuffle_pos for all items after the item with given item_id
+  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, qi->shuffle_pos);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    {
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+db_queue_delete_byitemid(uint32_t item_id)
+{
+  int queue_version;
+  struct db_queue_item queue_item;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
+
+  if (ret < 0)
+    goto end_transaction;
+
+  if (queue_item.id == 0)
+    {
+      db_transaction_end();
+      return 0;
+    }
+
+  ret = queue_delete_item(&queue_item, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+int
+db_queue_delete_bypos(uint32_t pos, int count)
+{
+  int queue_version;
+  char *query;
+  int to_pos;
+  int shuffle_from;
+  int deleted;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  to_pos = pos + count;
+
+  // The shuffle queue only needs fixing from the first deleted item on
+  query = sqlite3_mprintf("SELECT MIN(shuffle_pos) FROM queue WHERE pos >= %d AND pos < %d;", pos, to_pos);
+  if (!query)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  shuffle_from = db_get_one_int(query);
+  sqlite3_free(query);
+  if (shuffle_from < 0)
+    shuffle_from = 0;
+
+  // Remove item with the given item_id
+  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d;", pos, to_pos);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  deleted = sqlite3_changes(hdl);
+  if (deleted <= 0)
+    goto end_transaction;
+
+  // The deleted items were consecutive in the normal queue, so the ones after just move up
+  query = sqlite3_mprintf("UPDATE queue SET pos = pos - %d, queue_version = %d WHERE pos >= %d;", deleted, queue_version, to_pos);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  ret = queue_fix_pos(S_SHUFFLE_POS, shuffle_from, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+int
+db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle)
+{
+  int queue_version;
+  struct db_queue_item queue_item;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, &queue_item, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  if (queue_item.id == 0)
+    {
+      // No item found
+      db_transaction_end();
+      return 0;
+    }
+
+  ret = queue_delete_item(&queue_item, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item with the given id to the given position (zero-based).
+ *
+ * @param item_id Queue item id
+ * @param pos_to target position in the queue (zero-based)
+ * @þaram shuffle If 1 move item in the shuffle queue
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
+{
+  int queue_version;
+  int pos_from;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  // Find item with the given item_id
+  pos_from = db_queue_get_pos(item_id, shuffle);
+  if (pos_from < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  ret = queue_move_pos(item_id, pos_from, pos_to, shuffle, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item at the given position to the given position (zero-based).
+ *
+ * @param pos_from Position of the queue item to move
+ * @param pos_to target position in the queue (zero-based)
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_bypos(int pos_from, int pos_to)
+{
+  int queue_version;
+  struct db_queue_item queue_item;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  // Find item to move
+  ret = queue_fetch_bypos(pos_from, 0, &queue_item, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  if (queue_item.id == 0)
+    {
+      db_transaction_end();
+      return 0;
+    }
+
+  ret = queue_move_pos(queue_item.id, queue_item.pos, pos_to, 0, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item at the given position to the given target position. The positions
+ * are relavtive to the given base item (item id).
+ *
+ * @param from_pos Relative position of the queue item to the base item
+ * @param to_offset Target position relative to the base item
+ * @param item_id The base item id (normaly the now playing item)
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_t item_id, char shuffle)
+{
+  int queue_version;
+  struct db_queue_item queue_item;
+  int pos_move_from;
+  int pos_move_to;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: from %d offset %d relative to item (%d)\n", from_pos, to_offset, item_id);
+
+  // Find item with the given item_id
+  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: base item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
+
+  if (queue_item.id == 0)
+    {
+      db_transaction_end();
+      return 0;
+    }
+
+  // Calculate the position of the item to move
+  if (shuffle)
+    pos_move_from = queue_item.shuffle_pos + from_pos;
+  else
+    pos_move_from = queue_item.pos + from_pos;
+
+  // Calculate the position where to move the item to
+  if (shuffle)
+    pos_move_to = queue_item.shuffle_pos + to_offset;
+  else
+    pos_move_to = queue_item.pos + to_offset;
+
+  if (pos_move_to < pos_move_from)
+    {
+      /*
+       * Moving an item to a previous position seems to send an offset incremented by one
+       */
+      pos_move_to++;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: absolute pos: move from %d to %d\n", pos_move_from, pos_move_to);
+
+  // Find item to move
+  ret = queue_fetch_bypos(pos_move_from, shuffle, &queue_item, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: move item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
+
+  if (queue_item.id == 0)
+    {
+      db_transaction_end();
+      return 0;
+    }
+
+  ret = queue_move_pos(queue_item.id, shuffle ? queue_item.shuffle_pos : queue_item.pos, pos_move_to, shuffle, queue_version);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Reshuffles the shuffle queue
+ *
+ * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
+ * queue is reshuffled after the item with the given id (excluding this item).
+ *
+ * @param item_id The base item, after this item the queue is reshuffled
+ * @return 0 on success, -1 on failure
+ */
+static int
+queue_reshuffle(uint32_t item_id, int queue_version)
+{
+#define Q_TMP_CREATE "CREATE TEMP TABLE IF NOT EXISTS queue_shuffle (pos INTEGER PRIMARY KEY, shuffle_pos INTEGER NOT NULL);"
+#define Q_TMP_INSERT "INSERT INTO temp.queue_shuffle (pos, shuffle_pos) VALUES (?, ?);"
+#define Q_TMP_CLEAR "DELETE FROM temp.queue_shuffle;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int pos;
+  uint32_t count;
+  int *shuffle_pos;
+  int len;
+  int i;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
+
+  pos = 0;
+  if (item_id > 0)
+    {
+      pos = db_queue_get_pos(item_id, 0);
+      if (pos < 0)
+	return -1;
+
+      pos++; // Do not reshuffle the base item
+    }
+
+  ret = db_queue_get_count(&count);
+  if (ret < 0)
+    return -1;
+
+  len = count - pos;
+  if (len < 0)
+    len = 0;
+
+  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
+
+  CHECK_NULL(L_DB, shuffle_pos = malloc((len + 1) * sizeof(int)));
+  for (i = 0; i < len; i++)
+    {
+      shuffle_pos[i] = i + pos;
+    }
+
+  shuffle_int(&shuffle_rng, shuffle_pos, len);
+
+  // The new shuffle positions go in a temp table (keyed by pos), so that they
+  // can be applied to the queue with a single update
+  ret = db_query_run(Q_TMP_CREATE, 0, 0);
+  if (ret == 0)
+    ret = db_query_run(Q_TMP_CLEAR, 0, 0);
+  if (ret < 0)
+    goto out;
+
+  ret = db_blocking_prepare_v2(Q_TMP_INSERT, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      ret = -1;
+      goto out;
+    }
+
+  for (i = 0; i < len; i++)
+    {
+      sqlite3_bind_int(stmt, 1, i + pos);
+      sqlite3_bind_int(stmt, 2, shuffle_pos[i]);
+
+      ret = db_blocking_step(stmt);
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+	  break;
+	}
+
+      sqlite3_reset(stmt);
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (i < len)
+    {
+      ret = -1;
+      goto out;
+    }
+
+  // Items before the start pos keep their normal order, all items are marked as changed
+  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = COALESCE((SELECT s.shuffle_pos FROM temp.queue_shuffle s WHERE s.pos = queue.pos), pos), queue_version = %d;", queue_version);
+  ret = db_query_run(query, 1, 0);
+
+  db_query_run(Q_TMP_CLEAR, 0, 0);
+
+ out:
+  free(shuffle_pos);
+
+  return (ret < 0) ? -1 : 0;
+
+#undef Q_TMP_CREATE
+#undef Q_TMP_INSERT
+#undef Q_TMP_CLEAR
+}
+
+/*
+ * Reshuffles the shuffle queue
+ *
+ * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
+ * queue is reshuffled after the item with the given id (excluding this item).
+ *
+ * @param item_id The base item, after this item the queue is reshuffled
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_reshuffle(uint32_t item_id)
+{
+  int queue_version;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+
+  ret = queue_reshuffle(item_id, queue_version);
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Increment queue version (triggers queue change event)
+ */
+int
+db_queue_inc_version()
+{
+  int queue_version;
+
+  queue_version = queue_transaction_begin();
+  queue_transaction_end(0, queue_version);
+
+  return 0;
+}
+
+int
+db_queue_get_count(uint32_t *nitems)
+{
+  int ret;
+
+  ret = queue_mirror_count(nitems);
+  if (ret == 0)
+    return 0;
+
+  ret = db_get_one_int("SELECT COUNT(*) FROM queue;");
+
+  if (ret < 0)
+    return -1;
+
+  *nitems = (uint32_t)ret;
+
+  return 0;
+}
+
+
+/* Inotify */
+int
+db_watch_clear(void)
+{
+  return db_query_run("DELETE FROM inotify;", 0, 0);
+}
+
+int
+db_watch_add(struct watch_info *wi)
+{
+#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bywd(uint32_t wd)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wd);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bypath(char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, path);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bymatch(char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path LIKE '%q/%%';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, path);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bycookie(uint32_t cookie)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
+  char *query;
+
+  if (cookie == 0)
+    return -1;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+static int
+db_watch_get_byquery(struct watch_info *wi, char *query)
+{
+  sqlite3_stmt *stmt;
+  int64_t cookie;
+  int ncols;
+  int i;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_WARN, L_DB, "Watch not found: '%s'\n", query);
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+
+  if (ncols < ARRAY_SIZE(wi_cols_map))
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than wi column map (%u)\n", ncols, ARRAY_SIZE(wi_cols_map));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(wi_cols_map); i++)
+    {
+      struct_field_from_statement(wi, wi_cols_map[i].offset, wi_cols_map[i].type, stmt, i, true, false);
+
+      if (wi_cols_map[i].offset == wi_offsetof(cookie))
+	{
+	  cookie = sqlite3_column_int64(stmt, i);
+	  wi->cookie = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
+	}
+    }
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+}
+
+int
+db_watch_get_bywd(struct watch_info *wi)
+{
+#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wi->wd);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  return db_watch_get_byquery(wi, query);
+#undef Q_TMPL
+}
+
+int
+db_watch_get_bypath(struct watch_info *wi)
+{
+#define Q_TMPL "SELECT * FROM inotify WHERE path = '%q';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wi->path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  return db_watch_get_byquery(wi, query);
+#undef Q_TMPL
+}
+
+void
+db_watch_mark_bypath(char *path, enum strip_type strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
+  char *query;
+  int64_t disabled;
+  int path_striplen;
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+
+  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+void
+db_watch_mark_bymatch(char *path, enum strip_type strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path LIKE '%q/%%';"
+  char *query;
+  int64_t disabled;
+  int path_striplen;
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+
+  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+void
+db_watch_move_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
+  char *query;
+
+  if (cookie == 0)
+    return;
+
+  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_cookie_known(uint32_t cookie)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
+  char *query;
+  int ret;
 
-  // Reset the shuffled order and mark all items as changed
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d;", queue_version);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    return -1;
+  if (cookie == 0)
+    return 0;
 
-  pos = 0;
-  if (item_id > 0)
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+  if (!query)
     {
-      pos = db_queue_get_pos(item_id, 0);
-      if (pos < 0)
-	return -1;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-      pos++; // Do not reshuffle the base item
+      return 0;
     }
 
-  ret = db_queue_get_count(&count);
-  if (ret < 0)
-    return -1;
+  ret = db_get_one_int(query);
 
-  len = count - pos;
+  sqlite3_free(query);
 
-  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
+  return (ret > 0);
 
-  shuffle_pos = malloc(len * sizeof(int));
-  for (i = 0; i < len; i++)
-    {
-      shuffle_pos[i] = i + pos;
-    }
+#undef Q_TMPL
+}
 
-  shuffle_int(&shuffle_rng, shuffle_pos, len);
+int
+db_watch_enum_start(struct watch_enum *we)
+{
+#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
+#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("pos >= %d", pos);
+  we->stmt = NULL;
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  if (we->match)
+    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
+  else if (we->cookie != 0)
+    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
+  else
     {
-      sqlite3_free(qp.filter);
+      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
       return -1;
     }
 
-  i = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
+  if (!query)
     {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
-	  break;
-	}
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-      i++;
+      sqlite3_free(query);
+      return -1;
     }
 
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
+  sqlite3_free(query);
 
-  if (ret < 0)
-    return -1;
+  we->stmt = stmt;
 
   return 0;
+
+#undef Q_MATCH_TMPL
+#undef Q_COOKIE_TMPL
+}
+
+void
+db_watch_enum_end(struct watch_enum *we)
+{
+  if (!we->stmt)
+    return;
+
+  sqlite3_finalize(we->stmt);
+  we->stmt = NULL;
 }
 
-/*
- * Reshuffles the shuffle queue
- *
- * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
- * queue is reshuffled after the item with the given id (excluding this item).
- *
- * @param item_id The base item, after this item the queue is reshuffled
- * @return 0 on success, -1 on failure
- */
 int
-db_queue_reshuffle(uint32_t item_id)
+db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
 {
-  int queue_version;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  *wd = 0;
 
-  ret = queue_reshuffle(item_id, queue_version);
+  if (!we->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
+      return -1;
+    }
 
-  queue_transaction_end(ret, queue_version);
+  ret = db_blocking_step(we->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
 
-  return ret;
+  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+
+  return 0;
 }
 
-/*
- * Increment queue version (triggers queue change event)
+
+#ifdef HAVE_SQLITE3_TRACE_V2
+/* SQL statistics
+ *
+ * When enabled (config or db_sqlstats_enable()) the trace callback aggregates
+ * the cost of each statement execution per normalized statement, i.e. with
+ * literals replaced by '?'. The query plan is captured the first time an
+ * execution takes longer than the threshold. The rows are only traced while the
+ * statistics are enabled, see sqlstats_trace_sync().
  */
-int
-db_queue_inc_version()
+#define SQLSTATS_BUCKETS 256
+#define SQLSTATS_MAX_ENTRIES 1000
+#define SQLSTATS_HIST_SIZE 32
+#define SQLSTATS_NESTED_MAX 8
+
+struct sqlstats_entry
 {
-  int queue_version;
+  char *query;
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t rows;
+  uint64_t wait_ns;
 
-  queue_version = queue_transaction_begin();
-  queue_transaction_end(0, queue_version);
+  // Number of executions per duration, bucket n is [2^n, 2^(n+1)) us
+  uint32_t hist[SQLSTATS_HIST_SIZE];
 
-  return 0;
-}
+  char *slowest;
+  char *plan;
 
-int
-db_queue_get_count(uint32_t *nitems)
+  struct sqlstats_entry *next;
+};
+
+struct sqlstats_rowcount
 {
-  int ret = db_get_one_int("SELECT COUNT(*) FROM queue;");
+  sqlite3_stmt *stmt;
+  uint64_t rows;
+};
 
-  if (ret < 0)
-    return -1;
+static struct sqlstats_entry *sqlstats[SQLSTATS_BUCKETS];
+static int sqlstats_nentries;
+static uint64_t sqlstats_dropped;
+static pthread_mutex_t sqlstats_lck = PTHREAD_MUTEX_INITIALIZER;
 
-  *nitems = (uint32_t)ret;
+// Read without the lock by the trace callback, so only accessed atomically.
+// The generation is incremented when sqlstats_enabled changes, each connection
+// picks up the new trace mask with sqlstats_trace_sync().
+static bool sqlstats_enabled;
+static unsigned int sqlstats_generation;
+static int sqlstats_explain_threshold_ms;
 
-  return 0;
-}
+// Connection and generation the thread last set the trace mask for
+static __thread sqlite3 *sqlstats_trace_hdl;
+static __thread unsigned int sqlstats_trace_generation;
 
+// Rows stepped by the statements the thread is currently running (they can be
+// nested, e.g. a lookup for each row of an enum)
+static __thread struct sqlstats_rowcount sqlstats_rowcount[SQLSTATS_NESTED_MAX];
+static __thread uint64_t sqlstats_wait_ns;
+static __thread bool sqlstats_in_explain;
 
-/* Inotify */
-int
-db_watch_clear(void)
+static inline bool
+sqlstats_is_enabled(void)
 {
-  return db_query_run("DELETE FROM inotify;", 0, 0);
+  return __atomic_load_n(&sqlstats_enabled, __ATOMIC_RELAXED);
 }
 
-int
-db_watch_add(struct watch_info *wi)
+static inline uint64_t
+sqlstats_now_ns(void)
 {
-#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
-  char *query;
+  struct timespec ts;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int
-db_watch_delete_bywd(uint32_t wd)
+/* Replaces literals with '?' and collapses whitespace and lists of parameters,
+ * so that "id IN (1, 2, 3)" and "id IN (?)" give the same result.
+ */
+static char *
+sqlstats_normalize(const char *query)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
-  char *query;
+  const char *p;
+  char *out;
+  char *o;
+  char *q;
+  char prev;
 
-  query = sqlite3_mprintf(Q_TMPL, wd);
+  CHECK_NULL(L_DB, out = malloc(strlen(query) + 1));
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  o = out;
+  prev = ' ';
+  for (p = query; *p; )
+    {
+      if (isspace((unsigned char)*p))
+	{
+	  while (isspace((unsigned char)*p))
+	    p++;
+
+	  if (prev != ' ' && *p)
+	    *o++ = prev = ' ';
+
+	  continue;
+	}
+      else if (*p == '\'')
+	{
+	  for (p++; *p; p++)
+	    {
+	      if (*p == '\'' && *(p + 1) == '\'')
+		p++;
+	      else if (*p == '\'')
+		break;
+	    }
+
+	  if (*p)
+	    p++;
+
+	  *o++ = prev = '?';
+	}
+      else if (isdigit((unsigned char)*p) && !isalnum((unsigned char)prev) && prev != '_' && prev != '.')
+	{
+	  while (isalnum((unsigned char)*p) || *p == '.')
+	    p++;
+
+	  *o++ = prev = '?';
+	}
+      else if ((*p == '?' || *p == ':' || *p == '@' || *p == '$') && !isalnum((unsigned char)prev))
+	{
+	  // Named or numbered parameter
+	  for (p++; isalnum((unsigned char)*p) || *p == '_'; p++)
+	    ; /* EMPTY */
+
+	  *o++ = prev = '?';
+	}
+      else
+	{
+	  *o++ = prev = *p++;
+	  continue;
+	}
+
+      // Collapse "?, ?" to "?"
+      q = o - 2;
+      if (q > out && *q == ' ')
+	q--;
+      if (q > out && *q == ',')
+	q--;
+      else
+	continue;
+      if (q >= out && *q == ' ')
+	q--;
+      if (q >= out && *q == '?')
+	o = q + 1;
+    }
+
+  *o = '\0';
+
+  return out;
 }
 
-int
-db_watch_delete_bypath(char *path)
+static uint32_t
+sqlstats_hash(const char *query)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
-  char *query;
+  uint32_t h = 5381;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  for (; *query; query++)
+    h = ((h << 5) + h) + (unsigned char)*query;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return h;
 }
 
-int
-db_watch_delete_bymatch(char *path)
+static int
+sqlstats_hist_bucket(uint64_t ns)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE path LIKE '%q/%%';"
-  char *query;
+  uint64_t us;
+  int n;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  us = ns / 1000;
+  for (n = 0; us > 1 && n < SQLSTATS_HIST_SIZE - 1; n++)
+    us >>= 1;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return n;
 }
 
-int
-db_watch_delete_bycookie(uint32_t cookie)
+static uint64_t
+sqlstats_p99(struct sqlstats_entry *e)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
+  uint64_t limit;
+  uint64_t count;
+  uint64_t upper;
+  int n;
 
-  if (cookie == 0)
-    return -1;
+  limit = e->calls - e->calls / 100;
+  count = 0;
+  for (n = 0; n < SQLSTATS_HIST_SIZE; n++)
+    {
+      count += e->hist[n];
+      if (count >= limit)
+	break;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+  upper = (UINT64_C(2) << n) * 1000;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return (upper < e->max_ns) ? upper : e->max_ns;
 }
 
-static int
-db_watch_get_byquery(struct watch_info *wi, char *query)
+/* Returns the query plan of a query as lines of "(id,parent,notused) detail",
+ * or NULL if it cannot be explained
+ */
+static char *
+sqlstats_explain(const char *query)
 {
   sqlite3_stmt *stmt;
-  int64_t cookie;
-  int ncols;
-  int i;
+  char *explain;
+  char *plan;
+  char *tmp;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_WARN, L_DB, "Watch not found: '%s'\n", query);
+  if ((strncasecmp(query, "SELECT", 6) != 0) && (strncasecmp(query, "UPDATE", 6) != 0) &&
+      (strncasecmp(query, "DELETE", 6) != 0) && (strncasecmp(query, "INSERT", 6) != 0))
+    return NULL;
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+  explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+  if (!explain)
+    {
+      DPRINTF(E_LOG, L_DBPERF, "Query plan: Out of memory\n");
+      return NULL;
     }
 
-  ncols = sqlite3_column_count(stmt);
+  sqlstats_in_explain = true;
 
-  if (ncols < ARRAY_SIZE(wi_cols_map))
+  ret = db_blocking_prepare_v2(explain, -1, &stmt, NULL);
+  sqlite3_free(explain);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than wi column map (%u)\n", ncols, ARRAY_SIZE(wi_cols_map));
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+      DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlstats_in_explain = false;
+      return NULL;
     }
 
-  for (i = 0; i < ARRAY_SIZE(wi_cols_map); i++)
+  plan = NULL;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      struct_field_from_statement(wi, wi_cols_map[i].offset, wi_cols_map[i].type, stmt, i, true, false);
-
-      if (wi_cols_map[i].offset == wi_offsetof(cookie))
-	{
-	  cookie = sqlite3_column_int64(stmt, i);
-	  wi->cookie = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
-	}
+      tmp = plan;
+      plan = safe_asprintf("%s(%d,%d,%d) %s\n", tmp ? tmp : "",
+			   sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+			   sqlite3_column_text(stmt, 3));
+      free(tmp);
     }
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(hdl));
 
   sqlite3_finalize(stmt);
-  sqlite3_free(query);
 
-  return 0;
+  sqlstats_in_explain = false;
+
+  return plan;
 }
 
-int
-db_watch_get_bywd(struct watch_info *wi)
+static void
+sqlstats_row(sqlite3_stmt *stmt)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
-  char *query;
+  int free_slot;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd);
-  if (!query)
+  free_slot = -1;
+  for (i = 0; i < SQLSTATS_NESTED_MAX; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      if (sqlstats_rowcount[i].stmt == stmt)
+	{
+	  sqlstats_rowcount[i].rows++;
+	  return;
+	}
+      else if (!sqlstats_rowcount[i].stmt && free_slot < 0)
+	free_slot = i;
     }
 
-  return db_watch_get_byquery(wi, query);
-#undef Q_TMPL
+  if (free_slot < 0)
+    return;
+
+  sqlstats_rowcount[free_slot].stmt = stmt;
+  sqlstats_rowcount[free_slot].rows = 1;
 }
 
-int
-db_watch_get_bypath(struct watch_info *wi)
+static uint64_t
+sqlstats_rows_take(sqlite3_stmt *stmt)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE path = '%q';"
-  char *query;
+  uint64_t rows;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->path);
-  if (!query)
+  for (i = 0; i < SQLSTATS_NESTED_MAX; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      if (sqlstats_rowcount[i].stmt != stmt)
+	continue;
+
+      rows = sqlstats_rowcount[i].rows;
+      sqlstats_rowcount[i].stmt = NULL;
+      return rows;
     }
 
-  return db_watch_get_byquery(wi, query);
-#undef Q_TMPL
+  return 0;
 }
 
-void
-db_watch_mark_bypath(char *path, enum strip_type strip, uint32_t cookie)
+static void
+sqlstats_add(sqlite3_stmt *stmt, uint64_t ns)
 {
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int path_striplen;
+  struct sqlstats_entry *e;
+  const char *query;
+  char *normalized;
+#ifdef HAVE_SQLITE3_EXPANDED_SQL
+  char *expanded;
+#endif
+  char *plan;
+  uint64_t rows;
+  uint64_t wait_ns;
+  uint32_t h;
+  bool want_plan;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  query = sqlite3_sql(stmt);
+  if (!query)
+    return;
 
-  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+  rows = sqlstats_rows_take(stmt);
+  wait_ns = sqlstats_wait_ns;
+  sqlstats_wait_ns = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+  normalized = sqlstats_normalize(query);
+  h = sqlstats_hash(normalized) % SQLSTATS_BUCKETS;
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
 
-void
-db_watch_mark_bymatch(char *path, enum strip_type strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int path_striplen;
+  for (e = sqlstats[h]; e; e = e->next)
+    {
+      if (strcmp(e->query, normalized) == 0)
+	break;
+    }
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  if (!e && sqlstats_nentries >= SQLSTATS_MAX_ENTRIES)
+    {
+      sqlstats_dropped++;
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
+      free(normalized);
+      return;
+    }
+  else if (!e)
+    {
+      CHECK_NULL(L_DB, e = calloc(1, sizeof(struct sqlstats_entry)));
+      e->query = normalized;
+      e->next = sqlstats[h];
+      sqlstats[h] = e;
+      sqlstats_nentries++;
+      normalized = NULL;
+    }
 
-  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+  e->calls++;
+  e->total_ns += ns;
+  e->rows += rows;
+  e->wait_ns += wait_ns;
+  e->hist[sqlstats_hist_bucket(ns)]++;
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+  if (ns > e->max_ns)
+    {
+      e->max_ns = ns;
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+      free(e->slowest);
+#ifdef HAVE_SQLITE3_EXPANDED_SQL
+      expanded = sqlite3_expanded_sql(stmt);
+      e->slowest = safe_strdup(expanded);
+      sqlite3_free(expanded);
+#else
+      e->slowest = safe_strdup(query);
+#endif
+    }
 
-void
-db_watch_move_bycookie(uint32_t cookie, char *path)
-{
-#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
-  char *query;
+  want_plan = !e->plan && (ns / 1000000 >= sqlstats_explain_threshold_ms);
 
-  if (cookie == 0)
-    return;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+  free(normalized);
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  if (!want_plan)
+    return;
 
-int
-db_watch_cookie_known(uint32_t cookie)
-{
-#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-  int ret;
+  // Not run with the lock held, since the explain is itself a query
+  plan = sqlstats_explain(query);
+  if (!plan)
+    return;
 
-  if (cookie == 0)
-    return 0;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
+  // The entry may have been removed by a reset in the meantime
+  normalized = sqlstats_normalize(query);
+  for (e = sqlstats[h]; e; e = e->next)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      if (strcmp(e->query, normalized) == 0)
+	break;
+    }
 
-      return 0;
+  if (e && !e->plan)
+    {
+      e->plan = plan;
+      plan = NULL;
     }
 
-  ret = db_get_one_int(query);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
 
-  sqlite3_free(query);
+  free(normalized);
+  free(plan);
+}
 
-  return (ret > 0);
+static void
+sqlstats_clear(void)
+{
+  struct sqlstats_entry *e;
+  int i;
 
-#undef Q_TMPL
+  for (i = 0; i < SQLSTATS_BUCKETS; i++)
+    {
+      while ((e = sqlstats[i]))
+	{
+	  sqlstats[i] = e->next;
+
+	  free(e->query);
+	  free(e->slowest);
+	  free(e->plan);
+	  free(e);
+	}
+    }
+
+  sqlstats_nentries = 0;
+  sqlstats_dropped = 0;
 }
 
-int
-db_watch_enum_start(struct watch_enum *we)
+static int
+db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
 {
-#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
-#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+  sqlite3_stmt *pstmt;
+  uint64_t ns;
+#ifdef DB_PROFILE
+  int64_t ms = 0;
+  const char *pquery;
+  char *plan;
+  int log_level;
+#endif
 
-  we->stmt = NULL;
+  if (sqlstats_in_explain)
+    return 0;
 
-  if (we->match)
-    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
-  else if (we->cookie != 0)
-    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
-  else
+  pstmt = ptr;
+
+  if (trace_type == SQLITE_TRACE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
-      return -1;
+      if (sqlstats_is_enabled())
+	sqlstats_row(pstmt);
+      return 0;
     }
+  else if (trace_type != SQLITE_TRACE_PROFILE)
+    return 0;
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  ns = *((int64_t *) ptr_data);
 
-      return -1;
-    }
+  if (sqlstats_is_enabled())
+    sqlstats_add(pstmt, ns);
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+#ifdef DB_PROFILE
+  pquery = sqlite3_sql(pstmt);
+  ms = ns / 1000000;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  if (ms > 1000)
+    log_level = E_LOG;
+  else if (ms > 500)
+    log_level = E_WARN;
+  else if (ms > 10)
+    log_level = E_DBG;
+  else
+    log_level = E_SPAM;
 
-      sqlite3_free(query);
-      return -1;
-    }
+  if (log_level > logger_severity())
+    return 0;
 
-  sqlite3_free(query);
+  DPRINTF(log_level, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
+  DPRINTF(log_level, L_DBPERF, "SQL PROFILE time: %" PRIi64 " ms\n", ms);
 
-  we->stmt = stmt;
+  plan = sqlstats_explain(pquery);
+  if (!plan)
+    return 0;
+
+  DPRINTF(log_level, L_DBPERF, "Query plan:\n%s", plan);
+
+  free(plan);
+#endif
 
   return 0;
+}
 
-#undef Q_MATCH_TMPL
-#undef Q_COOKIE_TMPL
+static void
+sqlstats_wait_add(uint64_t start_ns)
+{
+  if (sqlstats_is_enabled())
+    sqlstats_wait_ns += sqlstats_now_ns() - start_ns;
 }
 
-void
-db_watch_enum_end(struct watch_enum *we)
+/* Sets the trace mask of the thread's current connection if statistics were
+ * enabled or disabled since it was last set. Rows are only traced while the
+ * statistics are enabled, and with DB_PROFILE the execution time is always
+ * traced for the log.
+ */
+static void
+sqlstats_trace_sync(void)
 {
-  if (!we->stmt)
+  unsigned int generation;
+  unsigned int mask;
+
+  if (!hdl)
     return;
 
-  sqlite3_finalize(we->stmt);
-  we->stmt = NULL;
+  generation = __atomic_load_n(&sqlstats_generation, __ATOMIC_ACQUIRE);
+  if (hdl == sqlstats_trace_hdl && generation == sqlstats_trace_generation)
+    return;
+
+  if (sqlstats_is_enabled())
+    mask = SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW;
+  else
+#ifdef DB_PROFILE
+    mask = SQLITE_TRACE_PROFILE;
+#else
+    mask = 0;
+#endif
+
+  sqlite3_trace_v2(hdl, mask, mask ? db_xprofile : NULL, NULL);
+
+  sqlstats_trace_hdl = hdl;
+  sqlstats_trace_generation = generation;
+}
+
+static int
+sqlstats_entry_cmp(const void *a, const void *b)
+{
+  const struct db_sqlstat *sa = a;
+  const struct db_sqlstat *sb = b;
+
+  if (sa->total_ns != sb->total_ns)
+    return (sa->total_ns > sb->total_ns) ? -1 : 1;
+
+  return 0;
 }
 
 int
-db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+db_sqlstats_get(struct db_sqlstat **stats, int *nstats, uint64_t *dropped)
 {
-  int ret;
+  struct sqlstats_entry *e;
+  struct db_sqlstat *out;
+  int n;
+  int i;
 
-  *wd = 0;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
 
-  if (!we->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
-      return -1;
-    }
+  out = NULL;
+  if (sqlstats_nentries > 0)
+    CHECK_NULL(L_DB, out = calloc(sqlstats_nentries, sizeof(struct db_sqlstat)));
 
-  ret = db_blocking_step(we->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
+  n = 0;
+  for (i = 0; i < SQLSTATS_BUCKETS; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
+      for (e = sqlstats[i]; e; e = e->next)
+	{
+	  out[n].query = safe_strdup(e->query);
+	  out[n].calls = e->calls;
+	  out[n].total_ns = e->total_ns;
+	  out[n].max_ns = e->max_ns;
+	  out[n].p99_ns = sqlstats_p99(e);
+	  out[n].rows = e->rows;
+	  out[n].wait_ns = e->wait_ns;
+	  out[n].slowest = safe_strdup(e->slowest);
+	  out[n].plan = safe_strdup(e->plan);
+	  n++;
+	}
     }
 
-  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+  if (dropped)
+    *dropped = sqlstats_dropped;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
+
+  if (n > 0)
+    qsort(out, n, sizeof(struct db_sqlstat), sqlstats_entry_cmp);
+
+  *stats = out;
+  *nstats = n;
 
   return 0;
 }
 
+void
+db_sqlstats_reset(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
+  sqlstats_clear();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
 
-#ifdef DB_PROFILE
-static int
-db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
+  DPRINTF(E_INFO, L_DB, "SQL statistics were reset\n");
+}
+
+int
+db_sqlstats_enable(bool enable)
 {
-  sqlite3_stmt *pstmt;
-  int64_t ms = 0;
-  sqlite3_stmt *stmt;
-  const char *pquery;
-  char *query;
-  int log_level;
-  int ret;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
+  __atomic_store_n(&sqlstats_enabled, enable, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&sqlstats_generation, 1, __ATOMIC_RELEASE);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
 
-  if (trace_type != SQLITE_TRACE_PROFILE)
-    return 0;
+  // Other connections are updated by their thread before the next statement
+  sqlstats_trace_sync();
 
-  pstmt = ptr;
-  pquery = sqlite3_sql(pstmt);
-  ms = *((int64_t *) ptr_data) / 1000000;
+  DPRINTF(E_INFO, L_DB, "SQL statistics %s\n", enable ? "enabled" : "disabled");
 
-  if (ms > 1000)
-    log_level = E_LOG;
-  else if (ms > 500)
-    log_level = E_WARN;
-  else if (ms > 10)
-    log_level = E_DBG;
-  else
-    log_level = E_SPAM;
+  return 0;
+}
 
-  if (log_level > logger_severity())
-    return 0;
+bool
+db_sqlstats_enabled(void)
+{
+  return sqlstats_is_enabled();
+}
+#else
+static void
+sqlstats_wait_add(uint64_t start_ns)
+{
+  return;
+}
 
-  DPRINTF(log_level, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
-  DPRINTF(log_level, L_DBPERF, "SQL PROFILE time: %" PRIi64 " ms\n", ms);
+static void
+sqlstats_trace_sync(void)
+{
+  return;
+}
 
-  if ((strncmp(pquery, "SELECT", 6) != 0)
-       && (strncmp(pquery, "UPDATE", 6) != 0)
-       && (strncmp(pquery, "DELETE", 6) != 0))
-      return 0;
+static inline uint64_t
+sqlstats_now_ns(void)
+{
+  return 0;
+}
 
-  /* Disable profiling callback */
-  sqlite3_trace_v2(hdl, 0, NULL, NULL);
+int
+db_sqlstats_get(struct db_sqlstat **stats, int *nstats, uint64_t *dropped)
+{
+  return -1;
+}
 
-  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", pquery);
-  if (!query)
-    {
-      DPRINTF(log_level, L_DBPERF, "Query plan: Out of memory\n");
+void
+db_sqlstats_reset(void)
+{
+  return;
+}
 
-      goto out;
-    }
+int
+db_sqlstats_enable(bool enable)
+{
+  if (enable)
+    DPRINTF(E_LOG, L_DB, "SQL statistics are not supported, SQLite3 is too old (no sqlite3_trace_v2)\n");
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(log_level, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  return -1;
+}
 
-      goto out;
-    }
+bool
+db_sqlstats_enabled(void)
+{
+  return false;
+}
+#endif
 
-  DPRINTF(log_level, L_DBPERF, "Query plan:\n");
+void
+db_sqlstats_free(struct db_sqlstat *stats, int nstats)
+{
+  int i;
 
-  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+  for (i = 0; i < nstats; i++)
     {
-      DPRINTF(log_level, L_DBPERF, "(%d,%d,%d) %s\n",
-	      sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
-	      sqlite3_column_text(stmt, 3));
+      free(stats[i].query);
+      free(stats[i].slowest);
+      free(stats[i].plan);
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(log_level, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(hdl));
-
-  sqlite3_finalize(stmt);
-
- out:
-  /* Reenable profiling callback */
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
-
-  return 0;
+  free(stats);
 }
-#endif
 
 static int
 db_pragma_get_cache_size()
@@ -6776,7 +10926,7 @@ db_pragma_set_mmap_size(int mmap_size)
 }
 
 static int
-db_open(void)
+db_open(int flags)
 {
   char *errmsg;
   int ret;
@@ -6788,7 +10938,7 @@ db_open(void)
   if (!db_path)
     return -1;
 
-  ret = sqlite3_open(db_path, &hdl);
+  ret = sqlite3_open_v2(db_path, &hdl, flags, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(hdl));
@@ -6831,9 +10981,15 @@ db_open(void)
       return -1;
     }
 
-#ifdef DB_PROFILE
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
+#ifdef HAVE_SQLITE3_TRACE_V2
+  // New connection, a closed one may have had the same address
+  sqlstats_trace_hdl = NULL;
 #endif
+  sqlstats_trace_sync();
+
+  // Collects the changed files for the smart playlists
+  if (!(flags & SQLITE_OPEN_READONLY))
+    sqlite3_update_hook(hdl, db_xupdate, NULL);
 
   cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
   if (cache_size > -1)
@@ -6844,7 +11000,7 @@ db_open(void)
     }
 
   journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
-  if (journal_mode)
+  if (journal_mode && !(flags & SQLITE_OPEN_READONLY))
     {
       journal_mode = db_pragma_set_journal_mode(journal_mode);
       DPRINTF(E_DBG, L_DB, "Database journal mode: %s\n", journal_mode);
@@ -6869,12 +11025,16 @@ db_open(void)
   return 0;
 }
 
+// With rows > 1 the statement inserts that many rows at once (VALUES (...), (...))
 static sqlite3_stmt *
-db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, const char *table)
+db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, const char *table, int rows)
 {
   char *query;
   char keystr[2048];
   char valstr[1024];
+  char *rowstr;
+  size_t rowlen;
+  size_t len;
   sqlite3_stmt *stmt;
   int ret;
   int i;
@@ -6894,7 +11054,14 @@ db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, co
   *(strrchr(keystr, ',')) = '\0';
   *(strrchr(valstr, ',')) = '\0';
 
-  CHECK_NULL(L_DB, query = db_mprintf("INSERT INTO %s (%s) VALUES (%s);", table, keystr, valstr));
+  // Room for "(valstr), " per row
+  rowlen = strlen(valstr) + 4;
+  CHECK_NULL(L_DB, rowstr = malloc(rows * rowlen + 1));
+  for (i = 0, len = 0; i < rows; i++)
+    len += sprintf(rowstr + len, "%s(%s)", (i > 0) ? ", " : "", valstr);
+
+  CHECK_NULL(L_DB, query = db_mprintf("INSERT INTO %s (%s) VALUES %s;", table, keystr, rowstr));
+  free(rowstr);
 
   ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
@@ -6973,14 +11140,14 @@ db_statements_prepare_ping(const char *table)
 static int
 db_statements_prepare(void)
 {
-  db_statements.files_insert = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
+  db_statements.files_insert = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files", 1);
   db_statements.files_update = db_statements_prepare_update(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
   db_statements.files_ping   = db_statements_prepare_ping("files");
 
-  db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
+  db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists", 1);
   db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
 
-  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
+  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue", 1);
   db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
 
   if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
@@ -7053,12 +11220,196 @@ error:
   return -1;
 }
 
+/* Read-only connection pool
+ *
+ * In WAL mode, readers on their own connection see a consistent snapshot of the
+ * database and are neither blocked by nor blocking the writers. The pool
+ * connections are opened read-only with a private cache (the thread
+ * connections use shared cache, where readers wait on table locks instead).
+ * While a thread has a connection checked out, it replaces the thread's
+ * connection and statement cache, so the connection can only be used for
+ * reads. The connections are opened on first use.
+ */
+static void
+read_pool_init(void)
+{
+  cfg_t *sqlite_cfg;
+  const char *journal_mode;
+  int size;
+
+  sqlite_cfg = cfg_getsec(cfg, "sqlite");
+
+  size = cfg_getint(sqlite_cfg, "read_pool_size");
+  if (size <= 0)
+    return;
+
+  journal_mode = cfg_getstr(sqlite_cfg, "pragma_journal_mode");
+  if (!journal_mode || (strcasecmp(journal_mode, "wal") != 0))
+    {
+      DPRINTF(E_INFO, L_DB, "Read connection pool disabled, it requires pragma_journal_mode = WAL\n");
+      return;
+    }
+
+  CHECK_NULL(L_DB, db_read_pool.conns = calloc(size, sizeof(struct db_read_conn)));
+  db_read_pool.size = size;
+
+  DPRINTF(E_DBG, L_DB, "Read connection pool with %d connections enabled\n", size);
+}
+
+static void
+read_pool_deinit(void)
+{
+  struct db_read_conn *conn;
+  sqlite3_stmt *stmt;
+  int i;
+
+  for (i = 0; i < db_read_pool.size; i++)
+    {
+      conn = &db_read_pool.conns[i];
+      if (!conn->hdl)
+	continue;
+
+      // stmt_cache_deinit() works on the thread's cache
+      hdl = conn->hdl;
+      db_stmt_cache = conn->stmt_cache;
+      stmt_cache_deinit();
+
+      while ((stmt = sqlite3_next_stmt(hdl, 0)))
+	sqlite3_finalize(stmt);
+
+      sqlite3_close(hdl);
+      hdl = NULL;
+    }
+
+  free(db_read_pool.conns);
+  db_read_pool.conns = NULL;
+  db_read_pool.size = 0;
+}
+
+/* Starts a read transaction on a connection from the read pool, so that the
+ * following queries from the thread see the same snapshot of the library.
+ * Returns -1 if no connection was available, in which case the thread's own
+ * connection is used as usual. Only call db_snapshot_end() if this succeeded,
+ * and don't write to the database in between.
+ */
+int
+db_snapshot_begin(void)
+{
+  struct db_read_conn *conn;
+  char *errmsg;
+  int ret;
+  int i;
+
+  if (db_read_conn || db_read_pool.size == 0)
+    return -1;
+
+  conn = NULL;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_read_pool.lck));
+  for (i = 0; i < db_read_pool.size; i++)
+    {
+      if (!db_read_pool.conns[i].in_use)
+	{
+	  conn = &db_read_pool.conns[i];
+	  conn->in_use = true;
+	  break;
+	}
+    }
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_read_pool.lck));
+
+  if (!conn)
+    {
+      DPRINTF(E_DBG, L_DB, "No free read connection, using thread connection\n");
+      return -1;
+    }
+
+  db_read_saved_hdl = hdl;
+  db_read_saved_stmt_cache = db_stmt_cache;
+
+  hdl = conn->hdl;
+  db_stmt_cache = conn->stmt_cache;
+
+  if (!hdl)
+    {
+      ret = db_open(SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE);
+      if (ret < 0)
+	{
+	  hdl = NULL;
+	  goto error;
+	}
+
+      // WAL readers only wait if a checkpoint or recovery is running
+      sqlite3_busy_timeout(hdl, 5000);
+
+      stmt_cache_init();
+    }
+
+  // Get the revision before the snapshot is taken, see db_get_query_count()
+  db_read_revision = db_write_revision_get();
+  smartpl_snapshot_get(&db_read_files_revision, &db_read_smartpl_generation);
+  db_read_conn = conn;
+
+  // The snapshot is taken by the first read after BEGIN. Not using db_exec()
+  // since that would bump the write revision.
+  ret = sqlite3_exec(hdl, "BEGIN TRANSACTION; SELECT COUNT(*) FROM admin;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start read transaction: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      db_snapshot_end();
+      return -1;
+    }
+
+  return 0;
+
+ error:
+  conn->hdl = hdl;
+  conn->stmt_cache = db_stmt_cache;
+
+  hdl = db_read_saved_hdl;
+  db_stmt_cache = db_read_saved_stmt_cache;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_read_pool.lck));
+  conn->in_use = false;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_read_pool.lck));
+
+  return -1;
+}
+
+void
+db_snapshot_end(void)
+{
+  struct db_read_conn *conn;
+  int ret;
+
+  conn = db_read_conn;
+  if (!conn)
+    return;
+
+  if (!sqlite3_get_autocommit(hdl))
+    {
+      ret = sqlite3_exec(hdl, "END TRANSACTION;", NULL, NULL, NULL);
+      if (ret != SQLITE_OK)
+	DPRINTF(E_LOG, L_DB, "Could not end read transaction: %s\n", sqlite3_errmsg(hdl));
+    }
+
+  conn->hdl = hdl;
+  conn->stmt_cache = db_stmt_cache;
+
+  hdl = db_read_saved_hdl;
+  db_stmt_cache = db_read_saved_stmt_cache;
+  db_read_conn = NULL;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_read_pool.lck));
+  conn->in_use = false;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_read_pool.lck));
+}
+
 int
 db_perthread_init(void)
 {
   int ret;
 
-  ret = db_open();
+  ret = db_open(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
   if (ret < 0)
     return -1;
 
@@ -7071,6 +11422,8 @@ db_perthread_init(void)
       return -1;
     }
 
+  stmt_cache_init();
+
   return 0;
 }
 
@@ -7082,6 +11435,12 @@ db_perthread_deinit(void)
   if (!hdl)
     return;
 
+  stmt_cache_deinit();
+  count_cache_deinit();
+
+  free(db_files_changes.ids);
+  memset(&db_files_changes, 0, sizeof(struct db_files_changes));
+
   /* Tear down anything that's in flight */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
@@ -7090,6 +11449,111 @@ db_perthread_deinit(void)
 }
 
 
+/* Sets the sort key columns (<col>_key) of all rows in a table, used when the
+ * columns have been added by a schema upgrade
+ */
+static int
+sort_keys_fill(const char *table, const char **cols, int ncols)
+{
+  sqlite3_stmt *stmt;
+  sqlite3_stmt *ustmt;
+  char *query;
+  char *uquery;
+  char *tmp;
+  char *key;
+  int nrows;
+  int ret;
+  int i;
+
+  query = sqlite3_mprintf("SELECT id");
+  uquery = sqlite3_mprintf("UPDATE %s SET", table);
+  for (i = 0; i < ncols; i++)
+    {
+      tmp = sqlite3_mprintf("%s, %s", query, cols[i]);
+      sqlite3_free(query);
+      query = tmp;
+
+      tmp = sqlite3_mprintf("%s%s %s_key = ?%d", uquery, (i > 0) ? "," : "", cols[i], i + 1);
+      sqlite3_free(uquery);
+      uquery = tmp;
+    }
+
+  tmp = sqlite3_mprintf("%s FROM %s;", query, table);
+  sqlite3_free(query);
+  query = tmp;
+
+  tmp = sqlite3_mprintf("%s WHERE id = ?%d;", uquery, ncols + 1);
+  sqlite3_free(uquery);
+  uquery = tmp;
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    goto error_prepare;
+
+  ret = sqlite3_prepare_v2(hdl, uquery, -1, &ustmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      sqlite3_finalize(stmt);
+      goto error_prepare;
+    }
+
+  nrows = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      for (i = 0; i < ncols; i++)
+	{
+	  key = NULL;
+	  sort_key_create(&key, (const char *)sqlite3_column_text(stmt, i + 1));
+	  sqlite3_bind_text(ustmt, i + 1, key, -1, free);
+	}
+
+      sqlite3_bind_int(ustmt, ncols + 1, sqlite3_column_int(stmt, 0));
+
+      ret = sqlite3_step(ustmt);
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not set sort keys in '%s': %s\n", table, sqlite3_errmsg(hdl));
+	  break;
+	}
+
+      sqlite3_reset(ustmt);
+      sqlite3_clear_bindings(ustmt);
+      nrows++;
+    }
+
+  sqlite3_finalize(ustmt);
+  sqlite3_finalize(stmt);
+  sqlite3_free(uquery);
+  sqlite3_free(query);
+
+  if (ret != SQLITE_DONE)
+    return -1;
+
+  DPRINTF(E_LOG, L_DB, "Created sort keys for %d rows in '%s'\n", nrows, table);
+
+  return 0;
+
+ error_prepare:
+  DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  sqlite3_free(uquery);
+  sqlite3_free(query);
+  return -1;
+}
+
+static int
+db_sort_keys_fill(void)
+{
+  const char *files_cols[] = { "title_sort", "album_sort", "album_artist_sort", "composer_sort" };
+  const char *group_stats_cols[] = { "album_sort", "album_artist_sort" };
+  int ret;
+
+  ret = sort_keys_fill("files", files_cols, ARRAY_SIZE(files_cols));
+  if (ret < 0)
+    return -1;
+
+  return sort_keys_fill("group_stats", group_stats_cols, ARRAY_SIZE(group_stats_cols));
+}
+
 static int
 db_check_version(void)
 {
@@ -7142,6 +11606,8 @@ db_check_version(void)
 
       // Will drop indices and triggers
       ret = db_upgrade(hdl, db_ver);
+      if (ret == 0 && db_ver < 2108)
+	ret = db_sort_keys_fill();
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DB, "Database upgrade errored out, rolling back changes ...\n");
@@ -7259,9 +11725,21 @@ db_init(void)
       return -1;
     }
 
+  if (ARRAY_SIZE(sort_keysets) != ARRAY_SIZE(sort_clause))
+    {
+      DPRINTF(E_FATAL, L_DB, "BUG: sort keysets are not in sync with sort clauses\n");
+      return -1;
+    }
+
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
   db_rating_updates = cfg_getbool(cfg_getsec(cfg, "library"), "rating_updates");
 
+#ifdef HAVE_SQLITE3_TRACE_V2
+  sqlstats_explain_threshold_ms = cfg_getint(cfg_getsec(cfg, "sqlite"), "profiling_explain_threshold");
+#endif
+  if (cfg_getbool(cfg_getsec(cfg, "sqlite"), "profiling"))
+    db_sqlstats_enable(true);
+
   DPRINTF(E_LOG, L_DB, "Configured to use database file '%s'\n", db_path);
 
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
@@ -7286,7 +11764,7 @@ db_init(void)
       return -1;
     }
 
-  ret = db_open();
+  ret = db_open(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
   if (ret < 0)
     {
       DPRINTF(E_FATAL, L_DB, "Could not open database\n");
@@ -7314,6 +11792,9 @@ db_init(void)
 	}
     }
 
+  ret = db_init_fts(hdl);
+  db_fts_enabled = (ret == 0);
+
   db_set_cfg_names();
 
   CHECK_ERR(L_DB, db_files_get_count(&files, NULL, NULL));
@@ -7325,6 +11806,8 @@ db_init(void)
 
   DPRINTF(E_LOG, L_DB, "Database OK with %" PRIu32 " active files and %" PRIu32 " active playlists\n", files, pls);
 
+  read_pool_init();
+
   rng_init(&shuffle_rng);
 
   return 0;
@@ -7333,5 +11816,31 @@ db_init(void)
 void
 db_deinit(void)
 {
+  read_pool_deinit();
+
+#ifdef HAVE_SQLITE3_TRACE_V2
+  __atomic_store_n(&sqlstats_enabled, false, __ATOMIC_RELAXED);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&sqlstats_lck));
+  sqlstats_clear();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&sqlstats_lck));
+#endif
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_mirror.lck));
+  queue_mirror_free(db_queue_mirror.copy);
+  db_queue_mirror.copy = NULL;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_mirror.lck));
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dir_index.lck));
+  dir_index_clear();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dir_index.lck));
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl.lck));
+  smartpl_states_clear();
+  free(db_smartpl.changed);
+  db_smartpl.changed = NULL;
+  db_smartpl.nchanged = 0;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl.lck));
+
   sqlite3_shutdown();
 }
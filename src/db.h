@@ -72,6 +72,7 @@ enum query_type {
 #define DB_ADMIN_START_TIME "start_time"
 #define DB_ADMIN_LASTFM_SESSION_KEY "lastfm_sk"
 #define DB_ADMIN_SPOTIFY_REFRESH_TOKEN "spotify_refresh_token"
+#define DB_ADMIN_DAAP_REVISION "daap_revision"
 
 /* Max value for media_file_info->rating (valid range is from 0 to 100) */
 #define DB_FILES_RATING_MAX 100
@@ -95,8 +96,27 @@ struct query_params {
 
   char *filter;
 
+  /* Filters on media_kind and songartistid, added to filter if not 0. Unlike
+   * the same condition in filter they let album and artist queries use the
+   * precomputed group statistics. */
+  int filter_media_kind;
+  int64_t filter_songartistid;
+
+  /* Cursor from db_query_cursor_make(), if set the query continues after the
+   * row the cursor was made from (keyset pagination). Not freed by db. */
+  const char *after;
+
   int with_disabled;
 
+  /* Don't count the results if the caller doesn't need them (qp->results will
+   * be -1). Ignored for I_LAST, which needs the count for the offset. */
+  int skip_count;
+
+  /* Adds a rownum column after the files columns, numbering the rows in the
+   * order of the query. Only for Q_ITEMS, Q_PLITEMS and Q_GROUP_ITEMS, and
+   * requires sqlite 3.25 (window functions). */
+  int with_rownum;
+
   /* Query results, filled in by query_start */
   int results;
 
@@ -223,6 +243,12 @@ struct media_file_info {
   char *album_sort;
   char *album_artist_sort;
   char *composer_sort;
+
+  // Binary comparable keys for ORDER BY, made from the sort tags
+  char *title_sort_key;
+  char *album_sort_key;
+  char *album_artist_sort_key;
+  char *composer_sort_key;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -393,6 +419,10 @@ struct db_media_file_info {
   char *album_artist_sort;
   char *composer_sort;
   char *channels;
+  char *title_sort_key;
+  char *album_sort_key;
+  char *album_artist_sort_key;
+  char *composer_sort_key;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -425,6 +455,24 @@ struct filecount_info {
   uint32_t album_count;
 };
 
+struct db_stmt_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Aggregated cost of a normalized statement, see db_sqlstats_get() */
+struct db_sqlstat {
+  char *query;
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t p99_ns;  // Approximate, from a log2 histogram
+  uint64_t rows;
+  uint64_t wait_ns; // Time spent waiting for locks held by other threads
+  char *slowest;    // The slowest execution, with parameters
+  char *plan;       // Query plan, if an execution exceeded the threshold
+};
+
 /* Directory ids must be in sync with the ids in Q_DIR* in db_init.c */
 enum directory_ids {
   DIR_ROOT = 1,
@@ -448,6 +496,9 @@ struct directory_enum {
 
   /* Private enum context, keep out */
   void *stmt;
+  struct directory_info *dirs;
+  int ndirs;
+  int pos;
 };
 
 struct db_queue_item {
@@ -524,6 +575,9 @@ db_escape_string(const char *str); // TODO Remove this, use db_mprintf instead
 char *
 db_mprintf(const char *fmt, ...);
 
+char *
+db_mprintf_like(const char *col, const char *fmt, ...);
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...);
 
@@ -565,6 +619,20 @@ db_transaction_end(void);
 void
 db_transaction_rollback(void);
 
+/* Batched file writes, only affects the calling thread */
+void
+db_file_batch_begin(void);
+
+void
+db_file_batch_end(void);
+
+/* Read-only snapshots from the read connection pool */
+int
+db_snapshot_begin(void);
+
+void
+db_snapshot_end(void);
+
 /* Queries */
 int
 db_query_start(struct query_params *qp);
@@ -575,6 +643,15 @@ db_query_end(struct query_params *qp);
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi);
 
+int
+db_query_fetch_mfi(struct query_params *qp, struct media_file_info *mfi);
+
+char *
+db_query_cursor_make(struct query_params *qp, struct media_file_info *mfi);
+
+int
+db_query_cursor_check(struct query_params *qp);
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli);
 
@@ -612,6 +689,12 @@ db_file_reset_playskip_count(int id);
 void
 db_file_ping(int id);
 
+void
+db_file_ping_begin(void);
+
+void
+db_file_ping_end(void);
+
 int
 db_file_ping_bypath(const char *path, time_t mtime_max);
 
@@ -730,6 +813,17 @@ db_pl_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie);
 int
 db_pl_enable_bycookie(uint32_t cookie, const char *path);
 
+/* Smart playlists */
+void
+db_smartpl_refresh(void);
+
+/* Files journal */
+uint64_t
+db_files_journal_seq(void);
+
+int
+db_files_journal_get(uint64_t since, int64_t **ids, int *nids);
+
 /* Groups */
 int
 db_groups_cleanup();
@@ -958,6 +1052,24 @@ db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 int
 db_backup();
 
+void
+db_stmt_cache_stats_get(struct db_stmt_cache_stats *stats);
+
+int
+db_sqlstats_get(struct db_sqlstat **stats, int *nstats, uint64_t *dropped);
+
+void
+db_sqlstats_free(struct db_sqlstat *stats, int nstats);
+
+void
+db_sqlstats_reset(void);
+
+int
+db_sqlstats_enable(bool enable);
+
+bool
+db_sqlstats_enabled(void);
+
 int
 db_perthread_init(void);
 
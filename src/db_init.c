@@ -96,7 +96,11 @@
   "   album_sort         VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   album_artist_sort  VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   composer_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
-  "   channels           INTEGER DEFAULT 0"		\
+  "   channels           INTEGER DEFAULT 0,"		\
+  "   title_sort_key     VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_sort_key     VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_artist_sort_key VARCHAR(1024) DEFAULT NULL,"	\
+  "   composer_sort_key  VARCHAR(1024) DEFAULT NULL"	\
   ");"
 
 #define T_PL					\
@@ -126,6 +130,16 @@
   "   filepath       VARCHAR(4096) NOT NULL"		\
   ");"
 
+/* Materialized results of the smart playlist queries, maintained by
+ * db_smartpl_refresh(). Only used while they are known to be up to date.
+ */
+#define T_SMARTPL_ITEMS						\
+  "CREATE TABLE IF NOT EXISTS smartpl_items ("			\
+  "   playlistid     INTEGER NOT NULL,"				\
+  "   fileid         INTEGER NOT NULL,"				\
+  "CONSTRAINT smartpl_items_unique UNIQUE (playlistid, fileid)"	\
+  ");"
+
 #define T_GROUPS							\
   "CREATE TABLE IF NOT EXISTS groups ("					\
   "   id             INTEGER PRIMARY KEY NOT NULL,"			\
@@ -135,6 +149,47 @@
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+/* Statistics of the enabled files in each group, maintained by the
+ * trg_group_stats triggers. Each group has a row with kind 0 for all its files
+ * and a row per media kind, where kind is the media_kind of the files.
+ */
+#define T_GROUP_STATS							\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   id                 INTEGER PRIMARY KEY NOT NULL,"		\
+  "   type               INTEGER NOT NULL,"				\
+  "   persistentid       INTEGER NOT NULL,"				\
+  "   kind               INTEGER NOT NULL,"				\
+  "   album              VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_sort         VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_artist       VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_artist_sort  VARCHAR(1024) COLLATE DAAP,"			\
+  "   songartistid       INTEGER DEFAULT 0,"				\
+  "   track_count        INTEGER DEFAULT 0,"				\
+  "   album_count        INTEGER DEFAULT 0,"				\
+  "   song_length        INTEGER DEFAULT 0,"				\
+  "   data_kind          INTEGER DEFAULT 0,"				\
+  "   media_kind         INTEGER DEFAULT 0,"				\
+  "   year               INTEGER DEFAULT 0,"				\
+  "   date_released      INTEGER DEFAULT 0,"				\
+  "   time_added         INTEGER DEFAULT 0,"				\
+  "   time_played        INTEGER DEFAULT 0,"				\
+  "   seek               INTEGER DEFAULT 0,"				\
+  "   album_sort_key     VARCHAR(1024) DEFAULT NULL,"			\
+  "   album_artist_sort_key VARCHAR(1024) DEFAULT NULL,"		\
+  "CONSTRAINT group_stats_unique_kind UNIQUE (type, persistentid, kind)" \
+  ");"
+
+/* Groups whose group_stats rows are recomputed by group_stats_flush() instead
+ * of the triggers. The row with type 0 marks that this is wanted, it is only
+ * present within a transaction of a library scan, see db_file_batch_begin().
+ */
+#define T_GROUP_STATS_PENDING						\
+  "CREATE TABLE IF NOT EXISTS group_stats_pending ("			\
+  "   type           INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "CONSTRAINT group_stats_pending_unique UNIQUE (type, persistentid)"	\
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -265,7 +320,10 @@ static const struct db_init_query db_init_table_queries[] =
     { T_FILES,     "create table files" },
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
+    { T_SMARTPL_ITEMS, "create table smartpl_items" },
     { T_GROUPS,    "create table groups" },
+    { T_GROUP_STATS, "create table group_stats" },
+    { T_GROUP_STATS_PENDING, "create table group_stats_pending" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
@@ -301,7 +359,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_GROUP_ALBUMS */
 #define I_SONGALBUMID				\
-  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort, disc, track);"
+  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort_key, disc, track);"
 
 /* Used by Q_GROUP_ARTISTS */
 #define I_STATEMKINDSARI				\
@@ -312,15 +370,15 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_BROWSE_ALBUM */
 #define I_ALBUM					\
-  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, album, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort_key, album, media_kind);"
 
 /* Used by Q_BROWSE_ARTIST */
 #define I_ALBUMARTIST				\
-  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort, album_artist, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort_key, album_artist, media_kind);"
 
 /* Used by Q_BROWSE_COMPOSERS */
 #define I_COMPOSER				\
-  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort, composer, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort_key, composer, media_kind);"
 
 /* Used by Q_BROWSE_GENRES */
 #define I_GENRE					\
@@ -328,7 +386,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_PLITEMS for smart playlists */
 #define I_TITLE					\
-  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort_key, media_kind);"
 
 #define I_FILELIST					\
   "CREATE INDEX IF NOT EXISTS idx_filelist ON files(disabled, virtual_path, time_modified);"
@@ -339,6 +397,16 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_DATE_RELEASED                    \
   "CREATE INDEX IF NOT EXISTS idx_date_released ON files(disabled, date_released DESC, media_kind);"
 
+/* Used by Q_GROUP_ALBUMS and Q_GROUP_ARTISTS */
+#define I_GROUP_STATS_ALBUM			\
+  "CREATE INDEX IF NOT EXISTS idx_group_stats_album ON group_stats(type, kind, album_sort_key);"
+
+#define I_GROUP_STATS_ALBUMARTIST		\
+  "CREATE INDEX IF NOT EXISTS idx_group_stats_albumartist ON group_stats(type, kind, album_artist_sort_key, album_sort_key);"
+
+#define I_GROUP_STATS_SONGARTISTID		\
+  "CREATE INDEX IF NOT EXISTS idx_group_stats_sari ON group_stats(type, kind, songartistid);"
+
 #define I_PL_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path);"
 
@@ -398,6 +466,9 @@ static const struct db_init_query db_init_index_queries[] =
     { I_PLITEMID,  "create playlist id index" },
 
     { I_GRP_PERSIST, "create groups persistentid index" },
+    { I_GROUP_STATS_ALBUM, "create group stats album index" },
+    { I_GROUP_STATS_ALBUMARTIST, "create group stats album_artist index" },
+    { I_GROUP_STATS_SONGARTISTID, "create group stats songartistid index" },
 
     { I_PAIRING,   "create pairing guid index" },
 
@@ -425,10 +496,136 @@ static const struct db_init_query db_init_index_queries[] =
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
   " END;"
 
+#define Q_GROUP_STATS_DEFERRED										\
+  " EXISTS (SELECT 1 FROM group_stats_pending WHERE type = 0)"
+
+/* Recomputes the group_stats rows of a group, col is songalbumid or
+ * songartistid, and id is the persistentid of the group (NEW.col or OLD.col).
+ * During library scans the group is instead added to group_stats_pending, so
+ * that each group is recomputed once per commit, see group_stats_flush().
+ */
+#define Q_GROUP_STATS_UPDATE(type, col, id)								\
+  "   INSERT OR IGNORE INTO group_stats_pending (type, persistentid)"					\
+  "     SELECT " type ", " id " WHERE" Q_GROUP_STATS_DEFERRED ";"					\
+  "   DELETE FROM group_stats WHERE type = " type " AND persistentid = " id				\
+  "     AND NOT" Q_GROUP_STATS_DEFERRED ";"								\
+  "   INSERT INTO group_stats (" Q_GROUP_STATS_COLS ")"							\
+  "     SELECT " type ", f." col ", 0," Q_GROUP_STATS_AGGR						\
+  "     FROM files f WHERE f.disabled = 0 AND f." col " = " id " AND NOT" Q_GROUP_STATS_DEFERRED	\
+  "     GROUP BY f." col ";"										\
+  "   INSERT INTO group_stats (" Q_GROUP_STATS_COLS ")"							\
+  "     SELECT " type ", f." col ", f.media_kind," Q_GROUP_STATS_AGGR					\
+  "     FROM files f WHERE f.disabled = 0 AND f." col " = " id " AND NOT" Q_GROUP_STATS_DEFERRED	\
+  "     GROUP BY f." col ", f.media_kind;"
+
+// Pings and updates of other columns must not trigger a recompute
+#define Q_GROUP_STATS_CHANGED										\
+  " (OLD.disabled = 0 OR NEW.disabled = 0) AND (OLD.disabled IS NOT NEW.disabled"			\
+  "   OR OLD.songalbumid IS NOT NEW.songalbumid OR OLD.songartistid IS NOT NEW.songartistid"		\
+  "   OR OLD.album IS NOT NEW.album OR OLD.album_sort IS NOT NEW.album_sort"				\
+  "   OR OLD.album_artist IS NOT NEW.album_artist OR OLD.album_artist_sort IS NOT NEW.album_artist_sort"	\
+  "   OR OLD.song_length IS NOT NEW.song_length OR OLD.data_kind IS NOT NEW.data_kind"			\
+  "   OR OLD.media_kind IS NOT NEW.media_kind OR OLD.year IS NOT NEW.year"				\
+  "   OR OLD.date_released IS NOT NEW.date_released OR OLD.time_added IS NOT NEW.time_added"		\
+  "   OR OLD.time_played IS NOT NEW.time_played OR OLD.seek IS NOT NEW.seek)"
+
+#define TRG_GROUP_STATS_INSERT										\
+  "CREATE TRIGGER trg_group_stats_insert AFTER INSERT ON files FOR EACH ROW WHEN NEW.disabled = 0"	\
+  " BEGIN"												\
+  Q_GROUP_STATS_UPDATE("1", "songalbumid", "NEW.songalbumid")						\
+  Q_GROUP_STATS_UPDATE("2", "songartistid", "NEW.songartistid")					\
+  " END;"
+
+#define TRG_GROUP_STATS_DELETE										\
+  "CREATE TRIGGER trg_group_stats_delete AFTER DELETE ON files FOR EACH ROW WHEN OLD.disabled = 0"	\
+  " BEGIN"												\
+  Q_GROUP_STATS_UPDATE("1", "songalbumid", "OLD.songalbumid")						\
+  Q_GROUP_STATS_UPDATE("2", "songartistid", "OLD.songartistid")					\
+  " END;"
+
+#define TRG_GROUP_STATS_UPDATE										\
+  "CREATE TRIGGER trg_group_stats_update AFTER UPDATE ON files FOR EACH ROW WHEN" Q_GROUP_STATS_CHANGED	\
+  " BEGIN"												\
+  Q_GROUP_STATS_UPDATE("1", "songalbumid", "NEW.songalbumid")						\
+  Q_GROUP_STATS_UPDATE("2", "songartistid", "NEW.songartistid")					\
+  " END;"
+
+// If the file moved to another group, the group it left must be updated too
+#define TRG_GROUP_STATS_UPDATE_OLD									\
+  "CREATE TRIGGER trg_group_stats_update_old AFTER UPDATE OF songalbumid, songartistid ON files FOR EACH ROW" \
+  " WHEN OLD.disabled = 0 AND (OLD.songalbumid <> NEW.songalbumid OR OLD.songartistid <> NEW.songartistid)" \
+  " BEGIN"												\
+  Q_GROUP_STATS_UPDATE("1", "songalbumid", "OLD.songalbumid")						\
+  Q_GROUP_STATS_UPDATE("2", "songartistid", "OLD.songartistid")					\
+  " END;"
+
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_GROUP_STATS_INSERT,      "create trigger trg_group_stats_insert" },
+    { TRG_GROUP_STATS_DELETE,      "create trigger trg_group_stats_delete" },
+    { TRG_GROUP_STATS_UPDATE,      "create trigger trg_group_stats_update" },
+    { TRG_GROUP_STATS_UPDATE_OLD,  "create trigger trg_group_stats_update_old" },
+  };
+
+
+/* Full-text index for searching files, see db_mprintf_like(). It requires
+ * FTS5 with the trigram tokenizer (sqlite 3.34), so it is optional and not
+ * part of the regular tables. Since it has external content, the triggers must
+ * give it the same values that were indexed when deleting.
+ */
+
+#define T_FILES_FTS							\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("		\
+  "   title, artist, album, album_artist, composer, genre, virtual_path,"	\
+  "   content = 'files', content_rowid = 'id', tokenize = 'trigram'"	\
+  ");"
+
+#define Q_FILES_FTS_PROBE						\
+  "SELECT rowid FROM files_fts LIMIT 1;"
+
+#define Q_FILES_FTS_REBUILD						\
+  "INSERT INTO files_fts (files_fts) VALUES ('rebuild');"
+
+#define Q_FILES_FTS_TRIGGER_EXISTS					\
+  "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name = 'trg_files_fts_insert';"
+
+#define TRG_FILES_FTS_INSERT										\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_insert AFTER INSERT ON files FOR EACH ROW"			\
+  " BEGIN"												\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre, virtual_path)"		\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre, NEW.virtual_path);" \
+  " END;"
+
+#define TRG_FILES_FTS_DELETE										\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_delete AFTER DELETE ON files FOR EACH ROW"			\
+  " BEGIN"												\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre, virtual_path)" \
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre, OLD.virtual_path);" \
+  " END;"
+
+#define TRG_FILES_FTS_UPDATE										\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_update AFTER UPDATE OF title, artist, album, album_artist, composer, genre, virtual_path ON files FOR EACH ROW" \
+  " BEGIN"												\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre, virtual_path)" \
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre, OLD.virtual_path);" \
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre, virtual_path)"		\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre, NEW.virtual_path);" \
+  " END;"
+
+static const struct db_init_query db_init_fts_trigger_queries[] =
+  {
+    { TRG_FILES_FTS_INSERT,        "create trigger trg_files_fts_insert" },
+    { TRG_FILES_FTS_DELETE,        "create trigger trg_files_fts_delete" },
+    { TRG_FILES_FTS_UPDATE,        "create trigger trg_files_fts_update" },
+  };
+
+static const char *db_init_fts_trigger_names[] =
+  {
+    "trg_files_fts_insert",
+    "trg_files_fts_delete",
+    "trg_files_fts_update",
   };
 
 
@@ -543,3 +740,87 @@ db_init_tables(sqlite3 *hdl)
   return ret;
 }
 
+static void
+db_init_fts_drop_triggers(sqlite3 *hdl)
+{
+  char *query;
+  int i;
+
+  for (i = 0; i < (sizeof(db_init_fts_trigger_names) / sizeof(db_init_fts_trigger_names[0])); i++)
+    {
+      query = sqlite3_mprintf("DROP TRIGGER IF EXISTS %s;", db_init_fts_trigger_names[i]);
+      sqlite3_exec(hdl, query, NULL, NULL, NULL);
+      sqlite3_free(query);
+    }
+}
+
+/* Creates the full-text index if sqlite supports it, returns -1 if it doesn't.
+ * The index is (re)built if its triggers are missing, which is the case when it
+ * is new, after a schema upgrade (db_upgrade() drops all triggers) and after
+ * the database was used by an sqlite without FTS5.
+ */
+int
+db_init_fts(sqlite3 *hdl)
+{
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int has_triggers;
+  int i;
+  int ret;
+
+  ret = sqlite3_exec(hdl, T_FILES_FTS, NULL, NULL, &errmsg);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_exec(hdl, Q_FILES_FTS_PROBE, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Full-text search index not supported by sqlite (%s), will search without\n", errmsg);
+
+      sqlite3_free(errmsg);
+      goto error;
+    }
+
+  has_triggers = 0;
+  ret = sqlite3_prepare_v2(hdl, Q_FILES_FTS_TRIGGER_EXISTS, -1, &stmt, NULL);
+  if (ret == SQLITE_OK)
+    {
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+	has_triggers = sqlite3_column_int(stmt, 0);
+
+      sqlite3_finalize(stmt);
+    }
+
+  if (!has_triggers)
+    {
+      DPRINTF(E_LOG, L_DB, "Building full-text search index, this may take some time...\n");
+
+      ret = sqlite3_exec(hdl, Q_FILES_FTS_REBUILD, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "DB init error: could not build full-text search index: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  goto error;
+	}
+    }
+
+  for (i = 0; i < (sizeof(db_init_fts_trigger_queries) / sizeof(db_init_fts_trigger_queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init trigger query: %s\n", db_init_fts_trigger_queries[i].desc);
+
+      ret = sqlite3_exec(hdl, db_init_fts_trigger_queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "DB init error: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  goto error;
+	}
+    }
+
+  return 0;
+
+ error:
+  // Without the triggers the files table can be updated without FTS5
+  db_init_fts_drop_triggers(hdl);
+  return -1;
+}
@@ -26,7 +26,21 @@
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * forked-daapd after the database was upgraded. */
 #define SCHEMA_VERSION_MAJOR 21
-#define SCHEMA_VERSION_MINOR 06
+#define SCHEMA_VERSION_MINOR 10
+
+/* Columns of group_stats and the aggregates of the files of a group that fill
+ * them, used by the trg_group_stats triggers and group_stats_flush()
+ */
+#define Q_GROUP_STATS_COLS										\
+  "type, persistentid, kind, album, album_sort, album_artist, album_artist_sort, songartistid,"		\
+  " track_count, album_count, song_length, data_kind, media_kind, year, date_released,"		\
+  " time_added, time_played, seek, album_sort_key, album_artist_sort_key"
+
+#define Q_GROUP_STATS_AGGR										\
+  " f.album, f.album_sort, f.album_artist, f.album_artist_sort, f.songartistid,"			\
+  " COUNT(f.id), COUNT(DISTINCT f.songalbumid), SUM(f.song_length), MIN(f.data_kind), MIN(f.media_kind),"	\
+  " MAX(f.year), MAX(f.date_released), MAX(f.time_added), MAX(f.time_played), MAX(f.seek),"		\
+  " f.album_sort_key, f.album_artist_sort_key"
 
 int
 db_init_indices(sqlite3 *hdl);
@@ -37,4 +51,7 @@ db_init_triggers(sqlite3 *hdl);
 int
 db_init_tables(sqlite3 *hdl);
 
+int
+db_init_fts(sqlite3 *hdl);
+
 #endif /* SRC_DB_INIT_H_ */
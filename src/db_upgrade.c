@@ -1161,6 +1161,139 @@ static const struct db_upgrade_query db_upgrade_v2106_queries[] =
   };
 
 
+/* ---------------------------- 21.06 -> 21.07 ------------------------------ */
+
+#define U_v2107_CREATE_TABLE_GROUP_STATS				\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   id                 INTEGER PRIMARY KEY NOT NULL,"		\
+  "   type               INTEGER NOT NULL,"				\
+  "   persistentid       INTEGER NOT NULL,"				\
+  "   kind               INTEGER NOT NULL,"				\
+  "   album              VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_sort         VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_artist       VARCHAR(1024) COLLATE DAAP,"			\
+  "   album_artist_sort  VARCHAR(1024) COLLATE DAAP,"			\
+  "   songartistid       INTEGER DEFAULT 0,"				\
+  "   track_count        INTEGER DEFAULT 0,"				\
+  "   album_count        INTEGER DEFAULT 0,"				\
+  "   song_length        INTEGER DEFAULT 0,"				\
+  "   data_kind          INTEGER DEFAULT 0,"				\
+  "   media_kind         INTEGER DEFAULT 0,"				\
+  "   year               INTEGER DEFAULT 0,"				\
+  "   date_released      INTEGER DEFAULT 0,"				\
+  "   time_added         INTEGER DEFAULT 0,"				\
+  "   time_played        INTEGER DEFAULT 0,"				\
+  "   seek               INTEGER DEFAULT 0,"				\
+  "CONSTRAINT group_stats_unique_kind UNIQUE (type, persistentid, kind)" \
+  ");"
+
+#define U_v2107_GROUP_STATS_FILL(type, col, kind, group)						\
+  "INSERT INTO group_stats (type, persistentid, kind, album, album_sort, album_artist, album_artist_sort,"	\
+  "   songartistid, track_count, album_count, song_length, data_kind, media_kind, year, date_released,"	\
+  "   time_added, time_played, seek)"									\
+  " SELECT " type ", f." col ", " kind ", f.album, f.album_sort, f.album_artist, f.album_artist_sort,"	\
+  "   f.songartistid, COUNT(f.id), COUNT(DISTINCT f.songalbumid), SUM(f.song_length), MIN(f.data_kind),"	\
+  "   MIN(f.media_kind), MAX(f.year), MAX(f.date_released), MAX(f.time_added), MAX(f.time_played), MAX(f.seek)" \
+  " FROM files f WHERE f.disabled = 0 GROUP BY " group ";"
+
+#define U_v2107_FILL_ALBUMS \
+  U_v2107_GROUP_STATS_FILL("1", "songalbumid", "0", "f.songalbumid")
+#define U_v2107_FILL_ALBUMS_KIND \
+  U_v2107_GROUP_STATS_FILL("1", "songalbumid", "f.media_kind", "f.songalbumid, f.media_kind")
+#define U_v2107_FILL_ARTISTS \
+  U_v2107_GROUP_STATS_FILL("2", "songartistid", "0", "f.songartistid")
+#define U_v2107_FILL_ARTISTS_KIND \
+  U_v2107_GROUP_STATS_FILL("2", "songartistid", "f.media_kind", "f.songartistid, f.media_kind")
+
+#define U_v2107_SCVER_MINOR                    \
+  "UPDATE admin SET value = '07' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2107_queries[] =
+  {
+    { U_v2107_CREATE_TABLE_GROUP_STATS, "create table group_stats" },
+    { U_v2107_FILL_ALBUMS,        "fill group_stats with albums" },
+    { U_v2107_FILL_ALBUMS_KIND,   "fill group_stats with albums per media kind" },
+    { U_v2107_FILL_ARTISTS,       "fill group_stats with artists" },
+    { U_v2107_FILL_ARTISTS_KIND,  "fill group_stats with artists per media kind" },
+
+    { U_v2107_SCVER_MINOR,    "set schema_version_minor to 07" },
+  };
+
+
+/* ---------------------------- 21.07 -> 21.08 ------------------------------ */
+
+// The keys are filled by db.c after the upgrade, see sort_keys_fill()
+#define U_v2108_ALTER_FILES_ADD_TITLE_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN title_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2108_ALTER_FILES_ADD_ALBUM_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2108_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_artist_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2108_ALTER_FILES_ADD_COMPOSER_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN composer_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2108_ALTER_GROUP_STATS_ADD_ALBUM_SORT_KEY \
+  "ALTER TABLE group_stats ADD COLUMN album_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2108_ALTER_GROUP_STATS_ADD_ALBUM_ARTIST_SORT_KEY \
+  "ALTER TABLE group_stats ADD COLUMN album_artist_sort_key VARCHAR(1024) DEFAULT NULL;"
+
+#define U_v2108_SCVER_MINOR                    \
+  "UPDATE admin SET value = '08' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2108_queries[] =
+  {
+    { U_v2108_ALTER_FILES_ADD_TITLE_SORT_KEY,             "alter table files add column title_sort_key" },
+    { U_v2108_ALTER_FILES_ADD_ALBUM_SORT_KEY,             "alter table files add column album_sort_key" },
+    { U_v2108_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY,      "alter table files add column album_artist_sort_key" },
+    { U_v2108_ALTER_FILES_ADD_COMPOSER_SORT_KEY,          "alter table files add column composer_sort_key" },
+    { U_v2108_ALTER_GROUP_STATS_ADD_ALBUM_SORT_KEY,       "alter table group_stats add column album_sort_key" },
+    { U_v2108_ALTER_GROUP_STATS_ADD_ALBUM_ARTIST_SORT_KEY, "alter table group_stats add column album_artist_sort_key" },
+
+    { U_v2108_SCVER_MINOR,    "set schema_version_minor to 08" },
+  };
+
+
+/* ---------------------------- 21.08 -> 21.09 ------------------------------ */
+
+// The table is filled by db_smartpl_refresh() when the library thread starts
+#define U_v2109_CREATE_TABLE_SMARTPL_ITEMS				\
+  "CREATE TABLE IF NOT EXISTS smartpl_items ("			\
+  "   playlistid     INTEGER NOT NULL,"				\
+  "   fileid         INTEGER NOT NULL,"				\
+  "CONSTRAINT smartpl_items_unique UNIQUE (playlistid, fileid)"	\
+  ");"
+
+#define U_v2109_SCVER_MINOR                    \
+  "UPDATE admin SET value = '09' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2109_queries[] =
+  {
+    { U_v2109_CREATE_TABLE_SMARTPL_ITEMS, "create table smartpl_items" },
+
+    { U_v2109_SCVER_MINOR,    "set schema_version_minor to 09" },
+  };
+
+
+/* ---------------------------- 21.09 -> 21.10 ------------------------------ */
+
+// Used by the trg_group_stats triggers, which are recreated after upgrades
+#define U_v2110_CREATE_TABLE_GROUP_STATS_PENDING			\
+  "CREATE TABLE IF NOT EXISTS group_stats_pending ("			\
+  "   type           INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "CONSTRAINT group_stats_pending_unique UNIQUE (type, persistentid)"	\
+  ");"
+
+#define U_v2110_SCVER_MINOR                    \
+  "UPDATE admin SET value = '10' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2110_queries[] =
+  {
+    { U_v2110_CREATE_TABLE_GROUP_STATS_PENDING, "create table group_stats_pending" },
+
+    { U_v2110_SCVER_MINOR,    "set schema_version_minor to 10" },
+  };
+
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1357,6 +1490,34 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2106:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2107_queries, ARRAY_SIZE(db_upgrade_v2107_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2107:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2108_queries, ARRAY_SIZE(db_upgrade_v2108_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2108:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2109_queries, ARRAY_SIZE(db_upgrade_v2109_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2109:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2110_queries, ARRAY_SIZE(db_upgrade_v2110_queries));
+      if (ret < 0)
+	return -1;
+
 
       /* Last case statement is the only one that ends with a break statement! */
       break;
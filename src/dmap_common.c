@@ -211,7 +211,7 @@ dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str)
 }
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
 {
   union {
     int32_t v_i32;
@@ -385,14 +385,36 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 }
 
 
+/* Integer fields in struct media_file_info are uint32_t, except for these */
+static int64_t
+mfi_field_int(struct media_file_info *mfi, ssize_t offset)
+{
+  switch (offset)
+    {
+      case mfi_offsetof(file_size):
+	return mfi->file_size;
+
+      case mfi_offsetof(disabled):
+	return mfi->disabled;
+
+      case mfi_offsetof(songartistid):
+	return mfi->songartistid;
+
+      case mfi_offsetof(songalbumid):
+	return mfi->songalbumid;
+
+      default:
+	return *(uint32_t *) ((char *)mfi + offset);
+    }
+}
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct media_file_info *mfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
-  char *ptr;
-  int32_t val;
+  char *strval;
+  int64_t val;
   int want_mikd;
   int want_asdk;
   int want_ased;
@@ -458,44 +480,45 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
       DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
 
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      /* Here's one exception ... codectype (ascd) is actually an integer, but
+       * we store it as a string */
+      if ((df->type == DMAP_TYPE_STRING) || (dfm == &dfm_dmap_ascd))
+	{
+	  strval = *(char **) ((char *)mfi + dfm->mfi_offset);
+	  if (!strval || (*strval == '\0'))
+	    continue;
 
-      if (!(*strval) || (**strval == '\0'))
-	continue;
+	  if (dfm == &dfm_dmap_ascd)
+	    {
+	      dmap_add_literal(song, df->tag, strval, 4);
+	      continue;
+	    }
 
-      /* Here's one exception ... codectype (ascd) is actually an integer */
-      if (dfm == &dfm_dmap_ascd)
+	  val = 0;
+	}
+      else
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
-	  continue;
+	  strval = NULL;
+	  val = mfi_field_int(mfi, dfm->mfi_offset);
 	}
 
-      val = 0;
-
       if (force_wav)
 	{
 	  switch (dfm->mfi_offset)
 	    {
-	      case dbmfi_offsetof(type):
-		ptr = "wav";
-		strval = &ptr;
+	      case mfi_offsetof(type):
+		strval = "wav";
 		break;
 
-	      case dbmfi_offsetof(bitrate):
-		val = 0;
-		ret = safe_atoi32(dbmfi->samplerate, &val);
-		if ((ret < 0) || (val == 0))
+	      case mfi_offsetof(bitrate):
+		if (mfi->samplerate == 0)
 		  val = 1411;
 		else
-		  val = (val * 8) / 250;
-
-		ptr = NULL;
-		strval = &ptr;
+		  val = (mfi->samplerate * 8) / 250;
 		break;
 
-	      case dbmfi_offsetof(description):
-		ptr = "wav audio file";
-		strval = &ptr;
+	      case mfi_offsetof(description):
+		strval = "wav audio file";
 		break;
 
 	      default:
@@ -503,9 +526,9 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 	    }
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      dmap_add_field(song, df, strval, val);
 
-      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s\n", df->desc);
     }
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
@@ -517,13 +540,13 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
   if (sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      dmap_add_string(song, "assn", mfi->title_sort);
+      dmap_add_string(song, "assa", mfi->artist_sort);
+      dmap_add_string(song, "assu", mfi->album_sort);
+      dmap_add_string(song, "assl", mfi->album_artist_sort);
 
-      if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+      if (mfi->composer_sort)
+	dmap_add_string(song, "assc", mfi->composer_sort);
     }
 
   val = 0;
@@ -538,17 +561,11 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   if (want_mikd)
     {
       /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
+      dmap_add_char(songlist, "mikd", mfi->item_kind);
     }
   if (want_asdk)
     {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+      dmap_add_char(songlist, "asdk", mfi->data_kind);
     }
 
   ret = evbuffer_add_buffer(songlist, song);
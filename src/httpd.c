@@ -74,6 +74,7 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+#define HTTPD_GZIP_CHUNK_SIZE (64 * 1024)
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -1349,7 +1350,11 @@ httpd_gzip_deflate(struct evbuffer *in)
 {
   struct evbuffer *out;
   struct evbuffer_iovec iovec[1];
+  struct evbuffer_iovec chain;
+  struct evbuffer_ptr pos;
+  size_t remaining;
   z_stream strm;
+  int flush;
   int ret;
 
   strm.zalloc = Z_NULL;
@@ -1364,9 +1369,6 @@ httpd_gzip_deflate(struct evbuffer *in)
       return NULL;
     }
 
-  strm.next_in = evbuffer_pullup(in, -1);
-  strm.avail_in = evbuffer_get_length(in);
-
   out = evbuffer_new();
   if (!out)
     {
@@ -1374,26 +1376,65 @@ httpd_gzip_deflate(struct evbuffer *in)
       goto out_deflate_end;
     }
 
-  // We use this to avoid a memcpy. The 512 is an arbitrary padding to make sure
-  // there is enough space, even if the compressed output should be slightly
-  // larger than input (could happen with small inputs).
-  ret = evbuffer_reserve_space(out, strm.avail_in + 512, iovec, 1);
-  if (ret < 0)
+  // We compress the input one chain at a time and the output in blocks of
+  // HTTPD_GZIP_CHUNK_SIZE. For large replies (e.g. a big DAAP song list) this
+  // means we never need a contiguous copy of the input (evbuffer_pullup), nor
+  // an output reservation the size of the input. The input is not modified.
+  remaining = evbuffer_get_length(in);
+  evbuffer_ptr_set(in, &pos, 0, EVBUFFER_PTR_SET);
+  do
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
-      goto out_evbuf_free;
-    }
+      chain.iov_base = NULL;
+      chain.iov_len = 0;
+
+      if (remaining > 0)
+	{
+	  ret = evbuffer_peek(in, -1, &pos, &chain, 1);
+	  if ((ret < 1) || (chain.iov_len == 0))
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not read reply for gzipping\n");
+	      goto out_evbuf_free;
+	    }
+
+	  if (chain.iov_len > remaining)
+	    chain.iov_len = remaining;
+
+	  remaining -= chain.iov_len;
+	  if (remaining > 0)
+	    evbuffer_ptr_set(in, &pos, chain.iov_len, EVBUFFER_PTR_ADD);
+	}
+
+      strm.next_in = chain.iov_base;
+      strm.avail_in = chain.iov_len;
 
-  strm.next_out = iovec[0].iov_base;
-  strm.avail_out = iovec[0].iov_len;
+      flush = (remaining > 0) ? Z_NO_FLUSH : Z_FINISH;
+
+      do
+	{
+	  ret = evbuffer_reserve_space(out, HTTPD_GZIP_CHUNK_SIZE, iovec, 1);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
+	      goto out_evbuf_free;
+	    }
+
+	  strm.next_out = iovec[0].iov_base;
+	  strm.avail_out = iovec[0].iov_len;
+
+	  ret = deflate(&strm, flush);
+	  if (ret == Z_STREAM_ERROR)
+	    goto out_evbuf_free;
+
+	  iovec[0].iov_len -= strm.avail_out;
+	  evbuffer_commit_space(out, iovec, 1);
+	}
+      while (strm.avail_out == 0);
+    }
+  while (flush != Z_FINISH);
 
-  ret = deflate(&strm, Z_FINISH);
   if (ret != Z_STREAM_END)
     goto out_evbuf_free;
 
-  iovec[0].iov_len -= strm.avail_out;
-
-  evbuffer_commit_space(out, iovec, 1);
   deflateEnd(&strm);
 
   return out;
@@ -37,6 +37,7 @@
 #include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <uninorm.h>
 #include <unistd.h>
@@ -54,6 +55,7 @@
 #include "daap_query.h"
 #include "dmap_common.h"
 #include "cache.h"
+#include "listener.h"
 
 
 /* httpd event base, from httpd.c */
@@ -72,6 +74,14 @@ extern struct event_base *evbase_httpd;
 #define DAAP_SESSION_TIMEOUT_CAPABILITY 1800   // 30 minutes
 /* Update requests refresh interval in seconds */
 #define DAAP_UPDATE_REFRESH  0
+/* Number of recent revisions that clients can get a delta song list for */
+#define DAAP_REVISIONS 64
+/* Number of revisions reserved at a time in the admin table, see revision_add() */
+#define DAAP_REVISIONS_RESERVE 1024
+
+/* Number of encoded song list items kept in memory, and max size of each */
+#define DAAP_ITEM_CACHE_SLOTS 16384
+#define DAAP_ITEM_CACHE_RECORD_MAX 2048
 
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
@@ -108,6 +118,13 @@ struct daap_update_request {
   struct daap_update_request *next;
 };
 
+struct daap_revision {
+  int rev;
+
+  /* Files journal seq at the time of the revision */
+  uint64_t seq;
+};
+
 struct sort_ctx {
   struct evbuffer *headerlist;
   int16_t mshc;
@@ -127,8 +144,14 @@ static struct daap_session *daap_sessions;
 
 /* Update requests */
 static int current_rev;
+static int reserved_rev;
 static struct daap_update_request *update_requests;
 static struct timeval daap_update_refresh_tv = { DAAP_UPDATE_REFRESH, 0 };
+static struct event *daap_updateev;
+
+/* Recent revisions, see revision_seq() */
+static struct daap_revision daap_revisions[DAAP_REVISIONS];
+static int daap_revisions_head;
 
 
 /* -------------------------- SESSION HANDLING ------------------------------ */
@@ -287,19 +310,14 @@ update_remove(struct daap_update_request *ur)
 }
 
 static void
-update_refresh_cb(int fd, short event, void *arg)
+update_send(struct daap_update_request *ur)
 {
-  struct daap_update_request *ur;
   struct evhttp_connection *evcon;
   struct evbuffer *reply;
 
-  ur = (struct daap_update_request *)arg;
-
   CHECK_NULL(L_DAAP, reply = evbuffer_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(reply, 32));
 
-  current_rev++;
-
   /* Send back current revision */
   dmap_add_container(reply, "mupd", 24);
   dmap_add_int(reply, "mstt", 200);         /* 12 */
@@ -313,6 +331,79 @@ update_refresh_cb(int fd, short event, void *arg)
   update_remove(ur);
 }
 
+static void
+update_refresh_cb(int fd, short event, void *arg)
+{
+  update_send((struct daap_update_request *)arg);
+}
+
+/* Starts a new revision, remembering how far the files journal was then. A
+ * client that has the song list of a revision can later ask for just the songs
+ * that changed after it, see daap_reply_songlist_generic(). The revisions are
+ * reserved in blocks in the admin table, so that the next run continues after
+ * them and a client never gets a delta for a revision of a previous run.
+ */
+static void
+revision_add(void)
+{
+  int ret;
+
+  current_rev++;
+
+  if (current_rev > reserved_rev)
+    {
+      reserved_rev = current_rev + DAAP_REVISIONS_RESERVE - 1;
+
+      ret = db_admin_setint(DB_ADMIN_DAAP_REVISION, reserved_rev);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DAAP, "Could not save DAAP revision %d\n", reserved_rev);
+    }
+
+  daap_revisions[daap_revisions_head].rev = current_rev;
+  daap_revisions[daap_revisions_head].seq = db_files_journal_seq();
+
+  daap_revisions_head = (daap_revisions_head + 1) % DAAP_REVISIONS;
+}
+
+/* Gets the files journal seq of a recent revision, returns -1 if unknown */
+static int
+revision_seq(int rev, uint64_t *seq)
+{
+  int i;
+
+  if (rev <= 0)
+    return -1;
+
+  for (i = 0; i < DAAP_REVISIONS; i++)
+    {
+      if (daap_revisions[i].rev == rev)
+	{
+	  *seq = daap_revisions[i].seq;
+	  return 0;
+	}
+    }
+
+  return -1;
+}
+
+static void
+update_db_cb(int fd, short event, void *arg)
+{
+  revision_add();
+
+  DPRINTF(E_DBG, L_DAAP, "Library changed, now at revision %d\n", current_rev);
+
+  while (update_requests)
+    update_send(update_requests);
+}
+
+/* Thread: the one that changed the library */
+static void
+update_listener_cb(short event_mask)
+{
+  event_active(daap_updateev, 0, 0);
+}
+
 static void
 update_fail_cb(struct evhttp_connection *evcon, void *arg)
 {
@@ -462,6 +553,154 @@ daap_sort_finalize(struct sort_ctx *ctx)
 }
 
 
+/* ----------------------------- ITEM CACHE --------------------------------- */
+
+/* Encoded "mlit" records of song list replies, so the same item doesn't need to
+ * be encoded again for every request. The cache is direct-mapped on (file id,
+ * meta set), and an entry is only used if the fields that can change without a
+ * rescan (see daap_item_stamp) are unchanged. Used by both the httpd thread and
+ * the cache thread, hence the lock.
+ */
+struct daap_item_stamp {
+  int64_t disabled;
+  uint32_t db_timestamp;
+  uint32_t time_played;
+  uint32_t time_skipped;
+  uint32_t play_count;
+  uint32_t skip_count;
+  uint32_t rating;
+};
+
+struct daap_item {
+  uint32_t id;
+  uint64_t metakey;
+  struct daap_item_stamp stamp;
+
+  size_t len;
+  uint8_t *data;
+};
+
+static struct daap_item *daap_items;
+static pthread_mutex_t daap_items_lck;
+
+static void
+daap_item_stamp_set(struct daap_item_stamp *stamp, struct media_file_info *mfi)
+{
+  memset(stamp, 0, sizeof(struct daap_item_stamp));
+
+  stamp->disabled = mfi->disabled;
+  stamp->db_timestamp = mfi->db_timestamp;
+  stamp->time_played = mfi->time_played;
+  stamp->time_skipped = mfi->time_skipped;
+  stamp->play_count = mfi->play_count;
+  stamp->skip_count = mfi->skip_count;
+  stamp->rating = mfi->rating;
+}
+
+// Identifies the requested meta set, the lowest bit is reserved for transcode
+static uint64_t
+daap_item_metakey(const struct dmap_field **meta, int nmeta, int sort_headers)
+{
+  uint64_t key;
+
+  key = murmur_hash64(meta, nmeta * sizeof(*meta), 0) ^ ((uint64_t)nmeta << 2);
+  if (sort_headers)
+    key ^= 2;
+
+  return key & ~(uint64_t)1;
+}
+
+static struct daap_item *
+daap_item_slot(uint32_t id, uint64_t metakey)
+{
+  return &daap_items[(id ^ metakey ^ (metakey >> 32)) % DAAP_ITEM_CACHE_SLOTS];
+}
+
+// Adds the cached record for mfi to songlist, returns -1 if there is none
+static int
+daap_item_cache_get(struct evbuffer *songlist, struct media_file_info *mfi, uint64_t metakey)
+{
+  struct daap_item_stamp stamp;
+  struct daap_item *item;
+  int ret;
+
+  if (!daap_items)
+    return -1;
+
+  daap_item_stamp_set(&stamp, mfi);
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&daap_items_lck));
+
+  item = daap_item_slot(mfi->id, metakey);
+  if (!item->data || (item->id != mfi->id) || (item->metakey != metakey) || (memcmp(&item->stamp, &stamp, sizeof(stamp)) != 0))
+    ret = -1;
+  else
+    ret = evbuffer_add(songlist, item->data, item->len);
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_items_lck));
+
+  return ret;
+}
+
+static void
+daap_item_cache_add(struct evbuffer *record, struct media_file_info *mfi, uint64_t metakey)
+{
+  struct daap_item *item;
+  uint8_t *data;
+  size_t len;
+
+  if (!daap_items)
+    return;
+
+  len = evbuffer_get_length(record);
+  if (len > DAAP_ITEM_CACHE_RECORD_MAX)
+    return;
+
+  data = malloc(len);
+  if (!data)
+    return;
+
+  evbuffer_copyout(record, data, len);
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&daap_items_lck));
+
+  item = daap_item_slot(mfi->id, metakey);
+  free(item->data);
+
+  item->id = mfi->id;
+  item->metakey = metakey;
+  daap_item_stamp_set(&item->stamp, mfi);
+  item->len = len;
+  item->data = data;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_items_lck));
+}
+
+static void
+daap_item_cache_init(void)
+{
+  CHECK_NULL(L_DAAP, daap_items = calloc(DAAP_ITEM_CACHE_SLOTS, sizeof(struct daap_item)));
+  CHECK_ERR(L_DAAP, mutex_init(&daap_items_lck));
+}
+
+static void
+daap_item_cache_deinit(void)
+{
+  int i;
+
+  if (!daap_items)
+    return;
+
+  for (i = 0; i < DAAP_ITEM_CACHE_SLOTS; i++)
+    free(daap_items[i].data);
+
+  free(daap_items);
+  daap_items = NULL;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_destroy(&daap_items_lck));
+}
+
+
 /* ----------------------------- OTHER HELPERS ------------------------------ */
 
 /* We try not to return items that the client cannot play (like Spotify and
@@ -503,6 +742,71 @@ user_agent_filter(struct query_params *qp, struct httpd_request *hreq)
   DPRINTF(E_DBG, L_DAAP, "SQL filter w/client mod: %s\n", qp->filter);
 }
 
+static int
+delta_id_cmp(const void *a, const void *b)
+{
+  int64_t ia = *(const int64_t *)a;
+  int64_t ib = *(const int64_t *)b;
+
+  return (ia > ib) - (ia < ib);
+}
+
+/* If the client asks for the songs that changed after a revision it has (the
+ * delta parameter), and we still know which ones that is, the query is limited
+ * to those. Returns the sorted ids of the changed files, or -1 if the client
+ * must get the full list.
+ */
+static int
+delta_filter(struct query_params *qp, struct httpd_request *hreq, int64_t **changed, int *nchanged)
+{
+  const char *param;
+  char *idlist;
+  char *filter;
+  uint64_t seq;
+  size_t len;
+  int delta;
+  int i;
+  int ret;
+
+  *changed = NULL;
+  *nchanged = 0;
+
+  // The revisions are only known to the httpd thread, not to cache rebuilds.
+  // With an index range we can't tell a deleted file from one outside the range.
+  if (!hreq->req || qp->idx_type != I_NONE)
+    return -1;
+
+  param = evhttp_find_header(hreq->query, "delta");
+  if (!param || safe_atoi32(param, &delta) < 0 || delta <= 0)
+    return -1;
+
+  ret = revision_seq(delta, &seq);
+  if (ret < 0 || db_files_journal_get(seq, changed, nchanged) < 0)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Changes since revision %d are unknown, sending full song list\n", delta);
+      return -1;
+    }
+
+  CHECK_NULL(L_DAAP, idlist = malloc(*nchanged * 21 + 3));
+
+  strcpy(idlist, "-1");
+  for (len = 2, i = 0; i < *nchanged; i++)
+    len += sprintf(idlist + len, ",%" PRIi64, (*changed)[i]);
+
+  if (qp->filter)
+    filter = safe_asprintf("%s AND (f.id IN (%s))", qp->filter, idlist);
+  else
+    filter = safe_asprintf("(f.id IN (%s))", idlist);
+
+  free(idlist);
+  free(qp->filter);
+  qp->filter = filter;
+
+  DPRINTF(E_DBG, L_DAAP, "Sending delta song list, %d files changed since revision %d\n", *nchanged, delta);
+
+  return 0;
+}
+
 static void
 query_params_set(struct query_params *qp, int *sort_headers, struct httpd_request *hreq, enum query_type type)
 {
@@ -600,7 +904,7 @@ query_params_set(struct query_params *qp, int *sort_headers, struct httpd_reques
     {
       DPRINTF(E_DBG, L_DAAP, "DAAP browse query filter: %s\n", param);
 
-      qp->filter = daap_query_parse_sql(param);
+      qp->filter = daap_query_parse_sql(param, (type != Q_PL));
       if (!qp->filter)
 	DPRINTF(E_LOG, L_DAAP, "Ignoring improper DAAP query: %s\n", param);
 
@@ -1028,7 +1332,8 @@ daap_reply_update(struct httpd_request *hreq)
       return DAAP_REPLY_ERROR;
     }
 
-  if (reqd_rev == 1) /* Or revision is not valid */
+  /* New clients ask for revision 1, others may have missed a change */
+  if (reqd_rev != current_rev)
     {
       CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 32));
 
@@ -1180,9 +1485,11 @@ static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   struct evbuffer *song;
+  struct evbuffer *record;
   struct evbuffer *songlist;
+  struct evbuffer *deleted;
   struct evkeyvalq *headers;
   struct daap_session *s;
   const struct dmap_field **meta;
@@ -1191,11 +1498,20 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   const char *client_codecs;
   const char *tag;
   char *last_codectype;
+  int64_t *changed;
+  int64_t *found;
+  int64_t id;
+  bool *returned;
+  uint64_t metabase;
+  uint64_t metakey;
   size_t len;
+  size_t dlen;
+  int nchanged;
   int nmeta;
   int sort_headers;
   int nsongs;
   int transcode;
+  int i;
   int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
@@ -1221,8 +1537,19 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       query_params_set(&qp, &sort_headers, hreq, Q_ITEMS);
     }
 
+  changed = NULL;
+  nchanged = 0;
+  returned = NULL;
+  deleted = NULL;
+  if (playlist == -1 && delta_filter(&qp, hreq, &changed, &nchanged) == 0)
+    {
+      CHECK_NULL(L_DAAP, returned = calloc(nchanged + 1, sizeof(bool)));
+      CHECK_NULL(L_DAAP, deleted = evbuffer_new());
+    }
+
   CHECK_NULL(L_DAAP, songlist = evbuffer_new());
   CHECK_NULL(L_DAAP, song = evbuffer_new());
+  CHECK_NULL(L_DAAP, record = evbuffer_new());
   CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
   CHECK_ERR(L_DAAP, evbuffer_expand(songlist, 4096));
@@ -1269,15 +1596,17 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       client_codecs = evhttp_find_header(headers, "Accept-Codecs");
     }
 
+  metabase = daap_item_metakey(meta, nmeta, sort_headers);
+
   nsongs = 0;
   last_codectype = NULL;
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
       nsongs++;
 
-      if (!dbmfi.codectype)
+      if (!mfi.codectype)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
+	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", mfi.fname);
 
 	  transcode = 0;
 	}
@@ -1285,26 +1614,51 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	{
 	  transcode = 1;
 	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
+      else if (!last_codectype || (strcmp(last_codectype, mfi.codectype) != 0))
 	{
-	  transcode = transcode_needed(hreq->user_agent, client_codecs, dbmfi.codectype);
+	  transcode = transcode_needed(hreq->user_agent, client_codecs, mfi.codectype);
 
 	  free(last_codectype);
-	  last_codectype = strdup(dbmfi.codectype);
+	  last_codectype = strdup(mfi.codectype);
 	}
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
+      metakey = metabase | (transcode ? 1 : 0);
+
+      if (returned)
+	{
+	  id = mfi.id;
+	  found = bsearch(&id, changed, nchanged, sizeof(int64_t), delta_id_cmp);
+	  if (found)
+	    returned[found - changed] = true;
+	}
+
+      ret = daap_item_cache_get(songlist, &mfi, metakey);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
+	  ret = dmap_encode_file_metadata(record, song, &mfi, meta, nmeta, sort_headers, transcode);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
 
-	  ret = -100;
-	  break;
+	      ret = -100;
+	      break;
+	    }
+
+	  daap_item_cache_add(record, &mfi, metakey);
+
+	  ret = evbuffer_add_buffer(songlist, record);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
+
+	      ret = -100;
+	      break;
+	    }
 	}
 
       if (sort_headers)
 	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
+	  ret = daap_sort_build(sctx, mfi.title_sort);
 	  if (ret < 0)
 	    {
 	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
@@ -1335,24 +1689,46 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       goto error;
     }
 
+  /* Changed files that are not in the reply have been deleted, disabled or no
+   * longer match the query, so the client should remove them */
+  dlen = 0;
+  if (deleted)
+    {
+      for (i = 0; i < nchanged; i++)
+	{
+	  if (!returned[i])
+	    dmap_add_int(deleted, "miid", (int)changed[i]); /* 12 */
+	}
+
+      dlen = evbuffer_get_length(deleted) + 8;
+    }
+
   /* Add header to evbuf, add songlist to evbuf */
   len = evbuffer_get_length(songlist);
   if (sort_headers)
     {
       daap_sort_finalize(sctx);
-      dmap_add_container(hreq->reply, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
+      dmap_add_container(hreq->reply, tag, len + dlen + evbuffer_get_length(sctx->headerlist) + 61);
     }
   else
-    dmap_add_container(hreq->reply, tag, len + 53);
+    dmap_add_container(hreq->reply, tag, len + dlen + 53);
 
+  // Update type 1 tells the client that the list only has the changed songs
   dmap_add_int(hreq->reply, "mstt", 200);        /* 12 */
-  dmap_add_char(hreq->reply, "muty", 0);         /* 9 */
+  dmap_add_char(hreq->reply, "muty", deleted ? 1 : 0); /* 9 */
   dmap_add_int(hreq->reply, "mtco", qp.results); /* 12 */
   dmap_add_int(hreq->reply, "mrco", nsongs);     /* 12 */
   dmap_add_container(hreq->reply, "mlcl", len); /* 8 */
 
   CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, songlist));
 
+  if (deleted)
+    {
+      dmap_add_container(hreq->reply, "mudl", dlen - 8); /* 8 */
+
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, deleted));
+    }
+
   if (sort_headers)
     {
       len = evbuffer_get_length(sctx->headerlist);
@@ -1362,16 +1738,26 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
     }
 
   daap_sort_context_free(sctx);
+  evbuffer_free(record);
   evbuffer_free(song);
   evbuffer_free(songlist);
+  if (deleted)
+    evbuffer_free(deleted);
+  free(returned);
+  free(changed);
   free_query_params(&qp, 1);
 
   return DAAP_REPLY_OK;
 
  error:
   daap_sort_context_free(sctx);
+  evbuffer_free(record);
   evbuffer_free(song);
   evbuffer_free(songlist);
+  if (deleted)
+    evbuffer_free(deleted);
+  free(returned);
+  free(changed);
   free_query_params(&qp, 1);
 
   return DAAP_REPLY_ERROR;
@@ -2240,6 +2626,20 @@ static struct httpd_uri_map daap_handlers[] =
     }
   };
 
+/* Only the list handlers are served from a snapshot, since they just read from
+ * the library. Others like login, update and stream use the normal connection.
+ */
+static bool
+daap_request_is_list(struct httpd_request *hreq)
+{
+  return (hreq->handler == daap_reply_dblist ||
+	  hreq->handler == daap_reply_browse ||
+	  hreq->handler == daap_reply_dbsonglist ||
+	  hreq->handler == daap_reply_playlists ||
+	  hreq->handler == daap_reply_plsonglist ||
+	  hreq->handler == daap_reply_groups);
+}
+
 
 /* ------------------------------- DAAP API --------------------------------- */
 
@@ -2258,6 +2658,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   struct daap_session session;
   const char *param;
   int32_t id;
+  bool snapshot;
   int ret;
   int msec;
 
@@ -2326,8 +2727,14 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   // No dice, let's call the handler so it can construct a reply and then send it (note that the reply may be an error)
   clock_gettime(CLOCK_MONOTONIC, &start);
 
+  // List requests only read from the library, so serve them from a snapshot
+  snapshot = daap_request_is_list(hreq) && (db_snapshot_begin() == 0);
+
   ret = hreq->handler(hreq);
 
+  if (snapshot)
+    db_snapshot_end();
+
   daap_reply_send(hreq, ret);
 
   clock_gettime(CLOCK_MONOTONIC, &end);
@@ -2391,6 +2798,7 @@ daap_reply_build(const char *uri, const char *user_agent, int is_remote)
   struct httpd_uri_parsed *uri_parsed;
   struct evbuffer *reply;
   struct daap_session session;
+  bool snapshot;
   int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Building reply for DAAP request: '%s'\n", uri);
@@ -2415,7 +2823,13 @@ daap_reply_build(const char *uri, const char *user_agent, int is_remote)
 
   CHECK_NULL(L_DAAP, hreq->reply = evbuffer_new());
 
+  snapshot = daap_request_is_list(hreq) && (db_snapshot_begin() == 0);
+
   ret = hreq->handler(hreq);
+
+  if (snapshot)
+    db_snapshot_end();
+
   if (ret < 0)
     {
       evbuffer_free(hreq->reply);
@@ -2440,9 +2854,19 @@ daap_init(void)
   int ret;
 
   srand((unsigned)time(NULL));
-  current_rev = 2;
   update_requests = NULL;
 
+  /* Clients may still have revisions from a previous run, so continue after
+   * the ones that run reserved */
+  ret = db_admin_getint(&current_rev, DB_ADMIN_DAAP_REVISION);
+  if (ret < 0 || current_rev < 0 || current_rev > INT_MAX - DAAP_REVISIONS_RESERVE)
+    current_rev = 0;
+
+  reserved_rev = current_rev;
+  revision_add();
+
+  daap_item_cache_init();
+
   for (i = 0; daap_handlers[i].handler; i++)
     {
       ret = regcomp(&daap_handlers[i].preg, daap_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
@@ -2455,6 +2879,15 @@ daap_init(void)
         }
     }
 
+  daap_updateev = event_new(evbase_httpd, -1, 0, update_db_cb, NULL);
+  if (!daap_updateev)
+    {
+      DPRINTF(E_FATAL, L_DAAP, "DAAP init failed; could not create update event\n");
+      return -1;
+    }
+
+  listener_add(update_listener_cb, LISTENER_DATABASE);
+
   return 0;
 }
 
@@ -2466,9 +2899,14 @@ daap_deinit(void)
   struct evhttp_connection *evcon;
   int i;
 
+  listener_remove(update_listener_cb);
+  event_free(daap_updateev);
+
   for (i = 0; daap_handlers[i].handler; i++)
     regfree(&daap_handlers[i].preg);
 
+  daap_item_cache_deinit();
+
   for (s = daap_sessions; daap_sessions; s = daap_sessions)
     {
       daap_sessions = s->next;
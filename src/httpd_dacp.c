@@ -237,7 +237,7 @@ find_first_song_id(const char *query)
   qp.sort = S_NONE;
   qp.offset = 0;
   qp.limit = 1;
-  qp.filter = daap_query_parse_sql(query);
+  qp.filter = daap_query_parse_sql(query, true);
   if (!qp.filter)
     {
       DPRINTF(E_LOG, L_DACP, "Improper DAAP query!\n");
@@ -379,7 +379,7 @@ dacp_queueitem_add(const char *query, const char *queuefilter, const char *sort,
 
 	      return -1;
 	    }
-	  qp.filter = daap_query_parse_sql(buf);
+	  qp.filter = daap_query_parse_sql(buf, true);
 	}
       else
 	{
@@ -388,14 +388,14 @@ dacp_queueitem_add(const char *query, const char *queuefilter, const char *sort,
 	  // If the queuefilter is unkown, ignore it and use the query parameter instead to build the sql query
 	  id = 0;
 	  qp.type = Q_ITEMS;
-	  qp.filter = daap_query_parse_sql(query);
+	  qp.filter = daap_query_parse_sql(query, true);
 	}
     }
   else
     {
       id = 0;
       qp.type = Q_ITEMS;
-      qp.filter = daap_query_parse_sql(query);
+      qp.filter = daap_query_parse_sql(query, true);
     }
 
   if (sort)
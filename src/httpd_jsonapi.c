@@ -113,29 +113,17 @@ safe_json_add_int_from_string(json_object *obj, const char *key, const char *val
 }
 
 static inline void
-safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_time(json_object *obj, const char *key, time_t timestamp)
 {
-  uint32_t tmp;
-  time_t timestamp;
   struct tm tm;
   char result[32];
 
-  if (!value)
-    return;
-
-  if (safe_atou32(value, &tmp) != 0)
-    {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
-      return;
-    }
-
-  if (!tmp)
+  if (!timestamp)
     return;
 
-  timestamp = tmp;
   if (gmtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %ld\n", (long)timestamp);
       return;
     }
 
@@ -145,12 +133,9 @@ safe_json_add_time_from_string(json_object *obj, const char *key, const char *va
 }
 
 static inline void
-safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
 {
   uint32_t tmp;
-  time_t timestamp;
-  struct tm tm;
-  char result[32];
 
   if (!value)
     return;
@@ -161,13 +146,21 @@ safe_json_add_date_from_string(json_object *obj, const char *key, const char *va
       return;
     }
 
-  if (!tmp)
+  safe_json_add_time(obj, key, tmp);
+}
+
+static inline void
+safe_json_add_date(json_object *obj, const char *key, time_t timestamp)
+{
+  struct tm tm;
+  char result[32];
+
+  if (!timestamp)
     return;
 
-  timestamp = tmp;
   if (localtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %ld\n", (long)timestamp);
       return;
     }
 
@@ -176,6 +169,23 @@ safe_json_add_date_from_string(json_object *obj, const char *key, const char *va
   json_object_object_add(obj, key, json_object_new_string(result));
 }
 
+static inline void
+safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+{
+  uint32_t tmp;
+
+  if (!value)
+    return;
+
+  if (safe_atou32(value, &tmp) != 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
+      return;
+    }
+
+  safe_json_add_date(obj, key, tmp);
+}
+
 static json_object *
 artist_to_json(struct db_group_info *dbgri)
 {
@@ -269,63 +279,57 @@ album_to_json(struct db_group_info *dbgri)
 }
 
 static json_object *
-track_to_json(struct db_media_file_info *dbmfi)
+track_to_json(struct media_file_info *mfi)
 {
   json_object *item;
   char uri[100];
   char artwork_url[100];
-  int intval;
   int ret;
 
   item = json_object_new_object();
 
-  safe_json_add_int_from_string(item, "id", dbmfi->id);
-  safe_json_add_string(item, "title", dbmfi->title);
-  safe_json_add_string(item, "title_sort", dbmfi->title_sort);
-  safe_json_add_string(item, "artist", dbmfi->artist);
-  safe_json_add_string(item, "artist_sort", dbmfi->artist_sort);
-  safe_json_add_string(item, "album", dbmfi->album);
-  safe_json_add_string(item, "album_sort", dbmfi->album_sort);
-  safe_json_add_string(item, "album_id", dbmfi->songalbumid);
-  safe_json_add_string(item, "album_artist", dbmfi->album_artist);
-  safe_json_add_string(item, "album_artist_sort", dbmfi->album_artist_sort);
-  safe_json_add_string(item, "album_artist_id", dbmfi->songartistid);
-  safe_json_add_string(item, "composer", dbmfi->composer);
-  safe_json_add_string(item, "genre", dbmfi->genre);
-  safe_json_add_int_from_string(item, "year", dbmfi->year);
-  safe_json_add_int_from_string(item, "track_number", dbmfi->track);
-  safe_json_add_int_from_string(item, "disc_number", dbmfi->disc);
-  safe_json_add_int_from_string(item, "length_ms", dbmfi->song_length);
-
-  safe_json_add_int_from_string(item, "rating", dbmfi->rating);
-  safe_json_add_int_from_string(item, "play_count", dbmfi->play_count);
-  safe_json_add_int_from_string(item, "skip_count", dbmfi->skip_count);
-  safe_json_add_time_from_string(item, "time_played", dbmfi->time_played);
-  safe_json_add_time_from_string(item, "time_skipped", dbmfi->time_skipped);
-  safe_json_add_time_from_string(item, "time_added", dbmfi->time_added);
-  safe_json_add_date_from_string(item, "date_released", dbmfi->date_released);
-  safe_json_add_int_from_string(item, "seek_ms", dbmfi->seek);
-
-  safe_json_add_string(item, "type", dbmfi->type);
-  safe_json_add_int_from_string(item, "samplerate", dbmfi->samplerate);
-  safe_json_add_int_from_string(item, "bitrate", dbmfi->bitrate);
-  safe_json_add_int_from_string(item, "channels", dbmfi->channels);
-
-  ret = safe_atoi32(dbmfi->media_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
-
-  ret = safe_atoi32(dbmfi->data_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
-
-  safe_json_add_string(item, "path", dbmfi->path);
-
-  ret = snprintf(uri, sizeof(uri), "%s:%s:%s", "library", "track", dbmfi->id);
+  json_object_object_add(item, "id", json_object_new_int(mfi->id));
+  safe_json_add_string(item, "title", mfi->title);
+  safe_json_add_string(item, "title_sort", mfi->title_sort);
+  safe_json_add_string(item, "artist", mfi->artist);
+  safe_json_add_string(item, "artist_sort", mfi->artist_sort);
+  safe_json_add_string(item, "album", mfi->album);
+  safe_json_add_string(item, "album_sort", mfi->album_sort);
+  safe_json_add_string_from_int64(item, "album_id", mfi->songalbumid);
+  safe_json_add_string(item, "album_artist", mfi->album_artist);
+  safe_json_add_string(item, "album_artist_sort", mfi->album_artist_sort);
+  safe_json_add_string_from_int64(item, "album_artist_id", mfi->songartistid);
+  safe_json_add_string(item, "composer", mfi->composer);
+  safe_json_add_string(item, "genre", mfi->genre);
+  json_object_object_add(item, "year", json_object_new_int(mfi->year));
+  json_object_object_add(item, "track_number", json_object_new_int(mfi->track));
+  json_object_object_add(item, "disc_number", json_object_new_int(mfi->disc));
+  json_object_object_add(item, "length_ms", json_object_new_int(mfi->song_length));
+
+  json_object_object_add(item, "rating", json_object_new_int(mfi->rating));
+  json_object_object_add(item, "play_count", json_object_new_int(mfi->play_count));
+  json_object_object_add(item, "skip_count", json_object_new_int(mfi->skip_count));
+  safe_json_add_time(item, "time_played", mfi->time_played);
+  safe_json_add_time(item, "time_skipped", mfi->time_skipped);
+  safe_json_add_time(item, "time_added", mfi->time_added);
+  safe_json_add_date(item, "date_released", mfi->date_released);
+  json_object_object_add(item, "seek_ms", json_object_new_int(mfi->seek));
+
+  safe_json_add_string(item, "type", mfi->type);
+  json_object_object_add(item, "samplerate", json_object_new_int(mfi->samplerate));
+  json_object_object_add(item, "bitrate", json_object_new_int(mfi->bitrate));
+  json_object_object_add(item, "channels", json_object_new_int(mfi->channels));
+
+  safe_json_add_string(item, "media_kind", db_media_kind_label(mfi->media_kind));
+  safe_json_add_string(item, "data_kind", db_data_kind_label(mfi->data_kind));
+
+  safe_json_add_string(item, "path", mfi->path);
+
+  ret = snprintf(uri, sizeof(uri), "%s:%s:%d", "library", "track", mfi->id);
   if (ret < sizeof(uri))
     json_object_object_add(item, "uri", json_object_new_string(uri));
 
-  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%s", dbmfi->id);
+  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%d", mfi->id);
   if (ret < sizeof(artwork_url))
     json_object_object_add(item, "artwork_url", json_object_new_string(artwork_url));
 
@@ -402,19 +406,24 @@ directory_to_json(struct directory_info *directory_info)
 
 
 static int
-fetch_tracks(struct query_params *query_params, json_object *items, int *total)
+fetch_tracks(struct query_params *query_params, json_object *items, int *total, char **next)
 {
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *item;
+  int nitems;
   int ret;
 
+  if (!total)
+    query_params->skip_count = 1;
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
 
-  while (((ret = db_query_fetch_file(query_params, &dbmfi)) == 0) && (dbmfi.id))
+  nitems = 0;
+  while (((ret = db_query_fetch_mfi(query_params, &mfi)) == 0) && (mfi.id))
     {
-      item = track_to_json(&dbmfi);
+      item = track_to_json(&mfi);
       if (!item)
 	{
 	  ret = -1;
@@ -422,6 +431,11 @@ fetch_tracks(struct query_params *query_params, json_object *items, int *total)
 	}
 
       json_object_array_add(items, item);
+
+      // Full page, so give the client a cursor for the next one
+      nitems++;
+      if (next && (nitems == query_params->limit))
+	*next = db_query_cursor_make(query_params, &mfi);
     }
 
   if (total)
@@ -440,6 +454,9 @@ fetch_artists(struct query_params *query_params, json_object *items, int *total)
   json_object *item;
   int ret = 0;
 
+  if (!total)
+    query_params->skip_count = 1;
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -481,8 +498,12 @@ fetch_artist(const char *artist_id)
   artist = NULL;
 
   query_params.type = Q_GROUP_ARTISTS;
+  query_params.skip_count = 1;
   query_params.sort = S_ARTIST;
-  query_params.filter = db_mprintf("(f.songartistid = %s)", artist_id);
+
+  ret = safe_atoi64(artist_id, &query_params.filter_songartistid);
+  if (ret < 0)
+    goto error;
 
   ret = db_query_start(&query_params);
   if (ret < 0)
@@ -495,7 +516,6 @@ fetch_artist(const char *artist_id)
 
  error:
   db_query_end(&query_params);
-  free(query_params.filter);
 
   return artist;
 }
@@ -507,6 +527,9 @@ fetch_albums(struct query_params *query_params, json_object *items, int *total)
   json_object *item;
   int ret = 0;
 
+  if (!total)
+    query_params->skip_count = 1;
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -548,6 +571,7 @@ fetch_album(const char *album_id)
   album = NULL;
 
   query_params.type = Q_GROUP_ALBUMS;
+  query_params.skip_count = 1;
   query_params.sort = S_ALBUM;
   query_params.filter = db_mprintf("(f.songalbumid = %s)", album_id);
 
@@ -574,6 +598,9 @@ fetch_playlists(struct query_params *query_params, json_object *items, int *tota
   json_object *item;
   int ret = 0;
 
+  if (!total)
+    query_params->skip_count = 1;
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -611,6 +638,7 @@ fetch_playlist(uint32_t playlist_id)
   playlist = NULL;
 
   query_params.type = Q_PL;
+  query_params.skip_count = 1;
   query_params.sort = S_PLAYLIST;
   query_params.filter = db_mprintf("(f.id = %d)", playlist_id);
 
@@ -638,6 +666,9 @@ fetch_genres(struct query_params *query_params, json_object *items, int *total)
   char *genre;
   char *sort_item;
 
+  if (!total)
+    query_params->skip_count = 1;
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
@@ -727,6 +758,43 @@ query_params_limit_set(struct query_params *query_params, struct httpd_request *
   return 0;
 }
 
+/*
+ * Sets the "after" cursor of a paged tracks query. The cursor takes the place
+ * of the offset, so an offset given with it is ignored.
+ */
+static void
+query_params_after_set(struct query_params *query_params, struct httpd_request *hreq)
+{
+  query_params->after = evhttp_find_header(hreq->query, "after");
+  if (query_params->after)
+    query_params->offset = 0;
+}
+
+/*
+ * Checks the "after" cursor of the request against the type and sort of the
+ * query it will be used for, so that handlers can reply with a bad request
+ * instead of failing the query.
+ */
+static int
+query_cursor_check(struct httpd_request *hreq, enum query_type type, enum sort_type sort)
+{
+  struct query_params query_params;
+
+  memset(&query_params, 0, sizeof(struct query_params));
+
+  query_params.type = type;
+  query_params.sort = sort;
+  query_params.after = evhttp_find_header(hreq->query, "after");
+
+  if (db_query_cursor_check(&query_params) < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'after' (%s)\n", query_params.after);
+      return -1;
+    }
+
+  return 0;
+}
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 
 /*
@@ -1122,7 +1190,9 @@ jsonapi_reply_library(struct httpd_request *hreq)
 {
   struct query_params qp;
   struct filecount_info fci;
+  struct db_stmt_cache_stats stmt_cache_stats;
   json_object *jreply;
+  json_object *jstmt_cache;
   int ret;
   char *s;
 
@@ -1160,6 +1230,12 @@ jsonapi_reply_library(struct httpd_request *hreq)
 
   json_object_object_add(jreply, "updating", json_object_new_boolean(library_is_scanning()));
 
+  db_stmt_cache_stats_get(&stmt_cache_stats);
+  jstmt_cache = json_object_new_object();
+  json_object_object_add(jstmt_cache, "hits", json_object_new_int64(stmt_cache_stats.hits));
+  json_object_object_add(jstmt_cache, "misses", json_object_new_int64(stmt_cache_stats.misses));
+  json_object_object_add(jreply, "statement_cache", jstmt_cache);
+
   CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
   jparse_free(jreply);
 
@@ -2944,9 +3020,7 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
-
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.filter_media_kind = media_kind;
 
   ret = fetch_artists(&query_params, items, &total);
   if (ret < 0)
@@ -3029,11 +3103,12 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
-  query_params.filter = db_mprintf("(f.songartistid = %q)", artist_id);
 
-  ret = fetch_albums(&query_params, items, &total);
-  free(query_params.filter);
+  ret = safe_atoi64(artist_id, &query_params.filter_songartistid);
+  if (ret < 0)
+    goto error;
 
+  ret = fetch_albums(&query_params, items, &total);
   if (ret < 0)
     goto error;
 
@@ -3092,9 +3167,7 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
-
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  query_params.filter_media_kind = media_kind;
 
   ret = fetch_albums(&query_params, items, &total);
   if (ret < 0)
@@ -3157,12 +3230,16 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   const char *album_id;
   json_object *reply;
   json_object *items;
+  char *next = NULL;
   int total;
   int ret = 0;
 
   if (!is_modified(hreq->req, DB_ADMIN_DB_MODIFIED))
     return HTTP_NOTMODIFIED;
 
+  if (query_cursor_check(hreq, Q_ITEMS, S_ALBUM) < 0)
+    return HTTP_BADREQUEST;
+
   album_id = hreq->uri_parsed->path_parts[3];
 
   reply = json_object_new_object();
@@ -3178,8 +3255,9 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   query_params.type = Q_ITEMS;
   query_params.sort = S_ALBUM;
   query_params.filter = db_mprintf("(f.songalbumid = %q)", album_id);
+  query_params_after_set(&query_params, hreq);
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, items, &total, &next);
   free(query_params.filter);
 
   if (ret < 0)
@@ -3188,6 +3266,7 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next", next);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3195,6 +3274,7 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
 
  error:
   jparse_free(reply);
+  free(next);
 
   if (ret < 0)
     return HTTP_INTERNAL;
@@ -3239,7 +3319,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
 {
   struct query_params query_params;
   const char *track_id;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *reply = NULL;
   int ret = 0;
 
@@ -3251,24 +3331,25 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
   memset(&query_params, 0, sizeof(struct query_params));
 
   query_params.type = Q_ITEMS;
+  query_params.skip_count = 1;
   query_params.filter = db_mprintf("(f.id = %q)", track_id);
 
   ret = db_query_start(&query_params);
   if (ret < 0)
     goto error;
 
-  ret = db_query_fetch_file(&query_params, &dbmfi);
+  ret = db_query_fetch_mfi(&query_params, &mfi);
   if (ret < 0)
     goto error;
 
-  if (dbmfi.id == 0)
+  if (mfi.id == 0)
     {
       DPRINTF(E_LOG, L_WEB, "Track with id '%s' not found.\n", track_id);
       ret = -1;
       goto error;
     }
 
-  reply = track_to_json(&dbmfi);
+  reply = track_to_json(&mfi);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3582,7 +3663,7 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
   query_params.type = Q_PLITEMS;
   query_params.id = playlist_id;
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, items, &total, NULL);
   if (ret < 0)
     goto error;
 
@@ -3893,9 +3974,13 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   json_object *tracks_items;
   json_object *playlists;
   json_object *playlists_items;
+  char *next = NULL;
   int total;
   int ret;
 
+  if (query_cursor_check(hreq, Q_ITEMS, S_VPATH) < 0)
+    return HTTP_BADREQUEST;
+
   param = evhttp_find_header(hreq->query, "directory");
 
   directory_id = DIR_FILE;
@@ -3932,8 +4017,9 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   query_params.type = Q_ITEMS;
   query_params.sort = S_VPATH;
   query_params.filter = db_mprintf("(f.directory_id = %d)", directory_id);
+  query_params_after_set(&query_params, hreq);
 
-  ret = fetch_tracks(&query_params, tracks_items, &total);
+  ret = fetch_tracks(&query_params, tracks_items, &total, &next);
   free(query_params.filter);
 
   if (ret < 0)
@@ -3942,6 +4028,7 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   json_object_object_add(tracks, "total", json_object_new_int(total));
   json_object_object_add(tracks, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(tracks, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(tracks, "next", next);
 
   // Add playlists
   playlists = json_object_new_object();
@@ -3975,6 +4062,7 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
 
  error:
   jparse_free(reply);
+  free(next);
 
   if (ret < 0)
     return HTTP_INTERNAL;
@@ -4008,6 +4096,8 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *next = NULL;
+  char *like;
   int total;
   int ret;
 
@@ -4027,10 +4117,14 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
+      like = db_mprintf_like("f.title", "%%%q%%", param_query);
       if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
+	query_params.filter = db_mprintf("(%s AND f.media_kind = %d)", like, media_kind);
       else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(%s)", like);
+      free(like);
+
+      query_params_after_set(&query_params, hreq);
     }
   else
     {
@@ -4045,16 +4139,18 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 	}
     }
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, items, &total, &next);
   if (ret < 0)
     goto out;
 
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next", next);
 
  out:
   free_query_params(&query_params, 1);
+  free(next);
 
   return ret;
 }
@@ -4065,6 +4161,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *like;
   int total;
   int ret;
 
@@ -4088,10 +4185,12 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
   if (param_query)
     {
+      like = db_mprintf_like("f.album_artist", "%%%q%%", param_query);
       if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
+	query_params.filter = db_mprintf("(%s AND f.media_kind = %d)", like, media_kind);
       else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(%s)", like);
+      free(like);
     }
   else
     {
@@ -4127,6 +4226,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *like;
   int total;
   int ret;
 
@@ -4150,10 +4250,12 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
+      like = db_mprintf_like("f.album", "%%%q%%", param_query);
       if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
+	query_params.filter = db_mprintf("(%s AND f.media_kind = %d)", like, media_kind);
       else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+	query_params.filter = db_mprintf("(%s)", like);
+      free(like);
     }
   else
     {
@@ -4262,6 +4364,10 @@ jsonapi_reply_search(struct httpd_request *hreq)
       }
     }
 
+  // Only track searches by query use the cursor
+  if (param_query && strstr(param_type, "track") && query_cursor_check(hreq, Q_ITEMS, S_NAME) < 0)
+    return HTTP_BADREQUEST;
+
   memset(&smartpl_expression, 0, sizeof(struct smartpl));
 
   if (param_expression)
@@ -4336,6 +4442,102 @@ jsonapi_reply_library_backup(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+/*
+ * Endpoint to retrieve the SQL statistics, i.e. the aggregated cost of each
+ * statement the server has run since profiling was enabled or reset
+ *
+ * Example response:
+ *
+ * {
+ *  "enabled": true,
+ *  "dropped": 0,
+ *  "statement_cache": { "hits": 1200, "misses": 35 },
+ *  "statements": [ { "query": "SELECT ... WHERE f.id = ?;", "calls": 12, "total_us": 3500, ... } ]
+ * }
+ */
+static int
+jsonapi_reply_sqlstats(struct httpd_request *hreq)
+{
+  struct db_stmt_cache_stats cache_stats;
+  struct db_sqlstat *stats;
+  json_object *jreply;
+  json_object *jcache;
+  json_object *jstatements;
+  json_object *jstatement;
+  uint64_t dropped;
+  int nstats;
+  int ret;
+  int i;
+
+  ret = db_sqlstats_get(&stats, &nstats, &dropped);
+  if (ret < 0)
+    return HTTP_SERVUNAVAIL; // not supported by the SQLite3 version
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+  CHECK_NULL(L_WEB, jcache = json_object_new_object());
+  CHECK_NULL(L_WEB, jstatements = json_object_new_array());
+
+  json_object_object_add(jreply, "enabled", json_object_new_boolean(db_sqlstats_enabled()));
+  json_object_object_add(jreply, "dropped", json_object_new_int64(dropped));
+
+  db_stmt_cache_stats_get(&cache_stats);
+  json_object_object_add(jcache, "hits", json_object_new_int64(cache_stats.hits));
+  json_object_object_add(jcache, "misses", json_object_new_int64(cache_stats.misses));
+  json_object_object_add(jreply, "statement_cache", jcache);
+
+  for (i = 0; i < nstats; i++)
+    {
+      CHECK_NULL(L_WEB, jstatement = json_object_new_object());
+
+      safe_json_add_string(jstatement, "query", stats[i].query);
+      json_object_object_add(jstatement, "calls", json_object_new_int64(stats[i].calls));
+      json_object_object_add(jstatement, "total_us", json_object_new_int64(stats[i].total_ns / 1000));
+      json_object_object_add(jstatement, "mean_us", json_object_new_int64(stats[i].calls ? stats[i].total_ns / stats[i].calls / 1000 : 0));
+      json_object_object_add(jstatement, "p99_us", json_object_new_int64(stats[i].p99_ns / 1000));
+      json_object_object_add(jstatement, "max_us", json_object_new_int64(stats[i].max_ns / 1000));
+      json_object_object_add(jstatement, "rows", json_object_new_int64(stats[i].rows));
+      json_object_object_add(jstatement, "lock_wait_us", json_object_new_int64(stats[i].wait_ns / 1000));
+      safe_json_add_string(jstatement, "slowest_query", stats[i].slowest);
+      safe_json_add_string(jstatement, "query_plan", stats[i].plan);
+
+      json_object_array_add(jstatements, jstatement);
+    }
+
+  json_object_object_add(jreply, "statements", jstatements);
+
+  db_sqlstats_free(stats, nstats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_sqlstats_put(struct httpd_request *hreq)
+{
+  const char *param;
+  int ret;
+
+  param = evhttp_find_header(hreq->query, "enabled");
+  if (!param)
+    return HTTP_BADREQUEST;
+
+  ret = db_sqlstats_enable(strcmp(param, "true") == 0);
+  if (ret < 0)
+    return HTTP_SERVUNAVAIL;
+
+  return HTTP_NOCONTENT;
+}
+
+static int
+jsonapi_reply_sqlstats_reset(struct httpd_request *hreq)
+{
+  db_sqlstats_reset();
+
+  return HTTP_NOCONTENT;
+}
+
 
 static struct httpd_uri_map adm_handlers[] =
   {
@@ -4411,11 +4613,40 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_POST,   "^/api/library/add$",                           jsonapi_reply_library_add },
     { EVHTTP_REQ_PUT,    "^/api/library/backup$",                        jsonapi_reply_library_backup },
 
+    { EVHTTP_REQ_GET,    "^/api/sqlstats$",                              jsonapi_reply_sqlstats },
+    { EVHTTP_REQ_PUT,    "^/api/sqlstats$",                              jsonapi_reply_sqlstats_put },
+    { EVHTTP_REQ_PUT,    "^/api/sqlstats/reset$",                        jsonapi_reply_sqlstats_reset },
+
     { EVHTTP_REQ_GET,    "^/api/search$",                                jsonapi_reply_search },
 
     { 0, NULL, NULL }
   };
 
+/* Library and search replies can be large, so these read-only handlers are
+ * served from a snapshot. Handlers that write use the normal connection.
+ */
+static bool
+jsonapi_request_is_read(struct httpd_request *hreq)
+{
+  return (hreq->handler == jsonapi_reply_library ||
+	  hreq->handler == jsonapi_reply_library_playlists ||
+	  hreq->handler == jsonapi_reply_library_playlist_get ||
+	  hreq->handler == jsonapi_reply_library_playlist_tracks ||
+	  hreq->handler == jsonapi_reply_library_playlist_playlists ||
+	  hreq->handler == jsonapi_reply_library_artists ||
+	  hreq->handler == jsonapi_reply_library_artist ||
+	  hreq->handler == jsonapi_reply_library_artist_albums ||
+	  hreq->handler == jsonapi_reply_library_albums ||
+	  hreq->handler == jsonapi_reply_library_album ||
+	  hreq->handler == jsonapi_reply_library_album_tracks ||
+	  hreq->handler == jsonapi_reply_library_tracks_get_byid ||
+	  hreq->handler == jsonapi_reply_library_track_playlists ||
+	  hreq->handler == jsonapi_reply_library_genres ||
+	  hreq->handler == jsonapi_reply_library_count ||
+	  hreq->handler == jsonapi_reply_library_files ||
+	  hreq->handler == jsonapi_reply_search);
+}
+
 
 /* ------------------------------- JSON API --------------------------------- */
 
@@ -4424,6 +4655,7 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 {
   struct httpd_request *hreq;
   struct evkeyvalq *headers;
+  bool snapshot;
   int status_code;
 
   DPRINTF(E_DBG, L_WEB, "JSON api request: '%s'\n", uri_parsed->uri);
@@ -4442,8 +4674,13 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
 
+  snapshot = jsonapi_request_is_read(hreq) && (db_snapshot_begin() == 0);
+
   status_code = hreq->handler(hreq);
 
+  if (snapshot)
+    db_snapshot_end();
+
   if (status_code >= 400)
     DPRINTF(E_LOG, L_WEB, "JSON api request failed with error code %d (%s)\n", status_code, uri_parsed->uri);
 
@@ -889,6 +889,7 @@ pipelist_create(void)
 
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.filter = filter;
 
   snprintf(filter, sizeof(filter), "f.data_kind = %d", DATA_KIND_PIPE);
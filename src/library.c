@@ -111,6 +111,12 @@ static bool scanning;
 static struct timeval library_update_wait = { 5, 0 };
 static struct event *updateev;
 
+// Interval for refreshing the materialized smart playlists, which is needed
+// for queries relative to the current time and after silent changes (e.g. play
+// counts), see db_smartpl_refresh()
+static struct timeval library_smartpl_interval = { 60, 0 };
+static struct event *smartplev;
+
 // Counts the number of changes made to the database between to DATABASE
 // event notifications
 static unsigned int deferred_update_notifications;
@@ -258,6 +264,9 @@ handle_deferred_update_notifications(void)
       db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) update_time);
     }
 
+  // Also done without notifications, since e.g. play counts change silently
+  db_smartpl_refresh();
+
   return ret;
 }
 
@@ -567,6 +576,13 @@ item_add(void *arg, int *retval)
   return COMMAND_END;
 }
 
+static void
+smartpl_refresh_cb(int fd, short what, void *arg)
+{
+  if (!scanning)
+    db_smartpl_refresh();
+}
+
 // Callback to notify listeners of database changes
 static void
 update_trigger_cb(int fd, short what, void *arg)
@@ -861,6 +877,8 @@ library_init(void)
 
   CHECK_NULL(L_LIB, evbase_lib = event_base_new());
   CHECK_NULL(L_LIB, updateev = evtimer_new(evbase_lib, update_trigger_cb, NULL));
+  CHECK_NULL(L_LIB, smartplev = event_new(evbase_lib, -1, EV_PERSIST, smartpl_refresh_cb, NULL));
+  evtimer_add(smartplev, &library_smartpl_interval);
 
   for (i = 0; sources[i]; i++)
     {
@@ -921,6 +939,7 @@ library_deinit()
 	event_free(library_cb_register[i].ev);
     }
 
+  event_free(smartplev);
   event_free(updateev);
   event_base_free(evbase_lib);
 }
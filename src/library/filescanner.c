@@ -114,8 +114,38 @@ struct stacked_dir {
   struct stacked_dir *next;
 };
 
+// A regular file waiting for or done with metadata extraction in the pool
+struct metadata_job {
+  struct media_file_info mfi;
+  char *file;
+  time_t mtime;
+  int ret;
+  struct metadata_job *next;
+};
+
+// Worker threads that run scan_metadata_ffmpeg() during a bulk scan. Only the
+// library thread touches the db, so finished jobs are handed back to it.
+struct metadata_pool {
+  pthread_t *threads;
+  int nthreads;
+
+  struct metadata_job *todo;
+  struct metadata_job *todo_tail;
+  struct metadata_job *done;
+
+  // Jobs submitted but not yet saved, bounded so memory stays flat
+  int pending;
+  int max_pending;
+  bool exit;
+
+  pthread_mutex_t lck;
+  pthread_cond_t todo_cond;
+  pthread_cond_t done_cond;
+};
+
 static int inofd;
 static struct event *inoev;
+static struct metadata_pool *mdpool;
 static struct deferred_pl *playlists;
 static struct stacked_dir *dirstack;
 
@@ -560,6 +590,237 @@ process_deferred_playlists(void)
     }
 }
 
+static void
+metadata_job_free(struct metadata_job *job)
+{
+  free_mfi(&job->mfi, 1);
+  free(job->file);
+  free(job);
+}
+
+/* Thread: metadata worker */
+static void *
+metadata_worker(void *arg)
+{
+  struct metadata_pool *pool = arg;
+  struct metadata_job *job;
+
+#ifdef __linux__
+  struct sched_param param;
+
+  // Same low priority as the library thread, see library()
+  memset(&param, 0, sizeof(struct sched_param));
+  if (pthread_setschedparam(pthread_self(), SCHED_BATCH, &param) != 0)
+    DPRINTF(E_LOG, L_SCAN, "Warning: Could not set metadata thread priority to SCHED_BATCH\n");
+#endif
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  for (;;)
+    {
+      while (!pool->todo && !pool->exit)
+	CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->todo_cond, &pool->lck));
+
+      if (pool->exit)
+	break;
+
+      job = pool->todo;
+      pool->todo = job->next;
+      if (!pool->todo)
+	pool->todo_tail = NULL;
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+      job->ret = scan_metadata_ffmpeg(&job->mfi, job->file);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+      job->next = pool->done;
+      pool->done = job;
+
+      CHECK_ERR(L_SCAN, pthread_cond_signal(&pool->done_cond));
+    }
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  pthread_exit(NULL);
+}
+
+// Must be called with the pool lock held. Detaches the finished jobs, which the
+// caller must then pass to metadata_jobs_save() after releasing the lock.
+static struct metadata_job *
+metadata_jobs_take(struct metadata_pool *pool)
+{
+  struct metadata_job *jobs;
+  struct metadata_job *job;
+
+  jobs = pool->done;
+  pool->done = NULL;
+
+  for (job = jobs; job; job = job->next)
+    pool->pending--;
+
+  return jobs;
+}
+
+/* Thread: scan */
+static void
+metadata_jobs_save(struct metadata_job *jobs)
+{
+  struct metadata_job *job;
+
+  while (jobs)
+    {
+      job = jobs;
+      jobs = job->next;
+
+      if (job->ret == 0)
+	{
+	  library_media_save(&job->mfi);
+	  cache_artwork_ping(job->file, job->mtime, 0);
+	}
+
+      metadata_job_free(job);
+    }
+}
+
+static void
+metadata_pool_destroy(struct metadata_pool *pool)
+{
+  struct metadata_job *job;
+  int i;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+  pool->exit = true;
+  CHECK_ERR(L_SCAN, pthread_cond_broadcast(&pool->todo_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  // Anything left over is dropped, only happens if the scan was aborted
+  while ((job = pool->todo))
+    {
+      pool->todo = job->next;
+      metadata_job_free(job);
+    }
+  while ((job = pool->done))
+    {
+      pool->done = job->next;
+      metadata_job_free(job);
+    }
+
+  CHECK_ERR(L_SCAN, pthread_cond_destroy(&pool->done_cond));
+  CHECK_ERR(L_SCAN, pthread_cond_destroy(&pool->todo_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_destroy(&pool->lck));
+
+  free(pool->threads);
+  free(pool);
+}
+
+static struct metadata_pool *
+metadata_pool_create(int nthreads)
+{
+  struct metadata_pool *pool;
+  char name[16];
+  int ret;
+
+  CHECK_NULL(L_SCAN, pool = calloc(1, sizeof(struct metadata_pool)));
+  CHECK_NULL(L_SCAN, pool->threads = calloc(nthreads, sizeof(pthread_t)));
+
+  pool->max_pending = 4 * nthreads;
+
+  CHECK_ERR(L_SCAN, mutex_init(&pool->lck));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->todo_cond, NULL));
+  CHECK_ERR(L_SCAN, pthread_cond_init(&pool->done_cond, NULL));
+
+  for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++)
+    {
+      ret = pthread_create(&pool->threads[pool->nthreads], NULL, metadata_worker, pool);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not create metadata thread: %s\n", strerror(ret));
+	  break;
+	}
+
+      snprintf(name, sizeof(name), "metadata%d", pool->nthreads);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(pool->threads[pool->nthreads], name);
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(pool->threads[pool->nthreads], name);
+#endif
+    }
+
+  if (pool->nthreads == 0)
+    {
+      metadata_pool_destroy(pool);
+      return NULL;
+    }
+
+  DPRINTF(E_INFO, L_SCAN, "Reading metadata with %d threads\n", pool->nthreads);
+
+  return pool;
+}
+
+/* Thread: scan */
+// Takes ownership of the content of mfi. Blocks while the pool is full, saving
+// whatever the workers have finished in the meantime.
+static void
+metadata_pool_submit(struct metadata_pool *pool, struct media_file_info *mfi, const char *file, time_t mtime)
+{
+  struct metadata_job *job;
+  struct metadata_job *jobs;
+
+  CHECK_NULL(L_SCAN, job = calloc(1, sizeof(struct metadata_job)));
+  CHECK_NULL(L_SCAN, job->file = strdup(file));
+
+  job->mfi = *mfi;
+  job->mtime = mtime;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  while (pool->pending >= pool->max_pending && !pool->done)
+    CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->done_cond, &pool->lck));
+
+  jobs = metadata_jobs_take(pool);
+
+  if (pool->todo_tail)
+    pool->todo_tail->next = job;
+  else
+    pool->todo = job;
+  pool->todo_tail = job;
+  pool->pending++;
+
+  CHECK_ERR(L_SCAN, pthread_cond_signal(&pool->todo_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+
+  metadata_jobs_save(jobs);
+}
+
+/* Thread: scan */
+// Waits for all submitted jobs and saves them
+static void
+metadata_pool_flush(struct metadata_pool *pool)
+{
+  struct metadata_job *jobs;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+
+  while (pool->pending > 0 && !library_is_exiting())
+    {
+      while (!pool->done)
+	CHECK_ERR(L_SCAN, pthread_cond_wait(&pool->done_cond, &pool->lck));
+
+      jobs = metadata_jobs_take(pool);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+      metadata_jobs_save(jobs);
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&pool->lck));
+    }
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&pool->lck));
+}
+
 static void
 process_regular_file(const char *file, struct stat *sb, int type, int flags, int dir_id)
 {
@@ -618,6 +879,13 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	  mfi.album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
 	}
 
+      // The pool reads the metadata and hands the file back for saving
+      if (is_bulkscan && mdpool)
+	{
+	  metadata_pool_submit(mdpool, &mfi, file, sb->st_mtime);
+	  return;
+	}
+
       ret = scan_metadata_ffmpeg(&mfi, file);
       if (ret < 0)
 	{
@@ -645,13 +913,9 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
 
 	counter++;
 
-	/* When in bulk mode, split transaction in pieces of 200 */
+	/* When in bulk mode, writes are batched and committed by the db, see db_file_batch_begin() */
 	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
-	  {
-	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
-	    db_transaction_end();
-	    db_transaction_begin();
-	  }
+	  DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
 	break;
 
       case FILE_PLAYLIST:
@@ -770,19 +1034,23 @@ check_speciallib(char *path, const char *libtype)
  * and resolved_path contains the resolved path (resolved_path must be of length PATH_MAX).
  * If path is not a symbolic link, resolved_path holds the same value as path.
  *
+ * The file is looked up as 'name' relative to the open directory 'dfd', which
+ * saves resolving the full path for every entry of a directory. 'path' must be
+ * the full path of the same file.
+ *
  * The return value is 0 if the operation is successful, or -1 on failure
  */
 static int
-read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_link)
+read_attributes_at(char *resolved_path, int dfd, const char *name, const char *path, struct stat *sb, int *is_link)
 {
   int ret;
 
   *is_link = 0;
 
-  ret = lstat(path, sb);
+  ret = fstatat(dfd, name, sb, AT_SYMLINK_NOFOLLOW);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_SCAN, "Skipping %s, lstat() failed: %s\n", path, strerror(errno));
+      DPRINTF(E_LOG, L_SCAN, "Skipping %s, fstatat() failed: %s\n", path, strerror(errno));
       return -1;
     }
 
@@ -811,11 +1079,18 @@ read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_
   return 0;
 }
 
+static int
+read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_link)
+{
+  return read_attributes_at(resolved_path, AT_FDCWD, path, path, sb, is_link);
+}
+
 static void
 process_directory(char *path, int parent_id, int flags)
 {
   DIR *dirp;
   struct dirent *de;
+  int dfd;
   char entry[PATH_MAX];
   char resolved_path[PATH_MAX];
   struct stat sb;
@@ -838,6 +1113,8 @@ process_directory(char *path, int parent_id, int flags)
       return;
     }
 
+  dfd = dirfd(dirp);
+
   /* Add/update directories table */
 
   ret = virtual_path_make(virtual_path, sizeof(virtual_path), path);
@@ -881,6 +1158,12 @@ process_directory(char *path, int parent_id, int flags)
       if (de->d_name[0] == '.')
 	continue;
 
+#ifdef _DIRENT_HAVE_D_TYPE
+      // A fast scan only looks for directories, so other entries don't need a stat
+      if ((flags & F_SCAN_FAST) && (de->d_type != DT_DIR) && (de->d_type != DT_LNK) && (de->d_type != DT_UNKNOWN))
+	continue;
+#endif
+
       ret = snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
       if ((ret < 0) || (ret >= sizeof(entry)))
 	{
@@ -893,7 +1176,16 @@ process_directory(char *path, int parent_id, int flags)
       if (file_type == FILE_IGNORE)
 	continue;
 
-      ret = read_attributes(resolved_path, entry, &sb, &is_link);
+#ifdef _DIRENT_HAVE_D_TYPE
+      // Subdirectories are stat'ed when they are processed themselves
+      if (de->d_type == DT_DIR)
+	{
+	  push_dir(&dirstack, entry, dir_id);
+	  continue;
+	}
+#endif
+
+      ret = read_attributes_at(resolved_path, dfd, de->d_name, entry, &sb, &is_link);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", entry);
@@ -1018,6 +1310,7 @@ bulk_scan(int flags)
 {
   cfg_t *lib;
   int ndirs;
+  int nthreads;
   char *path;
   char *deref;
   time_t start;
@@ -1035,6 +1328,14 @@ bulk_scan(int flags)
   lib = cfg_getsec(cfg, "library");
   counter = 0;
 
+  // Unchanged files are then found without a query per file, see process_regular_file()
+  if (!(flags & (F_SCAN_FAST | F_SCAN_METARESCAN)))
+    db_file_ping_begin();
+
+  nthreads = cfg_getint(lib, "metadata_threads");
+  if (!(flags & F_SCAN_FAST) && (nthreads > 1))
+    mdpool = metadata_pool_create(nthreads);
+
   ndirs = cfg_size(lib, "directories");
   for (i = 0; i < ndirs; i++)
     {
@@ -1063,17 +1364,31 @@ bulk_scan(int flags)
 	  continue;
 	}
 
-      db_transaction_begin();
+      db_file_batch_begin();
 
       process_directories(deref, parent_id, flags);
-      db_transaction_end();
+      if (mdpool)
+	metadata_pool_flush(mdpool);
+      db_file_batch_end();
 
       free(deref);
 
       if (library_is_exiting())
-	return;
+	break;
+    }
+
+  if (mdpool)
+    {
+      metadata_pool_destroy(mdpool);
+      mdpool = NULL;
     }
 
+  // Must be done before the library purges files that were not pinged
+  db_file_ping_end();
+
+  if (library_is_exiting())
+    return;
+
   if (!(flags & F_SCAN_FAST) && playlists)
     process_deferred_playlists();
 
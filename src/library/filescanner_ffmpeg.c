@@ -22,8 +22,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <stdint.h>
 
@@ -46,7 +51,7 @@ struct metadata_map {
 };
 
 // Used for passing errors to DPRINTF (can't count on av_err2str being present)
-static char errbuf[64];
+static __thread char errbuf[64];
 
 static inline char *
 err2str(int errnum)
@@ -343,6 +348,463 @@ extract_metadata(struct media_file_info *mfi, AVFormatContext *ctx, AVStream *au
   return mdcount;
 }
 
+/* ----------------------- Native tag reader (fast path) -------------------- */
+
+/* FLAC and Ogg Vorbis keep their tags and stream parameters in a few headers
+ * at the start of the file (plus the last Ogg page for the duration), so for
+ * those we can skip avformat_open_input() + avformat_find_stream_info(), which
+ * may read considerably more of the file. Anything unexpected makes us return
+ * -1, and the caller then falls back to ffmpeg. The tags are put in an
+ * AVDictionary with the same names ffmpeg would use, so the md_maps apply.
+ */
+
+// Larger comment blocks are unusual (embedded Ogg artwork), leave them to ffmpeg
+#define NATIVE_COMMENT_MAX (4 * 1024 * 1024)
+// How much of the end of an Ogg file we search for the last page
+#define NATIVE_OGG_TAIL 65536
+
+struct native_info {
+  const char *type;
+  const char *codectype;
+  const char *description;
+
+  uint32_t samplerate;
+  uint32_t channels;
+  uint32_t bits_per_sample;
+  uint64_t samples;
+  int artwork;
+
+  AVDictionary *md;
+};
+
+// Same conversion as ffmpeg does for Vorbis comments (ff_vorbiscomment_metadata_conv)
+static const char *native_vorbis_conv[][2] =
+  {
+    { "ALBUMARTIST", "album_artist" },
+    { "TRACKNUMBER", "track" },
+    { "DISCNUMBER",  "disc" },
+    { "DESCRIPTION", "comment" },
+  };
+
+static inline uint32_t
+native_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+native_le64(const uint8_t *p)
+{
+  return (uint64_t)native_le32(p) | ((uint64_t)native_le32(p + 4) << 32);
+}
+
+static int
+native_read(int fd, off_t offset, void *buf, size_t len)
+{
+  ssize_t ret;
+
+  ret = pread(fd, buf, len, offset);
+  if ((ret < 0) || ((size_t)ret != len))
+    return -1;
+
+  return 0;
+}
+
+static int
+native_vorbis_comments(struct native_info *ni, const uint8_t *buf, size_t len)
+{
+  const char *key;
+  char *tag;
+  char *val;
+  uint32_t count;
+  uint32_t n;
+  size_t pos;
+  int i;
+
+  if (len < 4)
+    return -1;
+
+  // Vendor string
+  n = native_le32(buf);
+  if (n > len - 4)
+    return -1;
+  pos = 4 + n;
+
+  if (len - pos < 4)
+    return -1;
+  count = native_le32(buf + pos);
+  pos += 4;
+
+  for (; count > 0; count--)
+    {
+      if (len - pos < 4)
+	return -1;
+      n = native_le32(buf + pos);
+      pos += 4;
+
+      if (n > len - pos)
+	return -1;
+
+      tag = strndup((const char *)buf + pos, n);
+      pos += n;
+      if (!tag)
+	return -1;
+
+      val = strchr(tag, '=');
+      if (!val || (val == tag) || (*(val + 1) == '\0'))
+	{
+	  free(tag);
+	  continue;
+	}
+      *val = '\0';
+      val++;
+
+      if (strcasecmp(tag, "METADATA_BLOCK_PICTURE") == 0)
+	{
+	  ni->artwork = 1;
+	  free(tag);
+	  continue;
+	}
+
+      key = tag;
+      for (i = 0; i < ARRAY_SIZE(native_vorbis_conv); i++)
+	{
+	  if (strcasecmp(tag, native_vorbis_conv[i][0]) == 0)
+	    {
+	      key = native_vorbis_conv[i][1];
+	      break;
+	    }
+	}
+
+      av_dict_set(&ni->md, key, val, AV_DICT_DONT_OVERWRITE);
+      free(tag);
+    }
+
+  return 0;
+}
+
+static int
+native_flac(struct native_info *ni, int fd, off_t size)
+{
+  uint8_t hdr[34];
+  uint8_t *buf;
+  uint32_t len;
+  off_t offset;
+  bool last;
+  bool streaminfo;
+  int type;
+  int ret;
+
+  offset = 0;
+
+  // ffmpeg also accepts an ID3v2 tag before the FLAC marker
+  if (native_read(fd, 0, hdr, 10) < 0)
+    return -1;
+  if (memcmp(hdr, "ID3", 3) == 0)
+    {
+      offset = 10 + (((hdr[6] & 0x7f) << 21) | ((hdr[7] & 0x7f) << 14) | ((hdr[8] & 0x7f) << 7) | (hdr[9] & 0x7f));
+      if (hdr[5] & 0x10)
+	offset += 10;
+
+      if (native_read(fd, offset, hdr, 4) < 0)
+	return -1;
+    }
+
+  if (memcmp(hdr, "fLaC", 4) != 0)
+    return -1;
+
+  offset += 4;
+  streaminfo = false;
+
+  do
+    {
+      if (native_read(fd, offset, hdr, 4) < 0)
+	return -1;
+
+      last = (hdr[0] & 0x80);
+      type = (hdr[0] & 0x7f);
+      len = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+      offset += 4;
+
+      if (offset + len > size)
+	return -1;
+
+      switch (type)
+	{
+	  case 0: // STREAMINFO
+	    if ((len < 34) || (native_read(fd, offset, hdr, 34) < 0))
+	      return -1;
+
+	    ni->samplerate = (hdr[10] << 12) | (hdr[11] << 4) | (hdr[12] >> 4);
+	    ni->channels = ((hdr[12] >> 1) & 0x07) + 1;
+	    ni->bits_per_sample = (((hdr[12] & 0x01) << 4) | (hdr[13] >> 4)) + 1;
+	    ni->samples = ((uint64_t)(hdr[13] & 0x0f) << 32) | ((uint64_t)hdr[14] << 24) | (hdr[15] << 16) | (hdr[16] << 8) | hdr[17];
+	    streaminfo = true;
+	    break;
+
+	  case 4: // VORBIS_COMMENT
+	    if (len > NATIVE_COMMENT_MAX)
+	      return -1;
+
+	    CHECK_NULL(L_SCAN, buf = malloc(len));
+
+	    ret = native_read(fd, offset, buf, len);
+	    if (ret == 0)
+	      ret = native_vorbis_comments(ni, buf, len);
+
+	    free(buf);
+	    if (ret < 0)
+	      return -1;
+	    break;
+
+	  case 6: // PICTURE
+	    ni->artwork = 1;
+	    break;
+
+	  case 127: // Invalid
+	    return -1;
+	}
+
+      offset += len;
+    }
+  while (!last);
+
+  // Streams without a sample count are left to ffmpeg, which can estimate it
+  if (!streaminfo || (ni->samplerate == 0) || (ni->samples == 0))
+    return -1;
+
+  // ffmpeg decodes to 16 or 32 bit samples, report the same
+  ni->bits_per_sample = (ni->bits_per_sample > 16) ? 32 : 16;
+
+  ni->type = "flac";
+  ni->codectype = "flac";
+  ni->description = "FLAC audio file";
+
+  return 0;
+}
+
+// Reads the Ogg page header at offset, returns the offset of the page data
+static off_t
+native_ogg_page(int fd, off_t offset, uint8_t *hdr, uint8_t *segments)
+{
+  if (native_read(fd, offset, hdr, 27) < 0)
+    return -1;
+
+  if ((memcmp(hdr, "OggS", 4) != 0) || (hdr[4] != 0))
+    return -1;
+
+  if (native_read(fd, offset + 27, segments, hdr[26]) < 0)
+    return -1;
+
+  return offset + 27 + hdr[26];
+}
+
+static int
+native_ogg(struct native_info *ni, int fd, off_t size)
+{
+  uint8_t hdr[27];
+  uint8_t segments[255];
+  uint8_t *buf;
+  uint8_t *tail;
+  uint32_t serial;
+  uint64_t granule;
+  size_t len;
+  size_t seglen;
+  size_t taillen;
+  off_t offset;
+  off_t data;
+  bool complete;
+  int i;
+  int ret;
+
+  // First page holds only the identification header, see Vorbis I spec 4.2.2
+  data = native_ogg_page(fd, 0, hdr, segments);
+  if ((data < 0) || !(hdr[5] & 0x02) || (hdr[26] != 1) || (segments[0] != 30))
+    return -1;
+
+  serial = native_le32(hdr + 14);
+
+  CHECK_NULL(L_SCAN, buf = malloc(30));
+  ret = native_read(fd, data, buf, 30);
+  if ((ret < 0) || (buf[0] != 0x01) || (memcmp(buf + 1, "vorbis", 6) != 0))
+    {
+      free(buf);
+      return -1;
+    }
+
+  ni->channels = buf[11];
+  ni->samplerate = native_le32(buf + 12);
+  free(buf);
+
+  if ((ni->channels == 0) || (ni->samplerate == 0))
+    return -1;
+
+  // The comment header is the second packet, it may span several pages
+  offset = data + 30;
+  buf = NULL;
+  len = 0;
+  complete = false;
+  while (!complete)
+    {
+      data = native_ogg_page(fd, offset, hdr, segments);
+      if ((data < 0) || (native_le32(hdr + 14) != serial))
+	goto fail;
+
+      offset = data;
+      for (i = 0; (i < hdr[26]) && !complete; i++)
+	{
+	  seglen = segments[i];
+	  if (len + seglen > NATIVE_COMMENT_MAX)
+	    goto fail;
+
+	  CHECK_NULL(L_SCAN, buf = realloc(buf, len + seglen + 1));
+	  if ((seglen > 0) && (native_read(fd, offset, buf + len, seglen) < 0))
+	    goto fail;
+
+	  len += seglen;
+	  offset += seglen;
+
+	  if (seglen < 255)
+	    complete = true;
+	}
+
+      for (; i < hdr[26]; i++)
+	offset += segments[i];
+    }
+
+  if ((len < 7) || (buf[0] != 0x03) || (memcmp(buf + 1, "vorbis", 6) != 0))
+    goto fail;
+
+  ret = native_vorbis_comments(ni, buf + 7, len - 7);
+  free(buf);
+  buf = NULL;
+  if (ret < 0)
+    return -1;
+
+  // Duration is the granule position of the last page
+  taillen = (size > NATIVE_OGG_TAIL) ? NATIVE_OGG_TAIL : size;
+  if (taillen < 27)
+    return -1;
+
+  CHECK_NULL(L_SCAN, tail = malloc(taillen));
+  if (native_read(fd, size - taillen, tail, taillen) < 0)
+    {
+      free(tail);
+      return -1;
+    }
+
+  granule = 0;
+  for (i = taillen - 27; i >= 0; i--)
+    {
+      if ((memcmp(tail + i, "OggS", 4) == 0) && (tail[i + 4] == 0) && (native_le32(tail + i + 14) == serial))
+	{
+	  granule = native_le64(tail + i + 6);
+	  if (granule != (uint64_t)-1)
+	    break;
+	  granule = 0;
+	}
+    }
+  free(tail);
+
+  if (granule == 0)
+    return -1;
+
+  ni->samples = granule;
+  // ffmpeg decodes Vorbis to float
+  ni->bits_per_sample = 32;
+
+  ni->type = "ogg";
+  ni->codectype = "ogg";
+  ni->description = "Ogg Vorbis audio file";
+
+  return 0;
+
+ fail:
+  free(buf);
+  return -1;
+}
+
+static int
+scan_metadata_native(struct media_file_info *mfi, const char *file)
+{
+  int (*native_reader)(struct native_info *, int, off_t);
+  struct native_info ni;
+  const char *ext;
+  struct stat sb;
+  int mdcount;
+  int fd;
+  int ret;
+
+  // Don't touch files the native readers can't handle anyway
+  ext = strrchr(file, '.');
+  if (!ext)
+    return -1;
+
+  if (strcasecmp(ext, ".flac") == 0)
+    native_reader = native_flac;
+  else if ((strcasecmp(ext, ".ogg") == 0) || (strcasecmp(ext, ".oga") == 0))
+    native_reader = native_ogg;
+  else
+    return -1;
+
+  memset(&ni, 0, sizeof(struct native_info));
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ret = fstat(fd, &sb);
+  if (ret < 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  ret = native_reader(&ni, fd, sb.st_size);
+
+  close(fd);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_SPAM, L_SCAN, "Native tag reader could not handle '%s', using ffmpeg\n", file);
+
+      av_dict_free(&ni.md);
+      return -1;
+    }
+
+  mfi->samplerate = ni.samplerate;
+  mfi->channels = ni.channels;
+  mfi->bits_per_sample = ni.bits_per_sample;
+  mfi->song_length = (ni.samples * 1000) / ni.samplerate;
+
+  if (mfi->song_length > 0)
+    mfi->bitrate = (sb.st_size * 8) / mfi->song_length;
+
+  if (ni.artwork)
+    mfi->artwork = ARTWORK_EMBEDDED;
+
+  mfi->type = strdup(ni.type);
+  mfi->codectype = strdup(ni.codectype);
+  mfi->description = strdup(ni.description);
+
+  DPRINTF(E_DBG, L_SCAN, "Duration %d ms, bitrate %d kbps, samplerate %d channels %d (native)\n", mfi->song_length, mfi->bitrate, mfi->samplerate, mfi->channels);
+
+  mdcount = 0;
+  if (ni.md)
+    {
+      mdcount += extract_metadata_core(mfi, ni.md, md_map_vorbis);
+      mdcount += extract_metadata_core(mfi, ni.md, md_map_generic);
+      av_dict_free(&ni.md);
+    }
+
+  DPRINTF(E_DBG, L_SCAN, "Picked up %d tags with native tag reader\n", mdcount);
+
+  if (mfi->title == NULL)
+    mfi->title = strdup(mfi->fname);
+
+  return 0;
+}
+
 /*
  * Fills metadata read with ffmpeg/libav from the given path into the given mfi
  *
@@ -374,6 +836,14 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
   int i;
   int ret;
 
+  // FLAC and Ogg Vorbis files can usually be read without ffmpeg, see above
+  if (mfi->data_kind == DATA_KIND_FILE)
+    {
+      ret = scan_metadata_native(mfi, file);
+      if (ret == 0)
+	return 0;
+    }
+
   ctx = NULL;
   options = NULL;
   path = strdup(file);
@@ -556,6 +556,7 @@ rss_scan_all(enum rss_scan_type scan_type)
   start = time(NULL);
 
   qp.type = Q_PL;
+  qp.skip_count = 1;
   qp.sort = S_PLAYLIST;
   qp.filter = db_mprintf("(f.type = %d)", PL_RSS);
 
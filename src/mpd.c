@@ -175,24 +175,24 @@ struct mpd_tagtype
 
 static struct mpd_tagtype tagtypes[] =
   {
-    /* tag               | db field             | db sort field                        | db group field  | type             | media_file offset                | group_in_listcommand */
+    /* tag               | db field             | db sort field                           | db group field  | type             | media_file offset                | group_in_listcommand */
 
     // We treat the artist tag as album artist, this allows grouping over the artist-persistent-id index and increases performance
-    // { "Artist",           "f.artist",             "f.artist",             "f.artist",             MPD_TYPE_STRING,   dbmfi_offsetof(artist), },
-    { "Artist",           "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "Album",            "f.album",              "f.album_sort, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   dbmfi_offsetof(album),             false, },
-    { "Title",            "f.title",              "f.title",                             "f.title",        MPD_TYPE_STRING,   dbmfi_offsetof(title),             true, },
-    { "Track",            "f.track",              "f.track",                             "f.track",        MPD_TYPE_INT,      dbmfi_offsetof(track),             true, },
-    { "Genre",            "f.genre",              "f.genre",                             "f.genre",        MPD_TYPE_STRING,   dbmfi_offsetof(genre),             true, },
-    { "Disc",             "f.disc",               "f.disc",                              "f.disc",         MPD_TYPE_INT,      dbmfi_offsetof(disc),              true, },
-    { "Date",             "f.year",               "f.year",                              "f.year",         MPD_TYPE_INT,      dbmfi_offsetof(year),              true, },
-    { "file",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "base",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "any",              NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "modified-since",   NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    // { "Artist",           "f.artist",             "f.artist",             "f.artist",             MPD_TYPE_STRING,   mfi_offsetof(artist),   },
+    { "Artist",           "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist),        false, },
+    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist_sort),   false, },
+    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist),        false, },
+    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist_sort),   false, },
+    { "Album",            "f.album",              "f.album_sort_key, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   mfi_offsetof(album),               false, },
+    { "Title",            "f.title",              "f.title",                                 "f.title",        MPD_TYPE_STRING,   mfi_offsetof(title),               true, },
+    { "Track",            "f.track",              "f.track",                                 "f.track",        MPD_TYPE_INT,      mfi_offsetof(track),               true, },
+    { "Genre",            "f.genre",              "f.genre",                                 "f.genre",        MPD_TYPE_STRING,   mfi_offsetof(genre),               true, },
+    { "Disc",             "f.disc",               "f.disc",                                  "f.disc",         MPD_TYPE_INT,      mfi_offsetof(disc),                true, },
+    { "Date",             "f.year",               "f.year",                                  "f.year",         MPD_TYPE_INT,      mfi_offsetof(year),                true, },
+    { "file",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "base",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "any",              NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "modified-since",   NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
 
   };
 
@@ -600,26 +600,12 @@ mpd_add_db_queue_item(struct evbuffer *evbuf, struct db_queue_item *queue_item)
  * @return the number of bytes added if successful, or -1 if an error occurred.
  */
 static int
-mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *dbmfi)
+mpd_add_media_file_info(struct evbuffer *evbuf, struct media_file_info *mfi)
 {
   char modified[32];
-  uint32_t time_modified;
-  uint32_t songlength;
   int ret;
 
-  if (safe_atou32(dbmfi->time_modified, &time_modified) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting time modified to uint32_t: %s\n", dbmfi->time_modified);
-      return -1;
-    }
-
-  mpd_time(modified, sizeof(modified), time_modified);
-
-  if (safe_atou32(dbmfi->song_length, &songlength) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting song length to uint32_t: %s\n", dbmfi->song_length);
-      return -1;
-    }
+  mpd_time(modified, sizeof(modified), mfi->time_modified);
 
   ret = evbuffer_add_printf(evbuf,
       "file: %s\n"
@@ -632,28 +618,57 @@ mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *db
       "AlbumArtistSort: %s\n"
       "Album: %s\n"
       "Title: %s\n"
-      "Track: %s\n"
-      "Date: %s\n"
+      "Track: %d\n"
+      "Date: %d\n"
       "Genre: %s\n"
-      "Disc: %s\n",
-      (dbmfi->virtual_path + 1),
+      "Disc: %d\n",
+      (mfi->virtual_path + 1),
       modified,
-      (songlength / 1000),
-      ((float) songlength / 1000),
-      dbmfi->artist,
-      dbmfi->album_artist,
-      dbmfi->artist_sort,
-      dbmfi->album_artist_sort,
-      dbmfi->album,
-      dbmfi->title,
-      dbmfi->track,
-      dbmfi->year,
-      dbmfi->genre,
-      dbmfi->disc);
+      (mfi->song_length / 1000),
+      ((float) mfi->song_length / 1000),
+      mfi->artist,
+      mfi->album_artist,
+      mfi->artist_sort,
+      mfi->album_artist_sort,
+      mfi->album,
+      mfi->title,
+      mfi->track,
+      mfi->year,
+      mfi->genre,
+      mfi->disc);
 
   return ret;
 }
 
+/*
+ * Adds the value of the given tag type to the response buffer, e. g. "Album: bar"
+ *
+ * @param evbuf the response event buffer
+ * @param tagtype the tag type, must not be MPD_TYPE_SPECIAL
+ * @param mfi media information
+ * @return the number of bytes added, 0 if the tag has no value, or -1 if an error occurred.
+ */
+static int
+mpd_add_tagtype_value(struct evbuffer *evbuf, struct mpd_tagtype *tagtype, struct media_file_info *mfi)
+{
+  char *strval;
+  uint32_t intval;
+
+  if (tagtype->type == MPD_TYPE_INT)
+    {
+      intval = *(uint32_t *) ((char *)mfi + tagtype->mfi_offset);
+
+      return evbuffer_add_printf(evbuf, "%s: %u\n", tagtype->tag, intval);
+    }
+
+  strval = *(char **) ((char *)mfi + tagtype->mfi_offset);
+
+  if (!strval || (*strval == '\0'))
+    return 0;
+
+  return evbuffer_add_printf(evbuf, "%s: %s\n", tagtype->tag, strval);
+}
+
 static void
 append_string(char **a, const char *b, const char *separator)
 {
@@ -682,6 +697,9 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 {
   struct mpd_tagtype *tagtype;
   char *c1;
+  char *artist;
+  char *album;
+  char *title;
   int start_pos;
   int end_pos;
   int i;
@@ -712,7 +730,7 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 	      if (exact_match)
 		c1 = db_mprintf("(%s = '%q')", tagtype->field, argv[i + 1]);
 	      else
-		c1 = db_mprintf("(%s LIKE '%%%q%%')", tagtype->field, argv[i + 1]);
+		c1 = db_mprintf_like(tagtype->field, "%%%q%%", argv[i + 1]);
 	    }
 	  else if (tagtype->type == MPD_TYPE_INT)
 	    {
@@ -726,14 +744,20 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 	    {
 	      if (0 == strcasecmp(tagtype->tag, "any"))
 	        {
-		  c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
+		  artist = db_mprintf_like("f.artist", "%%%q%%", argv[i + 1]);
+		  album = db_mprintf_like("f.album", "%%%q%%", argv[i + 1]);
+		  title = db_mprintf_like("f.title", "%%%q%%", argv[i + 1]);
+		  c1 = db_mprintf("(%s OR %s OR %s)", artist, album, title);
+		  free(artist);
+		  free(album);
+		  free(title);
 		}
 	      else if (0 == strcasecmp(tagtype->tag, "file"))
 	        {
 		  if (exact_match)
 		    c1 = db_mprintf("(f.virtual_path = '/%q')", argv[i + 1]);
 		  else
-		    c1 = db_mprintf("(f.virtual_path LIKE '%%%q%%')", argv[i + 1]);
+		    c1 = db_mprintf_like("f.virtual_path", "%%%q%%", argv[i + 1]);
 		}
 	      else if (0 == strcasecmp(tagtype->tag, "base"))
 	        {
@@ -2281,7 +2305,7 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
   char *path;
   struct playlist_info *pli;
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (!default_pl_dir || strstr(argv[1], ":/"))
@@ -2306,6 +2330,7 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_PLITEMS;
+  qp.skip_count = 1;
   qp.idx_type = I_NONE;
   qp.id = pli->id;
 
@@ -2320,11 +2345,11 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
       return ACK_ERROR_UNKNOWN;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
       evbuffer_add_printf(evbuf,
 	  "file: %s\n",
-	  (dbmfi.virtual_path + 1));
+	  (mfi.virtual_path + 1));
     }
 
   db_query_end(&qp);
@@ -2344,7 +2369,7 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
   char *path;
   struct playlist_info *pli;
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (!default_pl_dir || strstr(argv[1], ":/"))
@@ -2369,6 +2394,7 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_PLITEMS;
+  qp.skip_count = 1;
   qp.idx_type = I_NONE;
   qp.id = pli->id;
 
@@ -2383,12 +2409,12 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
       return ACK_ERROR_UNKNOWN;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -2415,6 +2441,7 @@ mpd_command_listplaylists(struct evbuffer *evbuf, int argc, char **argv, char **
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_PL;
+  qp.skip_count = 1;
   qp.sort = S_PLAYLIST;
   qp.idx_type = I_NONE;
   qp.filter = db_mprintf("(f.type = %d OR f.type = %d)", PL_PLAIN, PL_SMART);
@@ -2648,7 +2675,7 @@ static int
 mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -2660,6 +2687,7 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.sort = S_NAME;
   qp.idx_type = I_NONE;
 
@@ -2675,12 +2703,12 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return ACK_ERROR_UNKNOWN;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -2731,8 +2759,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   struct query_params qp;
   struct mpd_tagtype **group;
   int groupsize;
-  struct db_media_file_info dbmfi;
-  char **strval;
+  struct media_file_info mfi;
   int i;
   int ret;
 
@@ -2755,6 +2782,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.idx_type = I_NONE;
   qp.order = tagtype->sort_field;
   qp.group = strdup(tagtype->group_field);
@@ -2780,18 +2808,12 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return ACK_ERROR_UNKNOWN;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
-      strval = (char **) ((char *)&dbmfi + tagtype->mfi_offset);
-
-      if (!(*strval) || (**strval == '\0'))
+      ret = mpd_add_tagtype_value(evbuf, tagtype, &mfi);
+      if (ret <= 0)
 	continue;
 
-      evbuffer_add_printf(evbuf,
-			  "%s: %s\n",
-			  tagtype->tag,
-			  *strval);
-
       if (group && groupsize > 0)
 	{
 	  for (i = 0; i < groupsize; i++)
@@ -2799,15 +2821,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	      if (!group[i])
 		continue;
 
-	      strval = (char **) ((char *)&dbmfi + group[i]->mfi_offset);
-
-	      if (!(*strval) || (**strval == '\0'))
-		continue;
-
-	      evbuffer_add_printf(evbuf,
-	      			  "%s: %s\n",
-				  group[i]->tag,
-	      			  *strval);
+	      mpd_add_tagtype_value(evbuf, group[i], &mfi);
 	    }
 	}
     }
@@ -2829,12 +2843,13 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   // Load playlists for dir-id
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_PL;
+  qp.skip_count = 1;
   qp.sort = S_PLAYLIST;
   qp.idx_type = I_NONE;
   qp.filter = db_mprintf("(f.directory_id = %d AND (f.type = %d OR f.type = %d))", directory_id, PL_PLAIN, PL_SMART);
@@ -2909,6 +2924,7 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   // Load files for dir-id
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.sort = S_ARTIST;
   qp.idx_type = I_NONE;
   qp.filter = db_mprintf("(f.directory_id = %d)", directory_id);
@@ -2920,21 +2936,21 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
       *errmsg = safe_asprintf("Could not start query");
       return ACK_ERROR_UNKNOWN;
     }
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
       if (listinfo)
 	{
-	  ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+	  ret = mpd_add_media_file_info(evbuf, &mfi);
 	  if (ret < 0)
 	    {
-	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	    }
 	}
       else
 	{
 	  evbuffer_add_printf(evbuf,
 	    "file: %s\n",
-	    (dbmfi.virtual_path + 1));
+	    (mfi.virtual_path + 1));
 	}
     }
   db_query_end(&qp);
@@ -3116,7 +3132,7 @@ static int
 mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -3128,6 +3144,7 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.sort = S_NAME;
   qp.idx_type = I_NONE;
 
@@ -3143,12 +3160,12 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       return ACK_ERROR_UNKNOWN;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -3329,7 +3346,7 @@ static int
 mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, const char *virtual_path)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   uint32_t rating = 0;
   uint32_t rating_arg = 0;
   const char *operator;
@@ -3373,6 +3390,7 @@ mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, c
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_ITEMS;
+  qp.skip_count = 1;
   qp.sort = S_VPATH;
   qp.idx_type = I_NONE;
 
@@ -3395,24 +3413,16 @@ mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, c
       return ret;
     }
 
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_mfi(&qp, &mfi)) == 0) && (mfi.id))
     {
-      ret = safe_atou32(dbmfi.rating, &rating);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_MPD, "Error rating=%s doesn't convert to integer, song id: %s\n",
-		  dbmfi.rating, dbmfi.id);
-	  continue;
-	}
-
-      rating /= MPD_RATING_FACTOR;
+      rating = mfi.rating / MPD_RATING_FACTOR;
       ret = evbuffer_add_printf(evbuf,
 				"file: %s\n"
 				"sticker: rating=%d\n",
-				(dbmfi.virtual_path + 1),
+				(mfi.virtual_path + 1),
 				rating);
       if (ret < 0)
-	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
     }
 
   db_query_end(&qp);
@@ -1351,6 +1351,7 @@ cleanup_spotify_files(void)
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_BROWSE_PATH;
+  qp.skip_count = 1;
   qp.sort = S_NONE;
   qp.filter = "f.path LIKE 'spotify:%%' AND NOT f.path IN (SELECT filepath FROM playlistitems)";
 